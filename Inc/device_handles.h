@@ -24,6 +24,8 @@ extern TIM_HandleTypeDef htim10;
 
 extern UART_HandleTypeDef huart3;
 
+extern DMA_HandleTypeDef hdma_spi1_tx;
+
 extern SPI_HandleTypeDef hspi1;
 
 
@@ -164,6 +164,13 @@ void Error_Handler(void);
 // To quickly change from float to double
 typedef double real;
 
+// Placement of time critical code and data in the tightly coupled memories
+// and of DMA buffers in the non-cacheable SRAM2. See linker script.
+#define ITCM_TEXT	__attribute__((section(".itcm_text")))
+#define DTCM_DATA	__attribute__((section(".dtcm_data")))
+#define DTCM_BSS	__attribute__((section(".dtcm_bss")))
+#define DMA_BUFFER	__attribute__((section(".dma_buffer"), aligned(32)))
+
 /* USER CODE END Private defines */
 
 #ifdef __cplusplus
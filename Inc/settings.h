@@ -11,6 +11,15 @@
  * USB CDC Communication with PC for music data
  */
 #define 	DBG_TIM_ISR_LOAD_PIN		0			// switch to 1-> duration in timer-isr will pull the ISR_LOAD Pin high.
+#define 	DBG_TIM_ISR_CYCLE_COUNT		0			// switch to 1-> CPU cycles spent in the step timer isr are measured with the DWT counter and reported periodically
+#define 	DBG_TIM_ISR_REPORT_PERIOD	5000		// [ms] period for reporting the step timer isr cycle counts (and planner statistics) over the debug uart
+#define 	DBG_SCHEDULER_STATS			0			// switch to 1-> refill latency and deadline slack of the planner are reported periodically
+#define 	DBG_PLANNER_PRINTS			0			// switch to 1-> the planner prints its calculations and the referencing progress. Blocks PendSV on the debug uart!
+#define 	DBG_NOTES_LATENCY			0			// switch to 1-> note-to-latch latency of the note magnets is reported periodically
+#define 	DBG_STORE_STATS				0			// switch to 1-> underruns of the playback from the piece store are reported periodically
+#define 	DBG_CPU_LOAD				0			// switch to 1-> CPU cycles per interrupt / main loop context are measured with the DWT counter (see debug_tools.h)
+#define 	DBG_CPU_LOAD_WINDOW			100			// [ms] window the CPU load is measured over, peaks are the highest window
+#define 	DBG_COUNTERS				0			// switch to 1-> health counters and histograms are collected (see counters.h) and reported periodically
 
 
 
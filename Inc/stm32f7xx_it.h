@@ -61,6 +61,7 @@ void TIM1_CC_IRQHandler(void);
 void EXTI15_10_IRQHandler(void);
 void OTG_FS_IRQHandler(void);
 /* USER CODE BEGIN EFP */
+void DMA2_Stream3_IRQHandler(void);
 
 /* USER CODE END EFP */
 
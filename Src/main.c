@@ -42,10 +42,17 @@
 #include "step_generation.h"
 #include "motor_control.h"
 #include "notes.h"
+#include "vibrato.h"
 #include "channels.h"
 #include "timekeeper.h"
 #include <math.h>
 #include "communication.h"
+#include "settings.h"
+#include "scheduler.h"
+#include "store.h"
+#include "parameters.h"
+#include "step_bench.h"
+#include "counters.h"
 
 /* USER CODE END Includes */
 
@@ -76,6 +83,7 @@ TIM_HandleTypeDef htim10;
 UART_HandleTypeDef huart3;
 
 /* USER CODE BEGIN PV */
+DMA_HandleTypeDef hdma_spi1_tx;
 
 /* USER CODE END PV */
 
@@ -90,7 +98,7 @@ static void MX_TIM8_Init(void);
 static void MX_TIM2_Init(void);
 static void MX_TIM10_Init(void);
 /* USER CODE BEGIN PFP */
-
+static void MPU_Config(void);
 /* USER CODE END PFP */
 
 /* Private user code ---------------------------------------------------------*/
@@ -106,6 +114,11 @@ int main(void)
 {
   /* USER CODE BEGIN 1 */
 
+  // The MPU has to be set up before the caches are switched on, so that the DMA buffers are never cached.
+  MPU_Config();
+  SCB_EnableICache();
+  SCB_EnableDCache();
+
   /* USER CODE END 1 */
 
   /* MCU Configuration--------------------------------------------------------*/
@@ -142,8 +155,13 @@ int main(void)
 
   USB_CDC_Init();
 
+  debug_cycle_counter_init();
+
   //debug_start_motor_tracking();
 
+  // Interrupt priorities of the execution model. Needs to be set before the tick starts.
+  SCH_Init();
+
   TK_startTimer();
 
   CHA_Init();
@@ -152,42 +170,73 @@ int main(void)
 
   notes_init();
 
+  STO_Init();
+
+  // Tuning and home positions of the last save, after the defaults of CHA_Init() and SM_Init()
+  PAR_Init();
+
+  VIB_Init();
+
+  // From now on, the cycle planner runs in PendSV
+  SCH_startPlanner();
+
   dbgprintf("SPV ready and initialized.");
 
   /* USER CODE END 2 */
 
   /* Infinite loop */
   /* USER CODE BEGIN WHILE */
-  //int32_t wait_delay = 0;
-  int32_t run1 = 0, run2 = 0, run3 = 0;
+#if (DBG_TIM_ISR_CYCLE_COUNT || DBG_SCHEDULER_STATS || DBG_NOTES_LATENCY || DBG_STORE_STATS || DBG_COUNTERS || DBG_CPU_LOAD)
+  uint32_t isr_report_tick = HAL_GetTick();
+#endif
+  // The motors are planned in PendSV (see scheduler.c). Only communication and
+  // housekeeping is done here, the rest of the time the core sleeps until the next interrupt.
   while (1)
   {
+	  DEBUG_LOAD_ENTER(DEBUG_LOAD_COMM);
+	  COM_update();
+	  DEBUG_LOAD_EXIT();
 
-	  run1 |= SM_updateMotor(&x_dae_motor, &cha_posx_dae);
-	  run2 |= SM_updateMotor(&y_dae_motor, &cha_posy_dae);
-	  run3 |= SM_updateMotor(&z_dae_motor, &cha_str_dae);
+	  // Keeps the channels filled when a stored piece is played
+	  STO_update();
 
-	  COM_update();
+	  // Runs the step rate benchmark when it was started
+	  BEN_update();
 
 	  //toggle_debug_led();
-	  //notes_e_set(cycle_number%8, 1);
+	  //notes_set(NOTES_STRING_E, cycle_number%8);
 
-	  if (run1 != 0 && run2 != 0 && run3 != 0)
+	  // Update debug transmit values
+	  //debug_transmit_motor_tracking_data();
+
+#if (DBG_TIM_ISR_CYCLE_COUNT || DBG_SCHEDULER_STATS || DBG_NOTES_LATENCY || DBG_STORE_STATS || DBG_COUNTERS || DBG_CPU_LOAD)
+	  if (HAL_GetTick() - isr_report_tick >= DBG_TIM_ISR_REPORT_PERIOD)
 	  {
-		 /* run1 = 0;
-		  run2 = 0;
-		  run3 = 0;
-		  for (wait_delay=0; wait_delay < 2000; wait_delay++)
-		  {
-			  HAL_Delay(1);
-		  }
-		  notes_init();
-		  SM_restart_testcylce();
-		  wait_delay = 0;*/
+		  isr_report_tick = HAL_GetTick();
+#if (DBG_TIM_ISR_CYCLE_COUNT)
+		  debug_report_isr_cycles();
+#endif
+#if (DBG_SCHEDULER_STATS)
+		  SCH_reportStatistics();
+#endif
+#if (DBG_NOTES_LATENCY)
+		  notes_report_latency();
+#endif
+#if (DBG_STORE_STATS)
+		  STO_reportStatistics();
+#endif
+#if (DBG_COUNTERS)
+		  CNT_report();
+#endif
+#if (DBG_CPU_LOAD)
+		  debug_report_load();
+#endif
 	  }
+#endif
 
-	  // Update debug transmit values
-	  //debug_transmit_motor_tracking_data();
+	  DEBUG_LOAD_ENTER(DEBUG_LOAD_IDLE);
+	  __WFI();
+	  DEBUG_LOAD_EXIT();
 
     /* USER CODE END WHILE */
 
@@ -747,6 +796,35 @@ static void MX_GPIO_Init(void)
 
 /* USER CODE BEGIN 4 */
 
+/**
+  * @brief  Sets up the MPU so that SRAM2 (0x2007C000, 16kB), where the linker
+  *         puts the .dma_buffer section, is non-cacheable. Everything the DMA
+  *         reads or writes lives there, so it stays coherent with the D-cache
+  *         without any clean/invalidate calls. The TCMs are never cached anyway.
+  * @retval None
+  */
+static void MPU_Config(void)
+{
+  MPU_Region_InitTypeDef MPU_InitStruct = {0};
+
+  HAL_MPU_Disable();
+
+  MPU_InitStruct.Enable = MPU_REGION_ENABLE;
+  MPU_InitStruct.Number = MPU_REGION_NUMBER0;
+  MPU_InitStruct.BaseAddress = 0x2007C000;
+  MPU_InitStruct.Size = MPU_REGION_SIZE_16KB;
+  MPU_InitStruct.SubRegionDisable = 0x00;
+  MPU_InitStruct.TypeExtField = MPU_TEX_LEVEL1;
+  MPU_InitStruct.AccessPermission = MPU_REGION_FULL_ACCESS;
+  MPU_InitStruct.DisableExec = MPU_INSTRUCTION_ACCESS_DISABLE;
+  MPU_InitStruct.IsShareable = MPU_ACCESS_SHAREABLE;
+  MPU_InitStruct.IsCacheable = MPU_ACCESS_NOT_CACHEABLE;
+  MPU_InitStruct.IsBufferable = MPU_ACCESS_NOT_BUFFERABLE;
+  HAL_MPU_ConfigRegion(&MPU_InitStruct);
+
+  HAL_MPU_Enable(MPU_PRIVILEGED_DEFAULT);
+}
+
 /* USER CODE END 4 */
 
 /**
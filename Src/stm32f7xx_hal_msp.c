@@ -22,6 +22,8 @@
 /* Includes ------------------------------------------------------------------*/
 #include "main.h"
 /* USER CODE BEGIN Includes */
+#include "device_handles.h"
+#include "scheduler.h"
 
 /* USER CODE END Includes */
 
@@ -119,6 +121,28 @@ void HAL_SPI_MspInit(SPI_HandleTypeDef* hspi)
 
   /* USER CODE BEGIN SPI1_MspInit 1 */
 
+    /* SPI1 DMA Init: SPI1_TX on DMA2 Stream3 Channel3, feeds the note magnet drivers */
+    __HAL_RCC_DMA2_CLK_ENABLE();
+    hdma_spi1_tx.Instance = DMA2_Stream3;
+    hdma_spi1_tx.Init.Channel = DMA_CHANNEL_3;
+    hdma_spi1_tx.Init.Direction = DMA_MEMORY_TO_PERIPH;
+    hdma_spi1_tx.Init.PeriphInc = DMA_PINC_DISABLE;
+    hdma_spi1_tx.Init.MemInc = DMA_MINC_ENABLE;
+    hdma_spi1_tx.Init.PeriphDataAlignment = DMA_PDATAALIGN_BYTE;
+    hdma_spi1_tx.Init.MemDataAlignment = DMA_MDATAALIGN_BYTE;
+    hdma_spi1_tx.Init.Mode = DMA_NORMAL;
+    hdma_spi1_tx.Init.Priority = DMA_PRIORITY_HIGH;
+    hdma_spi1_tx.Init.FIFOMode = DMA_FIFOMODE_DISABLE;
+    if (HAL_DMA_Init(&hdma_spi1_tx) != HAL_OK)
+    {
+      Error_Handler();
+    }
+    __HAL_LINKDMA(hspi, hdmatx, hdma_spi1_tx);
+
+    /* Same priority as the ms tick which starts the transfers, so they never preempt each other */
+    HAL_NVIC_SetPriority(DMA2_Stream3_IRQn, SCH_PRIO_TICK, 0);
+    HAL_NVIC_EnableIRQ(DMA2_Stream3_IRQn);
+
   /* USER CODE END SPI1_MspInit 1 */
   }
 
@@ -150,6 +174,8 @@ void HAL_SPI_MspDeInit(SPI_HandleTypeDef* hspi)
     HAL_GPIO_DeInit(NOTE_DATA_GPIO_Port, NOTE_DATA_Pin);
 
   /* USER CODE BEGIN SPI1_MspDeInit 1 */
+    HAL_DMA_DeInit(hspi->hdmatx);
+    HAL_NVIC_DisableIRQ(DMA2_Stream3_IRQn);
 
   /* USER CODE END SPI1_MspDeInit 1 */
   }
@@ -23,10 +23,13 @@
 #include "stm32f7xx_it.h"
 /* Private includes ----------------------------------------------------------*/
 /* USER CODE BEGIN Includes */
+#include "settings.h"
 #include "debug_tools.h"
 #include "step_generation.h"
 #include "motor_parameters.h"
 #include "timekeeper.h"
+#include "scheduler.h"
+#include "device_handles.h"
 /* USER CODE END Includes */
   
 /* Private typedef -----------------------------------------------------------*/
@@ -51,7 +54,8 @@
 
 /* Private function prototypes -----------------------------------------------*/
 /* USER CODE BEGIN PFP */
-
+// The step timer ISR is executed from ITCM (no flash wait states)
+void TIM1_CC_IRQHandler(void) ITCM_TEXT;
 /* USER CODE END PFP */
 
 /* Private user code ---------------------------------------------------------*/
@@ -175,7 +179,9 @@ void DebugMon_Handler(void)
 void PendSV_Handler(void)
 {
   /* USER CODE BEGIN PendSV_IRQn 0 */
-
+  DEBUG_LOAD_ENTER(DEBUG_LOAD_PLANNER);
+  SCH_runPlanner();
+  DEBUG_LOAD_EXIT();
   /* USER CODE END PendSV_IRQn 0 */
   /* USER CODE BEGIN PendSV_IRQn 1 */
 
@@ -188,11 +194,11 @@ void PendSV_Handler(void)
 void SysTick_Handler(void)
 {
   /* USER CODE BEGIN SysTick_IRQn 0 */
-
+  DEBUG_LOAD_ENTER(DEBUG_LOAD_OTHER);
   /* USER CODE END SysTick_IRQn 0 */
   HAL_IncTick();
   /* USER CODE BEGIN SysTick_IRQn 1 */
-
+  DEBUG_LOAD_EXIT();
   /* USER CODE END SysTick_IRQn 1 */
 }
 
@@ -209,6 +215,7 @@ void SysTick_Handler(void)
 void TIM1_UP_TIM10_IRQHandler(void)
 {
   /* USER CODE BEGIN TIM1_UP_TIM10_IRQn 0 */
+  DEBUG_LOAD_ENTER(DEBUG_LOAD_TICK);
 
 #if (DBG_TIM_ISR_LOAD_PIN)
 	isr_load_pin_on();
@@ -234,6 +241,7 @@ void TIM1_UP_TIM10_IRQHandler(void)
   #if (DBG_TIM_ISR_LOAD_PIN)
 	isr_load_pin_off();
 #endif
+  DEBUG_LOAD_EXIT();
 
   /* USER CODE END TIM1_UP_TIM10_IRQn 1 */
 }
@@ -244,8 +252,12 @@ void TIM1_UP_TIM10_IRQHandler(void)
 void TIM1_CC_IRQHandler(void)
 {
   /* USER CODE BEGIN TIM1_CC_IRQn 0 */
+	DEBUG_LOAD_ENTER(DEBUG_LOAD_STEP);
 #if (DBG_TIM_ISR_LOAD_PIN)
 	isr_load_pin_on();
+#endif
+#if (DBG_TIM_ISR_CYCLE_COUNT)
+	uint32_t	cycles_start = DWT->CYCCNT;
 #endif
 	// We make a local pointer for copy and paste purposes of the other axis.
 	uint16_t 	tim1_cnt;
@@ -300,9 +312,18 @@ void TIM1_CC_IRQHandler(void)
   /* USER CODE BEGIN TIM1_CC_IRQn 1 */
 #endif
 
+#if (DBG_TIM_ISR_CYCLE_COUNT)
+	// Done inline rather than by a function call, because the debug tools are in flash.
+	debug_isr_cycles.last = DWT->CYCCNT - cycles_start;
+	debug_isr_cycles.sum += debug_isr_cycles.last;
+	debug_isr_cycles.count++;
+	if (debug_isr_cycles.last > debug_isr_cycles.max)
+		debug_isr_cycles.max = debug_isr_cycles.last;
+#endif
 #if (DBG_TIM_ISR_LOAD_PIN)
   isr_load_pin_off();
 #endif
+	DEBUG_LOAD_EXIT();
   /* USER CODE END TIM1_CC_IRQn 1 */
 }
 
@@ -312,7 +333,7 @@ void TIM1_CC_IRQHandler(void)
 void EXTI15_10_IRQHandler(void)
 {
   /* USER CODE BEGIN EXTI15_10_IRQn 0 */
-
+  DEBUG_LOAD_ENTER(DEBUG_LOAD_EXTI);
   /* USER CODE END EXTI15_10_IRQn 0 */
   HAL_GPIO_EXTI_IRQHandler(GPIO_PIN_10);
   HAL_GPIO_EXTI_IRQHandler(GPIO_PIN_11);
@@ -321,7 +342,7 @@ void EXTI15_10_IRQHandler(void)
   HAL_GPIO_EXTI_IRQHandler(GPIO_PIN_14);
   HAL_GPIO_EXTI_IRQHandler(GPIO_PIN_15);
   /* USER CODE BEGIN EXTI15_10_IRQn 1 */
-
+  DEBUG_LOAD_EXIT();
   /* USER CODE END EXTI15_10_IRQn 1 */
 }
 
@@ -331,15 +352,25 @@ void EXTI15_10_IRQHandler(void)
 void OTG_FS_IRQHandler(void)
 {
   /* USER CODE BEGIN OTG_FS_IRQn 0 */
-
+  DEBUG_LOAD_ENTER(DEBUG_LOAD_USB);
   /* USER CODE END OTG_FS_IRQn 0 */
   HAL_PCD_IRQHandler(&hpcd_USB_OTG_FS);
   /* USER CODE BEGIN OTG_FS_IRQn 1 */
-
+  DEBUG_LOAD_EXIT();
   /* USER CODE END OTG_FS_IRQn 1 */
 }
 
 /* USER CODE BEGIN 1 */
 
+/**
+  * @brief This function handles DMA2 stream3 global interrupt (SPI1 TX, note magnets).
+  */
+void DMA2_Stream3_IRQHandler(void)
+{
+  DEBUG_LOAD_ENTER(DEBUG_LOAD_OTHER);
+  HAL_DMA_IRQHandler(&hdma_spi1_tx);
+  DEBUG_LOAD_EXIT();
+}
+
 /* USER CODE END 1 */
 /************************ (C) COPYRIGHT STMicroelectronics *****END OF FILE****/
@@ -306,6 +306,20 @@ uint8_t CDC_Transmit_FS(uint8_t* Buf, uint16_t Len)
 }
 
 /* USER CODE BEGIN PRIVATE_FUNCTIONS_IMPLEMENTATION */
+/**
+  * @brief  CDC_IsTxBusy_FS
+  *         Tells if the last transfer given to CDC_Transmit_FS is still running.
+  *         The buffer of that transfer must not be touched until it is done.
+  * @retval 1 while a transfer is running (or the device is not configured), 0 otherwise
+  */
+uint8_t CDC_IsTxBusy_FS(void)
+{
+  USBD_CDC_HandleTypeDef *hcdc = (USBD_CDC_HandleTypeDef*)hUsbDeviceFS.pClassData;
+  if (hcdc == NULL){
+    return 1;
+  }
+  return hcdc->TxState != 0;
+}
 
 /* USER CODE END PRIVATE_FUNCTIONS_IMPLEMENTATION */
 
@@ -18,16 +18,30 @@
 #include "motor_control.h"
 #include "channels.h"
 #include <string.h>
+#include <math.h>
 #include "notes.h"
+#include "vibrato.h"
+#include "store.h"
 
 // Memory allocation for channel buffers
+T_DTP_NOTE g_note_buffer[CHA_G_NOTE_LENGTH];
+T_DTP_NOTE d_note_buffer[CHA_D_NOTE_LENGTH];
+T_DTP_NOTE a_note_buffer[CHA_A_NOTE_LENGTH];
 T_DTP_NOTE e_note_buffer[CHA_E_NOTE_LENGTH];
 T_DTP_MOTOR posx_dae_buffer[CHA_POSX_DAE_LENGTH];
 T_DTP_MOTOR posy_dae_buffer[CHA_POSX_DAE_LENGTH];
 T_DTP_MOTOR str_dae_buffer[CHA_POSX_DAE_LENGTH];
+T_CHA_SEGMENT posx_dae_segment;
+T_CHA_SEGMENT posy_dae_segment;
+T_CHA_SEGMENT str_dae_segment;
+T_DTP_VIB g_vib_buffer[CHA_G_VIB_LENGTH];
+T_DTP_VIB d_vib_buffer[CHA_D_VIB_LENGTH];
+T_DTP_VIB a_vib_buffer[CHA_A_VIB_LENGTH];
+T_DTP_VIB e_vib_buffer[CHA_E_VIB_LENGTH];
 
 // Main structure where channel time is accessed.
-T_CHANNEL_TIME channel_time;
+T_CHANNEL_TIME channel_time = {.tempo = CHA_TEMPO_ONE, .tempo_target = CHA_TEMPO_ONE,
+		.clock_tempo = CHA_TEMPO_ONE, .clock_target = CHA_TEMPO_ONE};
 
 T_CHANNEL *cha_list[CHA_NUMBER_CHANNELS_TOTAL] =
 		{&cha_g_note, &cha_d_note, &cha_a_note, &cha_e_note,
@@ -35,6 +49,17 @@ T_CHANNEL *cha_list[CHA_NUMBER_CHANNELS_TOTAL] =
 		&cha_posx_gda, &cha_posy_gda, &cha_str_gda,
 		&cha_g_vib, &cha_d_vib, &cha_a_vib, &cha_e_vib};
 
+// PROTOTYPES
+static void update_note_channel(T_CHANNEL *cha, E_NOTES_STRING string);
+static void update_vib_channel(T_CHANNEL *cha, E_NOTES_STRING string);
+static void update_motor_channel(T_CHANNEL *cha, T_MOTOR_CONTROL *ctl);
+static uint32_t channel_time_ahead(T_CHANNEL *cha);
+static int32_t segment_sampled(const T_CHA_SEGMENT *seg, const T_DTP_MOTOR *point, uint32_t sample_time);
+static void segment_start(T_CHA_SEGMENT *seg, const T_DTP_MOTOR *point, uint32_t sample_time);
+static void segment_sample(const T_CHA_SEGMENT *seg, int32_t i, T_DTP_MOTOR *out);
+static void schedule_clock(uint32_t tempo, uint32_t ramp, int32_t limit, uint32_t delay);
+static void change_clock(uint32_t tempo, uint32_t ramp, int32_t limit);
+
 /** @brief 	Initializes all the channels presently in use
  *
  *  @param (none)
@@ -42,6 +67,33 @@ T_CHANNEL *cha_list[CHA_NUMBER_CHANNELS_TOTAL] =
  */
 void CHA_Init(void)
 {
+	// G_NOTE channel
+	cha_g_note.channel_number = CHA_G_NOTE_NR;
+	cha_g_note.base = (void*) g_note_buffer;
+	cha_g_note.ellen = sizeof(g_note_buffer[0]);
+	cha_g_note.buffer_length = CHA_G_NOTE_LENGTH;
+	cha_g_note.in = 0;
+	cha_g_note.out = 0;
+	cha_g_note.last_point_time = 0;
+
+	// D_NOTE channel
+	cha_d_note.channel_number = CHA_D_NOTE_NR;
+	cha_d_note.base = (void*) d_note_buffer;
+	cha_d_note.ellen = sizeof(d_note_buffer[0]);
+	cha_d_note.buffer_length = CHA_D_NOTE_LENGTH;
+	cha_d_note.in = 0;
+	cha_d_note.out = 0;
+	cha_d_note.last_point_time = 0;
+
+	// A_NOTE channel
+	cha_a_note.channel_number = CHA_A_NOTE_NR;
+	cha_a_note.base = (void*) a_note_buffer;
+	cha_a_note.ellen = sizeof(a_note_buffer[0]);
+	cha_a_note.buffer_length = CHA_A_NOTE_LENGTH;
+	cha_a_note.in = 0;
+	cha_a_note.out = 0;
+	cha_a_note.last_point_time = 0;
+
 	// E_NOTE channel
 	cha_e_note.channel_number = CHA_E_NOTE_NR;
 	cha_e_note.base = (void*) e_note_buffer;
@@ -59,6 +111,8 @@ void CHA_Init(void)
 	cha_posx_dae.in = 0;
 	cha_posx_dae.out = 0;
 	cha_posx_dae.last_point_time = 0;
+	cha_posx_dae.segment = &posx_dae_segment;
+	memset(&posx_dae_segment, 0, sizeof(posx_dae_segment));
 
 	// POSY_DAE channel
 	cha_posy_dae.channel_number = CHA_POSY_DAE_NR;
@@ -68,6 +122,8 @@ void CHA_Init(void)
 	cha_posy_dae.in = 0;
 	cha_posy_dae.out = 0;
 	cha_posy_dae.last_point_time = 0;
+	cha_posy_dae.segment = &posy_dae_segment;
+	memset(&posy_dae_segment, 0, sizeof(posy_dae_segment));
 
 	// STR_Z_DAE channel
 	cha_str_dae.channel_number = CHA_STR_DAE_NR;
@@ -77,6 +133,44 @@ void CHA_Init(void)
 	cha_str_dae.in = 0;
 	cha_str_dae.out = 0;
 	cha_str_dae.last_point_time = 0;
+	cha_str_dae.segment = &str_dae_segment;
+	memset(&str_dae_segment, 0, sizeof(str_dae_segment));
+
+	// G_VIB channel
+	cha_g_vib.channel_number = CHA_G_VIB_NR;
+	cha_g_vib.base = (void*) g_vib_buffer;
+	cha_g_vib.ellen = sizeof(g_vib_buffer[0]);
+	cha_g_vib.buffer_length = CHA_G_VIB_LENGTH;
+	cha_g_vib.in = 0;
+	cha_g_vib.out = 0;
+	cha_g_vib.last_point_time = 0;
+
+	// D_VIB channel
+	cha_d_vib.channel_number = CHA_D_VIB_NR;
+	cha_d_vib.base = (void*) d_vib_buffer;
+	cha_d_vib.ellen = sizeof(d_vib_buffer[0]);
+	cha_d_vib.buffer_length = CHA_D_VIB_LENGTH;
+	cha_d_vib.in = 0;
+	cha_d_vib.out = 0;
+	cha_d_vib.last_point_time = 0;
+
+	// A_VIB channel
+	cha_a_vib.channel_number = CHA_A_VIB_NR;
+	cha_a_vib.base = (void*) a_vib_buffer;
+	cha_a_vib.ellen = sizeof(a_vib_buffer[0]);
+	cha_a_vib.buffer_length = CHA_A_VIB_LENGTH;
+	cha_a_vib.in = 0;
+	cha_a_vib.out = 0;
+	cha_a_vib.last_point_time = 0;
+
+	// E_VIB channel
+	cha_e_vib.channel_number = CHA_E_VIB_NR;
+	cha_e_vib.base = (void*) e_vib_buffer;
+	cha_e_vib.ellen = sizeof(e_vib_buffer[0]);
+	cha_e_vib.buffer_length = CHA_E_VIB_LENGTH;
+	cha_e_vib.in = 0;
+	cha_e_vib.out = 0;
+	cha_e_vib.last_point_time = 0;
 }
 
 /** @brief  Starts playing off channel data. Time is initialized to 0
@@ -85,6 +179,10 @@ void CHA_Init(void)
  */
 void CHA_startPlaying (void)
 {
+	// Stored piece: the channels are filled from the store, not by the host
+	if (STO_isSelected())
+		STO_startStream();
+
 	CHA_setChannelTime(0);
 	CHA_setRelativeExecutionTime(0);
 	CHA_startTime();
@@ -98,6 +196,8 @@ void CHA_startPlaying (void)
 void CHA_stopPlaying (void)
 {
 	CHA_stopTime();
+	STO_stopStream();
+	VIB_Init();
 	dbgprintf("STOP playing channel data at t=%d", CHA_getChannelTime());
 	CHA_setChannelTime(0);
 }
@@ -115,10 +215,220 @@ void CHA_stopPlaying (void)
  */
 void CHA_setRelativeExecutionTime(uint32_t time)
 {
+	cha_g_note.last_point_time = 0;
+	cha_d_note.last_point_time = 0;
+	cha_a_note.last_point_time = 0;
 	cha_e_note.last_point_time = 0;
 	cha_posx_dae.last_point_time = 0;
 	cha_posy_dae.last_point_time = 0;
 	cha_str_dae.last_point_time = 0;
+	cha_g_vib.last_point_time = 0;
+	cha_d_vib.last_point_time = 0;
+	cha_a_vib.last_point_time = 0;
+	cha_e_vib.last_point_time = 0;
+}
+
+/** @brief 	Sets the lead time of a channel. The datapoints of the channel are
+ * 			executed this much earlier than their music time, to make up for
+ * 			the mechanical delay of the actuator (magnet, stepper). That way the
+ * 			finger and the bow can be aligned without changing the score on the host.
+ *
+ * 			Datapoints that are due within the lead time after the start of
+ * 			playing are executed right at the start.
+ *
+ *  @param 	*cha - channel
+ *  @param 	lead_time - [ms], at most CHA_MAX_LEAD_TIME
+ *  @return SUCCESS, or ERROR if the channel is not in use or the lead time is too long
+ */
+ErrorStatus CHA_setLeadTime(T_CHANNEL *cha, uint32_t lead_time)
+{
+	if (cha->buffer_length == 0 || lead_time > CHA_MAX_LEAD_TIME)
+		return ERROR;
+
+	cha->lead_time = lead_time;
+	return SUCCESS;
+}
+
+/** @brief 	Number of points a motor channel still hands out with CHA_popMotorPoint().
+ * 			Segments count with their number of samples as far as it matters
+ * 			(the planner only distinguishes 0, 1 and more points).
+ *
+ *  @param *cha - motor channel
+ *  @param sample_time - [ms] sample time the planner uses for segments
+ *  @return number of points
+ */
+int32_t CHA_getNumberMotorPoints(T_CHANNEL *cha, uint32_t sample_time)
+{
+	T_CHA_SEGMENT *seg = cha->segment;
+	T_CHA_SEGMENT next;
+	int32_t points = CHA_getNumberDatapoint(cha);
+
+	if (seg == NULL)
+		return points;
+
+	if (seg->active)
+		return points + seg->n - seg->k;
+
+	if (points == 1 && segment_sampled(seg, (T_DTP_MOTOR*) CHA_peekFirstDatapoint(cha), sample_time))
+	{
+		next = *seg;
+		segment_start(&next, CHA_peekFirstDatapoint(cha), sample_time);
+		if (next.active)
+			return next.n;
+	}
+	return points;
+}
+
+/** @brief 	Pops the next point of a motor channel. Plain datapoints are handed
+ * 			out as they are, Hermite segments are sampled into points sample_time
+ * 			apart (the last sample is exactly the end point of the segment).
+ *
+ *  @param *cha - motor channel
+ *  @param *out - next point
+ *  @param sample_time - [ms] sample time the planner uses for segments
+ *  @return 0 if success, -1 if there is no point
+ */
+int32_t CHA_popMotorPoint(T_CHANNEL *cha, T_DTP_MOTOR *out, uint32_t sample_time)
+{
+	T_CHA_SEGMENT *seg = cha->segment;
+	T_DTP_MOTOR point;
+
+	if (seg == NULL)
+		return CHA_popDatapoints(cha, out, 1);
+
+	if (!seg->active)
+	{
+		if (CHA_popDatapoints(cha, &point, 1) != 0)
+			return -1;
+		segment_start(seg, &point, sample_time);
+		if (!seg->active)
+		{
+			*out = point;
+			out->segment = 0;
+		}
+		seg->last_steps = point.steps;
+		seg->last_velocity = point.velocity;
+		seg->last_valid = 1;
+	}
+
+	if (seg->active)
+	{
+		seg->k++;
+		segment_sample(seg, seg->k, out);
+		if (seg->k >= seg->n)
+			seg->active = 0;
+	}
+	return 0;
+}
+
+/** @brief 	Reads the point CHA_popMotorPoint() will hand out next, without removing it.
+ *
+ *  @param *cha - motor channel
+ *  @param *out - next point
+ *  @param sample_time - [ms] sample time the planner uses for segments
+ *  @return 0 if success, -1 if there is no point
+ */
+int32_t CHA_readMotorPoint(T_CHANNEL *cha, T_DTP_MOTOR *out, uint32_t sample_time)
+{
+	T_CHA_SEGMENT *seg = cha->segment;
+	T_CHA_SEGMENT next;
+
+	if (seg == NULL || !seg->active)
+	{
+		if (CHA_readDatapoints(cha, out, 1) != 0)
+			return -1;
+		if (seg == NULL || !segment_sampled(seg, out, sample_time))
+			return 0;
+
+		next = *seg;
+		segment_start(&next, out, sample_time);
+		if (next.active)
+			segment_sample(&next, 1, out);
+		else
+			out->segment = 0;
+		return 0;
+	}
+
+	segment_sample(seg, seg->k + 1, out);
+	return 0;
+}
+
+/** @brief 	Sets up the sampling of a segment datapoint. Plain datapoints, and
+ * 			segments without a known start point, leave the state inactive.
+ *
+ *  @param *seg - sampling state, holds the previous point
+ *  @param *point - datapoint just taken from the channel
+ *  @param sample_time - [ms] time between the samples (the last one can be shorter)
+ *  @return (none)
+ */
+static void segment_start(T_CHA_SEGMENT *seg, const T_DTP_MOTOR *point, uint32_t sample_time)
+{
+	seg->active = 0;
+	if (!segment_sampled(seg, point, sample_time) || !seg->last_valid || point->timediff == 0)
+		return;
+
+	if (sample_time == 0)
+		sample_time = 1;
+	seg->n = (point->timediff + sample_time - 1) / sample_time;
+	seg->k = 0;
+	seg->duration = point->timediff;
+	seg->p0 = (real) seg->last_steps;
+	seg->p1 = (real) point->steps;
+	if (point->segment)
+	{
+		seg->v0 = (real) seg->last_velocity;
+		seg->v1 = (real) point->velocity;
+	}
+	else
+	{
+		// A split plain point: the same slope at both ends is a straight line
+		seg->v0 = (seg->p1 - seg->p0) * 1000.0 / point->timediff;
+		seg->v1 = seg->v0;
+	}
+	seg->active = 1;
+}
+
+/** @brief 	Checks if a point is handed out in samples: Hermite segments always,
+ * 			plain points only with split set and if they are longer than a sample
+ *
+ *  @param *seg - sampling state of the channel
+ *  @param *point - point in the channel
+ *  @param sample_time - [ms] sample time the planner uses for segments
+ *  @return 1 if sampled
+ */
+static int32_t segment_sampled(const T_CHA_SEGMENT *seg, const T_DTP_MOTOR *point, uint32_t sample_time)
+{
+	return point->segment || (seg->split && point->timediff > sample_time);
+}
+
+/** @brief 	Calculates one sample of a Hermite segment
+ *
+ *  @param *seg - sampling state of the segment
+ *  @param i - sample number, 1 to n
+ *  @param *out - sampled point (plain), timediff relative to the previous sample
+ *  @return (none)
+ */
+static void segment_sample(const T_CHA_SEGMENT *seg, int32_t i, T_DTP_MOTOR *out)
+{
+	uint32_t t_prev = seg->duration * (i - 1) / seg->n;
+	uint32_t t = seg->duration * i / seg->n;
+	real T = (real) seg->duration / 1000.0; // [s]
+	real x = (real) t / (real) seg->duration;
+	real x2 = x * x;
+	real x3 = x2 * x;
+
+	out->timediff = t - t_prev;
+	out->segment = 0;
+	if (i >= seg->n)
+	{
+		out->steps = (int32_t) seg->p1;
+		out->velocity = (int32_t) seg->v1;
+		return;
+	}
+
+	out->steps = (int32_t) lround((2*x3 - 3*x2 + 1) * seg->p0 + (x3 - 2*x2 + x) * T * seg->v0
+			+ (-2*x3 + 3*x2) * seg->p1 + (x3 - x2) * T * seg->v1);
+	out->velocity = (int32_t) (((6*x2 - 6*x) * (seg->p0 - seg->p1)) / T + (3*x2 - 4*x + 1) * seg->v0 + (3*x2 - 2*x) * seg->v1);
 }
 
 /** @brief 	Pushes count elements that can be found in *in on the channel buffer
@@ -136,7 +446,7 @@ int32_t CHA_pushDatapoints(T_CHANNEL *cha, void *in, int32_t count)
 {
 	int32_t i;
 	// Check if they still fit in
-	if (cha->buffer_length - CHA_getNumberDatapoint(cha) < count)
+	if (CHA_getFreeDatapoints(cha) < count)
 		return -1;
 
 	if (in == NULL)
@@ -235,6 +545,17 @@ int32_t CHA_getNumberDatapoint(T_CHANNEL *cha)
 	return diff;
 }
 
+/** @brief 	Returns how many elements can still be pushed. One slot of the ring
+ * 			stays empty, a full ring would look the same as an empty one.
+ *
+ *  @param *cha - data structure of channel that should be accessed
+ *  @return number of free elements
+ */
+int32_t CHA_getFreeDatapoints(T_CHANNEL *cha)
+{
+	return cha->buffer_length - 1 - CHA_getNumberDatapoint(cha);
+}
+
 /** @brief 	Clears out the whole buffer
  *
  *  @param *cha - data structure of channel that should be accessed
@@ -256,7 +577,8 @@ void CHA_setChannelTime(uint32_t time)
 	channel_time.time = time;
 }
 
-/** @brief 	Increments the channel time by 1.
+/** @brief 	Advances the channel time by one real ms scaled with the tempo,
+ * 			so the music time can stand still or advance by more than 1.
  * 			Should be called only by the timer with
  * 			1ms period.
  *
@@ -265,7 +587,208 @@ void CHA_setChannelTime(uint32_t time)
  */
 void CHA_incrementChannelTime(void)
 {
-	channel_time.time += 1;
+	if (channel_time.tempo_ramp_left > 0)
+	{
+		channel_time.tempo_ramp_left--;
+		if (channel_time.tempo_ramp_left == 0)
+			channel_time.tempo = channel_time.tempo_target;
+		else
+			channel_time.tempo += channel_time.tempo_step;
+	}
+
+	// The music time makes the change when the cycles queued before it are done
+	if (channel_time.pending_delay > 0)
+	{
+		channel_time.pending_delay--;
+		if (channel_time.pending_delay == 0)
+			change_clock(channel_time.pending_tempo, channel_time.pending_ramp, channel_time.pending_limit);
+	}
+	if (channel_time.clock_ramp_left > 0)
+	{
+		channel_time.clock_ramp_left--;
+		if (channel_time.clock_ramp_left == 0)
+			channel_time.clock_tempo = channel_time.clock_target;
+		else
+			channel_time.clock_tempo += channel_time.clock_step;
+	}
+
+	channel_time.tempo_frac += channel_time.clock_tempo;
+	channel_time.time += channel_time.tempo_frac >> 16;
+	channel_time.tempo_frac &= 0xFFFF;
+}
+
+/** @brief 	Changes the tempo of the music time, also while playing.
+ * 			The tempo glides linearly to the new value within the ramp time.
+ * 			New cycles of the axes get the new tempo at once, the music time
+ * 			makes the same change after the cycles queued already.
+ *
+ *  @param tempo - new tempo, CHA_TEMPO_ONE is the tempo of the datapoints
+ *  @param ramp - [ms] time to reach the new tempo, 0 to jump
+ *  @param delay - [ms] real time of the cycles the axes have queued
+ *  @return SUCCESS, or ERROR if the tempo is out of range
+ */
+ErrorStatus CHA_setTempo(uint32_t tempo, uint32_t ramp, uint32_t delay)
+{
+	uint32_t primask;
+
+	if (tempo < CHA_TEMPO_MIN || tempo > CHA_TEMPO_MAX)
+		return ERROR;
+
+	// The tick ramps the tempo, so it must not see half of the new setting
+	primask = __get_PRIMASK();
+	__disable_irq();
+	channel_time.tempo_target = tempo;
+	if (ramp == 0)
+	{
+		channel_time.tempo = tempo;
+		channel_time.tempo_ramp_left = 0;
+	}
+	else
+	{
+		channel_time.tempo_step = ((int32_t) tempo - (int32_t) channel_time.tempo) / (int32_t) ramp;
+		channel_time.tempo_ramp_left = ramp;
+	}
+	schedule_clock(tempo, ramp, 0, delay);
+	__set_PRIMASK(primask);
+	return SUCCESS;
+}
+
+/** @brief 	Returns the current tempo
+ *
+ *  @param (none)
+ *  @return tempo, CHA_TEMPO_ONE is the tempo of the datapoints
+ */
+uint32_t CHA_getTempo(void)
+{
+	return channel_time.tempo;
+}
+
+/** @brief 	Slows the music down at once if it is faster than the given tempo.
+ * 			Used by the planner when an axis cannot follow at the current tempo.
+ * 			A running ramp does not go above it either. The music time follows
+ * 			after the cycles queued already, like for CHA_setTempo().
+ *
+ *  @param tempo - highest tempo allowed from now on
+ *  @param delay - [ms] real time of the cycles the axis has queued
+ *  @return (none)
+ */
+void CHA_limitTempo(uint32_t tempo, uint32_t delay)
+{
+	uint32_t primask;
+
+	if (tempo < CHA_TEMPO_MIN)
+		tempo = CHA_TEMPO_MIN;
+
+	primask = __get_PRIMASK();
+	__disable_irq();
+	if (channel_time.tempo > tempo)
+		channel_time.tempo = tempo;
+	if (channel_time.tempo_target > tempo)
+	{
+		channel_time.tempo_target = tempo;
+		if (channel_time.tempo_ramp_left > 0)
+			channel_time.tempo_step = ((int32_t) tempo - (int32_t) channel_time.tempo) / (int32_t) channel_time.tempo_ramp_left;
+	}
+	if (channel_time.pending_delay > 0)
+	{
+		// Comes before or with the change that is pending, so it holds for that one as well
+		if (channel_time.pending_tempo > tempo)
+			channel_time.pending_tempo = tempo;
+	}
+	else if (channel_time.clock_tempo > tempo || channel_time.clock_target > tempo)
+	{
+		schedule_clock(tempo, 0, 1, delay);
+	}
+	__set_PRIMASK(primask);
+}
+
+/** @brief 	Schedules a change of the tempo of the music time. A change that is
+ * 			still pending is started at once, so the music time misses none.
+ * 			Call with interrupts disabled.
+ *
+ *  @param tempo - new tempo
+ *  @param ramp - [ms] time to reach it, 0 to jump
+ *  @param limit - 1: only lower the tempo to this value
+ *  @param delay - [ms] until the change starts
+ *  @return (none)
+ */
+static void schedule_clock(uint32_t tempo, uint32_t ramp, int32_t limit, uint32_t delay)
+{
+	if (channel_time.pending_delay > 0)
+	{
+		channel_time.pending_delay = 0;
+		change_clock(channel_time.pending_tempo, channel_time.pending_ramp, channel_time.pending_limit);
+	}
+
+	if (delay == 0)
+	{
+		change_clock(tempo, ramp, limit);
+		return;
+	}
+	channel_time.pending_tempo = tempo;
+	channel_time.pending_ramp = ramp;
+	channel_time.pending_limit = limit;
+	channel_time.pending_delay = delay;
+}
+
+/** @brief 	Starts a change of the tempo of the music time
+ *
+ *  @param tempo - new tempo
+ *  @param ramp - [ms] time to reach it, 0 to jump
+ *  @param limit - 1: only lower the tempo and a running ramp to this value
+ *  @return (none)
+ */
+static void change_clock(uint32_t tempo, uint32_t ramp, int32_t limit)
+{
+	if (limit)
+	{
+		if (channel_time.clock_tempo > tempo)
+			channel_time.clock_tempo = tempo;
+		if (channel_time.clock_target > tempo)
+		{
+			channel_time.clock_target = tempo;
+			if (channel_time.clock_ramp_left > 0)
+				channel_time.clock_step = ((int32_t) tempo - (int32_t) channel_time.clock_tempo) / (int32_t) channel_time.clock_ramp_left;
+		}
+		return;
+	}
+
+	channel_time.clock_target = tempo;
+	if (ramp == 0)
+	{
+		channel_time.clock_tempo = tempo;
+		channel_time.clock_ramp_left = 0;
+	}
+	else
+	{
+		channel_time.clock_step = ((int32_t) tempo - (int32_t) channel_time.clock_tempo) / (int32_t) ramp;
+		channel_time.clock_ramp_left = ramp;
+	}
+}
+
+/** @brief 	Converts a duration in music time to real time at the current tempo
+ *
+ *  @param time - duration in music time [ms]
+ *  @return duration in real time [ms], at least 1 for a non zero time
+ */
+uint32_t CHA_musicToRealTime(uint32_t time)
+{
+	return CHA_musicToRealTimeAt(time, channel_time.tempo);
+}
+
+/** @brief 	Converts a duration in music time to real time at a given tempo
+ *
+ *  @param time - duration in music time [ms]
+ *  @param tempo - CHA_TEMPO_ONE is the tempo of the datapoints
+ *  @return duration in real time [ms], at least 1 for a non zero time
+ */
+uint32_t CHA_musicToRealTimeAt(uint32_t time, uint32_t tempo)
+{
+	uint32_t real_time = (uint32_t) ((((uint64_t) time << 16) + tempo / 2) / tempo);
+
+	if (real_time == 0 && time > 0)
+		real_time = 1;
+	return real_time;
 }
 
 /** @brief 	Returns the current system time
@@ -325,61 +848,101 @@ void CHA_stopTime (void)
  */
 void CHA_updateChannels (void)
 {
-	if (CHA_getNumberDatapoint(&cha_e_note) > 0)
-	{
-		if(((T_DTP_NOTE*) CHA_peekFirstDatapoint(&cha_e_note))->timediff >=
-				CHA_getChannelTime() - cha_e_note.last_point_time)
-		{
-			T_DTP_NOTE point;
-			CHA_popDatapoints(&cha_e_note, &point, 1);
-			cha_e_note.last_point_time += point.timediff;
-			notes_e_set(point.note);
+	// Notes only change the shadow bitmap, all strings go out in one transfer at the end of the tick
+	update_note_channel(&cha_g_note, NOTES_STRING_G);
+	update_note_channel(&cha_d_note, NOTES_STRING_D);
+	update_note_channel(&cha_a_note, NOTES_STRING_A);
+	update_note_channel(&cha_e_note, NOTES_STRING_E);
+
+	update_vib_channel(&cha_g_vib, NOTES_STRING_G);
+	update_vib_channel(&cha_d_vib, NOTES_STRING_D);
+	update_vib_channel(&cha_a_vib, NOTES_STRING_A);
+	update_vib_channel(&cha_e_vib, NOTES_STRING_E);
+
+	update_motor_channel(&cha_posx_dae, &x_dae_motor);
+	update_motor_channel(&cha_posy_dae, &y_dae_motor);
+	update_motor_channel(&cha_str_dae, &z_dae_motor);
+}
 
-		}
-	}
-	if (CHA_getNumberDatapoint(&cha_posx_dae) > 0)
+/** @brief 	Plays all the notes of one note channel that are due.
+ * 			A note is due lead_time ms before its music time. Several points
+ * 			can be due in the same ms (e.g. timediff 0), only the last one
+ * 			stays on the string. Ornaments are started here and expanded by notes_update().
+ *
+ *  @param *cha - note channel
+ *  @param string - string the channel plays on
+ *  @return (none)
+ */
+static void update_note_channel(T_CHANNEL *cha, E_NOTES_STRING string)
+{
+	T_DTP_NOTE point;
+
+	while (CHA_getNumberDatapoint(cha) > 0)
 	{
-		if(((T_DTP_MOTOR*) CHA_peekFirstDatapoint(&cha_posx_dae))->timediff >=
-				CHA_getChannelTime() - cha_posx_dae.last_point_time) // Update of last_point_time happens in motor function
-		{
-			if (x_dae_motor.status == STG_IDLE)
-				SM_setMotorReady(&x_dae_motor);
-		}
+		// Signed: a lower lead or tempo can set the channel time back behind the last point
+		if ((int32_t) (channel_time_ahead(cha) - cha->last_point_time) <
+				(int32_t) ((T_DTP_NOTE*) CHA_peekFirstDatapoint(cha))->timediff)
+			break;
+
+		CHA_popDatapoints(cha, &point, 1);
+		cha->last_point_time += point.timediff;
+		notes_play(string, &point); // a note that is not on this string is ignored
 	}
+}
+
+/** @brief 	Hands all vibrato datapoints of one vibrato channel that are due
+ * 			to the oscillator of the string.
+ *
+ *  @param *cha - vibrato channel
+ *  @param string - string the channel belongs to
+ *  @return (none)
+ */
+static void update_vib_channel(T_CHANNEL *cha, E_NOTES_STRING string)
+{
+	T_DTP_VIB point;
 
-	if (CHA_getNumberDatapoint(&cha_posy_dae) > 0)
+	while (CHA_getNumberDatapoint(cha) > 0)
 	{
-		if(((T_DTP_MOTOR*) CHA_peekFirstDatapoint(&cha_posy_dae))->timediff >=
-				CHA_getChannelTime() - cha_posy_dae.last_point_time)
-		{
-			if (y_dae_motor.status == STG_IDLE)
-				SM_setMotorReady(&y_dae_motor);
-		}
+		// Signed, see update_note_channel
+		if ((int32_t) (channel_time_ahead(cha) - cha->last_point_time) <
+				(int32_t) ((T_DTP_VIB*) CHA_peekFirstDatapoint(cha))->timediff)
+			break;
+
+		CHA_popDatapoints(cha, &point, 1);
+		cha->last_point_time += point.timediff;
+		VIB_set(string, &point);
 	}
+}
 
-	if (CHA_getNumberDatapoint(&cha_str_dae) > 0)
+/** @brief 	Starts the trajectory of an idle motor when its channel is due.
+ * 			The motion towards the first datapoint starts at the time of the
+ * 			previous point, minus the lead time of the channel.
+ *
+ *  @param *cha - motor channel
+ *  @param *ctl - motor that plays the channel
+ *  @return (none)
+ */
+static void update_motor_channel(T_CHANNEL *cha, T_MOTOR_CONTROL *ctl)
+{
+	if (CHA_getNumberMotorPoints(cha, SM_SEGMENT_SAMPLE_TIME) > 0)
 	{
-		if(((T_DTP_MOTOR*) CHA_peekFirstDatapoint(&cha_str_dae))->timediff >=
-				CHA_getChannelTime() - cha_str_dae.last_point_time)
+		// Update of last_point_time happens in motor function. A motor that is late still starts.
+		if ((int32_t) (channel_time_ahead(cha) - cha->last_point_time) >= 0)
 		{
-			if (z_dae_motor.status == STG_IDLE)
-				SM_setMotorReady(&z_dae_motor);
+			if (ctl->status == STG_IDLE)
+				SM_setMotorReady(ctl);
 		}
 	}
 }
 
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
+/** @brief 	Music time as seen by one channel: the channel time plus the
+ * 			lead time of the channel. Datapoints are executed when this time reaches them.
+ *
+ *  @param *cha - channel
+ *  @return channel time + lead time at the current tempo [ms]
+ */
+static uint32_t channel_time_ahead(T_CHANNEL *cha)
+{
+	// The latency of the actuator is real time, so it is worth more music time at a faster tempo
+	return CHA_getChannelTime() + ((cha->lead_time * channel_time.clock_tempo) >> 16);
+}
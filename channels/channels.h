@@ -13,10 +13,17 @@
 
 // Numbers for channels according to specification
 // Be careful: when changing something here, you also need to change the order in cha_list[] in channels.c
+#define		CHA_G_NOTE_NR		0
+#define		CHA_D_NOTE_NR		1
+#define		CHA_A_NOTE_NR		2
 #define		CHA_E_NOTE_NR		3
 #define		CHA_POSX_DAE_NR		4
 #define		CHA_POSY_DAE_NR		5
 #define		CHA_STR_DAE_NR		6
+#define		CHA_G_VIB_NR		10
+#define		CHA_D_VIB_NR		11
+#define		CHA_A_VIB_NR		12
+#define		CHA_E_VIB_NR		13
 
 // Number of datapoints in each channel (can be adjusted individually to have more buffer for more active channels such as STR_DAE)
 #define CHA_G_NOTE_LENGTH 		50
@@ -29,6 +36,29 @@
 #define CHA_POSX_GDA_LENGTH 	50
 #define CHA_POSY_GDA_LENGTH 	50
 #define CHA_STR_GDA_LENGTH 		50
+#define CHA_G_VIB_LENGTH 		20
+#define CHA_D_VIB_LENGTH 		20
+#define CHA_A_VIB_LENGTH 		20
+#define CHA_E_VIB_LENGTH 		20
+
+#define CHA_MAX_LEAD_TIME		500 // [ms] maximum actuator latency that can be compensated
+
+/*
+ * Sampling state of a motor channel. Hermite segments in the channel
+ * are handed out as a series of plain points (see CHA_popMotorPoint()).
+ */
+typedef struct
+{
+	int32_t		active;			// 1 while a segment is sampled
+	int32_t		n;				// number of samples of that segment
+	int32_t		k;				// samples already handed out
+	uint32_t	duration;		// [ms] of the segment
+	real		p0, v0, p1, v1;	// start and end of the segment [steps], [steps/s]
+	int32_t		last_steps;		// position of the last channel point handed out
+	int32_t		last_velocity;	// [steps/s] velocity given at that point
+	int32_t		last_valid;		// 0 as long as no point was handed out
+	int32_t		split;			// 1: plain points longer than the sample time are sampled as straight segments (vibrato)
+}T_CHA_SEGMENT;
 
 /*
  * Main handle for one channel
@@ -43,6 +73,8 @@ typedef struct
 	int32_t in; // index of incoming element which is empty and ready to write on (array-like)
 	int32_t out; // index of outgoing element which is filled and ready to be read (array-like numeration)
 	uint32_t last_point_time; // used to keep the time stamp of the last event to be able to check when the relative time has elapsed
+	T_CHA_SEGMENT *segment; // sampling state for motor channels, NULL for the others
+	uint32_t lead_time; // [ms] the datapoints are executed this much before their time to compensate the actuator delay. Kept by CHA_Init().
 }T_CHANNEL;
 
 /*
@@ -57,9 +89,29 @@ typedef struct
 {
 	volatile int32_t	time_running; 	// if 0, the channel time is not incremented AND the channels are not checked
 	volatile uint32_t 	time;	// main music time [ms]
-
+	// Tempo: music ms per real ms, Q16. All datapoint times stay in music time.
+	// The planner converts new cycles with it at once.
+	volatile uint32_t	tempo;
+	uint32_t			tempo_frac;		// music time below 1 ms, Q16
+	uint32_t			tempo_target;
+	int32_t				tempo_step;		// change of tempo per ms while ramping
+	uint32_t			tempo_ramp_left;// [ms]
+	// Tempo the music time runs at. It makes each change of tempo only after the
+	// cycles the axes had queued at the old tempo, so notes and axes stay together.
+	volatile uint32_t	clock_tempo;
+	uint32_t			clock_target;
+	int32_t				clock_step;		// change of clock_tempo per ms while ramping
+	uint32_t			clock_ramp_left;// [ms]
+	uint32_t			pending_tempo;	// change the music time still has to make
+	uint32_t			pending_ramp;	// [ms]
+	int32_t				pending_limit;	// 1: the change only lowers the tempo (CHA_limitTempo)
+	uint32_t			pending_delay;	// [ms] until the change starts, 0 if none is pending
 }T_CHANNEL_TIME;
 
+#define CHA_TEMPO_ONE			0x10000					// tempo 100%
+#define CHA_TEMPO_MIN			(CHA_TEMPO_ONE / 4)		// 25%
+#define CHA_TEMPO_MAX			(CHA_TEMPO_ONE * 2)		// 200%, the axes may limit it further
+
 // Allocation of channel buffer handles
 T_CHANNEL cha_g_note;
 T_CHANNEL cha_d_note;
@@ -85,6 +137,7 @@ int32_t CHA_pushDatapoints(T_CHANNEL *cha, void *in, int32_t count);
 int32_t CHA_popDatapoints(T_CHANNEL *cha, void *out, int32_t count);
 int32_t CHA_readDatapoints(T_CHANNEL *cha, void *out, int32_t count);
 int32_t CHA_getNumberDatapoint(T_CHANNEL *cha);
+int32_t CHA_getFreeDatapoints(T_CHANNEL *cha);
 void* CHA_peekFirstDatapoint(T_CHANNEL *cha);
 void CHA_clearBuffer(T_CHANNEL *cha);
 void CHA_updateChannels (void);
@@ -97,6 +150,15 @@ void CHA_stopTime (void);
 void CHA_startPlaying (void);
 void CHA_stopPlaying (void);
 void CHA_setRelativeExecutionTime(uint32_t time);
+ErrorStatus CHA_setLeadTime(T_CHANNEL *cha, uint32_t lead_time);
+ErrorStatus CHA_setTempo(uint32_t tempo, uint32_t ramp, uint32_t delay);
+uint32_t CHA_getTempo(void);
+void CHA_limitTempo(uint32_t tempo, uint32_t delay);
+uint32_t CHA_musicToRealTime(uint32_t time);
+uint32_t CHA_musicToRealTimeAt(uint32_t time, uint32_t tempo);
+int32_t CHA_getNumberMotorPoints(T_CHANNEL *cha, uint32_t sample_time);
+int32_t CHA_popMotorPoint(T_CHANNEL *cha, T_DTP_MOTOR *out, uint32_t sample_time);
+int32_t CHA_readMotorPoint(T_CHANNEL *cha, T_DTP_MOTOR *out, uint32_t sample_time);
 
 
 
@@ -11,11 +11,19 @@
 
 /*
  * Datapoint in motor axis (X, Y and Z for DAE and GDA)
+ *
+ * With segment set to 1, the motion from the previous datapoint to this one is a
+ * cubic Hermite curve: it leaves the previous point with the velocity given there
+ * and arrives here with this velocity. The SPV samples the curve into cycles itself,
+ * so smooth strokes need only a few datapoints. Otherwise, velocity is only used
+ * as start tangent if the next datapoint is a segment.
  */
 typedef struct __attribute__((__packed__))
 {
 	uint32_t timediff;		// relative time difference in ms to last datapoint (or to start timepoint)
 	int32_t steps;			// number of steps from calibrated zero-point
+	int32_t velocity;		// [steps/s] velocity at this point (tangent of Hermite segments)
+	uint8_t segment;		// 1: Hermite segment from the previous point to this one, 0: plain point
 }T_DTP_MOTOR;
 
 /*
@@ -27,12 +35,36 @@ typedef struct __attribute__((__packed__))
  * A: 69 - 80
  * E: 76 - 93
  * 255 means no note is played.
+ *
+ * With a period other than 0, the point is an ornament which is expanded on the SPV:
+ * the string alternates between note and note_alt every period (trill), or between
+ * note and nothing if note_alt is 255 (repeated note / tremolo). The period changes
+ * by accel after every switch. After duration ms the main note stays.
  */
 typedef struct __attribute__((__packed__))
 {
 	uint32_t timediff;    	// relative time difference in ms to last datapoint (or to start timepoint)
 	uint8_t  note;			// number of note to be pressed on that string, in midi notataion (e.g. 76 is the empty E-string)
+	uint8_t  note_alt;		// ornament: second note (255: release). Ignored for plain notes
+	uint16_t period;		// ornament: time per note [1/10 ms]. 0 for a plain note
+	uint16_t duration;		// ornament: length [ms]
+	int8_t   accel;			// ornament: change of the period after each note [1/10 ms], negative accelerates
 }T_DTP_NOTE;
 
+/*
+ * Datapoint for vibrato (one channel per string)
+ *
+ * Only describes the vibrato, the motion is generated on the SPV (vibrato.c).
+ * The new rate and depth are reached after the ramp time, starting at the time of the datapoint.
+ */
+typedef struct __attribute__((__packed__))
+{
+	uint32_t timediff;    	// relative time difference in ms to last datapoint (or to start timepoint)
+	uint16_t rate;			// vibrato frequency in 1/100 Hz (e.g. 550 is 5.5 Hz), at most 20 Hz. 0 fades the vibrato out.
+	uint16_t depth;			// peak deviation from the note in cent (1/100 semitone), at most 200
+	uint8_t  waveform;		// 0: sine, 1: triangle
+	uint16_t ramp;			// [ms] glide time from the current rate and depth to the new ones
+}T_DTP_VIB;
+
 
 #endif /* DATAPOINT_DEF_H_ */
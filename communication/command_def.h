@@ -21,6 +21,33 @@
 #define 	COMM_MOVECHANNELTO			0x09
 #define		COMM_MOVECHANNELRELATIVE	0x0A
 #define 	COMM_REFERENCECHANNEL		0x0B
+#define		COMM_SETCHANNELLEAD			0x0C
+#define		COMM_STOREBEGIN				0x0D
+#define		COMM_STOREDATA				0x0E
+#define		COMM_STOREEND				0x0F
+#define		COMM_STORESELECT			0x10
+#define		COMM_STORESEEK				0x11
+#define		COMM_STORELOOP				0x12
+#define		COMM_SETTEMPO				0x13
+#define		COMM_SUBSCRIBETELEMETRY		0x14
+#define		COMM_DUMPCOUNTERS			0x15
+#define		COMM_SELFCHECK				0x16
+#define		COMM_REFERENCEALL			0x17
+#define		COMM_SAVEPARAMETERS			0x18
+#define		COMM_SETAXISPARAMETERS		0x19
+#define		COMM_STEPBENCH				0x1A
+
+// Status of packets the SPV sends without a request (instead of ACK/NACK)
+#define		COMM_TELEMETRY				0x80
+
+// Version of the packet and datapoint layouts, reported in the status. Raised with every
+// change of a layout, the PC has to check it before it sends datapoints.
+// 1: baseline
+// 2: channelfill of 11 channels, T_DTP_NOTE with ornaments, T_DTP_MOTOR with velocity and segment,
+//    T_DTP_VIB on the vibrato channels
+// 3: STOREBEGIN is acknowledged before the flash is erased, the store status tells when
+//    STOREDATA is accepted
+#define		COMM_PROTOCOL_VERSION		3
 
 // Tags which SPV returns upon request
 #define		COMM_STAT_ID_TAG			0x00
@@ -35,12 +62,20 @@
 #define		COMM_STAT_CHANNELREADY_LEN	1
 #define 	COMM_STAT_AXISSTATUS_TAG	0x05
 #define 	COMM_STAT_AXISSTATUS_LEN	4
+#define		COMM_STAT_CPULOAD_TAG		0x06
+#define		COMM_STAT_CPULOAD_LEN		(4 * DEBUG_LOAD_CONTEXTS)	// per context (E_DEBUG_LOAD_CONTEXT): last window, peak since the last request [1/1000], uint16_t each, 0xFFFF without DBG_CPU_LOAD
+#define		COMM_STAT_HOMING_TAG		0x07
+#define		COMM_STAT_HOMING_LEN		(2 + 4 * (COMM_AXISSTATUS_AXIS + 1))	// running, homed axis (bits), total time, time per axis [ms], uint32_t each
+#define		COMM_STAT_PROTOCOL_TAG		0x08
+#define		COMM_STAT_PROTOCOL_LEN		1	// COMM_PROTOCOL_VERSION
+#define		COMM_STAT_STORE_TAG			0x09
+#define		COMM_STAT_STORE_LEN			3	// erasing, uploading, valid piece stored
 
-#define 	COMM_STATUS_FIELD_SIZE 	(COMM_STAT_ID_LEN + 2 + COMM_STAT_TIME_LEN + 2 + COMM_STAT_RUNNING_LEN + 2)
+#define 	COMM_STATUS_FIELD_SIZE 	(COMM_STAT_ID_LEN + 2 + COMM_STAT_TIME_LEN + 2 + COMM_STAT_RUNNING_LEN + 2 + COMM_STAT_CPULOAD_LEN + 2 + COMM_STAT_HOMING_LEN + 2 + COMM_STAT_PROTOCOL_LEN + 2 + COMM_STAT_STORE_LEN + 2)
 #define		COMM_STAT_AXISSTATUS_FIELD_SIZE (COMM_STAT_AXISSTATUS_LEN + 2) * 3
 
 // Number of channels which are included in the channelfill - report
-#define		COMM_CHANNELFILL_CHANNELS	4
+#define		COMM_CHANNELFILL_CHANNELS	11
 #define		COMM_CHANNELFILL_FIELD_LEN	4
 
 #define		COMM_AXISSTATUS_AXIS	3	// How many axis are transmitted
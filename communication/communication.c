@@ -17,9 +17,13 @@
 #include "settings.h"
 #include "notes.h"
 #include "channels.h"
-
-// PROTOTYPES
-unsigned short crc16(const unsigned char* data_p, unsigned int length);
+#include "scheduler.h"
+#include "store.h"
+#include "telemetry.h"
+#include "counters.h"
+#include "trajectory_check.h"
+#include "parameters.h"
+#include "step_bench.h"
 
 /** @brief  Initializes communication stuff.
  *
@@ -35,13 +39,17 @@ void COM_init(void)
 /** @brief 	Is periodically called from the main loop and checks if new
  * 			commands have entered via the USB-CDC interface.
  *
- * 			From here, all the package decoding is done.
+ * 			From here, all the package decoding is done. Also keeps
+ * 			the transmit queue and the telemetry going.
  *
  *  @param (none)
  *  @return (none)
  */
 void COM_update (void)
 {
+	// Next part of the transmit queue as soon as USB is free
+	USB_CDC_updateTx();
+
 	if (usb_cdc_rx_buffer.packet_in_buffer==1)
 	{
 		// There is a good packet in the buffer -> decode and execute it
@@ -57,6 +65,37 @@ void COM_update (void)
 		COM_sendResponse(NACK, NULL, 0); // Indicate by a NACK that something is wrong.
 	}
 
+	TEL_update();
+}
+
+/** @brief 	Commands that are refused while the step rate benchmark runs: they would
+ * 			move the axes under it, change their parameters or stall the CPU with flash
+ * 			operations (see step_bench.h).
+ *
+ *  @param command - command byte
+ *  @return 1 if refused
+ */
+static uint8_t com_busyDuringBench(uint8_t command)
+{
+	switch (command)
+	{
+	case COMM_STARTPLAYING:
+	case COMM_STOPPLAYING:
+	case COMM_INITCHANNELSTODATA:
+	case COMM_MOVECHANNELTO:
+	case COMM_MOVECHANNELRELATIVE:
+	case COMM_REFERENCECHANNEL:
+	case COMM_REFERENCEALL:
+	case COMM_STOREBEGIN:
+	case COMM_STOREDATA:
+	case COMM_STOREEND:
+	case COMM_STORESEEK:
+	case COMM_SETAXISPARAMETERS:
+	case COMM_SAVEPARAMETERS:
+		return 1;
+	default:
+		return 0;
+	}
 }
 
 /** @brief 	Decodes the package and gets the require stuff going!
@@ -64,7 +103,7 @@ void COM_update (void)
  *			only the command and the data bytes!
  *
  *  @param *buf - pointer to buffer, where buf[0] is CMD, the rest is data (CRC is excluded already)
- *  @param len - lenth of data field. len = number of data bytes + 1 command byte
+ *  @param len - lenth of data field. len = number of data bytes, without the command byte
  *  @return (none)
  */
 void COM_decodePackage(uint8_t *buf, int32_t len)
@@ -76,7 +115,13 @@ void COM_decodePackage(uint8_t *buf, int32_t len)
 	uint8_t command = buf[0];
 
 	// -----------------------------------------------------
-	if (command == COMM_GETSTATUS)
+	if (ben.state == BEN_RUNNING && com_busyDuringBench(command))
+	{
+		dbgprintf("Command %02X refused, the step rate benchmark is running", command);
+		COM_sendResponse(NACK, NULL, 0);
+	}
+	// -----------------------------------------------------
+	else if (command == COMM_GETSTATUS)
 	{
 		// PC requested the status of the SPV
 		uint8_t data[COMM_STATUS_FIELD_SIZE];
@@ -97,6 +142,41 @@ void COM_decodePackage(uint8_t *buf, int32_t len)
 		*(ptr++) = COMM_STAT_RUNNING_LEN;
 		*(ptr++) = CHA_getIfTimeActive() & 0x000000FF;
 
+		uint16_t load_last[DEBUG_LOAD_CONTEXTS], load_peak[DEBUG_LOAD_CONTEXTS];
+		int i;
+		debug_load_read(load_last, load_peak);
+		*(ptr++) = COMM_STAT_CPULOAD_TAG;
+		*(ptr++) = COMM_STAT_CPULOAD_LEN;
+		for (i = 0; i < DEBUG_LOAD_CONTEXTS; i++)
+		{
+			memcpy(ptr, &load_last[i], sizeof(uint16_t));
+			memcpy(ptr + 2, &load_peak[i], sizeof(uint16_t));
+			ptr += 4;
+		}
+
+		T_MOTOR_CONTROL *homing_axis[COMM_AXISSTATUS_AXIS] = {&x_dae_motor, &y_dae_motor, &z_dae_motor};
+		*(ptr++) = COMM_STAT_HOMING_TAG;
+		*(ptr++) = COMM_STAT_HOMING_LEN;
+		*(ptr++) = sm_homing.active & 0x000000FF;
+		*(ptr++) = sm_homing.homed;
+		memcpy(ptr, &sm_homing.time, sizeof(uint32_t));
+		ptr += 4;
+		for (i = 0; i < COMM_AXISSTATUS_AXIS; i++)
+		{
+			memcpy(ptr, &homing_axis[i]->motor.home_time, sizeof(uint32_t));
+			ptr += 4;
+		}
+
+		*(ptr++) = COMM_STAT_PROTOCOL_TAG;
+		*(ptr++) = COMM_STAT_PROTOCOL_LEN;
+		*(ptr++) = COMM_PROTOCOL_VERSION;
+
+		*(ptr++) = COMM_STAT_STORE_TAG;
+		*(ptr++) = COMM_STAT_STORE_LEN;
+		*(ptr++) = STO_isErasing() & 0x000000FF;
+		*(ptr++) = sto.uploading & 0x000000FF;
+		*(ptr++) = sto.valid & 0x000000FF;
+
 		// DO NOT FORGET to adapt COMM_STATUS_FIELD_SIZE when adding new status fields here.
 
 		COM_sendResponse(ACK, data, sizeof(data));
@@ -145,16 +225,23 @@ void COM_decodePackage(uint8_t *buf, int32_t len)
 		uint8_t missing = 0;
 
 		T_CHANNEL *channels[COMM_CHANNELFILL_CHANNELS];
-		channels[0] = &cha_e_note;
-		channels[1] = &cha_posx_dae;
-		channels[2] = &cha_posy_dae;
-		channels[3] = &cha_str_dae;
+		channels[0] = &cha_g_note;
+		channels[1] = &cha_d_note;
+		channels[2] = &cha_a_note;
+		channels[3] = &cha_e_note;
+		channels[4] = &cha_posx_dae;
+		channels[5] = &cha_posy_dae;
+		channels[6] = &cha_str_dae;
+		channels[7] = &cha_g_vib;
+		channels[8] = &cha_d_vib;
+		channels[9] = &cha_a_vib;
+		channels[10] = &cha_e_vib;
 		// DO NOT FORGET to adapt COMM_CHANNELFILL_CHANNELS when adding more channels here!
 
 		int32_t i;
 		for (i = 0; i < COMM_CHANNELFILL_CHANNELS; i++)
 		{
-			missing = channels[i]->buffer_length - CHA_getNumberDatapoint(channels[i]);
+			missing = CHA_getFreeDatapoints(channels[i]);
 			if (missing > 0)
 			{
 				*(ptr++) = COMM_STAT_CHANNELFILL_TAG;
@@ -193,22 +280,29 @@ void COM_decodePackage(uint8_t *buf, int32_t len)
 	else if (command == COMM_STARTPLAYING)
 	{
 		dbgprintf("Start Playing command!");
+		uint32_t lock = SCH_lockPlanner();
 		CHA_startPlaying();
+		SCH_unlockPlanner(lock);
 		COM_sendResponse(ACK, NULL, 0);
 	}
 	// -----------------------------------------------------
 	else if (command == COMM_STOPPLAYING)
 	{
+		uint32_t request = DWT->CYCCNT;
 		dbgprintf("Stop Playing command!");
+		uint32_t lock = SCH_lockPlanner();
 		CHA_stopPlaying();
-		SM_softstop();
+		SM_softstop(request);
+		SCH_unlockPlanner(lock);
 		COM_sendResponse(ACK, NULL, 0);
 	}
 	// -----------------------------------------------------
 	else if (command == COMM_CLEARCHANNELS)
 	{
 		dbgprintf("Clear all channels");
+		uint32_t lock = SCH_lockPlanner();
 		CHA_Init();
+		SCH_unlockPlanner(lock);
 		COM_sendResponse(ACK, NULL, 0);
 	}
 	// -----------------------------------------------------
@@ -216,6 +310,7 @@ void COM_decodePackage(uint8_t *buf, int32_t len)
 	{
 		dbgprintf("Init channels to current data points");
 		T_DTP_MOTOR *ptr;
+		uint32_t lock = SCH_lockPlanner();
 		if (CHA_getNumberDatapoint(&cha_posx_dae) > 0)
 		{
 			ptr = CHA_peekFirstDatapoint(&cha_posx_dae);
@@ -231,6 +326,7 @@ void COM_decodePackage(uint8_t *buf, int32_t len)
 			ptr = CHA_peekFirstDatapoint(&cha_str_dae);
 			SM_moveMotorToLocation(&z_dae_motor, (int32_t) ptr->steps, Z_NOMSPEED);
 		}
+		SCH_unlockPlanner(lock);
 
 		COM_sendResponse(ACK, NULL, 0);
 	}
@@ -244,9 +340,22 @@ void COM_decodePackage(uint8_t *buf, int32_t len)
 
 		dbgprintf("Should move to pos=%d at speed=%d", position, (int)speed);
 
-		if (channel_nr == CHA_E_NOTE_NR)
+		uint32_t lock = SCH_lockPlanner();
+		if (channel_nr == CHA_G_NOTE_NR)
+		{
+			notes_set(NOTES_STRING_G, position);
+		}
+		else if (channel_nr == CHA_D_NOTE_NR)
 		{
-			notes_e_set(position);
+			notes_set(NOTES_STRING_D, position);
+		}
+		else if (channel_nr == CHA_A_NOTE_NR)
+		{
+			notes_set(NOTES_STRING_A, position);
+		}
+		else if (channel_nr == CHA_E_NOTE_NR)
+		{
+			notes_set(NOTES_STRING_E, position);
 		}
 		else if (channel_nr == CHA_POSX_DAE_NR)
 		{
@@ -260,6 +369,7 @@ void COM_decodePackage(uint8_t *buf, int32_t len)
 		{
 			SM_moveMotorToLocation(&z_dae_motor, (int32_t) position, speed);
 		}
+		SCH_unlockPlanner(lock);
 
 		COM_sendResponse(ACK, NULL, 0);
 	}
@@ -274,6 +384,7 @@ void COM_decodePackage(uint8_t *buf, int32_t len)
 
 		dbgprintf("Should move by %d steps at speed=%d", pos_diff, (int)speed);
 
+		uint32_t lock = SCH_lockPlanner();
 		if (channel_nr == CHA_POSX_DAE_NR)
 		{
 			SM_moveMotorRelative(&x_dae_motor, pos_diff, speed);
@@ -291,6 +402,7 @@ void COM_decodePackage(uint8_t *buf, int32_t len)
 			// This command is not supported for other channels
 			acknowledge = NACK;
 		}
+		SCH_unlockPlanner(lock);
 		COM_sendResponse(acknowledge, NULL, 0);
 	}
 	// -----------------------------------------------------
@@ -301,6 +413,7 @@ void COM_decodePackage(uint8_t *buf, int32_t len)
 		real speed = (double) buf[2];
 		uint8_t acknowledge = ACK;
 
+		uint32_t lock = SCH_lockPlanner();
 		if (channel_nr == CHA_POSX_DAE_NR)
 		{
 			SM_referenceMotor(&x_dae_motor, speed);
@@ -318,9 +431,225 @@ void COM_decodePackage(uint8_t *buf, int32_t len)
 			// This command is not supported for other channels
 			acknowledge = NACK;
 		}
+		SCH_unlockPlanner(lock);
 		COM_sendResponse(acknowledge, NULL, 0);
 	}
 	// -----------------------------------------------------
+	else if (command == COMM_REFERENCEALL)
+	{
+		// All axis at once. The PC polls the homing status (GETSTATUS) to see when it is done and how long it took.
+		dbgprintf("Reference all axis");
+		uint8_t acknowledge = ACK;
+
+		uint32_t lock = SCH_lockPlanner();
+		if (CHA_getIfTimeActive() || SM_referenceAll() != SUCCESS)
+			acknowledge = NACK;
+		SCH_unlockPlanner(lock);
+		COM_sendResponse(acknowledge, NULL, 0);
+	}
+	// -----------------------------------------------------
+	else if (command == COMM_SAVEPARAMETERS)
+	{
+		// Tuning, lead times and the positions of the referenced axis go to flash. Not while playing.
+		uint8_t acknowledge = PAR_save() == SUCCESS ? ACK : NACK;
+		COM_sendResponse(acknowledge, NULL, 0);
+	}
+	// -----------------------------------------------------
+	else if (command == COMM_SETAXISPARAMETERS)
+	{
+		// channel nr, acceleration [rad/s^2] (float), max speed [rad/s] (float), travel [steps] (int32), flip dir (int8),
+		// optionally step mode (E_STG_STEP_MODE, unchanged if left out)
+		uint8_t channel_nr = buf[1];
+		float acc, w_max;
+		int32_t max_travel;
+		int8_t flip_dir = buf[14];
+		T_MOTOR_CONTROL *ctl = NULL;
+		uint8_t acknowledge = NACK;
+		memcpy(&acc, &buf[2], sizeof(float));
+		memcpy(&w_max, &buf[6], sizeof(float));
+		memcpy(&max_travel, &buf[10], sizeof(int32_t));
+
+		if (channel_nr == CHA_POSX_DAE_NR)
+			ctl = &x_dae_motor;
+		else if (channel_nr == CHA_POSY_DAE_NR)
+			ctl = &y_dae_motor;
+		else if (channel_nr == CHA_STR_DAE_NR)
+			ctl = &z_dae_motor;
+
+		uint32_t lock = SCH_lockPlanner();
+		if (len >= 14 && ctl != NULL)
+		{
+			E_STG_STEP_MODE step_mode = len >= 15 ? (E_STG_STEP_MODE) buf[15] : ctl->motor.hw.step_mode;
+			acknowledge = PAR_setAxis(ctl, acc, w_max, max_travel, flip_dir, step_mode) == SUCCESS ? ACK : NACK;
+		}
+		SCH_unlockPlanner(lock);
+		COM_sendResponse(acknowledge, NULL, 0);
+	}
+	// -----------------------------------------------------
+	else if (command == COMM_SETCHANNELLEAD)
+	{
+		uint8_t channel_nr = buf[1];
+		uint32_t lead_time = buf[3] << 8 | buf[2];
+		uint8_t acknowledge = NACK;
+
+		dbgprintf("Set lead time of channel %d to %d ms", channel_nr, lead_time);
+
+		uint32_t lock = SCH_lockPlanner();
+		if (channel_nr < CHA_NUMBER_CHANNELS_TOTAL && CHA_setLeadTime(cha_list[channel_nr], lead_time) == SUCCESS)
+		{
+			acknowledge = ACK;
+		}
+		SCH_unlockPlanner(lock);
+		COM_sendResponse(acknowledge, NULL, 0);
+	}
+	// -----------------------------------------------------
+	else if (command == COMM_STOREBEGIN)
+	{
+		uint32_t length;
+		memcpy(&length, &buf[2], sizeof(length));
+		dbgprintf("Store piece of %d bytes in %s", length, buf[1] == STO_RAM ? "RAM" : "flash");
+
+		if (STO_beginUpload(buf[1] == STO_RAM ? STO_RAM : STO_FLASH, length) == SUCCESS)
+			COM_sendResponse(ACK, NULL, 0);
+		else
+			COM_sendResponse(NACK, NULL, 0);
+	}
+	// -----------------------------------------------------
+	else if (command == COMM_STOREDATA)
+	{
+		uint32_t offset;
+		memcpy(&offset, &buf[1], sizeof(offset));
+
+		if (len > 4 && STO_writeData(offset, &buf[5], len - 4) == SUCCESS)
+			COM_sendResponse(ACK, NULL, 0);
+		else
+			COM_sendResponse(NACK, NULL, 0);
+	}
+	// -----------------------------------------------------
+	else if (command == COMM_STOREEND)
+	{
+		// Upload benchmark: bytes, total time [ms], erase time [ms]
+		uint8_t data[3*sizeof(uint32_t)];
+		uint8_t acknowledge = (STO_endUpload() == SUCCESS) ? ACK : NACK;
+
+		memcpy(&data[0], &sto.received, sizeof(uint32_t));
+		memcpy(&data[4], &sto.upload_time, sizeof(uint32_t));
+		memcpy(&data[8], &sto.erase_time, sizeof(uint32_t));
+		COM_sendResponse(acknowledge, data, sizeof(data));
+	}
+	// -----------------------------------------------------
+	else if (command == COMM_STORESELECT)
+	{
+		dbgprintf("Play from %s", buf[1] ? "stored piece" : "host stream");
+		uint32_t lock = SCH_lockPlanner();
+		uint8_t acknowledge = (STO_select(buf[1]) == SUCCESS) ? ACK : NACK;
+		SCH_unlockPlanner(lock);
+		COM_sendResponse(acknowledge, NULL, 0);
+	}
+	// -----------------------------------------------------
+	else if (command == COMM_STORESEEK)
+	{
+		uint32_t time;
+		memcpy(&time, &buf[1], sizeof(time));
+		dbgprintf("Seek stored piece to %d ms", time);
+
+		uint32_t lock = SCH_lockPlanner();
+		uint8_t acknowledge = (STO_seek(time) == SUCCESS) ? ACK : NACK;
+		SCH_unlockPlanner(lock);
+		COM_sendResponse(acknowledge, NULL, 0);
+	}
+	// -----------------------------------------------------
+	else if (command == COMM_STORELOOP)
+	{
+		uint32_t a, b;
+		memcpy(&a, &buf[1], sizeof(a));
+		memcpy(&b, &buf[5], sizeof(b));
+		dbgprintf("Loop stored piece from %d to %d ms", a, b);
+
+		uint32_t lock = SCH_lockPlanner();
+		uint8_t acknowledge = (STO_setLoop(a, b) == SUCCESS) ? ACK : NACK;
+		SCH_unlockPlanner(lock);
+		COM_sendResponse(acknowledge, NULL, 0);
+	}
+	// -----------------------------------------------------
+	else if (command == COMM_SETTEMPO)
+	{
+		// Tempo in 1/65536 (0x10000 = 100%), ramp time in ms
+		uint32_t tempo;
+		uint32_t ramp = buf[6] << 8 | buf[5];
+		memcpy(&tempo, &buf[1], sizeof(tempo));
+		dbgprintf("Set tempo to %d%% within %d ms", (tempo * 100) >> 16, ramp);
+
+		// Nothing may be queued between reading the queue time and the change of tempo
+		uint32_t lock = SCH_lockPlanner();
+		uint8_t acknowledge = (CHA_setTempo(tempo, ramp, SM_getQueueTime()) == SUCCESS) ? ACK : NACK;
+		SCH_unlockPlanner(lock);
+		COM_sendResponse(acknowledge, NULL, 0);
+	}
+	// -----------------------------------------------------
+	else if (command == COMM_SUBSCRIBETELEMETRY)
+	{
+		// Period in ms, 0 stops the frames
+		uint32_t period = buf[2] << 8 | buf[1];
+		dbgprintf("Telemetry every %d ms", period);
+
+		if (TEL_subscribe(period) == SUCCESS)
+			COM_sendResponse(ACK, NULL, 0);
+		else
+			COM_sendResponse(NACK, NULL, 0);
+	}
+	// -----------------------------------------------------
+	else if (command == COMM_DUMPCOUNTERS)
+	{
+		// buf[1] = 1 resets the registry with the dump
+		uint8_t data[CNT_DUMP_SIZE];
+
+		CNT_dump(data, sizeof(data), buf[1] == 1);
+		COM_sendResponse(ACK, data, sizeof(data));
+	}
+	// -----------------------------------------------------
+	else if (command == COMM_SELFCHECK)
+	{
+		// Answer: number of failed passages, then T_TRC_RESULT of each passage
+		T_TRC_RESULT results[TRC_PASSAGES];
+		uint8_t data[1 + sizeof(results)];
+		int32_t failed;
+
+		failed = TRC_runCheck(results);
+		if (failed < 0)
+		{
+			COM_sendResponse(NACK, NULL, 0);
+		}
+		else
+		{
+			data[0] = failed;
+			memcpy(&data[1], results, sizeof(results));
+			COM_sendResponse(ACK, data, sizeof(data));
+		}
+	}
+	// -----------------------------------------------------
+	else if (command == COMM_STEPBENCH)
+	{
+		// 1: start the step rate benchmark (NACK while playing or moving), 0: read the result.
+		// Answer to 0: state (E_BEN_STATE), levels run, then T_BEN_RESULT for 1, 2 and 3 axis with pulses, the same with toggling step output
+		uint8_t data[2 + sizeof(ben.result)];
+
+		if (len >= 1 && buf[1] == 1)
+		{
+			uint32_t lock = SCH_lockPlanner();
+			uint8_t acknowledge = BEN_start() == SUCCESS ? ACK : NACK;
+			SCH_unlockPlanner(lock);
+			COM_sendResponse(acknowledge, NULL, 0);
+		}
+		else
+		{
+			data[0] = ben.state;
+			data[1] = ben.levels > 0xFF ? 0xFF : ben.levels;
+			memcpy(&data[2], ben.result, sizeof(ben.result));
+			COM_sendResponse(ACK, data, sizeof(data));
+		}
+	}
+	// -----------------------------------------------------
 	else
 	{
 		dbgprintf("Unknown command.");
@@ -343,6 +672,7 @@ void COM_updateTimeout (void)
 	{
 		comm.timeout = 0;
 		USB_CDC_clearRxBuffer();
+		CNT_INC(CNT_COM_RX_TIMEOUTS);
 		dbgprintf("Receive Timeout expired. Tossed away packet!");
 	}
 }
@@ -405,7 +735,10 @@ E_COM_PACKET_STATUS COM_checkIfPacketValid(uint8_t *buf, int32_t len)
 	else if (packet_len < len)
 		return COM_PACKET_TOO_LONG;
 	else if (crc_send != crc_calc)
+	{
+		CNT_INC(CNT_COM_CRC_ERRORS);
 		return COM_PACKET_CRC_ERROR;
+	}
 #if DEBUG_ENABLE_UART_LOGGING
 	dbgprintf("packet says len= %d", packet_len);
 #endif
@@ -424,15 +757,18 @@ E_COM_PACKET_STATUS COM_sendResponse(uint8_t status, uint8_t *data, int32_t len)
 {
 	uint16_t crc_calc = 0;
 
-	if (len > 0xFFFF)
+	if (len > COM_BUFFER_SIZE)
 		return COM_PACKET_TOO_LONG;
 	else if (len < 0)
 		return COM_PACKET_TOO_SHORT;
 	else if (len != 0 && data == NULL)
 		return COM_PACKET_GENERAL_ERROR;
 
-	// Assemble packet in temporary buffer
-	uint8_t buf[len + COM_MIN_PACKET_LEN];
+	if (status == NACK)
+		CNT_INC(CNT_COM_NACKS);
+
+	// Assemble packet. The transmit queue copies it, so one buffer is enough.
+	uint8_t *buf = comm.tx_buffer;
 	buf[0] = COM_SPV_UID_0;
 	buf[1] = COM_SPV_UID_1;
 	buf[2] = ((len+8) & 0x0000FF00) >> 8;
@@ -23,6 +23,7 @@ typedef struct
 	uint8_t packet_counter; 		// Counter used to enumerate the outgoing packets
 	uint8_t buffer[COM_BUFFER_SIZE];// Holds one command plus data bytes.
 	int32_t len; 					// length of buffer (including command and all data bytes). No CRC, UID etc.
+	uint8_t tx_buffer[COM_BUFFER_SIZE + COM_MIN_PACKET_LEN]; // Outgoing packet is assembled here before it is queued
 }T_COMMUNICATION;
 
 typedef enum
@@ -45,5 +46,6 @@ void COM_stopTimeout (void);
 E_COM_PACKET_STATUS COM_checkIfPacketValid(uint8_t *buf, int32_t len);
 E_COM_PACKET_STATUS COM_sendResponse(uint8_t status, uint8_t *data, int32_t len);
 void COM_decodePackage(uint8_t *buf, int32_t len);
+unsigned short crc16(const unsigned char* data_p, unsigned int length);
 
 #endif /* COMMUNICATION_H_ */
@@ -0,0 +1,142 @@
+/*
+ * telemetry.c
+ *
+ *  Created on: Oct 18, 2026
+ *      Author: josef
+ *
+ *	Periodic machine state frames, see telemetry.h. The frame is put together in
+ *	the main loop and only queued for USB, so it never holds up the motors. When
+ *	the transmit queue has no space for a frame, it is skipped: datapoints and
+ *	responses are more important than a state the host gets again shortly after.
+ */
+
+#include "main.h"
+#include "settings.h"
+#include "debug_tools.h"
+#include "communication.h"
+#include "command_def.h"
+#include "usb_cdc_comm.h"
+#include "motor_control.h"
+#include "notes.h"
+#include "store.h"
+#include "telemetry.h"
+#include <string.h>
+
+T_TEL_STATE tel;
+
+static T_MOTOR_CONTROL * const tel_axis[TEL_AXES] = {&x_dae_motor, &y_dae_motor, &z_dae_motor};
+
+// PROTOTYPES
+static void tel_fillAxis (T_TEL_AXIS *out, T_MOTOR_CONTROL *ctl);
+static uint16_t tel_isrLoad (void);
+
+/** @brief  Starts or stops the telemetry frames.
+ *
+ *  @param period - [ms] time between two frames, 0 to stop
+ *  @return SUCCESS, or ERROR if the period is too short
+ */
+ErrorStatus TEL_subscribe (uint32_t period)
+{
+	if (period != 0 && period < TEL_MIN_PERIOD)
+		return ERROR;
+
+	tel.period = period;
+	tel.last_tick = HAL_GetTick();
+	tel.isr_sum = debug_isr_cycles.sum;
+	tel.cycles = DWT->CYCCNT;
+	return SUCCESS;
+}
+
+/** @brief  Sends a frame when the period is over. Called from the main loop.
+ *
+ *  @param (none)
+ *  @return (none)
+ */
+void TEL_update (void)
+{
+	T_TEL_FRAME frame;
+	int32_t i, fill;
+
+	if (tel.period == 0 || HAL_GetTick() - tel.last_tick < tel.period)
+		return;
+	tel.last_tick += tel.period;
+	if (HAL_GetTick() - tel.last_tick >= tel.period)
+		tel.last_tick = HAL_GetTick(); // we were held up, do not send a burst to catch up
+
+	if (USB_CDC_getTxFree() < sizeof(frame) + COM_MIN_PACKET_LEN)
+		return;
+
+	frame.version = TEL_VERSION;
+	frame.flags = (CHA_getIfTimeActive() ? 0x01 : 0) | (sto.streaming ? 0x02 : 0) | (DBG_TIM_ISR_CYCLE_COUNT ? 0 : 0x04);
+	frame.time = CHA_getChannelTime();
+	frame.tempo = CHA_getTempo();
+	for (i = 0; i < TEL_AXES; i++)
+		tel_fillAxis(&frame.axis[i], tel_axis[i]);
+	for (i = 0; i < CHA_NUMBER_CHANNELS_TOTAL; i++)
+	{
+		fill = CHA_getNumberDatapoint(cha_list[i]);
+		frame.fill[i] = fill > 255 ? 255 : fill;
+	}
+	frame.levers = notes_getLevers();
+	frame.isr_load = tel_isrLoad();
+	frame.tx_dropped = usb_cdc_tx_buffer.dropped > 0xFFFF ? 0xFFFF : usb_cdc_tx_buffer.dropped;
+
+	COM_sendResponse(COMM_TELEMETRY, (uint8_t*) &frame, sizeof(frame));
+}
+
+/** @brief  Takes the state of one axis. The ISR keeps running meanwhile, so
+ * 			the fields are not from exactly the same moment.
+ *
+ *  @param *out - axis part of the frame
+ *  @param *ctl - motor
+ *  @return (none)
+ */
+static void tel_fillAxis (T_TEL_AXIS *out, T_MOTOR_CONTROL *ctl)
+{
+	T_ISR_CONTROL *active = ctl->active;
+	int32_t c = active->c;
+
+	out->pos = ctl->motor.pos;
+	if (active == &stepper_shutoff || c <= 0)
+		out->speed = 0;
+	else
+		out->speed = (int32_t) (((int64_t) F_TIMER * FACTOR / c) * active->dir_abs);
+	out->c_err = ctl->motor.c_err;
+	out->overshoot_on = ctl->motor.overshoot_on > 0xFFFF ? 0xFFFF : ctl->motor.overshoot_on;
+	out->overshoot_off = ctl->motor.overshoot_off > 0xFFFF ? 0xFFFF : ctl->motor.overshoot_off;
+	out->tim_overruns = ctl->tim_overruns > 0xFFFF ? 0xFFFF : ctl->tim_overruns;
+	out->status = ctl->status;
+	out->home_status = ctl->motor.home_status;
+}
+
+/** @brief  Share of the CPU spent in the step timer ISR since the last frame.
+ * 			Needs DBG_TIM_ISR_CYCLE_COUNT. Without it, the sum stays 0 and an idle ISR
+ * 			could not be told apart, so TEL_NOT_MEASURED is sent instead.
+ *
+ *  @param (none)
+ *  @return [1/1000], or TEL_NOT_MEASURED
+ */
+static uint16_t tel_isrLoad (void)
+{
+#if (DBG_TIM_ISR_CYCLE_COUNT)
+	uint64_t sum = debug_isr_cycles.sum;
+	uint32_t cycles = DWT->CYCCNT;
+	uint32_t elapsed = cycles - tel.cycles;
+	uint64_t spent;
+
+	// The periodic report resets the statistics. Then everything in there is new.
+	if (sum < tel.isr_sum)
+		spent = sum;
+	else
+		spent = sum - tel.isr_sum;
+
+	tel.isr_sum = sum;
+	tel.cycles = cycles;
+
+	if (elapsed == 0)
+		return 0;
+	return (uint16_t) ((spent * 1000) / elapsed);
+#else
+	return TEL_NOT_MEASURED;
+#endif
+}
@@ -0,0 +1,61 @@
+/*
+ * telemetry.h
+ *
+ *  Created on: Oct 18, 2026
+ *      Author: josef
+ *
+ *	Periodic machine state frames pushed to the PC without a request.
+ *	They go out as normal response packets with status COMM_TELEMETRY, so the
+ *	host tells them apart from the ACK/NACK of its commands.
+ */
+
+#ifndef TELEMETRY_H_
+#define TELEMETRY_H_
+
+#include "main.h"
+#include "channels.h"
+
+#define TEL_VERSION			3
+#define TEL_AXES			3		// x, y, z of the DAE apparatus
+#define TEL_MIN_PERIOD		5		// [ms] shortest period the host can subscribe to
+#define TEL_NOT_MEASURED	0xFFFF	// isr_load when DBG_TIM_ISR_CYCLE_COUNT is off
+
+typedef struct __attribute__((__packed__))
+{
+	int32_t  pos;			// [steps]
+	int32_t  speed;			// of the active cycle right now [steps/s], signed
+	int32_t  c_err;			// accumulated timing error [timer ticks]
+	uint16_t overshoot_on;	// saturated at 0xFFFF
+	uint16_t overshoot_off;
+	uint16_t tim_overruns;	// step edges that came late because the ISR was delayed, saturated at 0xFFFF
+	uint8_t  status;		// E_STG_EXECUTION_STATUS
+	uint8_t  home_status;	// E_STG_HOME_STATUS
+}T_TEL_AXIS;
+
+// One frame, all little endian
+typedef struct __attribute__((__packed__))
+{
+	uint8_t  version;		// TEL_VERSION
+	uint8_t  flags;			// bit 0: music time running, bit 1: playing from the store, bit 2: isr_load not measured
+	uint32_t time;			// music time [ms]
+	uint32_t tempo;			// CHA_TEMPO_ONE is 100%
+	T_TEL_AXIS axis[TEL_AXES];
+	uint8_t  fill[CHA_NUMBER_CHANNELS_TOTAL];	// datapoints per channel, saturated at 255
+	uint32_t levers;		// pulled note levers, see notes_getLevers()
+	uint16_t isr_load;		// step timer ISR since the last frame [1/1000 of the CPU], TEL_NOT_MEASURED without DBG_TIM_ISR_CYCLE_COUNT
+	uint16_t tx_dropped;	// packets that did not fit in the USB transmit queue so far
+}T_TEL_FRAME;
+
+typedef struct
+{
+	uint32_t period;		// [ms], 0 if nobody subscribed
+	uint32_t last_tick;		// HAL tick of the last frame
+	uint64_t isr_sum;		// step ISR cycles at the last frame, for the load
+	uint32_t cycles;		// DWT cycle counter at the last frame
+}T_TEL_STATE;
+
+// PROTOTYPES
+ErrorStatus TEL_subscribe (uint32_t period);
+void TEL_update (void);
+
+#endif /* TELEMETRY_H_ */
@@ -0,0 +1,103 @@
+/** @file counters.c
+ *  @brief Registry of health counters and histograms
+ *
+ *  Dump format (little endian): version, number of counters, number of histograms,
+ *  number of buckets (one byte each), then all counters and all histogram buckets
+ *  as uint32_t in the order of E_CNT_COUNTER and E_CNT_HISTOGRAM.
+ *
+ *  @author Josef Heel
+	@date October 18th, 2026
+ */
+
+#include "main.h"
+#include "debug_tools.h"
+#include "counters.h"
+#include <string.h>
+#include <stdio.h>
+
+// Written by the ISRs, so they are kept in DTCM
+volatile uint32_t cnt_counters[CNT_COUNTERS] DTCM_BSS;
+volatile uint32_t cnt_histograms[CNT_HISTOGRAMS][CNT_HIST_BUCKETS] DTCM_BSS;
+
+static const char * const cnt_counter_names[CNT_COUNTERS] = {
+	"com crc errors",
+	"com nacks",
+	"com rx timeouts",
+	"com tx dropped",
+	"stg queue underruns",
+	"stg stop overruns",
+	"stg timer overruns",
+	"sm calc errors",
+	"notes spi errors",
+	"debug tracking drops"};
+
+static const char * const cnt_histogram_names[CNT_HISTOGRAMS] = {
+	"c_err [ticks]",
+	"overshoot",
+	"refill slack [ms]"};
+
+/** @brief 	Copies the whole registry into a buffer, optionally resetting it in
+ * 			the same go, so no count gets lost between dump and reset.
+ *
+ *  @param 	*buf - where the dump goes
+ *  @param 	size - space in buf
+ *  @param 	reset - 1 to set everything to 0 afterwards
+ *  @return length of the dump, -1 if it does not fit in buf
+ */
+int32_t CNT_dump(uint8_t *buf, int32_t size, int32_t reset)
+{
+	uint32_t primask;
+
+	if (size < CNT_DUMP_SIZE)
+		return -1;
+
+	buf[0] = CNT_VERSION;
+	buf[1] = CNT_COUNTERS;
+	buf[2] = CNT_HISTOGRAMS;
+	buf[3] = CNT_HIST_BUCKETS;
+
+	primask = __get_PRIMASK();
+	__disable_irq();
+	memcpy(&buf[4], (const void*) cnt_counters, sizeof(cnt_counters));
+	memcpy(&buf[4 + sizeof(cnt_counters)], (const void*) cnt_histograms, sizeof(cnt_histograms));
+	if (reset)
+	{
+		memset((void*) cnt_counters, 0, sizeof(cnt_counters));
+		memset((void*) cnt_histograms, 0, sizeof(cnt_histograms));
+	}
+	__set_PRIMASK(primask);
+
+	return CNT_DUMP_SIZE;
+}
+
+/** @brief 	Prints all counters that are not 0 and the histograms that have
+ * 			entries (all buckets, from 0 up) over the debug uart. Does not reset anything.
+ *
+ *  @param 	(none)
+ *  @return (none)
+ */
+void CNT_report(void)
+{
+	char line[12 * CNT_HIST_BUCKETS];
+	uint32_t entries;
+	int32_t i, j, pos;
+
+	for (i = 0; i < CNT_COUNTERS; i++)
+	{
+		if (cnt_counters[i] != 0)
+			dbgprintf("Counter %s: %d", cnt_counter_names[i], cnt_counters[i]);
+	}
+
+	for (i = 0; i < CNT_HISTOGRAMS; i++)
+	{
+		pos = 0;
+		entries = 0;
+		for (j = 0; j < CNT_HIST_BUCKETS; j++)
+		{
+			pos += sprintf(&line[pos], " %u", (unsigned int) cnt_histograms[i][j]);
+			entries += cnt_histograms[i][j];
+		}
+		if (entries > 0)
+			dbgprintf("Histogram %s:%s", cnt_histogram_names[i], line);
+	}
+}
@@ -0,0 +1,74 @@
+/** @file counters.h
+ *  @brief Registry of health counters and histograms
+ *
+ *  Counters and histograms are plain arrays at fixed addresses, so a CNT_INC
+ *  in an ISR is one load, add and store. With DBG_COUNTERS set to 0 all the
+ *  macros are empty and nothing is left in the code.
+ *
+ *  The increments are not atomic. Each counter is meant to be incremented from
+ *  one priority only, a lost count in the rare other case does not matter.
+ *
+ *  @author Josef Heel
+	@date October 18th, 2026
+ */
+#ifndef COUNTERS_H_
+#define COUNTERS_H_
+
+#include "main.h"
+#include "settings.h"
+
+#define CNT_VERSION			1
+#define CNT_HIST_BUCKETS	16	// bucket 0: value 0, bucket n: 2^(n-1) .. 2^n - 1, last bucket: everything above
+#define CNT_DUMP_SIZE		(4 + 4 * (CNT_COUNTERS + CNT_HISTOGRAMS * CNT_HIST_BUCKETS))	// see CNT_dump()
+
+// When adding a counter or histogram, add its name in counters.c as well.
+typedef enum
+{
+	CNT_COM_CRC_ERRORS = 0,		// received packets with wrong crc
+	CNT_COM_NACKS,				// NACKs sent
+	CNT_COM_RX_TIMEOUTS,		// incomplete packets tossed away
+	CNT_COM_TX_DROPPED,			// packets that did not fit in the USB transmit queue
+	CNT_STG_QUEUE_UNDERRUNS,	// cycles that ended without a successor
+	CNT_STG_STOP_OVERRUNS,		// soft stops that took more steps than a stop from w_max
+	CNT_STG_TIMER_OVERRUNS,		// step compare values that were in the past already, edge put out late
+	CNT_SM_CALC_ERRORS,			// cycles the motor control could not fit
+	CNT_NOTES_SPI_ERRORS,		// magnet transfers the SPI did not accept
+	CNT_DEBUG_TRACKING_DROPS,	// timer values the motor tracking could not keep
+	CNT_COUNTERS
+}E_CNT_COUNTER;
+
+typedef enum
+{
+	CNT_HIST_C_ERR = 0,			// |c_real - c_ideal| of a finished cycle [timer ticks]
+	CNT_HIST_OVERSHOOT,			// overshoot_on + overshoot_off of a finished cycle
+	CNT_HIST_REFILL_SLACK,		// queued time left when the planner refilled a motor [ms]
+	CNT_HISTOGRAMS
+}E_CNT_HISTOGRAM;
+
+extern volatile uint32_t cnt_counters[CNT_COUNTERS];
+extern volatile uint32_t cnt_histograms[CNT_HISTOGRAMS][CNT_HIST_BUCKETS];
+
+#if (DBG_COUNTERS)
+#define CNT_INC(counter)			(cnt_counters[counter]++)
+#define CNT_HIST(hist, value)		(cnt_histograms[hist][CNT_bucket(value)]++)
+#else
+#define CNT_INC(counter)			((void) 0)
+#define CNT_HIST(hist, value)		((void) 0)
+#endif
+
+/** @brief 	Histogram bucket of a value: its number of significant bits
+ *
+ *  @param 	value - value to be sorted in
+ *  @return bucket 0 .. CNT_HIST_BUCKETS-1
+ */
+static inline uint32_t CNT_bucket(uint32_t value)
+{
+	uint32_t bucket = 32 - __CLZ(value);
+	return bucket < CNT_HIST_BUCKETS ? bucket : CNT_HIST_BUCKETS - 1;
+}
+
+// PROTOTYPES
+int32_t CNT_dump(uint8_t *buf, int32_t size, int32_t reset);
+void CNT_report(void);
+
+#endif /* COUNTERS_H_ */
@@ -18,6 +18,7 @@
 #include "device_handles.h"
 #include "debug_tools.h"
 #include "usb_cdc_comm.h"
+#include "counters.h"
 
 // PRIVATE DEFINES
 #define 	DEBUG_UART_HANDLE			&huart3		// Handle of the uart to be used as debug uart
@@ -33,6 +34,12 @@ int32_t 	debug_motor_tracking_output_pointer; 				// pointing to the next word t
 uint32_t 	debug_motor_tracking_running = 0; 						// Flag whether timer preload values should be output via USB
 uint32_t 	debug_motor_tracking_drop_counter; 					// Counts how many timer values had to be dropped because they could not be emptied fast enough
 
+T_DEBUG_CYCLE_STAT debug_isr_cycles DTCM_BSS; 						// Written by the step timer ISR, so it is kept in DTCM as well
+T_DEBUG_LOAD debug_load DTCM_BSS;									// Written at every interrupt entry and exit
+
+static const char * const debug_load_names[DEBUG_LOAD_CONTEXTS] = {
+		"main", "comm", "idle", "planner", "tick", "step", "usb", "exti", "other"};
+
 
 
 /** @brief prints out a standard printf-type format char over debug uart
@@ -143,6 +150,126 @@ void isr_load_pin_off (void)
     ISR_LOAD_GPIO_Port->BSRR = (uint32_t)ISR_LOAD_Pin << 16;
 }
 
+/** @brief  Enables the DWT cycle counter of the Cortex-M7. It counts CPU
+ * 			cycles (216MHz) and is used to measure how long ISRs take
+ * 			without the need for a scope on the load pins.
+ *
+ *  @param  (none)
+ *  @return (none)
+ */
+void debug_cycle_counter_init (void)
+{
+	CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+	DWT->LAR = 0xC5ACCE55; // Unlock access to the DWT registers (needed on the M7)
+	DWT->CYCCNT = 0;
+	DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+
+	memset(&debug_isr_cycles, 0, sizeof(debug_isr_cycles));
+	memset(&debug_load, 0, sizeof(debug_load));
+}
+
+/** @brief  Prints the cycle statistics of the step timer ISR over the debug
+ * 			uart and starts a new measurement period. Should be called periodically
+ * 			from the main loop.
+ *
+ *  @param  (none)
+ *  @return (none)
+ */
+void debug_report_isr_cycles (void)
+{
+	uint32_t count = debug_isr_cycles.count;
+	uint32_t avg = 0;
+
+	if (count > 0)
+		avg = debug_isr_cycles.sum / count;
+
+	dbgprintf("TIM1 CC ISR: %d calls, last %d, avg %d, max %d cycles", count, debug_isr_cycles.last, avg, debug_isr_cycles.max);
+
+	// Not atomic, but losing one sample here does not matter
+	debug_isr_cycles.count = 0;
+	debug_isr_cycles.sum = 0;
+	debug_isr_cycles.max = 0;
+}
+
+
+/** @brief  Closes the load measurement window every DBG_CPU_LOAD_WINDOW ms.
+ * 			Called from the millisecond tick.
+ *
+ *  @param  (none)
+ *  @return (none)
+ */
+void debug_load_tick (void)
+{
+	uint32_t primask, now, window, share;
+	int32_t i;
+
+	if (++debug_load.window_ms < DBG_CPU_LOAD_WINDOW)
+		return;
+	debug_load.window_ms = 0;
+
+	primask = __get_PRIMASK();
+	__disable_irq();
+	// The running context (the tick) gets its cycles so far, so the window is complete
+	now = DWT->CYCCNT;
+	debug_load.cycles[debug_load.current] += now - debug_load.switch_time;
+	debug_load.switch_time = now;
+	window = now - debug_load.window_start;
+	debug_load.window_start = now;
+	for (i = 0; i < DEBUG_LOAD_CONTEXTS; i++)
+	{
+		share = (uint32_t) (((uint64_t) (debug_load.cycles[i] - debug_load.window_cycles[i]) * 1000) / window);
+		debug_load.window_cycles[i] = debug_load.cycles[i];
+		debug_load.last[i] = share;
+		if (share > debug_load.peak[i])
+			debug_load.peak[i] = share;
+	}
+	__set_PRIMASK(primask);
+}
+
+/** @brief  Copies the load of all contexts and starts a new peak measurement.
+ * 			Without DBG_CPU_LOAD, nothing is measured and all values are DEBUG_LOAD_NOT_MEASURED,
+ * 			so they are not taken for idle contexts.
+ *
+ *  @param  *last - DEBUG_LOAD_CONTEXTS values: share in the last window [1/1000]
+ *  @param  *peak - DEBUG_LOAD_CONTEXTS values: highest share since the last read [1/1000]
+ *  @return (none)
+ */
+void debug_load_read (uint16_t *last, uint16_t *peak)
+{
+#if (DBG_CPU_LOAD)
+	uint32_t primask = __get_PRIMASK();
+
+	__disable_irq();
+	memcpy(last, debug_load.last, sizeof(debug_load.last));
+	memcpy(peak, debug_load.peak, sizeof(debug_load.peak));
+	memset(debug_load.peak, 0, sizeof(debug_load.peak));
+	__set_PRIMASK(primask);
+#else
+	int32_t i;
+
+	for (i = 0; i < DEBUG_LOAD_CONTEXTS; i++)
+	{
+		last[i] = DEBUG_LOAD_NOT_MEASURED;
+		peak[i] = DEBUG_LOAD_NOT_MEASURED;
+	}
+#endif
+}
+
+/** @brief  Prints the load of all contexts over the debug uart and starts a new
+ * 			peak measurement. Should be called periodically from the main loop.
+ *
+ *  @param  (none)
+ *  @return (none)
+ */
+void debug_report_load (void)
+{
+	uint16_t last[DEBUG_LOAD_CONTEXTS], peak[DEBUG_LOAD_CONTEXTS];
+	int32_t i;
+
+	debug_load_read(last, peak);
+	for (i = 0; i < DEBUG_LOAD_CONTEXTS; i++)
+		dbgprintf("CPU %s: %d.%d%%, peak %d.%d%%", debug_load_names[i], last[i] / 10, last[i] % 10, peak[i] / 10, peak[i] % 10);
+}
 
 /** @brief  Initializes the timer preload debug output functions and starts it.
  *  		This function is used to directly print each timer preload over the
@@ -217,6 +344,7 @@ void debug_push_preload(uint16_t preload)
 		{
 			// There was no space in the buffer.
 			debug_motor_tracking_drop_counter++;
+			CNT_INC(CNT_DEBUG_TRACKING_DROPS);
 		}
 	}
 }
@@ -4,6 +4,105 @@
  *  @author Josef Heel
 	@date March 19th, 2019
  */
+#ifndef DEBUG_TOOLS_H_
+#define DEBUG_TOOLS_H_
+
+#include "main.h"
+#include "settings.h"
+
+// CPU cycles spent in an interrupt service routine, measured with the DWT cycle counter
+typedef struct
+{
+	uint32_t	last; 		// duration of the last execution [CPU cycles]
+	uint32_t	max; 		// longest execution since the last report [CPU cycles]
+	uint32_t	count; 		// number of executions since the last report
+	uint64_t	sum; 		// sum of all executions since the last report, to get the average [CPU cycles]
+}T_DEBUG_CYCLE_STAT;
+
+extern T_DEBUG_CYCLE_STAT debug_isr_cycles; // statistics of the step timer ISR (TIM1 CC)
+
+// Contexts the CPU time is split up into. Thread mode outside COM_update and the sleep counts as main.
+typedef enum
+{
+	DEBUG_LOAD_MAIN = 0,
+	DEBUG_LOAD_COMM,		// COM_update
+	DEBUG_LOAD_IDLE,		// sleeping in __WFI
+	DEBUG_LOAD_PLANNER,		// PendSV
+	DEBUG_LOAD_TICK,		// TIM10
+	DEBUG_LOAD_STEP,		// TIM1 CC
+	DEBUG_LOAD_USB,			// OTG_FS
+	DEBUG_LOAD_EXTI,		// limit switches
+	DEBUG_LOAD_OTHER,		// SysTick, notes DMA
+	DEBUG_LOAD_CONTEXTS
+}E_DEBUG_LOAD_CONTEXT;
+
+// CPU cycles per context, measured with the DWT cycle counter at every context switch.
+// Time of a preempted context stops while the preempting one runs (exclusive time).
+typedef struct
+{
+	uint32_t	cycles[DEBUG_LOAD_CONTEXTS];		// running totals [CPU cycles], wrap around
+	uint32_t	window_cycles[DEBUG_LOAD_CONTEXTS];	// totals at the start of the window
+	uint16_t	last[DEBUG_LOAD_CONTEXTS];			// share in the last complete window [1/1000]
+	uint16_t	peak[DEBUG_LOAD_CONTEXTS];			// highest share of a window since the last read [1/1000]
+	uint32_t	window_start;						// cycle counter at the start of the window
+	uint32_t	window_ms;							// ms into the current window
+	uint32_t	switch_time;						// cycle counter at the last context switch
+	uint8_t		current;							// E_DEBUG_LOAD_CONTEXT running now
+	uint8_t		depth;								// number of preempted contexts
+	uint8_t		stack[DEBUG_LOAD_CONTEXTS];			// preempted contexts
+}T_DEBUG_LOAD;
+
+extern T_DEBUG_LOAD debug_load;
+
+#define DEBUG_LOAD_NOT_MEASURED		0xFFFF		// share read by debug_load_read without DBG_CPU_LOAD
+
+#if (DBG_CPU_LOAD)
+#define DEBUG_LOAD_ENTER(context)	debug_load_enter(context)
+#define DEBUG_LOAD_EXIT()			debug_load_exit()
+#else
+#define DEBUG_LOAD_ENTER(context)	((void) 0)
+#define DEBUG_LOAD_EXIT()			((void) 0)
+#endif
+
+/** @brief  Charges the cycles up to now to the running context and switches
+ * 			to a new one. Inline, because it runs in the ISRs (the debug tools are in flash).
+ *
+ *  @param  context - context that starts
+ *  @return (none)
+ */
+static inline void debug_load_enter (E_DEBUG_LOAD_CONTEXT context)
+{
+	uint32_t primask = __get_PRIMASK();
+	uint32_t now;
+
+	__disable_irq();
+	now = DWT->CYCCNT;
+	debug_load.cycles[debug_load.current] += now - debug_load.switch_time;
+	debug_load.switch_time = now;
+	if (debug_load.depth < DEBUG_LOAD_CONTEXTS)
+		debug_load.stack[debug_load.depth++] = debug_load.current;
+	debug_load.current = context;
+	__set_PRIMASK(primask);
+}
+
+/** @brief  Charges the cycles up to now to the running context and goes back
+ * 			to the one it preempted.
+ *
+ *  @param  (none)
+ *  @return (none)
+ */
+static inline void debug_load_exit (void)
+{
+	uint32_t primask = __get_PRIMASK();
+	uint32_t now;
+
+	__disable_irq();
+	now = DWT->CYCCNT;
+	debug_load.cycles[debug_load.current] += now - debug_load.switch_time;
+	debug_load.switch_time = now;
+	debug_load.current = debug_load.depth > 0 ? debug_load.stack[--debug_load.depth] : DEBUG_LOAD_MAIN;
+	__set_PRIMASK(primask);
+}
 
 // PROTOTYPES
 void print_hello_world (void);
@@ -17,8 +116,16 @@ void cpu_load_pin_off (void);
 void isr_load_pin_on (void);
 void isr_load_pin_off (void);
 
+void debug_cycle_counter_init (void);
+void debug_report_isr_cycles (void);
+void debug_load_tick (void);
+void debug_load_read (uint16_t *last, uint16_t *peak);
+void debug_report_load (void);
+
 void debug_start_motor_tracking (void);
 void debug_stop_motor_tracking (void);
 void debug_indicate_cycle_start(uint16_t delta_s, uint16_t delta_t);
 void debug_push_preload(uint16_t preload);
 void debug_transmit_motor_tracking_data (void);
+
+#endif /* DEBUG_TOOLS_H_ */
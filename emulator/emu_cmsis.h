@@ -0,0 +1,77 @@
+/** @file emu_cmsis.h
+ *  @brief Host replacement of the CMSIS compiler header (cmsis_gcc.h) for the emulator
+ *
+ *  Forced into every file of the emulator build (-include). It defines the include
+ *  guard of cmsis_gcc.h, so the inline assembly of the Cortex-M7 is never seen by
+ *  the host compiler. The core registers the firmware uses (PRIMASK, BASEPRI) are
+ *  plain variables here. The emulator runs all interrupts from its own loop and
+ *  only delivers them while they are not masked.
+ *
+ *  @author Josef Heel
+	@date October 18th, 2026
+ */
+
+#ifndef EMU_CMSIS_H_
+#define EMU_CMSIS_H_
+
+#define __CMSIS_GCC_H		// keeps the real cmsis_gcc.h out
+
+#include <stdint.h>
+
+#define __ASM                                  __asm
+#define __INLINE                               inline
+#define __STATIC_INLINE                        static inline
+#define __STATIC_FORCEINLINE                   __attribute__((always_inline)) static inline
+#define __NO_RETURN                            __attribute__((__noreturn__))
+#define __USED                                 __attribute__((used))
+#define __WEAK                                 __attribute__((weak))
+#define __PACKED                               __attribute__((packed, aligned(1)))
+#define __PACKED_STRUCT                        struct __attribute__((packed, aligned(1)))
+#define __PACKED_UNION                         union __attribute__((packed, aligned(1)))
+#define __ALIGNED(x)                           __attribute__((aligned(x)))
+#define __RESTRICT                             __restrict
+#define __COMPILER_BARRIER()                   __asm volatile("":::"memory")
+
+// Core registers of the emulated CPU (see emulator.c)
+extern volatile uint32_t emu_primask;
+extern volatile uint32_t emu_basepri;
+
+__STATIC_FORCEINLINE void __enable_irq(void) 			{ emu_primask = 0; }
+__STATIC_FORCEINLINE void __disable_irq(void) 			{ emu_primask = 1; }
+__STATIC_FORCEINLINE uint32_t __get_PRIMASK(void) 		{ return emu_primask; }
+__STATIC_FORCEINLINE void __set_PRIMASK(uint32_t m) 	{ emu_primask = m & 1; }
+__STATIC_FORCEINLINE uint32_t __get_BASEPRI(void) 		{ return emu_basepri; }
+__STATIC_FORCEINLINE void __set_BASEPRI(uint32_t b) 	{ emu_basepri = b & 0xFF; }
+__STATIC_FORCEINLINE void __set_BASEPRI_MAX(uint32_t b)
+{
+	b &= 0xFF;
+	if (b != 0 && (emu_basepri == 0 || b < emu_basepri))
+		emu_basepri = b;
+}
+
+__STATIC_FORCEINLINE void __ISB(void) 					{ __COMPILER_BARRIER(); }
+__STATIC_FORCEINLINE void __DSB(void) 					{ __COMPILER_BARRIER(); }
+__STATIC_FORCEINLINE void __DMB(void) 					{ __COMPILER_BARRIER(); }
+#define __NOP()									__COMPILER_BARRIER()
+#define __WFI()									__COMPILER_BARRIER()
+#define __WFE()									__COMPILER_BARRIER()
+#define __SEV()									__COMPILER_BARRIER()
+
+__STATIC_FORCEINLINE uint8_t __CLZ(uint32_t value) 		{ return value == 0 ? 32 : __builtin_clz(value); }
+__STATIC_FORCEINLINE uint32_t __RBIT(uint32_t value)
+{
+	uint32_t result = 0;
+	int32_t i;
+
+	for (i = 0; i < 32; i++)
+	{
+		result = (result << 1) | (value & 1);
+		value >>= 1;
+	}
+	return result;
+}
+__STATIC_FORCEINLINE uint32_t __REV(uint32_t value) 	{ return __builtin_bswap32(value); }
+__STATIC_FORCEINLINE uint32_t __get_FPSCR(void) 		{ return 0; }
+__STATIC_FORCEINLINE void __set_FPSCR(uint32_t fpscr) 	{ (void) fpscr; }
+
+#endif /* EMU_CMSIS_H_ */
@@ -0,0 +1,205 @@
+/** @file emu_hal.c
+ *  @brief The HAL and CDC functions the firmware core calls, for the emulator
+ *
+ *  Everything the CubeMX code would provide (device handles, HAL drivers, USB CDC
+ *  interface) is reduced to what the core needs. The registers behind the handles
+ *  are the mapped peripheral memory, so the firmware can read back what it wrote.
+ *
+ *  @author Josef Heel
+	@date October 18th, 2026
+ */
+
+#include "main.h"
+#include "device_handles.h"
+#include "usbd_cdc_if.h"
+#include "emulator.h"
+#include "emu_pty.h"
+#include <stdio.h>
+#include <string.h>
+
+uint32_t SystemCoreClock = 216000000;
+
+// Device handles (generated in main.c on the target)
+SPI_HandleTypeDef hspi1;
+TIM_HandleTypeDef htim1;
+TIM_HandleTypeDef htim10;
+UART_HandleTypeDef huart3;
+DMA_HandleTypeDef hdma_spi1_tx;
+
+// Start addresses of the flash sectors of a single bank F767
+static const uint32_t emu_flash_sectors[] = {
+	0x08000000, 0x08008000, 0x08010000, 0x08018000, 0x08020000, 0x08040000,
+	0x08080000, 0x080C0000, 0x08100000, 0x08140000, 0x08180000, 0x081C0000, 0x08200000};
+
+/** @brief 	Connects the device handles to their (mapped) peripherals
+ *
+ *  @param 	(none)
+ *  @return (none)
+ */
+void emu_initHandles (void)
+{
+	htim1.Instance = TIM1;
+	htim10.Instance = TIM10;
+	hspi1.Instance = SPI1;
+	huart3.Instance = USART3;
+}
+
+uint32_t HAL_GetTick (void)
+{
+	return emu.ms;
+}
+
+void HAL_NVIC_SetPriority (IRQn_Type IRQn, uint32_t PreemptPriority, uint32_t SubPriority)
+{
+	// Interrupts are delivered by the emulator loop in a fixed order, see emulator.c
+	(void) IRQn;
+	(void) PreemptPriority;
+	(void) SubPriority;
+}
+
+HAL_StatusTypeDef HAL_TIM_Base_Start_IT (TIM_HandleTypeDef *htim)
+{
+	htim->Instance->DIER |= TIM_DIER_UIE;
+	htim->Instance->CR1 |= TIM_CR1_CEN;
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_TIM_Base_Stop_IT (TIM_HandleTypeDef *htim)
+{
+	htim->Instance->DIER &= ~TIM_DIER_UIE;
+	htim->Instance->CR1 &= ~TIM_CR1_CEN;
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_TIM_OC_Start_IT (TIM_HandleTypeDef *htim, uint32_t Channel)
+{
+	// TIM_CHANNEL_1..4 are 0, 4, 8, 12
+	htim->Instance->DIER |= TIM_DIER_CC1IE << (Channel >> 2);
+	htim->Instance->CCER |= TIM_CCER_CC1E << Channel;
+	htim->Instance->CR1 |= TIM_CR1_CEN;
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_UART_Transmit (UART_HandleTypeDef *huart, uint8_t *pData, uint16_t Size, uint32_t Timeout)
+{
+	(void) huart;
+	(void) Timeout;
+	if (!emu.quiet)
+	{
+		fwrite(pData, 1, Size, stderr);
+		fflush(stderr);
+	}
+	return HAL_OK;
+}
+
+void HAL_GPIO_TogglePin (GPIO_TypeDef *GPIOx, uint16_t GPIO_Pin)
+{
+	GPIOx->ODR ^= GPIO_Pin;
+}
+
+HAL_StatusTypeDef HAL_SPI_Transmit_DMA (SPI_HandleTypeDef *hspi, uint8_t *pData, uint16_t Size)
+{
+	(void) hspi;
+	(void) pData;
+	(void) Size;
+	if (emu.spi_pending)
+		return HAL_BUSY;
+	// Completes with the next interrupt round of the emulator
+	emu.spi_pending = 1;
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_FLASH_Unlock (void)
+{
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_FLASH_Lock (void)
+{
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_FLASHEx_Erase (FLASH_EraseInitTypeDef *pEraseInit, uint32_t *SectorError)
+{
+	uint32_t sector;
+
+	*SectorError = 0xFFFFFFFF;
+	for (sector = pEraseInit->Sector; sector < pEraseInit->Sector + pEraseInit->NbSectors; sector++)
+	{
+		if (sector >= sizeof(emu_flash_sectors) / sizeof(emu_flash_sectors[0]) - 1)
+		{
+			*SectorError = sector;
+			return HAL_ERROR;
+		}
+		memset((void*) (uintptr_t) emu_flash_sectors[sector], 0xFF, emu_flash_sectors[sector + 1] - emu_flash_sectors[sector]);
+	}
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_FLASH_Program (uint32_t TypeProgram, uint32_t Address, uint64_t Data)
+{
+	// Programming can only clear bits, like on the real flash
+	switch (TypeProgram)
+	{
+	case FLASH_TYPEPROGRAM_BYTE: *(volatile uint8_t*) (uintptr_t) Address &= (uint8_t) Data; break;
+	case FLASH_TYPEPROGRAM_HALFWORD: *(volatile uint16_t*) (uintptr_t) Address &= (uint16_t) Data; break;
+	case FLASH_TYPEPROGRAM_WORD: *(volatile uint32_t*) (uintptr_t) Address &= (uint32_t) Data; break;
+	default: *(volatile uint64_t*) (uintptr_t) Address &= Data; break;
+	}
+	return HAL_OK;
+}
+
+/** @brief 	Starts a transfer to the player. Like on the target, the buffer
+ * 			has to stay untouched until CDC_IsTxBusy_FS() says it is done.
+ */
+uint8_t CDC_Transmit_FS (uint8_t* Buf, uint16_t Len)
+{
+	if (emu.tx_left > 0)
+		return USBD_BUSY;
+
+	if (emu.bench.ack_stamp_ns != 0)
+	{
+		uint64_t latency = emu_now() - emu.bench.ack_stamp_ns;
+
+		emu.bench.ack_stamp_ns = 0;
+		emu.bench.acks++;
+		emu.bench.ack_sum_ns += latency;
+		if (latency > emu.bench.ack_max_ns)
+			emu.bench.ack_max_ns = latency;
+	}
+
+	emu.tx_data = Buf;
+	emu.tx_left = Len;
+	emu_serviceTx();
+	return USBD_OK;
+}
+
+uint8_t CDC_IsTxBusy_FS (void)
+{
+	return emu.tx_left > 0;
+}
+
+/** @brief 	Writes as much of the running transfer to the pty as it takes
+ * 			without blocking. A player that does not read stalls the transmission,
+ * 			like a host that does not poll the IN endpoint.
+ *
+ *  @param 	(none)
+ *  @return (none)
+ */
+void emu_serviceTx (void)
+{
+	int32_t written;
+
+	while (emu.tx_left > 0)
+	{
+		written = emu_ptyWrite(emu.tx_data, emu.tx_left);
+		if (written <= 0)
+		{
+			if (written < 0)
+				emu.tx_left = 0; // nobody there, the data is lost like on an unplugged cable
+			return;
+		}
+		emu.tx_data += written;
+		emu.tx_left -= written;
+	}
+}
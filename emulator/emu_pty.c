@@ -0,0 +1,106 @@
+/** @file emu_pty.c
+ *  @brief Pseudo terminal the player connects to, for the emulator
+ *
+ *  The emulator keeps the slave side open itself. So the master does not see a
+ *  hangup while no player is connected, and players can come and go like a USB
+ *  cable is plugged and unplugged.
+ *
+ *  @author Josef Heel
+	@date October 18th, 2026
+ */
+
+#include "emu_pty.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <termios.h>
+#include <unistd.h>
+
+static int emu_pty_master = -1;
+static int emu_pty_slave = -1;
+
+/** @brief 	Opens the pseudo terminal and prints its name
+ *
+ *  @param 	*link - path of a symlink to the pty, NULL for none
+ *  @return (none)
+ */
+void emu_ptyOpen (const char *link)
+{
+	struct termios tio;
+	const char *name;
+
+	emu_pty_master = posix_openpt(O_RDWR | O_NOCTTY);
+	if (emu_pty_master < 0 || grantpt(emu_pty_master) != 0 || unlockpt(emu_pty_master) != 0)
+	{
+		perror("pty");
+		exit(1);
+	}
+	name = ptsname(emu_pty_master);
+
+	// Raw bytes in both directions, no echo, no line editing
+	emu_pty_slave = open(name, O_RDWR | O_NOCTTY);
+	tcgetattr(emu_pty_slave, &tio);
+	cfmakeraw(&tio);
+	tcsetattr(emu_pty_slave, TCSANOW, &tio);
+	fcntl(emu_pty_master, F_SETFL, fcntl(emu_pty_master, F_GETFL) | O_NONBLOCK);
+
+	if (link != NULL)
+	{
+		unlink(link);
+		if (symlink(name, link) != 0)
+			perror("symlink");
+	}
+	fprintf(stderr, "Virtual SPV on %s\n", link != NULL ? link : name);
+}
+
+/** @brief 	Reads what the player sent, without waiting
+ *
+ *  @param 	*buf - destination
+ *  @param 	len - most bytes to read
+ *  @return number of bytes read, 0 if there was nothing
+ */
+int32_t emu_ptyRead (uint8_t *buf, uint32_t len)
+{
+	ssize_t ret = read(emu_pty_master, buf, len);
+
+	return ret > 0 ? ret : 0;
+}
+
+/** @brief 	Writes to the player as much as fits without blocking
+ *
+ *  @param 	*buf - data
+ *  @param 	len - [bytes]
+ *  @return number of bytes written, -1 if the pty is gone
+ */
+int32_t emu_ptyWrite (const uint8_t *buf, uint32_t len)
+{
+	ssize_t ret = write(emu_pty_master, buf, len);
+
+	if (ret < 0)
+		return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+	return ret;
+}
+
+/** @brief 	Waits until the player sent something or (optionally) there is room to write
+ *
+ *  @param 	timeout - [ms]
+ *  @param 	write - 1 to wait for room to write as well
+ *  @return EMU_PTY_READABLE and/or EMU_PTY_WRITABLE, 0 on timeout
+ */
+int32_t emu_ptyWait (int32_t timeout, int32_t write)
+{
+	struct pollfd pfd = {.fd = emu_pty_master, .events = POLLIN};
+	int32_t ret = 0;
+
+	if (write)
+		pfd.events |= POLLOUT;
+	if (poll(&pfd, 1, timeout) <= 0)
+		return 0;
+	if (pfd.revents & POLLIN)
+		ret |= EMU_PTY_READABLE;
+	if (pfd.revents & POLLOUT)
+		ret |= EMU_PTY_WRITABLE;
+	return ret;
+}
@@ -0,0 +1,25 @@
+/** @file emu_pty.h
+ *  @brief Pseudo terminal the player connects to, for the emulator
+ *
+ *  Kept apart from the firmware headers: termios.h and the CMSIS register
+ *  definitions use the same names (CR1 ...).
+ *
+ *  @author Josef Heel
+	@date October 18th, 2026
+ */
+
+#ifndef EMU_PTY_H_
+#define EMU_PTY_H_
+
+#include <stdint.h>
+
+#define EMU_PTY_READABLE	1
+#define EMU_PTY_WRITABLE	2
+
+// PROTOTYPES
+void emu_ptyOpen (const char *link);
+int32_t emu_ptyRead (uint8_t *buf, uint32_t len);
+int32_t emu_ptyWrite (const uint8_t *buf, uint32_t len);
+int32_t emu_ptyWait (int32_t timeout, int32_t write);
+
+#endif /* EMU_PTY_H_ */
@@ -0,0 +1,532 @@
+/** @file emulator.c
+ *  @brief Virtual SPV: the firmware core running on a Linux host behind a pseudo terminal
+ *
+ *  Virtual time advances in steps of one ms (one period of TIM10). Within such a
+ *  step, the compare matches of the step timer are delivered in the order of their
+ *  timer ticks, then the ms tick, the notes DMA and the pending PendSV (the planner).
+ *  After that the main loop runs with whatever the player sent in the meantime.
+ *  Code takes no virtual time, so all interrupts see the timing of an infinitely
+ *  fast CPU. Timing problems of the target (ISR load, planner latency) do not show
+ *  here, everything that depends on the data and the protocol does.
+ *
+ *  The limit switches are at position 0 and below of a virtual carriage that follows
+ *  the steps. The axes start in the middle of their travel, so homing works as well.
+ *
+ *  @author Josef Heel
+	@date October 18th, 2026
+ */
+
+#include "main.h"
+#include "settings.h"
+#include "device_handles.h"
+#include "debug_tools.h"
+#include "usb_cdc_comm.h"
+#include "communication.h"
+#include "command_def.h"
+#include "step_generation.h"
+#include "motor_control.h"
+#include "limit_switches.h"
+#include "channels.h"
+#include "timekeeper.h"
+#include "scheduler.h"
+#include "notes.h"
+#include "vibrato.h"
+#include "store.h"
+#include "parameters.h"
+#include "step_bench.h"
+#include "counters.h"
+#include "trajectory_check.h"
+#include "emulator.h"
+#include "emu_pty.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+T_EMU emu;
+volatile uint32_t emu_primask = 0;
+volatile uint32_t emu_basepri = 0;
+
+static volatile sig_atomic_t emu_stop = 0;
+
+// Motors on the compare channels 1..3 of TIM1 and their limit switches
+static T_MOTOR_CONTROL * const emu_motor[EMU_MOTORS] = {TIMER1_CHANNEL1_MOTOR, TIMER1_CHANNEL2_MOTOR, TIMER1_CHANNEL3_MOTOR};
+static const uint16_t emu_limit_pin[EMU_MOTORS] = {LIMIT_X_DAE_Pin, LIMIT_Y_DAE_Pin, LIMIT_Z_DAE_Pin};
+
+// PROTOTYPES
+static const char* emu_parseOptions (int argc, char **argv);
+static void emu_mapMemory (void);
+static void emu_initFirmware (void);
+static void emu_runMillisecond (void);
+static void emu_stepInterrupt (void);
+static void emu_endOfInterrupt (void);
+static int32_t emu_receiveUsb (void);
+static void emu_mainLoop (void);
+static void emu_countDatapoints (void);
+static void emu_waitUntil (uint64_t deadline);
+static void emu_reportBenchmark (void);
+static void emu_signal (int sig);
+static int emu_runSelfCheck (void);
+
+int main (int argc, char **argv)
+{
+	uint64_t start;
+	const char *link;
+
+	link = emu_parseOptions(argc, argv);
+	emu_mapMemory();
+	if (emu.self_check)
+		return emu_runSelfCheck();
+	emu_ptyOpen(link);
+	signal(SIGINT, emu_signal);
+	signal(SIGTERM, emu_signal);
+
+	emu_initFirmware();
+
+	start = emu_now();
+	emu.bench.start_ns = start;
+	while (!emu_stop)
+	{
+		emu_runMillisecond();
+		emu_mainLoop();
+
+		if (emu.factor > 0)
+			emu_waitUntil(start + (uint64_t) (emu.ms * 1000000.0 / emu.factor));
+		if (emu.bench_period > 0 && emu_now() - emu.bench.start_ns >= emu.bench_period * 1000000000ULL)
+			emu_reportBenchmark();
+	}
+
+	if (emu.bench_period > 0 && emu.ms != emu.bench.start_ms)
+		emu_reportBenchmark();
+	return 0;
+}
+
+/** @brief 	Wall clock
+ *
+ *  @param 	(none)
+ *  @return [ns]
+ */
+uint64_t emu_now (void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/** @brief 	Reads the command line (see emulator.h)
+ *
+ *  @param 	argc, **argv - from main()
+ *  @return path of the symlink to the pty, NULL for none
+ */
+static const char* emu_parseOptions (int argc, char **argv)
+{
+	const char *link = NULL;
+	int opt;
+
+	emu.factor = 1.0;
+	while ((opt = getopt(argc, argv, "x:b:ql:f:t")) != -1)
+	{
+		switch (opt)
+		{
+		case 'x': emu.factor = atof(optarg); break;
+		case 'b': emu.bench_period = atoi(optarg); break;
+		case 'q': emu.quiet = 1; break;
+		case 'l': link = optarg; break;
+		case 'f': emu.flash_file = optarg; break;
+		case 't': emu.self_check = 1; break;
+		default:
+			fprintf(stderr, "usage: %s [-x factor] [-b seconds] [-q] [-l link] [-f flash image] [-t]\n", argv[0]);
+			exit(1);
+		}
+	}
+	return link;
+}
+
+/** @brief 	Maps memory at the addresses of the flash and the peripherals, so the
+ * 			firmware can access them through the usual CMSIS definitions.
+ * 			The flash starts erased, or is the image file given with -f. The file
+ * 			keeps what the firmware writes (piece and parameter store) for the next start.
+ *
+ *  @param 	(none)
+ *  @return (none)
+ */
+static void emu_mapMemory (void)
+{
+	static const struct { uintptr_t base; size_t size; } regions[] = {
+		{EMU_FLASH_BASE, EMU_FLASH_SIZE},
+		{EMU_PERIPH_BASE, EMU_PERIPH_SIZE},
+		{EMU_CORE_BASE, EMU_CORE_SIZE}};
+	void *mem;
+	uint32_t i;
+	int fd = -1;
+	struct stat st;
+	int32_t erased = 1;
+
+	if (emu.flash_file != NULL)
+	{
+		fd = open(emu.flash_file, O_RDWR | O_CREAT, 0644);
+		if (fd < 0 || fstat(fd, &st) != 0 || (st.st_size != EMU_FLASH_SIZE && ftruncate(fd, EMU_FLASH_SIZE) != 0))
+		{
+			fprintf(stderr, "Cannot use %s as flash image: %s\n", emu.flash_file, strerror(errno));
+			exit(1);
+		}
+		erased = st.st_size != EMU_FLASH_SIZE;
+	}
+
+	for (i = 0; i < sizeof(regions) / sizeof(regions[0]); i++)
+	{
+		if (i == 0 && fd >= 0)
+			mem = mmap((void*) regions[i].base, regions[i].size, PROT_READ | PROT_WRITE,
+					MAP_SHARED | MAP_FIXED_NOREPLACE, fd, 0);
+		else
+			mem = mmap((void*) regions[i].base, regions[i].size, PROT_READ | PROT_WRITE,
+					MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE | MAP_NORESERVE, -1, 0);
+		if (mem != (void*) regions[i].base)
+		{
+			fprintf(stderr, "Cannot map 0x%08lx: %s\n", (unsigned long) regions[i].base, strerror(errno));
+			exit(1);
+		}
+	}
+	if (erased)
+		memset((void*) EMU_FLASH_BASE, 0xFF, EMU_FLASH_SIZE);
+}
+
+/** @brief 	Same inits as the main() of the target (USER CODE 2), without the CubeMX part
+ *
+ *  @param 	(none)
+ *  @return (none)
+ */
+static void emu_initFirmware (void)
+{
+	int32_t i;
+
+	emu_initHandles();
+
+	USB_CDC_Init();
+	debug_cycle_counter_init();
+	SCH_Init();
+	TK_startTimer();
+	CHA_Init();
+	SM_Init();
+	notes_init();
+	STO_Init();
+	PAR_Init();
+	VIB_Init();
+	SCH_startPlanner();
+
+	// The axes stand in the middle. With a home position restored from the parameter store,
+	// they are still where the last run left them.
+	for (i = 0; i < EMU_MOTORS; i++)
+	{
+		if (emu_motor[i]->motor.home_confirm)
+			emu.carriage[i] = emu_motor[i]->motor.pos;
+		else
+			emu.carriage[i] = emu_motor[i]->motor.max_travel / 2;
+	}
+
+	dbgprintf("SPV ready and initialized.");
+	emu_endOfInterrupt();
+}
+
+/** @brief 	Advances the virtual time by one ms and delivers the interrupts of that ms
+ *
+ *  @param 	(none)
+ *  @return (none)
+ */
+static void emu_runMillisecond (void)
+{
+	uint64_t end = emu.ticks + EMU_TICKS_PER_MS;
+	uint32_t next, distance, ccr;
+	int32_t i;
+
+	// Compare matches of the step timer, in the order they happen
+	while (1)
+	{
+		next = UINT32_MAX;
+		for (i = 0; i < EMU_MOTORS; i++)
+		{
+			if (!(TIM1->DIER & (TIM_DIER_CC1IE << i)))
+				continue;
+			ccr = (&TIM1->CCR1)[i];
+			distance = (ccr - (uint32_t) emu.ticks) & 0xFFFF;
+			if (distance == 0)
+				distance = 0x10000; // matched already, the next match is one timer round later
+			if (distance < next)
+				next = distance;
+		}
+		if (next == UINT32_MAX || emu.ticks + next > end)
+			break;
+
+		emu.ticks += next;
+		TIM1->CNT = emu.ticks & 0xFFFF;
+		DWT->CYCCNT = emu.ticks * (SystemCoreClock / F_TIMER);
+		emu_stepInterrupt();
+		emu_endOfInterrupt();
+	}
+	emu.ticks = end;
+	TIM1->CNT = emu.ticks & 0xFFFF;
+	DWT->CYCCNT = emu.ticks * (SystemCoreClock / F_TIMER);
+
+	// The ms tick (TIM10 update)
+	emu.ms++;
+	if ((TIM10->CR1 & TIM_CR1_CEN) && (TIM10->DIER & TIM_DIER_UIE))
+	{
+		DEBUG_LOAD_ENTER(DEBUG_LOAD_TICK);
+		isr_tk_millisecond();
+		DEBUG_LOAD_EXIT();
+		emu_endOfInterrupt();
+	}
+}
+
+/** @brief 	TIM1_CC_IRQHandler: all channels that match at the current count.
+ * 			Moves the virtual carriages and triggers the limit switches.
+ *
+ *  @param 	(none)
+ *  @return (none)
+ */
+static void emu_stepInterrupt (void)
+{
+	uint16_t tim_cnt = TIM1->CNT;
+	int32_t pos, before;
+	int32_t i;
+
+	DEBUG_LOAD_ENTER(DEBUG_LOAD_STEP);
+	for (i = 0; i < EMU_MOTORS; i++)
+	{
+		if (!(TIM1->DIER & (TIM_DIER_CC1IE << i)) || ((&TIM1->CCR1)[i] & 0xFFFF) != tim_cnt)
+			continue;
+		pos = emu_motor[i]->motor.pos;
+		isr_update_stg(emu_motor[i], tim_cnt);
+
+		// Only a step output that is enabled moves the carriage.
+		// The switch closes when the carriage arrives at 0 (EXTI on the rising edge only)
+		before = emu.carriage[i];
+		if (TIM1->CCER & (TIM_CCER_CC1E << (4 * i)))
+			emu.carriage[i] += emu_motor[i]->motor.pos - pos;
+		if (before > 0 && emu.carriage[i] <= 0)
+		{
+			DEBUG_LOAD_ENTER(DEBUG_LOAD_EXTI);
+			HAL_GPIO_EXTI_Callback(emu_limit_pin[i]);
+			DEBUG_LOAD_EXIT();
+		}
+	}
+	DEBUG_LOAD_EXIT();
+}
+
+/** @brief 	Delivers what became pending during an interrupt: the end of the
+ * 			notes DMA transfer and the planner (PendSV, lowest priority).
+ *
+ *  @param 	(none)
+ *  @return (none)
+ */
+static void emu_endOfInterrupt (void)
+{
+	while (emu.spi_pending)
+	{
+		emu.spi_pending = 0;
+		DEBUG_LOAD_ENTER(DEBUG_LOAD_OTHER);
+		HAL_SPI_TxCpltCallback(&hspi1);
+		DEBUG_LOAD_EXIT();
+	}
+
+	if (SCB->ICSR & SCB_ICSR_PENDSVSET_Msk)
+	{
+		SCB->ICSR &= ~SCB_ICSR_PENDSVSET_Msk;
+		DEBUG_LOAD_ENTER(DEBUG_LOAD_PLANNER);
+		SCH_runPlanner();
+		DEBUG_LOAD_EXIT();
+	}
+}
+
+/** @brief 	OTG_FS_IRQHandler: hands one OUT packet from the player to the firmware
+ *
+ *  @param 	(none)
+ *  @return 1 if a packet was received, 0 if the player sent nothing
+ */
+static int32_t emu_receiveUsb (void)
+{
+	uint8_t packet[EMU_USB_PACKET];
+	int32_t len;
+
+	len = emu_ptyRead(packet, sizeof(packet));
+	if (len <= 0)
+		return 0;
+
+	emu.bench.bytes += len;
+	DEBUG_LOAD_ENTER(DEBUG_LOAD_USB);
+	USB_CDC_addDataToRxBuffer(packet, len);
+	DEBUG_LOAD_EXIT();
+	if (usb_cdc_rx_buffer.packet_in_buffer == 1 && emu.bench.ack_stamp_ns == 0)
+		emu.bench.ack_stamp_ns = emu_now();
+	emu_endOfInterrupt();
+	return 1;
+}
+
+/** @brief 	The main loop of the target. Runs once per ms and after each
+ * 			packet from the player, as many packets as a USB frame can carry.
+ *
+ *  @param 	(none)
+ *  @return (none)
+ */
+static void emu_mainLoop (void)
+{
+#if (DBG_TIM_ISR_CYCLE_COUNT || DBG_SCHEDULER_STATS || DBG_NOTES_LATENCY || DBG_STORE_STATS || DBG_COUNTERS || DBG_CPU_LOAD)
+	static uint32_t isr_report_tick = 0;
+#endif
+	int32_t packets = 0;
+
+	do
+	{
+		emu_serviceTx();
+		emu_countDatapoints();
+
+		DEBUG_LOAD_ENTER(DEBUG_LOAD_COMM);
+		COM_update();
+		DEBUG_LOAD_EXIT();
+		emu_endOfInterrupt();
+
+		STO_update();
+		BEN_update();
+		emu_endOfInterrupt();
+	} while (packets++ < EMU_USB_PACKETS_PER_MS && emu_receiveUsb());
+
+#if (DBG_TIM_ISR_CYCLE_COUNT || DBG_SCHEDULER_STATS || DBG_NOTES_LATENCY || DBG_STORE_STATS || DBG_COUNTERS || DBG_CPU_LOAD)
+	if (HAL_GetTick() - isr_report_tick >= DBG_TIM_ISR_REPORT_PERIOD)
+	{
+		isr_report_tick = HAL_GetTick();
+#if (DBG_SCHEDULER_STATS)
+		SCH_reportStatistics();
+#endif
+#if (DBG_STORE_STATS)
+		STO_reportStatistics();
+#endif
+#if (DBG_COUNTERS)
+		CNT_report();
+#endif
+	}
+#endif
+}
+
+/** @brief 	Counts the datapoints of a complete COMM_SENDDATAPOINTS packet
+ * 			before the firmware decodes it (same walk as COM_decodePackage)
+ *
+ *  @param 	(none)
+ *  @return (none)
+ */
+static void emu_countDatapoints (void)
+{
+	uint8_t *buf = &usb_cdc_rx_buffer.data[COMM_COMMAND_POSITION];
+	int32_t len = usb_cdc_rx_buffer.top - COM_MIN_PACKET_LEN;
+	int32_t i = 1;
+	int32_t channel_nr, number_points;
+
+	if (usb_cdc_rx_buffer.packet_in_buffer != 1)
+		return;
+	emu.bench.packets++;
+	if (buf[0] != COMM_SENDDATAPOINTS)
+		return;
+
+	while (i < len)
+	{
+		channel_nr = buf[i++];
+		number_points = buf[i++];
+		if (channel_nr >= CHA_NUMBER_CHANNELS_TOTAL)
+			break;
+		emu.bench.datapoints += number_points;
+		i += cha_list[channel_nr]->ellen * number_points;
+	}
+}
+
+/** @brief 	Waits for the wall clock to catch up with the virtual time.
+ * 			Packets of the player are taken in right away while waiting.
+ *
+ *  @param 	deadline - wall clock [ns]
+ *  @return (none)
+ */
+static void emu_waitUntil (uint64_t deadline)
+{
+	uint64_t now;
+	int32_t ready;
+
+	while (!emu_stop && (now = emu_now()) < deadline)
+	{
+		ready = emu_ptyWait((deadline - now) / 1000000, emu.tx_left > 0);
+		if (ready & EMU_PTY_WRITABLE)
+			emu_serviceTx();
+		if ((ready & EMU_PTY_READABLE) && emu_receiveUsb())
+			emu_mainLoop();
+	}
+}
+
+/** @brief 	Prints the benchmark figures since the last report and starts a new period
+ *
+ *  @param 	(none)
+ *  @return (none)
+ */
+static void emu_reportBenchmark (void)
+{
+	T_EMU_BENCH *b = &emu.bench;
+	uint64_t now = emu_now();
+	double wall = (now - b->start_ns) / 1e9;
+	double virtual = (emu.ms - b->start_ms) / 1e3;
+	uint32_t underruns = 0;
+	int32_t i;
+
+	for (i = 0; i < EMU_MOTORS; i++)
+		underruns += emu_motor[i]->q_underruns;
+
+	fprintf(stderr, "BENCH %.1f s wall, %.1f s virtual (x%.1f): %u datapoints (%.0f/s), %u packets, %.1f kB/s, "
+			"ACK latency mean %.0f us max %.0f us, underruns: queue %u store %u\n",
+			wall, virtual, wall > 0 ? virtual / wall : 0.0,
+			b->datapoints, wall > 0 ? b->datapoints / wall : 0.0, b->packets, wall > 0 ? b->bytes / wall / 1000 : 0.0,
+			b->acks ? b->ack_sum_ns / 1e3 / b->acks : 0.0, b->ack_max_ns / 1e3,
+			underruns, (unsigned) sto.underruns);
+
+	b->start_ns = now;
+	b->start_ms = emu.ms;
+	b->bytes = 0;
+	b->packets = 0;
+	b->datapoints = 0;
+	b->acks = 0;
+	b->ack_sum_ns = 0;
+	b->ack_max_ns = 0;
+}
+
+static void emu_signal (int sig)
+{
+	(void) sig;
+	emu_stop = 1;
+}
+
+/** @brief 	Host test (-t): runs the trajectory check of the firmware (TRC_runCheck, the same
+ * 			as COMM_SELFCHECK) on the initialized core and reports the passages on stdout
+ *
+ *  @param 	(none)
+ *  @return exit code: number of failed passages, 0 if all passed
+ */
+static int emu_runSelfCheck (void)
+{
+	T_TRC_RESULT results[TRC_PASSAGES];
+	int32_t failed, i;
+
+	emu_initFirmware();
+	failed = TRC_runCheck(results);
+	if (failed < 0)
+	{
+		printf("trajectory check not run\n");
+		return 1;
+	}
+	for (i = 0; i < TRC_PASSAGES; i++)
+		printf("passage %d: %s arrival %u us, speed %u, acc %u, overshoot %u, errors %u, cycles %u\n",
+				i, results[i].pass ? "ok  " : "FAIL", results[i].arrival, results[i].speed,
+				results[i].acc, results[i].overshoot, results[i].w_err, results[i].cycles);
+	printf("%d of %d passages failed\n", failed, TRC_PASSAGES);
+	return failed;
+}
@@ -0,0 +1,103 @@
+/** @file emulator.h
+ *  @brief Virtual SPV: the firmware core running on a Linux host behind a pseudo terminal
+ *
+ *  The application modules (communication, channels, stepper_driver, notes, timekeeper,
+ *  scheduler, store, debug_utils, usb_cdc_comm) are compiled unchanged for the host.
+ *  Only the CubeMX part (Src/, HAL drivers, USB middleware) is replaced:
+ *   - emu_cmsis.h replaces the CMSIS intrinsics (forced include),
+ *   - the peripheral address ranges, the flash and the core peripherals are mapped
+ *     as plain memory at their real addresses, so register accesses of the firmware
+ *     just work (they have no side effects of course),
+ *   - emu_hal.c provides the few HAL and CDC functions the core calls,
+ *   - emulator.c runs the interrupts of the step timer, the ms tick, the planner (PendSV),
+ *     the notes DMA and the USB reception on virtual time and the main loop in between.
+ *
+ *  The host player connects to the pty like to the real CDC device, the protocol is the
+ *  same byte for byte. Debug output of the firmware (debug uart) goes to stderr.
+ *
+ *  Build: make -C emulator (see the Makefile there), or by hand from the repository root, with APP being the directories
+ *  channels communication debug_utils notes scheduler stepper_driver store timekeeper usb_cdc_comm emulator:
+ *  	gcc -O2 -std=gnu99 -fcommon -D_GNU_SOURCE -include emulator/emu_cmsis.h -DUSE_HAL_DRIVER -DSTM32F767xx
+ *  		-IInc -IDrivers/STM32F7xx_HAL_Driver/Inc -IDrivers/CMSIS/Device/ST/STM32F7xx/Include
+ *  		-IDrivers/CMSIS/Include -IMiddlewares/ST/STM32_USB_Device_Library/Core/Inc
+ *  		-IMiddlewares/ST/STM32_USB_Device_Library/Class/CDC/Inc
+ *  		-I<each directory of APP> <all .c files of APP> -lm -o spv_emulator
+ *  -fcommon is needed for the buffers defined in usb_cdc_comm.h.
+ *
+ *  Usage: spv_emulator [-x factor] [-b seconds] [-q] [-l link] [-f flash image] [-t]
+ *  	-x	speed of the virtual time relative to the wall clock, 0 runs as fast as possible (default 1)
+ *  	-b	benchmark: reports ingest rate, ACK latency and underruns every that many seconds and at exit
+ *  	-q	no debug output
+ *  	-l	creates a symlink to the pty (e.g. /tmp/spv), so the player can always use the same name
+ *  	-f	file that keeps the flash content over restarts (piece and parameter store), created if missing
+ *  	-t	host test: runs the trajectory check (TRC_runCheck) and exits with the number of failed
+ *  		passages, no pty is opened. make -C emulator check builds and runs it.
+ *
+ *  @author Josef Heel
+	@date October 18th, 2026
+ */
+
+#ifndef EMULATOR_H_
+#define EMULATOR_H_
+
+#include "main.h"
+#include "step_generation.h"
+
+#define EMU_FLASH_BASE			0x08000000
+#define EMU_FLASH_SIZE			(2048*1024)
+#define EMU_PERIPH_BASE			0x40000000	// APB1 up to AHB2
+#define EMU_PERIPH_SIZE			0x20000000
+#define EMU_CORE_BASE			0xE0000000	// DWT, NVIC, SCB
+#define EMU_CORE_SIZE			0x00100000
+
+#define EMU_TICKS_PER_MS		(F_TIMER / 1000)	// TIM1 (step timer) ticks per tick of TIM10
+#define EMU_USB_PACKET			64			// size of the CDC OUT endpoint
+#define EMU_USB_PACKETS_PER_MS	19			// most bulk packets a full speed frame can carry
+#define EMU_MOTORS				3			// motors on the compare channels of TIM1
+
+// Benchmark counters. Times are wall clock, not virtual.
+typedef struct
+{
+	uint64_t start_ns;			// wall clock at the start (or the last report)
+	uint32_t start_ms;			// virtual time at the start (or the last report)
+	uint64_t bytes;				// received from the player
+	uint32_t packets;			// complete packets decoded
+	uint32_t datapoints;		// datapoints in COMM_SENDDATAPOINTS packets
+	uint32_t acks;				// responses sent
+	uint64_t ack_sum_ns;		// sum of the time from a complete packet to its response
+	uint64_t ack_max_ns;
+	uint64_t ack_stamp_ns;		// when the packet waiting for a response was complete, 0 if none
+}T_EMU_BENCH;
+
+typedef struct
+{
+	// Options
+	double   factor;			// virtual time speed relative to the wall clock, 0 = unlimited
+	uint32_t bench_period;		// [s] benchmark report period, 0 = off
+	int32_t  quiet;				// 1: debug output is dropped
+	const char *flash_file;		// flash image, NULL: the flash starts erased every time
+	int32_t  self_check;		// 1: runs the trajectory check and exits, no pty
+
+	// Virtual time
+	uint32_t ms;				// HAL tick
+	uint64_t ticks;				// TIM1 ticks since the start
+
+	// USB transmission to the player
+	const uint8_t *tx_data;		// rest of the running CDC transfer
+	uint32_t tx_left;
+
+	// Peripherals
+	int32_t  spi_pending;		// notes DMA transfer running
+	int32_t  carriage[EMU_MOTORS]; // physical position of the axes, the limit switch is at 0 and below [steps]
+
+	T_EMU_BENCH bench;
+}T_EMU;
+
+extern T_EMU emu;
+
+// PROTOTYPES
+void emu_initHandles (void);
+uint64_t emu_now (void);
+void emu_serviceTx (void);
+
+#endif /* EMULATOR_H_ */
@@ -9,14 +9,35 @@
 #include "debug_tools.h"
 #include "device_handles.h"
 #include "notes_mapping.h"
+#include "notes.h"
+#include "counters.h"
+#include <string.h>
 
-#define NUMBER_DRIVER_CARDS 1 // Number of magnet driver cards with 8 bit each
+// Lever table and range of one string
+typedef struct
+{
+	uint8_t empty_note;				// midi note of the empty string
+	uint8_t max_note;				// highest midi note with a lever
+	const T_NOTE_LEVER *levers;		// indexed by note - empty_note
+}T_NOTES_STRING;
+
+static const T_NOTES_STRING notes_strings[NOTES_STRINGS] = {
+		[NOTES_STRING_G] = {G_STRING_EMPTY_MIDI_NOTE, G_STRING_MAX_NOTE, g_levers},
+		[NOTES_STRING_D] = {D_STRING_EMPTY_MIDI_NOTE, D_STRING_MAX_NOTE, d_levers},
+		[NOTES_STRING_A] = {A_STRING_EMPTY_MIDI_NOTE, A_STRING_MAX_NOTE, a_levers},
+		[NOTES_STRING_E] = {E_STRING_EMPTY_MIDI_NOTE, E_STRING_MAX_NOTE, e_levers}};
 
-uint8_t notes_state[NUMBER_DRIVER_CARDS]; // global variable for storing magnet data
-uint8_t notes_return[NUMBER_DRIVER_CARDS]; // used for the returning SPI data. Not used for anything at the moment
+uint8_t notes_state[NUMBER_DRIVER_CARDS]; // global variable for storing magnet data (shadow of what the drivers should show)
+uint8_t notes_tx[NUMBER_DRIVER_CARDS] DMA_BUFFER; // copy of notes_state that is shifted out by the DMA
+volatile int32_t notes_dirty; // 1 if notes_state changed since it was last handed to the DMA
+volatile int32_t notes_tx_busy; // 1 while a transfer is running
+T_NOTES_LATENCY notes_latency; // note-to-latch latency statistics
+T_NOTES_ORNAMENT notes_ornament[NOTES_STRINGS]; // trill / tremolo state per string
+uint8_t notes_string_levers[NOTES_STRINGS][NUMBER_DRIVER_CARDS]; // all levers of a string, per card. Built from the lever tables in notes_init()
 
 // PROTOTYPES
-static void notes_update(void);
+static void notes_mark_dirty(void);
+static ErrorStatus notes_apply(E_NOTES_STRING string, uint8_t note);
 
 /** @brief 	Resets all note levers on all four strings to
  * 			the off (non-touching) position
@@ -26,61 +47,297 @@ static void notes_update(void);
  */
 void notes_init(void)
 {
-	uint8_t i;
+	uint8_t i, string;
+	const T_NOTES_STRING *str;
+
 	for(i=0; i<NUMBER_DRIVER_CARDS; i++)
 	{
 		notes_state[i] = 0x00;
 	}
-	notes_update();
+
+	memset(notes_string_levers, 0, sizeof(notes_string_levers));
+	for (string = 0; string < NOTES_STRINGS; string++)
+	{
+		str = &notes_strings[string];
+		for (i = 0; i <= str->max_note - str->empty_note; i++)
+		{
+			if (str->levers[i].card < NUMBER_DRIVER_CARDS)
+				notes_string_levers[string][str->levers[i].card] |= str->levers[i].mask;
+		}
+	}
+	memset(notes_ornament, 0, sizeof(notes_ornament));
+	notes_tx_busy = 0;
+	memset(&notes_latency, 0, sizeof(notes_latency));
+	notes_mark_dirty();
+	notes_flush();
+}
+/** @brief 	Plays a note on one string: releases all other levers of this string
+ * 			and pushes down the lever of the note. The other strings are not touched.
+ * 			Only the shadow bitmap is changed, the magnets are updated with the
+ * 			next notes_flush(), so notes on several strings in the same ms go out
+ * 			in one transfer. An ornament running on the string is stopped.
+ *
+ *  @param string - string to play the note on (E_NOTES_STRING)
+ *  @param note - midi note. The empty string note, a note without lever or NOTES_OFF release all levers of the string.
+ *  @return SUCCESS or ERROR if the note is not on this string (nothing changed)
+ */
+ErrorStatus notes_set(E_NOTES_STRING string, uint8_t note)
+{
+	ErrorStatus ret;
+	uint32_t primask;
+
+	if (string >= NOTES_STRINGS)
+		return ERROR;
+
+	primask = __get_PRIMASK();
+	__disable_irq();
+	ret = notes_apply(string, note);
+	if (ret == SUCCESS)
+		notes_ornament[string].active = 0;
+	__set_PRIMASK(primask);
+
+	return ret;
+}
+
+/** @brief 	Plays a note datapoint on one string. Plain notes are set right away.
+ * 			Ornaments (period != 0) start with the main note and are expanded
+ * 			by notes_update() once per ms: the string alternates between note
+ * 			and note_alt every period, the period changes by accel after each
+ * 			switch. After duration, the main note stays.
+ *
+ *  @param string - string to play the datapoint on (E_NOTES_STRING)
+ *  @param *point - note datapoint
+ *  @return SUCCESS or ERROR if one of the notes is not on this string (nothing changed)
+ */
+ErrorStatus notes_play(E_NOTES_STRING string, const T_DTP_NOTE *point)
+{
+	T_NOTES_ORNAMENT *orn;
+	const T_NOTES_STRING *str;
+	uint32_t primask;
+
+	if (point->period == 0 || point->duration == 0)
+		return notes_set(string, point->note);
+
+	if (string >= NOTES_STRINGS)
+		return ERROR;
+	str = &notes_strings[string];
+	if (point->note_alt != NOTES_OFF && (point->note_alt < str->empty_note || point->note_alt > str->max_note))
+		return ERROR;
+
+	orn = &notes_ornament[string];
+	primask = __get_PRIMASK();
+	__disable_irq();
+	if (notes_apply(string, point->note) == ERROR)
+	{
+		__set_PRIMASK(primask);
+		return ERROR;
+	}
+	orn->note = point->note;
+	orn->note_alt = point->note_alt;
+	orn->on_alt = 0;
+	orn->period = point->period < NOTES_ORNAMENT_MIN_PERIOD ? NOTES_ORNAMENT_MIN_PERIOD : point->period;
+	orn->accel = point->accel;
+	orn->elapsed = 0;
+	orn->left = point->duration;
+	orn->active = 1;
+	__set_PRIMASK(primask);
+
+	return SUCCESS;
 }
-/** @brief 	Sets the value of one specific note lever (up->0, down->1)
- * 			on the e-string.
+
+/** @brief 	Advances the ornaments of all strings by one ms. Called from the
+ * 			millisecond tick while the music time runs, before the channels
+ * 			are updated (a new note datapoint stops the ornament of its string).
  *
- *  @param note - note number starting with 0 at last
+ *  @param (none)
  *  @return (none)
  */
-void notes_e_set(uint8_t note)
+void notes_update(void)
 {
-	dbgprintf("E string note set to %d", note);
+	T_NOTES_ORNAMENT *orn;
+	int32_t period;
+	uint8_t string;
 
-	uint8_t note_offset = 0xFF;
-	if (note >= E_STRING_EMPTY_MIDI_NOTE && note <= E_STRING_MAX_NOTE)
+	for (string = 0; string < NOTES_STRINGS; string++)
 	{
-		note_offset = note - E_STRING_EMPTY_MIDI_NOTE;
+		orn = &notes_ornament[string];
+		if (orn->active == 0)
+			continue;
+
+		orn->left--;
+		if (orn->left == 0)
+		{
+			// Ornament is over, the main note stays
+			orn->active = 0;
+			if (orn->on_alt)
+				notes_apply(string, orn->note);
+			continue;
+		}
+
+		orn->elapsed += NOTES_ORNAMENT_TICK;
+		if (orn->elapsed >= orn->period)
+		{
+			orn->elapsed -= orn->period;
+			orn->on_alt = !orn->on_alt;
+			notes_apply(string, orn->on_alt ? orn->note_alt : orn->note);
+
+			period = (int32_t) orn->period + orn->accel;
+			orn->period = period < NOTES_ORNAMENT_MIN_PERIOD ? NOTES_ORNAMENT_MIN_PERIOD : period;
+		}
 	}
-	else
-		return;
+}
 
-	uint8_t board = e_boards[note_offset];
-	uint8_t pin = e_pins[note_offset];
+/** @brief 	Sets the levers of one string to a note, see notes_set()
+ *
+ *  @param string - string to play the note on (E_NOTES_STRING)
+ *  @param note - midi note or NOTES_OFF
+ *  @return SUCCESS or ERROR if the note is not on this string (nothing changed)
+ */
+static ErrorStatus notes_apply(E_NOTES_STRING string, uint8_t note)
+{
+	const T_NOTES_STRING *str;
+	const T_NOTE_LEVER *lever = NULL;
+	uint32_t primask;
+	uint8_t i;
 
-	// ONLY FOR PROTOTYPE
-	notes_state[board] = 0x00;
+	if (string >= NOTES_STRINGS)
+		return ERROR;
+	str = &notes_strings[string];
 
+	if (note != NOTES_OFF)
+	{
+		if (note < str->empty_note || note > str->max_note)
+			return ERROR;
+		lever = &str->levers[note - str->empty_note];
+	}
 
-	// note has no corresponding magnet. Could be because not ready or because its an empty string
-	if (board == NOTE_UNPOPULATED || pin == NOTE_UNPOPULATED || (board + 1 > NUMBER_DRIVER_CARDS || pin > 7))
+	// The tick and the command interface both set notes
+	primask = __get_PRIMASK();
+	__disable_irq();
+	for (i = 0; i < NUMBER_DRIVER_CARDS; i++)
 	{
-		// TODO: error handling
+		notes_state[i] &= ~notes_string_levers[string][i];
 	}
-	else
+	if (lever != NULL && lever->card < NUMBER_DRIVER_CARDS)
 	{
-		notes_state[board] |= (1<<pin);
+		notes_state[lever->card] |= lever->mask;
 	}
+	__set_PRIMASK(primask);
 
-	notes_update();
+	notes_mark_dirty();
+	return SUCCESS;
 }
 
-/** @brief 	Updates all the magnet drivers by writing notes_state
- * 			over the SPI bus
+/** @brief 	Hands the shadow bitmap to the DMA if it changed. Changes made
+ * 			during a running transfer are sent right after it completes.
+ * 			Meant to be called once per ms, after all notes due in this ms were set.
  *
  *  @param (none)
  *  @return (none)
  */
-static void notes_update(void)
+void notes_flush(void)
 {
-	HAL_SPI_TransmitReceive(&hspi1, notes_state, notes_return, NUMBER_DRIVER_CARDS, 10);
-	HAL_GPIO_WritePin(NOTE_LATCH_GPIO_Port, NOTE_LATCH_Pin, 1);
-	HAL_GPIO_WritePin(NOTE_LATCH_GPIO_Port, NOTE_LATCH_Pin, 0);
+	uint32_t primask;
+
+	primask = __get_PRIMASK();
+	__disable_irq();
+	if (notes_dirty == 0 || notes_tx_busy == 1)
+	{
+		__set_PRIMASK(primask);
+		return;
+	}
+	memcpy(notes_tx, notes_state, NUMBER_DRIVER_CARDS);
+	notes_dirty = 0;
+	notes_tx_busy = 1;
+	notes_latency.tx_change = notes_latency.change;
+	__set_PRIMASK(primask);
+
+	if (HAL_SPI_Transmit_DMA(&hspi1, notes_tx, NUMBER_DRIVER_CARDS) != HAL_OK)
+	{
+		// Try again with the next flush
+		notes_tx_busy = 0;
+		notes_dirty = 1;
+		notes_latency.errors++;
+		CNT_INC(CNT_NOTES_SPI_ERRORS);
+	}
+}
+
+/** @brief 	Called by the HAL when the DMA transfer to the magnet drivers
+ * 			is finished (all bits are shifted out). Latches the new state
+ * 			to the outputs.
+ *
+ *  @param *hspi - SPI handle that finished
+ *  @return (none)
+ */
+void HAL_SPI_TxCpltCallback(SPI_HandleTypeDef *hspi)
+{
+	uint32_t latency;
+
+	if (hspi != &hspi1)
+		return;
+
+	// Latch pulse. The read back makes sure the high level is on the pin before it is reset.
+	NOTE_LATCH_GPIO_Port->BSRR = NOTE_LATCH_Pin;
+	(void) NOTE_LATCH_GPIO_Port->ODR;
+	NOTE_LATCH_GPIO_Port->BSRR = (uint32_t) NOTE_LATCH_Pin << 16;
+
+	latency = DWT->CYCCNT - notes_latency.tx_change;
+	notes_latency.last = latency;
+	if (latency > notes_latency.max)
+		notes_latency.max = latency;
+	notes_latency.count++;
+
+	notes_tx_busy = 0;
+
+	// Something changed while we were sending
+	notes_flush();
 }
 
+/** @brief 	Prints the note-to-latch latency over the debug uart and resets the maximum.
+ *
+ *  @param (none)
+ *  @return (none)
+ */
+void notes_report_latency(void)
+{
+	dbgprintf("Notes: %d latches, latency last %d us, max %d us, %d errors",
+			notes_latency.count,
+			notes_latency.last / (SystemCoreClock / 1000000),
+			notes_latency.max / (SystemCoreClock / 1000000),
+			notes_latency.errors);
+	notes_latency.max = 0;
+}
+
+/** @brief 	Returns the levers that are pulled right now (the shadow bitmap,
+ * 			so changes of this ms might not be on the magnets yet).
+ *
+ *  @param (none)
+ *  @return one bit per lever, driver card n in byte n
+ */
+uint32_t notes_getLevers(void)
+{
+	uint32_t levers = 0;
+	int32_t i;
+
+	for (i = 0; i < NUMBER_DRIVER_CARDS && i < 4; i++)
+		levers |= (uint32_t) notes_state[i] << (8 * i);
+	return levers;
+}
+
+/** @brief 	Marks the shadow bitmap as changed. The time of the first change
+ * 			that was not sent yet is kept for the latency measurement.
+ *
+ *  @param (none)
+ *  @return (none)
+ */
+static void notes_mark_dirty(void)
+{
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+	if (notes_dirty == 0)
+	{
+		notes_latency.change = DWT->CYCCNT;
+		notes_dirty = 1;
+	}
+	__set_PRIMASK(primask);
+}
@@ -7,8 +7,54 @@
 #ifndef NOTES_H_
 #define NOTES_H_
 
+#include "datapoint_def.h"
+
+#define NOTES_OFF	255	// note value for "no note", releases all levers of a string
+
+#define NOTES_ORNAMENT_TICK			10	// [1/10 ms] ornaments are advanced once per ms
+#define NOTES_ORNAMENT_MIN_PERIOD	10	// [1/10 ms] shortest time per note of an ornament (one tick)
+
+typedef enum
+{
+	NOTES_STRING_G = 0,
+	NOTES_STRING_D,
+	NOTES_STRING_A,
+	NOTES_STRING_E,
+	NOTES_STRINGS
+}E_NOTES_STRING;
+
+// Ornament (trill, tremolo, repeated note) running on one string
+typedef struct
+{
+	uint8_t  active;
+	uint8_t  note;		// main note, the ornament ends on it
+	uint8_t  note_alt;	// second note, NOTES_OFF for a repeated note
+	uint8_t  on_alt;	// 1 while the second note is played
+	uint32_t period;	// [1/10 ms] current time per note
+	int32_t  accel;		// [1/10 ms] change of period after every switch
+	uint32_t elapsed;	// [1/10 ms] since the last switch
+	uint32_t left;		// [ms] until the ornament is over
+}T_NOTES_ORNAMENT;
+
+// Note-to-latch latency. Measured with the DWT cycle counter from the first note change
+// that is not on the magnets yet until the latch pulse.
+typedef struct
+{
+	uint32_t change;	// cycle count of the first unsent change
+	uint32_t tx_change;	// same, for the transfer that is running
+	uint32_t last;		// [cycles]
+	uint32_t max;		// [cycles]
+	uint32_t count;		// number of latch pulses
+	uint32_t errors;	// number of transfers the SPI did not accept
+}T_NOTES_LATENCY;
+
 void notes_init(void);
-void notes_e_set(uint8_t note);
+ErrorStatus notes_set(E_NOTES_STRING string, uint8_t note);
+ErrorStatus notes_play(E_NOTES_STRING string, const T_DTP_NOTE *point);
+void notes_update(void);
+void notes_flush(void);
+void notes_report_latency(void);
+uint32_t notes_getLevers(void);
 
 
 #endif /* NOTES_H_ */
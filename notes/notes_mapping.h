@@ -20,6 +20,21 @@
 #ifndef NOTES_MAPPING_H_
 #define NOTES_MAPPING_H_
 
+#define NUMBER_DRIVER_CARDS 4 // Number of magnet driver cards with 8 bit each, daisy-chained on SPI1
+
+// Position of the cards in the SPI frame (byte index). The first byte is shifted through
+// the whole chain, so card 0 is the last one in the chain.
+#define NOTE_CARD_E		0
+#define NOTE_CARD_A		1
+#define NOTE_CARD_D		2
+#define NOTE_CARD_G		3
+
+#define G_STRING_EMPTY_MIDI_NOTE 55
+#define G_STRING_MAX_NOTE 65
+#define D_STRING_EMPTY_MIDI_NOTE 62
+#define D_STRING_MAX_NOTE 73
+#define A_STRING_EMPTY_MIDI_NOTE 69
+#define A_STRING_MAX_NOTE 80
 #define E_STRING_EMPTY_MIDI_NOTE 76
 #define E_STRING_MAX_NOTE 93
 
@@ -29,9 +44,30 @@
 #define NOTES_ON_A (11+1)
 #define NOTES_ON_E (17+1)
 
-#define NOTE_UNPOPULATED 0xFF
-static const int e_pins[NOTES_ON_E] = {0xFF, 0xFF, 0, 0xFF, 1, 2, 0xFF, 3, 0xFF, 4, 0xFF, 5, 6, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
-static const int e_boards[NOTES_ON_E] = {0, 0xFF, 0, 0xFF, 0, 0, 0xFF, 0, 0xFF, 0, 0xFF, 0, 0, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
+// One lever: card in the chain and bit on that card. A mask of 0 means there is no lever
+// for this note (empty string or not populated), so only the other levers of the string are released.
+typedef struct
+{
+	uint8_t card;
+	uint8_t mask;
+}T_NOTE_LEVER;
+
+// Lever tables, indexed by midi note minus the empty string note.
+// The G, D and A cards are populated like the E prototype card (same lever for the same
+// interval above the empty string). Adapt the tables when the cards are wired differently.
+static const T_NOTE_LEVER g_levers[NOTES_ON_G] = {
+	{NOTE_CARD_G, 0}, {NOTE_CARD_G, 0}, {NOTE_CARD_G, 1<<0}, {NOTE_CARD_G, 0}, {NOTE_CARD_G, 1<<1}, {NOTE_CARD_G, 1<<2},
+	{NOTE_CARD_G, 0}, {NOTE_CARD_G, 1<<3}, {NOTE_CARD_G, 0}, {NOTE_CARD_G, 1<<4}, {NOTE_CARD_G, 0}};
+static const T_NOTE_LEVER d_levers[NOTES_ON_D] = {
+	{NOTE_CARD_D, 0}, {NOTE_CARD_D, 0}, {NOTE_CARD_D, 1<<0}, {NOTE_CARD_D, 0}, {NOTE_CARD_D, 1<<1}, {NOTE_CARD_D, 1<<2},
+	{NOTE_CARD_D, 0}, {NOTE_CARD_D, 1<<3}, {NOTE_CARD_D, 0}, {NOTE_CARD_D, 1<<4}, {NOTE_CARD_D, 0}, {NOTE_CARD_D, 1<<5}};
+static const T_NOTE_LEVER a_levers[NOTES_ON_A] = {
+	{NOTE_CARD_A, 0}, {NOTE_CARD_A, 0}, {NOTE_CARD_A, 1<<0}, {NOTE_CARD_A, 0}, {NOTE_CARD_A, 1<<1}, {NOTE_CARD_A, 1<<2},
+	{NOTE_CARD_A, 0}, {NOTE_CARD_A, 1<<3}, {NOTE_CARD_A, 0}, {NOTE_CARD_A, 1<<4}, {NOTE_CARD_A, 0}, {NOTE_CARD_A, 1<<5}};
+static const T_NOTE_LEVER e_levers[NOTES_ON_E] = {
+	{NOTE_CARD_E, 0}, {NOTE_CARD_E, 0}, {NOTE_CARD_E, 1<<0}, {NOTE_CARD_E, 0}, {NOTE_CARD_E, 1<<1}, {NOTE_CARD_E, 1<<2},
+	{NOTE_CARD_E, 0}, {NOTE_CARD_E, 1<<3}, {NOTE_CARD_E, 0}, {NOTE_CARD_E, 1<<4}, {NOTE_CARD_E, 0}, {NOTE_CARD_E, 1<<5},
+	{NOTE_CARD_E, 1<<6}, {NOTE_CARD_E, 0}, {NOTE_CARD_E, 0}, {NOTE_CARD_E, 0}, {NOTE_CARD_E, 0}, {NOTE_CARD_E, 0}};
 
 
 #endif /* NOTES_MAPPING_H_ */
@@ -0,0 +1,239 @@
+/** @file vibrato.c
+ *  @brief fixed-point vibrato oscillators for the four strings
+ *
+ *  The host only sends a vibrato datapoint when rate, depth or waveform change,
+ *  the motion itself is generated here once per ms. So the USB load does not
+ *  depend on how much vibrato is played.
+ *
+ *  Everything is integer math: the phase is a 32 bit accumulator (one period is 2^32),
+ *  the sine comes out of a quarter wave table with linear interpolation.
+ *  The output is the deviation from the note in cent. The planner of the string axis
+ *  adds it to its datapoints (VIB_getOffsetAhead(), for the time the axis gets there).
+ *
+ *  @author Josef Heel
+	@date October 18th, 2026
+ */
+
+#include "main.h"
+#include "vibrato.h"
+#include <string.h>
+
+#define VIB_QUADRANT_BITS	14	// resolution of the phase within a quarter period
+#define VIB_TABLE_BITS		6	// 64 table intervals per quarter period
+#define VIB_MAX_RATE		2000	// [1/100 Hz] faster rates are limited to this
+#define VIB_MAX_DEPTH		200		// [cent] deeper vibrato is limited to this
+
+// sin(x) for x = 0 .. pi/2, Q15
+static const int16_t vib_sine_table[(1 << VIB_TABLE_BITS) + 1] = {
+	0, 804, 1608, 2410, 3212, 4011, 4808, 5602,
+	6393, 7179, 7962, 8739, 9512, 10278, 11039, 11793,
+	12539, 13279, 14010, 14732, 15446, 16151, 16846, 17530,
+	18204, 18868, 19519, 20159, 20787, 21403, 22005, 22594,
+	23170, 23731, 24279, 24811, 25329, 25832, 26319, 26790,
+	27245, 27683, 28105, 28510, 28898, 29268, 29621, 29956,
+	30273, 30571, 30852, 31113, 31356, 31580, 31785, 31971,
+	32137, 32285, 32412, 32521, 32609, 32678, 32728, 32757,
+	32767};
+
+T_VIB_OSC vib_osc[NOTES_STRINGS];
+
+// PROTOTYPES
+static int32_t vib_waveform(uint8_t waveform, uint32_t phase);
+static int16_t vib_offset(uint8_t waveform, uint32_t phase, int32_t depth);
+
+/** @brief 	Switches off the vibrato on all strings
+ *
+ *  @param 	(none)
+ *  @return (none)
+ */
+void VIB_Init(void)
+{
+	memset(vib_osc, 0, sizeof(vib_osc));
+}
+
+/** @brief 	Sets new vibrato parameters for one string. Rate and depth glide
+ * 			linearly from the current values to the new ones within the ramp time.
+ * 			A rate of 0 fades the vibrato out with the ramp and stops the oscillator.
+ *
+ *  @param 	string - string the vibrato is played on
+ *  @param 	*point - vibrato datapoint
+ *  @return (none)
+ */
+void VIB_set(E_NOTES_STRING string, const T_DTP_VIB *point)
+{
+	T_VIB_OSC *osc;
+	uint16_t ramp, rate, depth;
+
+	if (string >= NOTES_STRINGS)
+		return;
+	osc = &vib_osc[string];
+	ramp = point->ramp > 0 ? point->ramp : 1;
+	rate = point->rate < VIB_MAX_RATE ? point->rate : VIB_MAX_RATE;
+	depth = point->depth < VIB_MAX_DEPTH ? point->depth : VIB_MAX_DEPTH;
+
+	if (rate == 0)
+	{
+		// Keep the rate, only the depth goes down to 0
+		osc->phase_inc_target = osc->phase_inc;
+		osc->depth_target = 0;
+	}
+	else
+	{
+		// rate is in 1/100 Hz, the oscillator is updated every ms
+		osc->phase_inc_target = (uint32_t) (((uint64_t) rate << 32) / 100000);
+		osc->depth_target = (int32_t) depth << 16;
+	}
+	if (point->waveform < VIB_WAVEFORMS)
+		osc->waveform = point->waveform;
+
+	osc->phase_inc_step = ((int32_t) (osc->phase_inc_target - osc->phase_inc)) / ramp;
+	osc->depth_step = (osc->depth_target - osc->depth) / ramp;
+	osc->ramp_left = ramp;
+}
+
+/** @brief 	Advances the oscillators of all strings by one ms.
+ * 			Called from the millisecond tick while the music time runs.
+ *
+ *  @param 	(none)
+ *  @return (none)
+ */
+void VIB_update(void)
+{
+	T_VIB_OSC *osc;
+	int32_t i;
+
+	for (i = 0; i < NOTES_STRINGS; i++)
+	{
+		osc = &vib_osc[i];
+
+		if (osc->ramp_left > 0)
+		{
+			osc->ramp_left--;
+			if (osc->ramp_left == 0)
+			{
+				// Land exactly on the target, the steps are rounded
+				osc->phase_inc = osc->phase_inc_target;
+				osc->depth = osc->depth_target;
+				if (osc->depth == 0)
+				{
+					osc->phase_inc = 0;
+					osc->phase = 0;
+				}
+			}
+			else
+			{
+				osc->phase_inc += osc->phase_inc_step;
+				osc->depth += osc->depth_step;
+			}
+		}
+
+		osc->phase += osc->phase_inc;
+		osc->offset = vib_offset(osc->waveform, osc->phase, osc->depth);
+	}
+}
+
+/** @brief 	Returns the current vibrato deviation of one string
+ *
+ *  @param 	string - string
+ *  @return deviation from the note [cent], 0 without vibrato
+ */
+int16_t VIB_getOffset(E_NOTES_STRING string)
+{
+	if (string >= NOTES_STRINGS)
+		return 0;
+	return vib_osc[string].offset;
+}
+
+/** @brief 	Predicts the vibrato deviation of one string some time ahead. The rate
+ * 			and depth ramps are followed, a new vibrato datapoint is of course not.
+ *
+ *  @param 	string - string
+ *  @param 	ms - time from now [ms]
+ *  @return deviation from the note [cent], 0 without vibrato
+ */
+int16_t VIB_getOffsetAhead(E_NOTES_STRING string, uint32_t ms)
+{
+	T_VIB_OSC copy;
+	const T_VIB_OSC *osc = &copy;
+	uint32_t ramp, phase;
+	int32_t depth;
+	uint32_t primask = __get_PRIMASK();
+
+	if (string >= NOTES_STRINGS)
+		return 0;
+
+	// The tick must not update the oscillator halfway through
+	__disable_irq();
+	copy = vib_osc[string];
+	__set_PRIMASK(primask);
+
+	ramp = ms < osc->ramp_left ? ms : osc->ramp_left;
+	depth = osc->depth + osc->depth_step * (int32_t) ramp;
+	if (ramp == osc->ramp_left && osc->ramp_left > 0)
+		depth = osc->depth_target;
+	if (depth == 0)
+		return 0;
+
+	// phase_inc changes by phase_inc_step every ms of the ramp. All modulo 2^32 like the phase itself.
+	phase = osc->phase + osc->phase_inc * ms
+			+ (uint32_t) osc->phase_inc_step * ramp * (ms - ramp)
+			+ (uint32_t) osc->phase_inc_step * ((ramp * (ramp + 1)) / 2);
+	return vib_offset(osc->waveform, phase, depth);
+}
+
+/** @brief 	Checks if a string has a vibrato or is fading one in or out
+ *
+ *  @param 	string - string
+ *  @return 1 if active
+ */
+int32_t VIB_isActive(E_NOTES_STRING string)
+{
+	if (string >= NOTES_STRINGS)
+		return 0;
+	return vib_osc[string].depth != 0 || vib_osc[string].depth_target != 0;
+}
+
+/** @brief 	Deviation for a phase and depth of the oscillator
+ *
+ *  @param 	waveform - E_VIB_WAVEFORM
+ *  @param 	phase - one full period is 2^32
+ *  @param 	depth - peak deviation [cent, Q16]
+ *  @return deviation from the note [cent]
+ */
+static int16_t vib_offset(uint8_t waveform, uint32_t phase, int32_t depth)
+{
+	return (int16_t) (((depth >> 8) * vib_waveform(waveform, phase)) >> 23);
+}
+
+/** @brief 	Value of the waveform at a phase
+ *
+ *  @param 	waveform - E_VIB_WAVEFORM
+ *  @param 	phase - one full period is 2^32
+ *  @return value between -32767 and 32767 (Q15)
+ */
+static int32_t vib_waveform(uint8_t waveform, uint32_t phase)
+{
+	uint32_t quadrant = phase >> 30;
+	uint32_t pos = (phase >> (30 - VIB_QUADRANT_BITS)) & ((1 << VIB_QUADRANT_BITS) - 1);
+	uint32_t idx, frac;
+	int32_t value;
+
+	// falling quarters are the rising ones mirrored
+	if (quadrant == 1 || quadrant == 3)
+		pos = (1 << VIB_QUADRANT_BITS) - pos;
+
+	if (waveform == VIB_TRIANGLE)
+	{
+		value = (int32_t) ((pos * 32767) >> VIB_QUADRANT_BITS);
+	}
+	else
+	{
+		idx = pos >> (VIB_QUADRANT_BITS - VIB_TABLE_BITS);
+		frac = pos & ((1 << (VIB_QUADRANT_BITS - VIB_TABLE_BITS)) - 1);
+		value = vib_sine_table[idx];
+		if (idx < (1 << VIB_TABLE_BITS))
+			value += ((vib_sine_table[idx + 1] - vib_sine_table[idx]) * (int32_t) frac) >> (VIB_QUADRANT_BITS - VIB_TABLE_BITS);
+	}
+
+	return quadrant >= 2 ? -value : value;
+}
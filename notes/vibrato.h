@@ -0,0 +1,43 @@
+/** @file vibrato.h
+ *  @brief fixed-point vibrato oscillators for the four strings
+ *
+ *  @author Josef Heel
+	@date October 18th, 2026
+ */
+#ifndef VIBRATO_H_
+#define VIBRATO_H_
+
+#include "datapoint_def.h"
+#include "notes.h"
+
+typedef enum
+{
+	VIB_SINE = 0,
+	VIB_TRIANGLE,
+	VIB_WAVEFORMS
+}E_VIB_WAVEFORM;
+
+// State of the oscillator of one string. Updated once per ms.
+typedef struct
+{
+	uint32_t phase;			// one full period is 2^32
+	uint32_t phase_inc;		// phase increment per ms
+	uint32_t phase_inc_target;
+	int32_t	 phase_inc_step;	// change of phase_inc per ms while ramping
+	int32_t  depth;			// peak deviation [cent, Q16]
+	int32_t  depth_target;
+	int32_t  depth_step;	// change of depth per ms while ramping
+	uint16_t ramp_left;		// [ms] until rate and depth reach their targets
+	uint8_t  waveform;		// E_VIB_WAVEFORM
+	int16_t	 offset;		// output: current deviation from the note [cent]
+}T_VIB_OSC;
+
+void VIB_Init(void);
+void VIB_set(E_NOTES_STRING string, const T_DTP_VIB *point);
+void VIB_update(void);
+int16_t VIB_getOffset(E_NOTES_STRING string);
+int16_t VIB_getOffsetAhead(E_NOTES_STRING string, uint32_t ms);
+int32_t VIB_isActive(E_NOTES_STRING string);
+
+
+#endif /* VIBRATO_H_ */
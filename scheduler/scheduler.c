@@ -0,0 +1,203 @@
+/*
+ * scheduler.c
+ *
+ *  Created on: Oct 18, 2026
+ *      Author: josef
+ *
+ *	The cycle planner (SM_updateMotor for every axis) is executed in the PendSV
+ *	exception at the lowest interrupt priority. That way a long packet decode
+ *	or a blocking debug print in the main loop cannot delay the preparation
+ *	of cycles anymore, only the step ISR and the other interrupts can.
+ *
+ *	Thread mode code that changes motor or channel state the planner works
+ *	with (motor commands, clearing channels ...) has to hold the planner lock
+ *	(SCH_lockPlanner / SCH_unlockPlanner) while doing so.
+ */
+
+#include "main.h"
+#include "debug_tools.h"
+#include "motor_control.h"
+#include "channels.h"
+#include "scheduler.h"
+
+T_SCH_AXIS sch_axis[SCH_NUMBER_AXIS];
+volatile int32_t sch_planner_running = 0; // Planner does nothing until SCH_startPlanner() is called
+
+
+/** @brief  Sets the interrupt priorities of the execution model. Has to be
+ * 			called after the CubeMX inits (they set everything to 0) and before
+ * 			the millisecond tick is started.
+ *
+ *  @param (none)
+ *  @return (none)
+ */
+void SCH_Init (void)
+{
+	sch_axis[0].ctl = &x_dae_motor;
+	sch_axis[0].cha = &cha_posx_dae;
+	sch_axis[1].ctl = &y_dae_motor;
+	sch_axis[1].cha = &cha_posy_dae;
+	sch_axis[2].ctl = &z_dae_motor;
+	sch_axis[2].cha = &cha_str_dae;
+
+	HAL_NVIC_SetPriority(TIM1_UP_TIM10_IRQn, SCH_PRIO_TICK, 0);
+	HAL_NVIC_SetPriority(OTG_FS_IRQn, SCH_PRIO_COMM, 0);
+	HAL_NVIC_SetPriority(PendSV_IRQn, SCH_PRIO_PLANNER, 0);
+}
+
+/** @brief  Enables the planner. Call when motors and channels are initialized.
+ *
+ *  @param (none)
+ *  @return (none)
+ */
+void SCH_startPlanner (void)
+{
+	sch_planner_running = 1;
+	SCH_requestPlanning();
+}
+
+/** @brief  Triggers a planner run. Can be called from anywhere, the planner
+ * 			runs as soon as no other interrupt is active anymore.
+ *
+ *  @param (none)
+ *  @return (none)
+ */
+void SCH_requestPlanning (void)
+{
+	SCB->ICSR = SCB_ICSR_PENDSVSET_Msk;
+}
+
+/** @brief  Called by the step ISR when a cycle of this motor finished and
+ * 			left a free queue slot. Remembers the time for the latency
+ * 			statistics and triggers the planner.
+ *
+ *  @param *ctl - motor that needs a refill
+ *  @return (none)
+ */
+void SCH_requestRefill (T_MOTOR_CONTROL *ctl)
+{
+	int32_t i;
+
+	for (i = 0; i < SCH_NUMBER_AXIS; i++)
+	{
+		if (sch_axis[i].ctl == ctl && sch_axis[i].request_pending == 0)
+		{
+			sch_axis[i].request_time = DWT->CYCCNT;
+			sch_axis[i].request_pending = 1;
+		}
+	}
+	SCB->ICSR = SCB_ICSR_PENDSVSET_Msk;
+}
+
+/** @brief  Runs the planner for all axis. Only to be called from PendSV_Handler.
+ *
+ *  @param (none)
+ *  @return (none)
+ */
+void SCH_runPlanner (void)
+{
+	int32_t i;
+	int32_t pending;
+	uint32_t request_time;
+	uint32_t latency;
+	int32_t unprepared;
+	int32_t count;
+	T_MOTOR_CONTROL *start[SCH_NUMBER_AXIS];
+
+	if (sch_planner_running == 0)
+		return;
+
+	do
+	{
+		for (i = 0; i < SCH_NUMBER_AXIS; i++)
+		{
+			// Take the request before planning. If the ISR frees another slot in the meantime, it is measured from then on.
+			pending = sch_axis[i].request_pending;
+			request_time = sch_axis[i].request_time;
+			sch_axis[i].request_pending = 0;
+
+			SM_updateMotor(sch_axis[i].ctl, sch_axis[i].cha);
+
+			if (pending)
+			{
+				latency = DWT->CYCCNT - request_time;
+				sch_axis[i].latency_last = latency;
+				if (latency > sch_axis[i].latency_max)
+					sch_axis[i].latency_max = latency;
+			}
+		}
+
+		// The tick may have made an axis ready that was already passed in the loop above.
+		// It has to be prepared as well before the group is started, otherwise it starts one planner run later.
+		unprepared = 0;
+		for (i = 0; i < SCH_NUMBER_AXIS; i++)
+		{
+			if (sch_axis[i].ctl->status == STG_READY && sch_axis[i].ctl->start_pending == 0)
+				unprepared = 1;
+		}
+	} while (unprepared);
+
+	// Start all axis that got ready in the same ms together
+	count = 0;
+	for (i = 0; i < SCH_NUMBER_AXIS; i++)
+	{
+		if (sch_axis[i].ctl->start_pending)
+			start[count++] = sch_axis[i].ctl;
+	}
+	if (count > 0)
+		STG_StartCycleGroup(start, count);
+
+	STG_evaluateGroupStart();
+}
+
+/** @brief  Keeps the planner from running until SCH_unlockPlanner() is called.
+ * 			All other interrupts stay enabled. Calls can be nested.
+ *
+ *  @param (none)
+ *  @return previous lock state to be handed to SCH_unlockPlanner()
+ */
+uint32_t SCH_lockPlanner (void)
+{
+	uint32_t basepri = __get_BASEPRI();
+	__set_BASEPRI_MAX(SCH_PRIO_PLANNER << (8U - __NVIC_PRIO_BITS));
+	return basepri;
+}
+
+/** @brief  Releases the planner lock. A planner run requested in the meantime
+ * 			is executed right away.
+ *
+ *  @param basepri - value returned by the matching SCH_lockPlanner()
+ *  @return (none)
+ */
+void SCH_unlockPlanner (uint32_t basepri)
+{
+	__set_BASEPRI(basepri);
+}
+
+/** @brief  Prints the refill latency, the deadline slack and the stops of
+ * 			every axis and resets the latency maximum.
+ *
+ *  @param (none)
+ *  @return (none)
+ */
+void SCH_reportStatistics (void)
+{
+	int32_t i;
+	T_MOTOR_CONTROL *ctl;
+
+	for (i = 0; i < SCH_NUMBER_AXIS; i++)
+	{
+		ctl = sch_axis[i].ctl;
+		dbgprintf("%s planner: refill latency last %d us, max %d us, min slack %d ms / %d cycles, underruns %d, timer overruns %d (max %d ticks late)",
+				ctl->name,
+				sch_axis[i].latency_last / (SystemCoreClock / 1000000),
+				sch_axis[i].latency_max / (SystemCoreClock / 1000000),
+				ctl->q_min_slack, ctl->q_min_fill, ctl->q_underruns, ctl->tim_overruns, ctl->tim_late_max);
+		sch_axis[i].latency_max = 0;
+		dbgprintf("%s stop: %d stops, distance last %d max %d (bound %d) steps, %d overruns, swap last %d max %d cycles, first decel step last %d max %d cycles",
+				ctl->name, ctl->stop.count, ctl->stop.distance_last, ctl->stop.distance_max, ctl->stop.bound,
+				ctl->stop.overruns, ctl->stop.cycles_last, ctl->stop.cycles_max, ctl->stop.latency_last, ctl->stop.latency_max);
+	}
+	dbgprintf("Group start: %d groups, skew last %d max %d ticks, compare to ISR max %d ticks",
+			stg_group.groups, stg_group.skew_last, stg_group.skew_max, stg_group.entry_max);
+}
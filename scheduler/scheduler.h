@@ -0,0 +1,51 @@
+/*
+ * scheduler.h
+ *
+ *  Created on: Oct 18, 2026
+ *      Author: josef
+ *
+ *	Execution model of the firmware. There are three levels:
+ *		o	Step generation (TIM1 CC) and limit switches run at the highest priority.
+ *		o	The cycle planner runs in PendSV at the lowest interrupt priority. It is
+ *			triggered by the step ISR whenever a queue slot is freed and once per ms
+ *			by the timekeeper. Everything else preempts it, but it preempts thread mode.
+ *		o	Communication and housekeeping run in thread mode (main loop) and sleep with WFI.
+ */
+
+#ifndef SCHEDULER_H_
+#define SCHEDULER_H_
+
+#include "main.h"
+#include "step_generation.h"
+#include "channels.h"
+
+// Interrupt priorities (preemption priority, NVIC_PRIORITYGROUP_4). Lower number is more important.
+#define SCH_PRIO_STEP			0		// TIM1 CC step generation and limit switch EXTI. Left at the CubeMX setting.
+#define SCH_PRIO_TICK			1		// TIM10 millisecond tick (channel time, timeouts)
+#define SCH_PRIO_COMM			2		// USB OTG FS
+#define SCH_PRIO_PLANNER		15		// PendSV, cycle planner. Must stay the lowest priority.
+
+#define SCH_NUMBER_AXIS			3
+
+// Planner statistics of one axis
+typedef struct
+{
+	T_MOTOR_CONTROL	*ctl;				// motor that is planned
+	T_CHANNEL		*cha;				// channel the motor takes its datapoints from
+	volatile uint32_t request_time;		// DWT cycle count when the step ISR freed a queue slot
+	volatile int32_t request_pending;	// 1 if the step ISR asked for a refill that has not been served yet
+	uint32_t		latency_last;		// Cycles from the refill request until the planner was done with this axis
+	uint32_t		latency_max;		// Maximum of latency_last since the last report
+}T_SCH_AXIS;
+
+// PROTOTYPES
+void SCH_Init (void);
+void SCH_startPlanner (void);
+void SCH_requestPlanning (void);
+void SCH_requestRefill (T_MOTOR_CONTROL *ctl) ITCM_TEXT;
+void SCH_runPlanner (void);
+uint32_t SCH_lockPlanner (void);
+void SCH_unlockPlanner (uint32_t basepri);
+void SCH_reportStatistics (void);
+
+#endif /* SCHEDULER_H_ */
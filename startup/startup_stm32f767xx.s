@@ -60,6 +60,15 @@ defined in linker script */
 .word  _sbss
 /* end address for the .bss section. defined in linker script */
 .word  _ebss
+/* start addresses of the ITCM code and DTCM data sections and their initialization values. defined in linker script */
+.word  _siitcm_text
+.word  _sitcm_text
+.word  _eitcm_text
+.word  _sidtcm_data
+.word  _sdtcm_data
+.word  _edtcm_data
+.word  _sdtcm_bss
+.word  _edtcm_bss
 /* stack used for SystemInit_ExtMemCtl; always internal RAM used */
 
 /**
@@ -105,6 +114,53 @@ LoopFillZerobss:
   cmp  r2, r3
   bcc  FillZerobss
 
+/* Copy the time critical code from flash to ITCM */
+  movs  r1, #0
+  b  LoopCopyItcmInit
+
+CopyItcmInit:
+  ldr  r3, =_siitcm_text
+  ldr  r3, [r3, r1]
+  str  r3, [r0, r1]
+  adds  r1, r1, #4
+
+LoopCopyItcmInit:
+  ldr  r0, =_sitcm_text
+  ldr  r3, =_eitcm_text
+  adds  r2, r0, r1
+  cmp  r2, r3
+  bcc  CopyItcmInit
+
+/* Copy the initialized time critical data from flash to DTCM */
+  movs  r1, #0
+  b  LoopCopyDtcmInit
+
+CopyDtcmInit:
+  ldr  r3, =_sidtcm_data
+  ldr  r3, [r3, r1]
+  str  r3, [r0, r1]
+  adds  r1, r1, #4
+
+LoopCopyDtcmInit:
+  ldr  r0, =_sdtcm_data
+  ldr  r3, =_edtcm_data
+  adds  r2, r0, r1
+  cmp  r2, r3
+  bcc  CopyDtcmInit
+  ldr  r2, =_sdtcm_bss
+  b  LoopFillZeroDtcmBss
+/* Zero fill the DTCM bss segment. */
+FillZeroDtcmBss:
+  movs  r3, #0
+  str  r3, [r2], #4
+
+LoopFillZeroDtcmBss:
+  ldr  r3, = _edtcm_bss
+  cmp  r2, r3
+  bcc  FillZeroDtcmBss
+  dsb
+  isb
+
 /* Call the clock system initialization function.*/
   bl  SystemInit   
 /* Call static constructors */
@@ -8,11 +8,14 @@
 #include "debug_tools.h"
 #include "limit_switches.h"
 #include "step_generation.h"
+#include "scheduler.h"
+#include "motor_parameters.h"
 
 
 // PROTOTYPES
-void check_stop(T_MOTOR_CONTROL *ctl);
-void check_referencing(T_MOTOR_CONTROL *ctl);
+static void check_contact(T_MOTOR_CONTROL *ctl, uint32_t request);
+void check_stop(T_MOTOR_CONTROL *ctl, uint32_t request);
+void check_referencing(T_MOTOR_CONTROL *ctl, int32_t contact);
 
 /** @brief 	Callback for the X-DAE limit switch. If it is triggered
  * 			meaning the moving part is touching, this interrupt is
@@ -24,8 +27,7 @@ void check_referencing(T_MOTOR_CONTROL *ctl);
  */
 void LIM_x_dae_callback(void)
 {
-	check_stop(&x_dae_motor);
-	check_referencing(&x_dae_motor);
+	check_contact(&x_dae_motor, DWT->CYCCNT);
 }
 
 /** @brief 	Callback for the Y-DAE limit switch. If it is triggered
@@ -38,8 +40,7 @@ void LIM_x_dae_callback(void)
  */
 void LIM_y_dae_callback(void)
 {
-	check_stop(&y_dae_motor);
-	check_referencing(&y_dae_motor);
+	check_contact(&y_dae_motor, DWT->CYCCNT);
 }
 
 /** @brief 	Callback for the Z-DAE limit switch. If it is triggered
@@ -52,33 +53,76 @@ void LIM_y_dae_callback(void)
  */
 void LIM_z_dae_callback(void)
 {
-	check_stop(&z_dae_motor);
-	check_referencing(&z_dae_motor);
+	check_contact(&z_dae_motor, DWT->CYCCNT);
 }
 
-void check_stop(T_MOTOR_CONTROL *ctl)
+/** @brief 	Common part of the limit switch callbacks. The position at the contact
+ * 			is latched first, before the stop changes the active cycle.
+ *
+ * 			A home axis only stops when it runs into the switch. Edges while it still
+ * 			decelerates behind the switch from its homing contact, stands or moves off
+ * 			the switch (a bouncing contact) are ignored.
+ *
+ *  @param *ctl - motor that ran into its limit switch
+ *  @param request - DWT->CYCCNT at the entry of the EXTI
+ *  @return (none)
+ */
+static void check_contact(T_MOTOR_CONTROL *ctl, uint32_t request)
+{
+	int32_t contact;
+
+	if (ctl->motor.home_status == STG_HOME
+			&& (ctl->slow_decel_at_limit || ctl->status == STG_IDLE || ctl->active->dir_abs > 0))
+		return;
+
+	contact = STG_getOutputPosition(ctl);
+	check_stop(ctl, request);
+	check_referencing(ctl, contact);
+	SCH_requestPlanning();
+}
+
+void check_stop(T_MOTOR_CONTROL *ctl, uint32_t request)
 {
 	if (ctl->slow_decel_at_limit == 0)
 		STG_hardstop(ctl);
 	else
-		STG_softstop(ctl);
+		STG_softstop(ctl, request);
 }
 
-void check_referencing(T_MOTOR_CONTROL *ctl)
+/** @brief 	Takes the contact as zero if the motor is referencing. The steps made after
+ * 			the contact was latched (deceleration behind the switch) are kept, so the zero
+ * 			does not depend on the length of the stop. Steps within the interrupt latency
+ * 			are not seen, they are part of the zero.
+ *
+ * 			After a soft stopped first contact the axis is home right away. Only after a
+ * 			hard stop, which may have lost steps, it makes the slow second contact
+ * 			(or always, if HOMING_SECOND_CONTACT is set).
+ *
+ *  @param *ctl - motor that ran into its limit switch
+ *  @param contact - position of the motor at the contact, see STG_getOutputPosition()
+ *  @return (none)
+ */
+void check_referencing(T_MOTOR_CONTROL *ctl, int32_t contact)
 {
-	if (ctl->motor.home_status == STG_WAITING_FIRST_CONTACT)
+	if (ctl->motor.home_status != STG_WAITING_FIRST_CONTACT && ctl->motor.home_status != STG_WAITING_SECOND_CONTACT)
+		return;
+
+	ctl->motor.pos -= contact;
+	ctl->motor.scheduled_pos -= contact;
+
+	if (ctl->motor.home_status == STG_WAITING_FIRST_CONTACT && (ctl->slow_decel_at_limit == 0 || HOMING_SECOND_CONTACT))
 	{
 		// First contact made -> retract for the second one
 		ctl->slow_decel_at_limit = 1;
 		ctl->motor.home_status = STG_AT_FIRST_CONTACT;
-
 	}
-	else if (ctl->motor.home_status == STG_WAITING_SECOND_CONTACT)
+	else
 	{
-		// Second contact made -> this is now the final motor position zero
-		ctl->slow_decel_at_limit = 0;
+		// This is now the final motor position zero. The axis may still decelerate behind the
+		// switch, slow_decel_at_limit stays set until it stands (see update_referencing).
 		ctl->motor.home_status = STG_HOME;
-		ctl->motor.pos = 0;
+		ctl->motor.home_time = HAL_GetTick() - ctl->motor.home_start;
+		ctl->motor.home_confirm = 0;
 	}
 }
 
@@ -11,6 +11,9 @@
 #include "motor_control.h"
 #include "motor_parameters.h"
 #include "timekeeper.h"
+#include "scheduler.h"
+#include "counters.h"
+#include "vibrato.h"
 #include <math.h>
 #include <stdlib.h>
 
@@ -22,9 +25,27 @@ int32_t test_times_z[TEST_POINTS] = 	  {0, 	300, 	400, 	500, 	600, 	1000, 	1000,
 real w_old_x, w_old_y, w_old_z;
 int32_t cycle_number_x, cycle_number_y, cycle_number_z;
 
+// The planner runs in PendSV, a print there blocks it and with it the refill of every axis
+#if (DBG_PLANNER_PRINTS)
+#define sm_dbgprintf(...)		dbgprintf(__VA_ARGS__)
+#define sm_dbgprintfc(...)		dbgprintfc(__VA_ARGS__)
+#else
+#define sm_dbgprintf(...)		((void) 0)
+#define sm_dbgprintfc(...)		((void) 0)
+#endif
+
+T_SM_HOMING sm_homing;
+static T_MOTOR_CONTROL * const sm_homing_axis[SM_HOMING_AXIS] = {&x_dae_motor, &y_dae_motor, &z_dae_motor};
+
 
 // PROTOTYPES
-real calculate_motor_control (T_SPT_CYCLESPEC *setup, T_MOTOR_CONTROL *ctl);
+int32_t prepare_next_cycle (T_MOTOR_CONTROL *ctl, T_CHANNEL *cha);
+static void limit_tempo (T_SPT_CYCLESPEC *setup, T_MOTOR_CONTROL *ctl, const T_DTP_MOTOR *datapoint);
+static int32_t vibrato_active (void);
+static void add_vibrato (T_MOTOR_CONTROL *ctl, T_CHANNEL *cha, T_DTP_MOTOR *datapoint);
+static uint8_t start_referencing (T_MOTOR_CONTROL *ctl, real speed, int32_t overrun);
+static void update_referencing (T_MOTOR_CONTROL *ctl);
+static void check_homing_done (void);
 real min (real a, real b);
 real max (real a, real b);
 
@@ -76,6 +97,8 @@ void SM_restart_testcylce (void)
 	{
 		datapoint.steps = test_positions_xy[i];
 		datapoint.timediff = test_times_xy[i];
+		datapoint.velocity = 0;
+		datapoint.segment = 0;
 		CHA_pushDatapoints(&cha_posx_dae, (void*) &datapoint, 1);
 		CHA_pushDatapoints(&cha_posy_dae, (void*) &datapoint, 1);
 	}
@@ -86,6 +109,8 @@ void SM_restart_testcylce (void)
 	{
 		datapoint.steps = test_positions_z[i];
 		datapoint.timediff = test_times_z[i];
+		datapoint.velocity = 0;
+		datapoint.segment = 0;
 		CHA_pushDatapoints(&cha_str_dae, (void*) &datapoint, 1);
 	}
 
@@ -111,14 +136,14 @@ void SM_hardstop (void)
 
 /** @brief  Immediately slow down all motor axis with maximum
  * 			deceleration. This function does not loose steps.
- *  @param 	(none)
+ *  @param 	request - DWT->CYCCNT at the entry of the stop command, the stop latency counts from there
  *  @return (none)
  */
-void SM_softstop (void)
+void SM_softstop (uint32_t request)
 {
-	STG_softstop(&x_dae_motor);
-	STG_softstop(&y_dae_motor);
-	STG_softstop(&z_dae_motor);
+	STG_softstop(&x_dae_motor, request);
+	STG_softstop(&y_dae_motor, request);
+	STG_softstop(&z_dae_motor, request);
 }
 
 /** @brief  Call when it is due to execute a datapoint. The is always stopped when this function is executed
@@ -132,6 +157,7 @@ void SM_setMotorReady (T_MOTOR_CONTROL *ctl)
 	ctl->motor.scheduled_pos = ctl->motor.pos;
 
 	ctl->status = STG_READY;
+	SCH_requestPlanning();
 }
 
 /** @brief  Moves a motor to a fixed step location and stops there.
@@ -141,6 +167,8 @@ void SM_setMotorReady (T_MOTOR_CONTROL *ctl)
  * 			It expects the motor to sit in the STG_IDLE state. If not, the command
  * 			is just ignored. (not buffered or anything!)
  *
+ * 			The referencing calls it from the planner, so it only prints with DBG_PLANNER_PRINTS.
+ *
  *  @param 	*ctl - Pointer to motor control handle
  *  @param	position - location in steps that it should move to
  *  @param 	speed - speed in [rad/s] that it should perform this task
@@ -149,7 +177,7 @@ void SM_setMotorReady (T_MOTOR_CONTROL *ctl)
 uint8_t SM_moveMotorToLocation(T_MOTOR_CONTROL *ctl, int32_t position, real speed)
 {
 	int32_t delta_s = position-ctl->motor.pos;
-	dbgprintf("MM abs pos=%d speed=%d", position, (int)speed);
+	sm_dbgprintf("MM abs pos=%d speed=%d", position, (int)speed);
 	int32_t delta_t = SM_calculate_minimal_time(delta_s, 0.0, 0.0, speed, &(ctl->motor));
 	T_SPT_CYCLESPEC setup;
 	real w_ret = 0.0;
@@ -166,17 +194,23 @@ uint8_t SM_moveMotorToLocation(T_MOTOR_CONTROL *ctl, int32_t position, real spee
 
 		// This is a new self-following trajectory to start. The motor has not been moving previously
 		setup.w_s = 0; // this is the start of a new trajectory, so start speed is 0
-		dbgprintf("%s Start manual move of %d steps in delta_t=%d: ",ctl->name, delta_s, delta_t);
+		sm_dbgprintf("%s Start manual move of %d steps in delta_t=%d: ",ctl->name, delta_s, delta_t);
+		STG_flushQueue(ctl);
 		w_ret = calculate_motor_control(&setup, ctl);
 		if (w_ret == W_ERR)
 		{
 			// Could not fit the motion request
 			ctl->status = STG_ERROR;
-			dbgprintf("%s CALCULATION ERROR!", ctl->name);
+			sm_dbgprintf("%s CALCULATION ERROR!", ctl->name);
 			return ERROR;
 		}
 		else
 		{
+			// Queue the move and the stop right behind it, the ISR runs through both by itself.
+			STG_commitCycle(ctl);
+			ctl->waiting->shutoff = 1;
+			STG_commitCycle(ctl);
+			ctl->motor.w_scheduled = 0;
 			ctl->status = STG_MANUAL;
 			STG_StartCycle(ctl);
 			return SUCCESS;
@@ -184,7 +218,7 @@ uint8_t SM_moveMotorToLocation(T_MOTOR_CONTROL *ctl, int32_t position, real spee
 	}
 	else
 	{
-		dbgprintf("Skipped manual move command because motor was busy!");
+		sm_dbgprintf("Skipped manual move command because motor was busy!");
 		return ERROR;
 	}
 }
@@ -195,7 +229,7 @@ uint8_t SM_moveMotorToLocation(T_MOTOR_CONTROL *ctl, int32_t position, real spee
  * 			it is not clear whether it will ever reach speed without going too far.
  *
  * 			It expects the motor to sit in the STG_IDLE state. If not, the command
- * 			is just ignored. (not buffered or anything!)
+ * 			is just ignored. (not buffered or anything!) Prints like SM_moveMotorToLocation.
  *
  *  @param 	*ctl - Pointer to motor control handle
  *  @param	position_difference - difference in steps it should move
@@ -205,7 +239,7 @@ uint8_t SM_moveMotorToLocation(T_MOTOR_CONTROL *ctl, int32_t position, real spee
 uint8_t SM_moveMotorRelative(T_MOTOR_CONTROL *ctl, int32_t position_difference, real speed)
 {
 	int32_t delta_s = position_difference;
-	dbgprintf("MM rel pos_diff=%d speed=%d", position_difference, (int)speed);
+	sm_dbgprintf("MM rel pos_diff=%d speed=%d", position_difference, (int)speed);
 	int32_t delta_t = SM_calculate_minimal_time(delta_s, 0.0, 0.0, speed, &(ctl->motor));
 	T_SPT_CYCLESPEC setup;
 	real w_ret = 0.0;
@@ -222,17 +256,23 @@ uint8_t SM_moveMotorRelative(T_MOTOR_CONTROL *ctl, int32_t position_difference,
 
 		// This is a new self-following trajectory to start. The motor has not been moving previously
 		setup.w_s = 0; // this is the start of a new trajectory, so start speed is 0
-		dbgprintf("%s Start manual move of %d steps in delta_t=%d: ",ctl->name, delta_s, delta_t);
+		sm_dbgprintf("%s Start manual move of %d steps in delta_t=%d: ",ctl->name, delta_s, delta_t);
+		STG_flushQueue(ctl);
 		w_ret = calculate_motor_control(&setup, ctl);
 		if (w_ret == W_ERR)
 		{
 			// Could not fit the motion request
 			ctl->status = STG_ERROR;
-			dbgprintf("%s CALCULATION ERROR!", ctl->name);
+			sm_dbgprintf("%s CALCULATION ERROR!", ctl->name);
 			return ERROR;
 		}
 		else
 		{
+			// Queue the move and the stop right behind it, the ISR runs through both by itself.
+			STG_commitCycle(ctl);
+			ctl->waiting->shutoff = 1;
+			STG_commitCycle(ctl);
+			ctl->motor.w_scheduled = 0;
 			ctl->status = STG_MANUAL;
 			STG_StartCycle(ctl);
 			return SUCCESS;
@@ -240,7 +280,7 @@ uint8_t SM_moveMotorRelative(T_MOTOR_CONTROL *ctl, int32_t position_difference,
 	}
 	else
 	{
-		dbgprintf("Skipped manual move command because motor was busy!");
+		sm_dbgprintf("Skipped manual move command because motor was busy!");
 		return ERROR;
 	}
 }
@@ -258,149 +298,457 @@ uint8_t SM_moveMotorRelative(T_MOTOR_CONTROL *ctl, int32_t position_difference,
  *  @return (none)
  */
 void SM_referenceMotor(T_MOTOR_CONTROL *ctl, real speed)
+{
+	start_referencing(ctl, speed, 0);
+	// All the rest is done by the state machine and SM_updateMotor
+}
+
+/** @brief  References all axis at the same time. The first approach runs at the
+ * 			highest speed from which the axis can still stop within HOMING_DECEL_DISTANCE
+ * 			behind the limit switch (soft stop), instead of a hard stop at a given speed.
+ * 			The position at the contact is latched, so the soft stopped first contact already
+ * 			gives the zero. Retract and slow second contact only follow with HOMING_SECOND_CONTACT.
+ *
+ * 			An axis with a position restored from the parameter store goes straight to
+ * 			where the retract would end and makes the second contact from there. If the
+ * 			switch is not where it should be, it continues with the sweep over the whole travel.
+ *
+ * 			The time until the last axis is done is kept in sm_homing.
+ *
+ *  @param 	(none)
+ *  @return SUCCESS if all axis started, ERROR if one of them was busy (then none is started)
+ * 			or could not start (the others run anyway, without the homing status)
+ */
+uint8_t SM_referenceAll(void)
+{
+	uint8_t ret = SUCCESS;
+	int32_t i;
+
+	// All or none, sm_homing.active must only be set when check_homing_done() can end it
+	for (i = 0; i < SM_HOMING_AXIS; i++)
+	{
+		if (sm_homing_axis[i]->status != STG_IDLE)
+		{
+			dbgprintf("Skipped referencing because %s was busy!", sm_homing_axis[i]->name);
+			return ERROR;
+		}
+	}
+
+	sm_homing.start = HAL_GetTick();
+	sm_homing.homed = 0;
+	for (i = 0; i < SM_HOMING_AXIS; i++)
+	{
+		if (start_referencing(sm_homing_axis[i], SM_homingSpeed(&sm_homing_axis[i]->motor), HOMING_DECEL_DISTANCE) != SUCCESS)
+			ret = ERROR;
+	}
+	// An axis that could not start (calculation error) would never end the run
+	sm_homing.active = ret == SUCCESS;
+	return ret;
+}
+
+/** @brief  Fastest approach speed of an axis towards its limit switch, so that
+ * 			it can decelerate to a stop within HOMING_DECEL_DISTANCE steps.
+ *
+ *  @param 	*motor - motor parameters
+ *  @return speed in [rad/s]
+ */
+real SM_homingSpeed(T_STEPPER_STATE *motor)
+{
+	// Braking from w takes w^2 / (2 * alpha * acc) steps
+	return min(motor->w_max, sqrt(2.0 * motor->alpha * motor->acc * HOMING_DECEL_DISTANCE));
+}
+
+/** @brief  Starts the first approach towards the limit switch.
+ *
+ *  @param 	*ctl - Pointer to motor control handle
+ *  @param 	speed - speed of the first approach [rad/s]
+ *  @param 	overrun - steps the axis may need to stop behind the switch, 0 for a hard stop at the switch
+ *  @return SUCCESS if started, ERROR if the motor was busy
+ */
+static uint8_t start_referencing (T_MOTOR_CONTROL *ctl, real speed, int32_t overrun)
 {
 	uint8_t ret;
-	ret = SM_moveMotorRelative(ctl, -(ctl->motor.max_travel), speed);
+
+	if (overrun > 0 && ctl->motor.home_confirm)
+	{
+		// Position restored from the parameter store: the second contact confirms it
+		ret = SM_moveMotorToLocation(ctl, RETRACTING_DISTANCE, speed);
+		if (ret == SUCCESS)
+		{
+			ctl->slow_decel_at_limit = 1;
+			ctl->motor.home_overrun = overrun;
+			ctl->motor.home_start = HAL_GetTick();
+			ctl->motor.home_status = STG_RETRACTING;
+		}
+		return ret;
+	}
+	ctl->motor.home_confirm = 0;
+
+	ret = SM_moveMotorRelative(ctl, -(ctl->motor.max_travel + overrun), speed);
 	if (ret == SUCCESS)
 	{
-	 ctl->motor.home_status = STG_WAITING_FIRST_CONTACT;
+		ctl->slow_decel_at_limit = overrun > 0;
+		ctl->motor.home_overrun = overrun;
+		ctl->motor.home_start = HAL_GetTick();
+		ctl->motor.home_status = STG_WAITING_FIRST_CONTACT;
 	}
-	 // All the rest is done by the state machine and SM_updateMotor
+	return ret;
 }
 
-/** @brief	Should be called periodically in the main loop for each motor.
+/** @brief	Is called by the planner (PendSV, see scheduler.c) for each motor.
  *
  * 			Executes the difference in time/position between the first two
  * 			elements in a channel if the status of the motor indicates to
  * 			do so.
  *
  * 			When the time reaches the timestamp of the execution, status
- * 			STG_READY should be set and this thing will start the execution
+ * 			STG_READY should be set and this thing will prepare the execution.
+ * 			The start itself is done by the planner for all motors at once.
  *
- * 			When the step generator requires a new cycle to be calculated in
- * 			an ongoing trajectory, it will set STG_NOT_PREPARED and this
- * 			function will calculate the next waiting cycle.
+ * 			While a trajectory is executed, the step generator sets STG_NOT_PREPARED
+ * 			whenever there is space in the cycle queue and this function fills it up.
+ * 			Cycles are only prepared ahead as long as the channel holds the datapoints
+ * 			for them. Otherwise the end of the trajectory is only planned when the
+ * 			executed cycle is the last one in the queue, so there is still time for
+ * 			new datapoints to arrive.
  *
- * 			It
  *  @param 	*ctl - pointer to motor control structure
  *  @param 	*cha - pointer to channel handle assigned to this motor.
  *  @return returns -2 if channel is empty, -1 if this was the last entry in the channel.
  */
 int32_t SM_updateMotor(T_MOTOR_CONTROL *ctl, T_CHANNEL *cha)
 {
-	T_SPT_CYCLESPEC setup;
-	T_DTP_MOTOR datapoint[2];
-	int32_t points_available;
 	int32_t ret = 0;
-	real w_ret = 0.0;
+	int32_t ret_cycle;
 
-	// Only do something if a cycle is currently executed and needs refilling or if a new trajectory should be started
-	if (ctl->status == STG_READY || ctl->status == STG_NOT_PREPARED)
+	if (ctl->status == STG_READY)
 	{
-		// Depending on how many datapoints are available, we pop one and read two more, or we
-		// pop one, read, whats there and fill the rest up with zero-cycles (you always need something
-		// pass to the motor_calculations function.
-		points_available = CHA_getNumberDatapoint(cha);
-		if (points_available >=2)
+		// This is a new self-following trajectory to start. The motor has not been moving previously
+		sm_dbgprintf("%s queue of last trajectory: min %d cycles ahead, %d underruns total", ctl->name, ctl->q_min_fill, ctl->q_underruns);
+		sm_dbgprintf("%s Start trajectory of at t=%d: ", ctl->name, CHA_getChannelTime());
+		STG_flushQueue(ctl);
+		ctl->motor.w_scheduled = 0; // this is the start of a new trajectory, so start speed is 0
+		ret = prepare_next_cycle(ctl, cha);
+		if (ctl->status == STG_READY && STG_getQueueFill(ctl) > 0)
 		{
-			CHA_popDatapoints(cha, (void*) &(datapoint[0]),1);
-			CHA_readDatapoints(cha, (void*) &(datapoint[1]), 1); // get one new datapoint without deleting.
+			// Not started here. The planner starts all motors due at the same time together (STG_StartCycleGroup)
+			ctl->start_pending = 1;
 		}
-		else if (points_available == 1)
+	}
+
+	// Fill up the cycle queue as far as possible
+	while (ctl->status == STG_NOT_PREPARED && STG_getQueueFree(ctl) > 0
+			&& (CHA_getNumberMotorPoints(cha, SM_SEGMENT_SAMPLE_TIME) >= 2 || STG_getQueueFill(ctl) <= 1))
+	{
+		ret_cycle = prepare_next_cycle(ctl, cha);
+		if (ret_cycle != 0)
+			ret = ret_cycle;
+	}
+
+	update_referencing(ctl);
+	if (sm_homing.active)
+		check_homing_done();
+
+	return ret;
+}
+
+/** @brief	Takes care of the referencing (homing) procedure after the first approach.
+ * 			The steps are only started when the axis stands still, after a fast first
+ * 			approach it still decelerates behind the switch for a while.
+ *
+ *  @param 	*ctl - pointer to motor control structure
+ *  @return (none)
+ */
+static void update_referencing (T_MOTOR_CONTROL *ctl)
+{
+	if (ctl->status != STG_IDLE)
+		return;
+
+	if (ctl->motor.home_status == STG_HOME)
+	{
+		// Stopped behind the switch, from now on a contact is a hard stop again
+		ctl->slow_decel_at_limit = 0;
+	} else if (ctl->motor.home_status == STG_AT_FIRST_CONTACT)
+	{
+		// Standing at (or behind) the first contact -> move back to make the second.
+		// The first contact was position 0, so the retract ends the same distance from the switch however far the axis overran it.
+		ctl->motor.home_status = STG_RETRACTING;
+		sm_dbgprintf("%s Starting retracting move.", ctl->name);
+		SM_moveMotorToLocation(ctl, RETRACTING_DISTANCE,
+				ctl->motor.home_overrun > 0 ? SM_homingSpeed(&ctl->motor) : SECOND_CONTACT_SPEED);
+	} else if (ctl->motor.home_status == STG_RETRACTING)
+	{
+		// retracting move has been completed. Moving towards it again.
+		ctl->motor.home_status = STG_WAITING_SECOND_CONTACT;
+		sm_dbgprintf("%s Moving towards for second contact.", ctl->name);
+		SM_moveMotorRelative(ctl, SECOND_CONTACT_DISTANCE, SECOND_CONTACT_SPEED);
+	} else if (ctl->motor.home_status == STG_WAITING_SECOND_CONTACT && ctl->motor.home_confirm)
+	{
+		// The axis was not where the parameter store said. Sweep the whole travel instead.
+		uint32_t start = ctl->motor.home_start;
+		sm_dbgprintf("%s Home position not confirmed, searching the limit switch.", ctl->name);
+		ctl->motor.home_confirm = 0;
+		start_referencing(ctl, SM_homingSpeed(&ctl->motor), ctl->motor.home_overrun);
+		ctl->motor.home_start = start; // the time of the failed confirmation counts as well
+	} else if (ctl->motor.home_status == STG_WAITING_SECOND_CONTACT)
+	{
+		sm_dbgprintf("%s Failed to reference, no second contact could be made.", ctl->name);
+		ctl->motor.home_status = STG_NOT_HOME;
+	} else if (ctl->motor.home_status == STG_WAITING_FIRST_CONTACT)
+	{
+		sm_dbgprintf("%s Failed to reference, the limit switch was not reached.", ctl->name);
+		ctl->motor.home_status = STG_NOT_HOME;
+	}
+}
+
+/** @brief	Ends a SM_referenceAll() run when no axis is referencing anymore
+ * 			and reports the times.
+ *
+ *  @param 	(none)
+ *  @return (none)
+ */
+static void check_homing_done (void)
+{
+	int32_t i;
+	E_STG_HOME_STATUS status;
+
+	for (i = 0; i < SM_HOMING_AXIS; i++)
+	{
+		// An axis that is home at the first contact still decelerates behind the switch
+		status = sm_homing_axis[i]->motor.home_status;
+		if ((status != STG_HOME && status != STG_NOT_HOME) || sm_homing_axis[i]->status != STG_IDLE)
+			return;
+	}
+
+	sm_homing.time = HAL_GetTick() - sm_homing.start;
+	sm_homing.homed = 0;
+	for (i = 0; i < SM_HOMING_AXIS; i++)
+	{
+		if (sm_homing_axis[i]->motor.home_status == STG_HOME)
 		{
-			// Add one zero-cylce at the end
-			CHA_popDatapoints(cha, (void*) &(datapoint[0]),1);
-			datapoint[1].timediff = 100;
-			datapoint[1].steps = datapoint[0].steps;
-			dbgprintf("Last point for %s", ctl->name);
-			ret = -1;
+			sm_homing.homed |= 1 << i;
+			sm_dbgprintf("%s homed in %u ms", sm_homing_axis[i]->name, sm_homing_axis[i]->motor.home_time);
 		}
-		else if (points_available == 0)
+		else
 		{
-			// Add two zero-cycles at the end
-			datapoint[0].timediff = 100;
-			datapoint[0].steps = ctl->motor.scheduled_pos;
-			datapoint[1].timediff = 100;
-			datapoint[1].steps = datapoint[0].steps;
-			dbgprintf("No points for %s", ctl->name);
+			sm_dbgprintf("%s NOT homed", sm_homing_axis[i]->name);
 		}
+	}
+	sm_dbgprintf("All axis referenced in %u ms", sm_homing.time);
+	sm_homing.active = 0;
+}
 
-		// And extract the difference between datapoints and pass them over to the motor calculator
-		setup.delta_s0 = datapoint[0].steps - ctl->motor.scheduled_pos; // where we need to be minus where we are
-		setup.delta_t0 = datapoint[0].timediff;
-		setup.delta_s1 = datapoint[1].steps - datapoint[0].steps;
-		setup.delta_t1 = datapoint[1].timediff;
+/** @brief	Calculates the next cycle of the trajectory out of the channel
+ * 			and puts it in the cycle queue of the motor.
+ *
+ * 			Depending on how many datapoints are available, we pop one and read one more,
+ * 			or we pop one, read whats there and fill the rest up with zero-cycles (you always
+ * 			need something to pass to the motor_calculations function).
+ * 			Hermite segments in the channel come in as points SM_SEGMENT_SAMPLE_TIME apart,
+ * 			one calculation each. The solver load is that of plain points at this spacing,
+ * 			only the host sends fewer points.
+ *
+ *  @param 	*ctl - pointer to motor control structure. Needs to have a free queue slot.
+ *  @param 	*cha - pointer to channel handle assigned to this motor.
+ *  @return -1 if this was the last entry in the channel, 0 otherwise.
+ */
+int32_t prepare_next_cycle (T_MOTOR_CONTROL *ctl, T_CHANNEL *cha)
+{
+	T_SPT_CYCLESPEC setup;
+	T_DTP_MOTOR datapoint[2];
+	int32_t points_available;
+	int32_t ret = 0;
+	real w_ret = 0.0;
+	uint32_t tempo;
 
-		// As the setup for the next cycle is done, we just scheduled a next position
-		// so we need to update this variable. Additionally, the last executed time point needs to be incremented.
-		ctl->motor.scheduled_pos = datapoint[0].steps;
-		cha->last_point_time = cha->last_point_time + datapoint[0].timediff;
+	// A vibrato needs points closer than a held note usually has
+	if (cha == &cha_str_dae)
+		cha->segment->split = vibrato_active();
 
-		if (ctl->status == STG_READY)
+	points_available = CHA_getNumberMotorPoints(cha, SM_SEGMENT_SAMPLE_TIME);
+	if (points_available >=2)
+	{
+		CHA_popMotorPoint(cha, &(datapoint[0]), SM_SEGMENT_SAMPLE_TIME);
+		CHA_readMotorPoint(cha, &(datapoint[1]), SM_SEGMENT_SAMPLE_TIME); // get one new datapoint without deleting.
+		if (cha == &cha_str_dae)
+			add_vibrato(ctl, cha, datapoint);
+	}
+	else if (points_available == 1)
+	{
+		// Add one zero-cylce at the end
+		CHA_popMotorPoint(cha, &(datapoint[0]), SM_SEGMENT_SAMPLE_TIME);
+		datapoint[1].timediff = 100;
+		datapoint[1].steps = datapoint[0].steps;
+		sm_dbgprintf("Last point for %s", ctl->name);
+		ret = -1;
+	}
+	else
+	{
+		// Add two zero-cycles at the end
+		datapoint[0].timediff = 100;
+		datapoint[0].steps = ctl->motor.scheduled_pos;
+		datapoint[1].timediff = 100;
+		datapoint[1].steps = datapoint[0].steps;
+		sm_dbgprintf("No points for %s", ctl->name);
+	}
+
+	// And extract the difference between datapoints and pass them over to the motor calculator
+	setup.delta_s0 = datapoint[0].steps - ctl->motor.scheduled_pos; // where we need to be minus where we are
+	setup.delta_t0 = CHA_musicToRealTime(datapoint[0].timediff); // datapoints are music time, cycles real time
+	setup.delta_s1 = datapoint[1].steps - datapoint[0].steps;
+	setup.delta_t1 = CHA_musicToRealTime(datapoint[1].timediff);
+	setup.w_s = ctl->motor.w_scheduled; // start of this cycle is the finishing speed of the last queued one
+	if (CHA_getTempo() > CHA_TEMPO_ONE)
+		limit_tempo(&setup, ctl, datapoint);
+
+	// As the setup for the next cycle is done, we just scheduled a next position
+	// so we need to update this variable. Additionally, the last executed time point needs to be incremented.
+	ctl->motor.scheduled_pos = datapoint[0].steps;
+	cha->last_point_time = cha->last_point_time + datapoint[0].timediff;
+
+	if (ctl->status != STG_READY)
+		sm_dbgprintf("%s continue trajectory at t=%d: ", ctl->name, CHA_getChannelTime());
+
+	w_ret = calculate_motor_control(&setup, ctl);
+	if (w_ret == W_ERR && CHA_getTempo() > CHA_TEMPO_ONE)
+	{
+		// The datapoints fit the axis at their own tempo, so it is the faster tempo that does not.
+		// Back off in steps until the cycle fits, a jump to 100% would be heard.
+		tempo = CHA_getTempo();
+		while (w_ret == W_ERR && tempo > CHA_TEMPO_ONE)
 		{
-			// This is a new self-following trajectory to start. The motor has not been moving previously
-			setup.w_s = 0; // this is the start of a new trajectory, so start speed is 0
-			dbgprintf("%s Start trajectory of at t=%d: ", ctl->name, CHA_getChannelTime());
+			tempo -= tempo / SM_TEMPO_BACKOFF;
+			if (tempo < CHA_TEMPO_ONE)
+				tempo = CHA_TEMPO_ONE;
+			setup.delta_t0 = CHA_musicToRealTimeAt(datapoint[0].timediff, tempo);
+			setup.delta_t1 = CHA_musicToRealTimeAt(datapoint[1].timediff, tempo);
 			w_ret = calculate_motor_control(&setup, ctl);
-			if (w_ret == W_ERR)
-			{
-				// Could not fit the motion request
-				ctl->status = STG_ERROR;
-				dbgprintf("%s CALCULATION ERROR!", ctl->name);
-			}
-			else
-			{
-				ctl->status = STG_PREPARED;
-				STG_StartCycle(ctl);
-			}
-		}
-		else if (ctl->status == STG_NOT_PREPARED)
-		{
-			// This is a point in a trajectory and not a new one.
-			setup.w_s = ctl->active->w_finish; // set the start of this waiting cycle to the finishing speed of the currently active one
-			dbgprintf("%s continue trajectory at t=%d: ", ctl->name, CHA_getChannelTime());
-			w_ret = calculate_motor_control(&setup, ctl);
-			if (w_ret == W_ERR)
-			{
-				// Could not fit the motion request
-				ctl->status = STG_ERROR;
-				dbgprintf("%s CALCULATION ERROR!", ctl->name);
-			}
-			else
-			{
-				ctl->status = STG_PREPARED;
-			}
-			// Does not have to be started because the ISR will swap the waiting struct in at the right time itself
 		}
+		sm_dbgprintf("%s cannot follow the tempo, back to %d%%", ctl->name, (tempo * 100) >> 16);
+		CHA_limitTempo(tempo, ctl->q_time > 0 ? ctl->q_time : 0);
 	}
-
-	// Takes care of the referencing (homing) procedure.
-	if (ctl->motor.home_status == STG_AT_FIRST_CONTACT)
+	if (w_ret == W_ERR)
 	{
-		// Just waiting at the first contact-> move back to make the second
-		ctl->motor.home_status = STG_RETRACTING;
-		dbgprintf("Starting retracting move.");
-		SM_moveMotorRelative(ctl, RETRACTING_DISTANCE, SECOND_CONTACT_SPEED);
-	} else if (ctl->motor.home_status == STG_RETRACTING && ctl->status == STG_IDLE)
+		// Could not fit the motion request. Let the motor stop after the cycles that are queued already.
+		sm_dbgprintf("%s CALCULATION ERROR!", ctl->name);
+		CNT_INC(CNT_SM_CALC_ERRORS);
+		ctl->waiting->shutoff = 1;
+		STG_commitCycle(ctl);
+		ctl->status = STG_ERROR;
+	}
+	else if (STG_commitCycle(ctl) == SUCCESS)
 	{
-		// retracting move has been completed. Moving towards it again.
-		ctl->motor.home_status = STG_WAITING_SECOND_CONTACT;
-		dbgprintf("Moving towards for second contact.");
-		SM_moveMotorRelative(ctl, SECOND_CONTACT_DISTANCE, SECOND_CONTACT_SPEED);
-	} else if (ctl->motor.home_status == STG_WAITING_SECOND_CONTACT && ctl->status == STG_IDLE)
+		ctl->motor.w_scheduled = w_ret;
+	}
+	// Does not have to be started because the ISR will swap the queued cycle in at the right time itself
+
+	return ret;
+}
+
+/** @brief	Checks if one of the strings of the DAE apparatus has a vibrato or one
+ * 			is queued in its channel (a held note read now may reach into it)
+ *
+ *  @param 	(none)
+ *  @return 1 if so
+ */
+static int32_t vibrato_active (void)
+{
+	return VIB_isActive(NOTES_STRING_D) || VIB_isActive(NOTES_STRING_A) || VIB_isActive(NOTES_STRING_E)
+			|| CHA_getNumberDatapoint(cha_list[CHA_D_VIB_NR]) > 0
+			|| CHA_getNumberDatapoint(cha_list[CHA_A_VIB_NR]) > 0
+			|| CHA_getNumberDatapoint(cha_list[CHA_E_VIB_NR]) > 0;
+}
+
+/** @brief	Moves the two datapoints of the next cycle of the string axis by the vibrato
+ * 			of the D, A and E string (only one of them is played at a time), each at
+ * 			the time the axis will get there. The last point of a trajectory is not
+ * 			moved, so the axis ends on the note. The travel of the axis is not left.
+ * 			Every turn of the oscillation is a stop of the axis, so rate and depth
+ * 			are bound by the acceleration of the axis (about 5 Hz at 25 cent).
+ *
+ *  @param 	*ctl - string axis
+ *  @param 	*cha - its channel, last_point_time not yet moved past datapoint[0]
+ *  @param 	*datapoint - the two datapoints of the next cycle, changed
+ *  @return (none)
+ */
+static void add_vibrato (T_MOTOR_CONTROL *ctl, T_CHANNEL *cha, T_DTP_MOTOR *datapoint)
+{
+	uint32_t now = CHA_getChannelTime();
+	uint32_t t = cha->last_point_time;
+	uint32_t ahead;
+	int32_t i, cent, steps;
+
+	for (i = 0; i < 2; i++)
 	{
-		dbgprintf("Failed to reference, no second contact could be made.");
-		ctl->motor.home_status = STG_NOT_HOME;
+		// Several cycles are prepared at once, so each point needs its own time ahead
+		t += datapoint[i].timediff;
+		ahead = (t > now ? CHA_musicToRealTime(t - now) : 0);
+		cent = VIB_getOffsetAhead(NOTES_STRING_D, ahead) + VIB_getOffsetAhead(NOTES_STRING_A, ahead)
+				+ VIB_getOffsetAhead(NOTES_STRING_E, ahead);
+		if (cent == 0)
+			continue;
+
+		steps = datapoint[i].steps + (int32_t) lroundf(cent * SM_VIB_STEPS_PER_CENT);
+		if (steps < 0)
+			steps = 0;
+		if (steps > ctl->motor.max_travel)
+			steps = ctl->motor.max_travel;
+		datapoint[i].steps = steps;
 	}
+}
 
+/** @brief	Real time the axes of the DAE apparatus have queued ahead. A change of
+ * 			tempo reaches the music time only after it (see CHA_setTempo()).
+ *
+ *  @param 	(none)
+ *  @return [ms], the longest queue of the axes
+ */
+uint32_t SM_getQueueTime (void)
+{
+	uint32_t ret = 0;
+	int32_t i, q_time;
+
+	for (i = 0; i < SM_HOMING_AXIS; i++)
+	{
+		q_time = sm_homing_axis[i]->q_time;
+		if (q_time > 0 && (uint32_t) q_time > ret)
+			ret = q_time;
+	}
 	return ret;
 }
 
+/** @brief	Lowers the tempo when the mean speed of the next cycle at the current
+ * 			tempo would already reach w_max of the axis, and converts the cycle times
+ * 			again. Slower than the datapoints is always possible (speed scales with
+ * 			the tempo, acceleration with its square), so this is only needed above 100%.
+ * 			The margin leaves room for accelerating above the mean speed.
+ *
+ *  @param 	*setup - cycle setup, the times are updated
+ *  @param 	*ctl - motor the cycle is for
+ *  @param 	*datapoint - the two datapoints of the setup, in music time
+ *  @return (none)
+ */
+static void limit_tempo (T_SPT_CYCLESPEC *setup, T_MOTOR_CONTROL *ctl, const T_DTP_MOTOR *datapoint)
+{
+	real w_mean;
+	real w_allowed = ctl->motor.w_max * 0.8;
+
+	if (setup->delta_t0 <= 0)
+		return;
+	w_mean = abs(setup->delta_s0) * ctl->motor.alpha * 1000 / setup->delta_t0;
+	if (w_mean <= w_allowed)
+		return;
+
+	CHA_limitTempo((uint32_t) (CHA_getTempo() * w_allowed / w_mean), ctl->q_time > 0 ? ctl->q_time : 0);
+	setup->delta_t0 = CHA_musicToRealTime(datapoint[0].timediff);
+	setup->delta_t1 = CHA_musicToRealTime(datapoint[1].timediff);
+}
+
 /** @brief 	Prepares the next waiting struct according to the cycle setup
  * 			must not be given cycles with a cycle with t=0 which is impossible
  *
  *  @param *setup - steps over time for this and for the next cycle, plus start speed
- *  @param *ctl - pointer to motor handle. Here it finds the waitin struct.
+ *  @param *ctl - pointer to motor handle. Here it finds the waitin struct (next free slot of the cycle queue).
  *  @return calculated passover speed (which is start speed of the next cycle's calculation
  */
 real calculate_motor_control (T_SPT_CYCLESPEC *setup, T_MOTOR_CONTROL *ctl)
@@ -456,36 +804,38 @@ real calculate_motor_control (T_SPT_CYCLESPEC *setup, T_MOTOR_CONTROL *ctl)
 	int32_t d_m_f; 				// Final mid acceleration direction (-1 or 1)
 	//int32_t d_e_f; 				// Final end acceleration direction (-1 or 1)
 
+#if (DBG_PLANNER_PRINTS)
 	// TODO: do this properly
 	int dbp=0;
 	if (ctl == &x_dae_motor)
 		dbp = 0;
+#endif
 
 	// Equivalent acceleration indices
 	int32_t	neq_mean0;
 	int32_t neq_mean1;
 
 	// Information of last cycle (how it performed during execution)
-	dbgprintfc(dbp, " --------- Information from last completed -----------------");
-	dbgprintfc(dbp, "Timing error: %f ms (%d ticks)", (real) ctl->motor.c_err * 1000 / F_TIMER, ctl->motor.c_err);
-	dbgprintfc(dbp, "Overshoot on: %d Overshoot off: %d", ctl->motor.overshoot_on, ctl->motor.overshoot_off);
+	sm_dbgprintfc(dbp, " --------- Information from last completed -----------------");
+	sm_dbgprintfc(dbp, "Timing error: %f ms (%d ticks)", (real) ctl->motor.c_err * 1000 / F_TIMER, ctl->motor.c_err);
+	sm_dbgprintfc(dbp, "Overshoot on: %d Overshoot off: %d", ctl->motor.overshoot_on, ctl->motor.overshoot_off);
 
 
 	// ------------ start calculations ------------------------------------
-	dbgprintfc(dbp, " --------- Start motor control calculations for %s -------", ctl->name);
+	sm_dbgprintfc(dbp, " --------- Start motor control calculations for %s -------", ctl->name);
 
 
 	// Print out input parameters for test purposes
-	dbgprintfc(dbp, "delta_s0: %d steps  in   delta_t0: %d ms", setup->delta_s0, setup->delta_t0);
-	dbgprintfc(dbp, "delta_s1: %d steps  in   delta_t1: %d ms", setup->delta_s1, setup->delta_t1);
-	dbgprintfc(dbp, "start speed: %f rad/s", setup->w_s);
+	sm_dbgprintfc(dbp, "delta_s0: %d steps  in   delta_t0: %d ms", setup->delta_s0, setup->delta_t0);
+	sm_dbgprintfc(dbp, "delta_s1: %d steps  in   delta_t1: %d ms", setup->delta_s1, setup->delta_t1);
+	sm_dbgprintfc(dbp, "start speed: %f rad/s", setup->w_s);
 
 	// First, decide some important things. Are all inputs valid?
 	if (delta_t0 < 0 || delta_t1 < 0)
 	{
 		// negative times are crap. Stop stepper and report error
-		dbgprintfc(1, "Input error: negative times");
-		ctl->waiting = &stepper_shutoff;
+		sm_dbgprintfc(1, "Input error: negative times");
+		ctl->waiting->shutoff = 1;
 		return 0;
 	}
 
@@ -493,8 +843,8 @@ real calculate_motor_control (T_SPT_CYCLESPEC *setup, T_MOTOR_CONTROL *ctl)
 	if (delta_s0 == 0)
 	{
 		// This is a zero-cycle. No need for further calculation of anything.
-		dbgprintfc(1, "%s Detected zero-cycle. Motor-control stop.", ctl->name);
-		ctl->waiting = &stepper_shutoff;
+		sm_dbgprintfc(1, "%s Detected zero-cycle. Motor-control stop.", ctl->name);
+		ctl->waiting->shutoff = 1;
 		return 0; // Passover speed after a stop-cycle is 0
 
 	}
@@ -577,13 +927,13 @@ real calculate_motor_control (T_SPT_CYCLESPEC *setup, T_MOTOR_CONTROL *ctl)
 		{
 			dw_s = -acc;
 			d_s[i] = -1;
-			dbgprintfc(dbp, "Start down");
+			sm_dbgprintfc(dbp, "Start down");
 		}
 		else
 		{
 			dw_s = acc;
 			d_s[i] = 1;
-			dbgprintfc(dbp, "Start up");
+			sm_dbgprintfc(dbp, "Start up");
 		}
 
 		// chose right direction for mid acceleration (passover)
@@ -591,13 +941,13 @@ real calculate_motor_control (T_SPT_CYCLESPEC *setup, T_MOTOR_CONTROL *ctl)
 		{
 			dw_m = -acc;
 			d_m[i] = -1;
-			dbgprintfc(dbp, "Middle down");
+			sm_dbgprintfc(dbp, "Middle down");
 		}
 		else
 		{
 			dw_m = acc;
 			d_m[i] = 1;
-			dbgprintfc(dbp, "Middle up");
+			sm_dbgprintfc(dbp, "Middle up");
 		}
 
 		// Its always end up for now, because it is not used later anyways.
@@ -620,12 +970,12 @@ real calculate_motor_control (T_SPT_CYCLESPEC *setup, T_MOTOR_CONTROL *ctl)
 			if (-R_ERR < b0 && b0 < R_ERR) // Means b0 == 0
 			{
 				// Speed cannot be calculated
-				dbgprintfc(1, "ERROR: Linear 0 (loop %d)", i);
+				sm_dbgprintfc(1, "ERROR: Linear 0 (loop %d)", i);
 				return W_ERR;
 			}
 			else
 			{
-				dbgprintfc(dbp, "Linear 0 ok");
+				sm_dbgprintfc(dbp, "Linear 0 ok");
 				w_t0[i] = -c0/b0;
 			}
 		}
@@ -634,12 +984,12 @@ real calculate_motor_control (T_SPT_CYCLESPEC *setup, T_MOTOR_CONTROL *ctl)
 			disk0 = b0*b0-4*a0*c0;
 			if (disk0 > 0)
 			{
-				dbgprintfc(dbp, "Root 0 ok");
+				sm_dbgprintfc(dbp, "Root 0 ok");
 				w_t0[i] = (-b0 + sqrt(disk0))/(2*a0);
 			}
 			else
 			{
-				dbgprintfc(1, "ERROR: Root 0 (loop %d)", i);
+				sm_dbgprintfc(1, "ERROR: Root 0 (loop %d)", i);
 				return W_ERR;
 			}
 		}
@@ -650,12 +1000,12 @@ real calculate_motor_control (T_SPT_CYCLESPEC *setup, T_MOTOR_CONTROL *ctl)
 			if (-R_ERR < b1 && b1 < R_ERR) // Means b0 == 0
 			{
 				// Speed cannot be calculated
-				dbgprintfc(1, "ERROR: Linear 1 (loop %d)", i);
+				sm_dbgprintfc(1, "ERROR: Linear 1 (loop %d)", i);
 				return W_ERR;
 			}
 			else
 			{
-				dbgprintfc(dbp, "Linear 1 ok");
+				sm_dbgprintfc(dbp, "Linear 1 ok");
 				w_t1[i] = -c1/b1;
 			}
 		}
@@ -664,12 +1014,12 @@ real calculate_motor_control (T_SPT_CYCLESPEC *setup, T_MOTOR_CONTROL *ctl)
 			disk1 = b1*b1-4*a1*c1;
 			if (disk1 > 0)
 			{
-				dbgprintfc(dbp, "Root 1 ok");
+				sm_dbgprintfc(dbp, "Root 1 ok");
 				w_t1[i] = (-b1 + sqrt(disk1))/(2*a1);
 			}
 			else
 			{
-				dbgprintfc(1, "ERROR: Root 1 (loop %d)", i);
+				sm_dbgprintfc(1, "ERROR: Root 1 (loop %d)", i);
 				return W_ERR;
 			}
 		}
@@ -724,12 +1074,12 @@ real calculate_motor_control (T_SPT_CYCLESPEC *setup, T_MOTOR_CONTROL *ctl)
 
 	if (w_t0_f < w_max)
 	{
-		dbgprintfc(dbp, "Found ideal w_m = %f, w_t0 = %f, w_t1 = %f", w_m_f, w_t0_f, w_t1_f);
+		sm_dbgprintfc(dbp, "Found ideal w_m = %f, w_t0 = %f, w_t1 = %f", w_m_f, w_t0_f, w_t1_f);
 	}
 	else
 	{
-		dbgprintfc(1, "ERROR: Found nothing possible! (w_m = %f)", w_m_f);
-		ctl->waiting = &stepper_shutoff;
+		sm_dbgprintfc(1, "ERROR: Found nothing possible! (w_m = %f)", w_m_f);
+		ctl->waiting->shutoff = 1;
 		return 0;
 	}
 
@@ -738,6 +1088,7 @@ real calculate_motor_control (T_SPT_CYCLESPEC *setup, T_MOTOR_CONTROL *ctl)
 	ctl->waiting->c_t = alpha/(w_t0_f / F_TIMER) * FACTOR;
 	// c_hw is set by ISR
 	ctl->waiting->c_ideal = delta_t0 * F_TIMER;
+	ctl->waiting->t_ideal = setup->delta_t0; // [ms], delta_t0 is in seconds here
 	ctl->waiting->c_real = 0;
 	ctl->waiting->c_hwr = 0; // That needs to be initialized for the ISR to calculate the first step. Then it is overwritten in the ISR.
 
@@ -748,6 +1099,7 @@ real calculate_motor_control (T_SPT_CYCLESPEC *setup, T_MOTOR_CONTROL *ctl)
 	// n is set by ISR
 	ctl->waiting->neq_on = w_s*w_s/(2*alpha*dw_s);
 	ctl->waiting->neq_off = w_t0_f*w_t0_f/(2*alpha*dw_m);
+	ctl->waiting->neq_stop = -w_t0_f*w_t0_f/(2*alpha*acc); // keeps the stop cycle ready for this target speed
 	ctl->waiting->shutoff = 0; // unless its a 0-cycle
 	ctl->waiting->running = 0; // Cycle is not activated yet
 	ctl->waiting->no_accel = slow0;
@@ -766,13 +1118,13 @@ real calculate_motor_control (T_SPT_CYCLESPEC *setup, T_MOTOR_CONTROL *ctl)
 		ctl->waiting->s_off = delta_s0;
 	}
 
-	dbgprintfc(dbp, "s_total: %d s_on: %d s_off: %d", ctl->waiting->s_total, ctl->waiting->s_on, ctl->waiting->s_off);
-	dbgprintfc(dbp, "neq_on: %d neq_off: %d ", ctl->waiting->neq_on, ctl->waiting->neq_off);
-	dbgprintfc(dbp, "c_t: %d", ctl->waiting->c_t);
-	dbgprintfc(dbp, "d_on: %d d_off: %d", ctl->waiting->d_on, ctl->waiting->d_off);
-	dbgprintfc(dbp, "dir_abs: %d slow: %d", ctl->waiting->dir_abs, ctl->waiting->no_accel);
+	sm_dbgprintfc(dbp, "s_total: %d s_on: %d s_off: %d", ctl->waiting->s_total, ctl->waiting->s_on, ctl->waiting->s_off);
+	sm_dbgprintfc(dbp, "neq_on: %d neq_off: %d ", ctl->waiting->neq_on, ctl->waiting->neq_off);
+	sm_dbgprintfc(dbp, "c_t: %d", ctl->waiting->c_t);
+	sm_dbgprintfc(dbp, "d_on: %d d_off: %d", ctl->waiting->d_on, ctl->waiting->d_off);
+	sm_dbgprintfc(dbp, "dir_abs: %d slow: %d", ctl->waiting->dir_abs, ctl->waiting->no_accel);
 
-	dbgprintfc(dbp, "-------- Finished motor control calculations -------------");
+	sm_dbgprintfc(dbp, "-------- Finished motor control calculations -------------");
 	// And thats it. Wow.
 	return w_m_f;
 }
@@ -800,7 +1152,7 @@ int32_t SM_calculate_minimal_time (int32_t delta_s, real w_start, real w_stop, r
 	// Some sanity checking on the input
 	if (fabs(w_start) > w_motor_max || fabs(w_stop) > w_motor_max || fabs(w_max) > w_motor_max)
 	{
-		dbgprintf("Required silly start/stop speeds!");
+		sm_dbgprintf("Required silly start/stop speeds!");
 		return 0;
 	}
 
@@ -825,7 +1177,7 @@ int32_t SM_calculate_minimal_time (int32_t delta_s, real w_start, real w_stop, r
 			w_m = sqrt(disk);
 		else
 		{
-			dbgprintf("Minimum Time finding root error!");
+			sm_dbgprintf("Minimum Time finding root error!");
 			return 0;
 		}
 
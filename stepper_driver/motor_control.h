@@ -26,8 +26,24 @@ typedef struct
 	real				w_s;
 } T_SPT_CYCLESPEC; // meaning steps per time setup
 
+// Referencing of all axis at once (SM_referenceAll)
+#define SM_HOMING_AXIS		3
+typedef struct
+{
+	int32_t		active;		// 1 while the axis of the last SM_referenceAll() are not all done
+	uint32_t	start;		// HAL tick at the start
+	uint32_t	time;		// Duration until the last axis was done [ms]
+	uint8_t		homed;		// Bit per axis (x, y, z) that found its home in the last run
+}T_SM_HOMING;
+
+extern T_SM_HOMING sm_homing;
+
 // Struct containing test motor data
 #define TEST_POINTS			9
+extern int32_t test_positions_xy[TEST_POINTS];
+extern int32_t test_times_xy[TEST_POINTS];
+extern int32_t test_positions_z[TEST_POINTS];
+extern int32_t test_times_z[TEST_POINTS];
 
 
 // PROTOTYPES
@@ -36,11 +52,15 @@ void SM_setMotorReady (T_MOTOR_CONTROL *ctl);
 int32_t SM_updateMotor(T_MOTOR_CONTROL *ctl, T_CHANNEL *cha);
 void SM_restart_testcylce (void);
 void SM_hardstop (void);
-void SM_softstop (void);
+void SM_softstop (uint32_t request);
 int32_t SM_calculate_minimal_time (int32_t delta_s, real w_start, real w_stop, real w_max, T_STEPPER_STATE *motor);
 uint8_t SM_moveMotorToLocation(T_MOTOR_CONTROL *ctl, int32_t position, real speed);
 uint8_t SM_moveMotorRelative(T_MOTOR_CONTROL *ctl, int32_t position_difference, real speed);
 void SM_referenceMotor(T_MOTOR_CONTROL *ctl, real speed);
+uint8_t SM_referenceAll(void);
+real SM_homingSpeed(T_STEPPER_STATE *motor);
+uint32_t SM_getQueueTime (void);
+real calculate_motor_control (T_SPT_CYCLESPEC *setup, T_MOTOR_CONTROL *ctl) ITCM_TEXT;
 
 
 # endif // MOTOR_CONTROL_H_
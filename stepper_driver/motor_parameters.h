@@ -24,10 +24,17 @@
 #define XY_ALPHA				((double) 2 * PI / (XY_STEPS_PER_REV * XY_STEP_MODE))	// This thing is used sometimes, easier that way
 #define XY_NOMSPEED				(15.0F)		// Nominal travel speed for initializing axis etc.
 
+// Trajectory planning
+#define SM_SEGMENT_SAMPLE_TIME		40		// [ms] Hermite segments in the channels are sampled into cycles of this length
+#define SM_TEMPO_BACKOFF			8		// a cycle the axis cannot follow lowers the tempo by 1/8 per try, down to 100%
+#define SM_VIB_STEPS_PER_CENT		(1.0F)	// [steps/cent] finger travel of the string axis for the vibrato, taken as constant along the string
+
 // Homing parameters
 #define RETRACTING_DISTANCE			100 		// Number of steps it retracts after first contact
 #define SECOND_CONTACT_DISTANCE		-120	// Number of steps it moves towards limit switch again for second contact
 #define SECOND_CONTACT_SPEED		2		// speed it makes the second contact (in rad/s)
+#define HOMING_DECEL_DISTANCE		200		// Steps behind the limit switch the fast first approach of SM_referenceAll() may use to stop. Limits its speed.
+#define HOMING_SECOND_CONTACT		0		// 1: a soft stopped first contact is followed by the slow second contact as well. Not needed, the contact position is latched.
 
 // -------- DAE apparatus -------------------------
 #define TIMER1_CHANNEL1_MOTOR				(&x_dae_motor)
@@ -51,6 +58,8 @@
 #define X_DAE_HW_OC_ACTIVE_MASK				TIM_CCMR1_OC1M_0
 #define X_DAE_HW_OC_INACTIVE_MASK		 	TIM_CCMR1_OC1M_1
 #define X_DAE_HW_OC_FORCED_INACTIVE_MASK	TIM_CCMR1_OC1M_2
+#define X_DAE_HW_OC_TOGGLE_MASK				(TIM_CCMR1_OC1M_0 | TIM_CCMR1_OC1M_1)
+#define X_DAE_HW_STEP_MODE					STG_STEP_PULSE		// STG_STEP_TOGGLE only if the driver steps on both edges
 
 // hardware mapping of Y_DAE-motor
 #define Y_DAE_HW_FLIP_DIR					1 // if -1, it changes direction
@@ -63,6 +72,8 @@
 #define Y_DAE_HW_OC_ACTIVE_MASK				TIM_CCMR1_OC2M_0
 #define Y_DAE_HW_OC_INACTIVE_MASK		 	TIM_CCMR1_OC2M_1
 #define Y_DAE_HW_OC_FORCED_INACTIVE_MASK	TIM_CCMR1_OC2M_2
+#define Y_DAE_HW_OC_TOGGLE_MASK				(TIM_CCMR1_OC2M_0 | TIM_CCMR1_OC2M_1)
+#define Y_DAE_HW_STEP_MODE					STG_STEP_PULSE		// STG_STEP_TOGGLE only if the driver steps on both edges
 
 // hardware mapping of Z_DAE-motor
 #define Z_DAE_HW_FLIP_DIR					1 	// If set to -1, the direction is flipped, it runs backwards.
@@ -75,6 +86,8 @@
 #define Z_DAE_HW_OC_ACTIVE_MASK				TIM_CCMR2_OC3M_0
 #define Z_DAE_HW_OC_INACTIVE_MASK		 	TIM_CCMR2_OC3M_1
 #define Z_DAE_HW_OC_FORCED_INACTIVE_MASK	TIM_CCMR2_OC3M_2
+#define Z_DAE_HW_OC_TOGGLE_MASK				(TIM_CCMR2_OC3M_0 | TIM_CCMR2_OC3M_1)
+#define Z_DAE_HW_STEP_MODE					STG_STEP_PULSE		// STG_STEP_TOGGLE only if the driver steps on both edges
 
 
 // -------- GDA apparatus -------------------------
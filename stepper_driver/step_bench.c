@@ -0,0 +1,345 @@
+/** @file step_bench.c
+ *  @brief Step rate benchmark (see step_bench.h)
+ *
+ *  Every level hands the step ISR one cycle of constant step interval per axis
+ *  (no_accel, the outputs are off anyway) and a stop cycle behind it, then starts the
+ *  axes with STG_StartCycleGroup like the planner does. The planner leaves motors that
+ *  are prepared alone, so it does not get in between. BEN_update() is called from the
+ *  main loop and goes on to the next level when the axes are idle again.
+ *
+ *  @author Josef Heel
+	@date October 18th, 2026
+ */
+
+#include "main.h"
+#include "debug_tools.h"
+#include "channels.h"
+#include "motor_control.h"
+#include "scheduler.h"
+#include "step_bench.h"
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+T_BEN_STATE ben;
+
+// Axes in the order they are added to the benchmark
+static T_MOTOR_CONTROL * const ben_axis[BEN_AXES] = {&x_dae_motor, &y_dae_motor, &z_dae_motor};
+
+// PROTOTYPES
+static void ben_startMode (E_STG_STEP_MODE mode);
+static void ben_startAxes (int32_t axes);
+static void ben_startLevel (void);
+static void ben_queueLevel (T_MOTOR_CONTROL *ctl);
+static int32_t ben_levelDone (void);
+static void ben_evaluateLevel (void);
+static void ben_finish (void);
+static void ben_enableOutput (T_MOTOR_CONTROL *ctl, int32_t enable);
+
+/** @brief  Starts the benchmark. Only when nothing is played and all axis stand still.
+ * 			The host polls the result with COMM_STEPBENCH.
+ *
+ *  @param (none)
+ *  @return SUCCESS or ERROR if busy
+ */
+ErrorStatus BEN_start (void)
+{
+	int32_t i;
+
+	if (ben.state == BEN_RUNNING || CHA_getIfTimeActive() || sm_homing.active)
+		return ERROR;
+	for (i = 0; i < BEN_AXES; i++)
+	{
+		if (ben_axis[i]->status != STG_IDLE)
+			return ERROR;
+	}
+
+	memset(&ben, 0, sizeof(ben));
+	for (i = 0; i < BEN_AXES; i++)
+	{
+		ben.saved_pos[i] = ben_axis[i]->motor.pos;
+		ben.saved_mode[i] = ben_axis[i]->motor.hw.step_mode;
+		ben_enableOutput(ben_axis[i], 0);
+	}
+
+	dbgprintf("Step rate benchmark started, step outputs are off");
+	ben.state = BEN_RUNNING;
+	ben_startMode(STG_STEP_PULSE);
+	return SUCCESS;
+}
+
+/** @brief  Runs the benchmark: goes on to the next level when the axes are done.
+ * 			Called from the main loop.
+ *
+ *  @param (none)
+ *  @return (none)
+ */
+void BEN_update (void)
+{
+	if (ben.state != BEN_RUNNING)
+		return;
+
+	if (!ben_levelDone())
+		return;
+
+	ben_evaluateLevel();
+	if (ben.result[ben.mode][ben.axes - 1].fail_rate == 0 && ben.rate < ben.cap)
+	{
+		ben.rate = (int32_t) (ben.rate * BEN_RATE_GROWTH);
+		if (ben.rate > ben.cap)
+			ben.rate = ben.cap;
+		ben_startLevel();
+	}
+	else if (ben.axes < BEN_AXES)
+	{
+		ben_startAxes(ben.axes + 1);
+	}
+	else if (ben.mode + 1 < STG_STEP_MODES)
+	{
+		ben_startMode(ben.mode + 1);
+	}
+	else
+	{
+		ben_finish();
+	}
+}
+
+/** @brief  Switches all axes to a step mode and starts its levels with one axis.
+ * 			The axes stand still between the levels.
+ *
+ *  @param mode - step mode
+ *  @return (none)
+ */
+static void ben_startMode (E_STG_STEP_MODE mode)
+{
+	int32_t i;
+	uint32_t lock;
+
+	ben.mode = mode;
+
+	// A pulse takes STEP_PULSE_WIDTH and needs at least as long low afterwards
+	ben.cap = mode == STG_STEP_PULSE ? F_TIMER / (2 * STEP_PULSE_WIDTH) : BEN_RATE_MAX;
+
+	lock = SCH_lockPlanner();
+	for (i = 0; i < BEN_AXES; i++)
+		STG_setStepMode(ben_axis[i], mode);
+	SCH_unlockPlanner(lock);
+	ben_startAxes(1);
+}
+
+/** @brief  Starts the levels for a number of axes at BEN_RATE_START
+ *
+ *  @param axes - the first that many of ben_axis run
+ *  @return (none)
+ */
+static void ben_startAxes (int32_t axes)
+{
+	int32_t i;
+	real cap = INFINITY;
+
+	ben.axes = axes;
+
+	// Only for comparison: the planner limits the tempo of a piece when the mean speed of a cycle gets above 80% of w_max
+	for (i = 0; i < axes; i++)
+		cap = fmin(cap, 0.8 * STG_maxSpeed(&ben_axis[i]->motor, ben_axis[i]->motor.acc) / ben_axis[i]->motor.alpha);
+	ben.result[ben.mode][axes - 1].cap_rate = (uint32_t) cap;
+
+	ben.rate = BEN_RATE_START < ben.cap ? BEN_RATE_START : ben.cap;
+	ben_startLevel();
+}
+
+/** @brief  Sets up a level: all running axes step at ben.rate for BEN_HOLD_MS,
+ * 			starting at the current positions at the same timer tick.
+ *
+ *  @param (none)
+ *  @return (none)
+ */
+static void ben_startLevel (void)
+{
+	int32_t i;
+	uint32_t lock;
+
+	ben.steps = ben.rate * BEN_HOLD_MS / 1000;
+	for (i = 0; i < ben.axes; i++)
+	{
+		ben.start_pos[i] = ben_axis[i]->motor.pos;
+		ben.overruns[i] = ben_axis[i]->tim_overruns;
+		ben.underruns[i] = ben_axis[i]->q_underruns;
+		ben.isr_calls[i] = ben_axis[i]->isr_calls;
+	}
+	ben.step_cycles = debug_load.cycles[DEBUG_LOAD_STEP];
+	ben.start = HAL_GetTick();
+	ben.levels++;
+
+	lock = SCH_lockPlanner();
+	for (i = 0; i < ben.axes; i++)
+		ben_queueLevel(ben_axis[i]);
+	STG_StartCycleGroup((T_MOTOR_CONTROL **) ben_axis, ben.axes);
+	SCH_unlockPlanner(lock);
+}
+
+/** @brief  Queues the cycle of the current level and the stop behind it. Only with
+ * 			the planner locked and the motor idle.
+ *
+ *  @param *ctl - motor
+ *  @return (none)
+ */
+static void ben_queueLevel (T_MOTOR_CONTROL *ctl)
+{
+	T_ISR_CONTROL *isr;
+	int32_t *c_table = ctl->ctl_queue[0].c_table;
+
+	STG_flushQueue(ctl);
+
+	isr = ctl->waiting;
+	memset(isr, 0, sizeof(T_ISR_CONTROL));
+	isr->c_t = (int32_t) ((int64_t) F_TIMER * FACTOR / ben.rate);
+	isr->c = isr->c_t;
+	isr->c_ideal = ben.steps * (isr->c_t / FACTOR);
+	isr->t_ideal = BEN_HOLD_MS;
+	isr->s_total = ben.steps;
+	isr->s_off = ben.steps;
+	isr->no_accel = 1;
+	isr->dir_abs = 1;
+	isr->d_on = 1;
+	isr->d_off = -1;
+	isr->c_table = c_table;
+	isr->w_finish = 0;
+	STG_commitCycle(ctl);
+
+	isr = ctl->waiting;
+	memset(isr, 0, sizeof(T_ISR_CONTROL));
+	isr->shutoff = 1;
+	isr->dir_abs = 1;
+	isr->c_table = c_table;
+	STG_commitCycle(ctl);
+
+	ctl->motor.scheduled_pos = ctl->motor.pos + ben.steps;
+	ctl->status = STG_READY;
+}
+
+/** @brief  Checks if the level is over: the axes stand still. A level that takes
+ * 			much longer than planned is stopped.
+ *
+ *  @param (none)
+ *  @return 1 if done
+ */
+static int32_t ben_levelDone (void)
+{
+	int32_t i;
+	int32_t done = 1;
+
+	for (i = 0; i < ben.axes; i++)
+	{
+		if (ben_axis[i]->status != STG_IDLE)
+			done = 0;
+	}
+	if (!done && HAL_GetTick() - ben.start > BEN_HOLD_MS + BEN_TIMEOUT_MS)
+	{
+		dbgprintf("Step rate benchmark: level at %d steps/s did not finish", ben.rate);
+		for (i = 0; i < ben.axes; i++)
+			STG_hardstop(ben_axis[i]);
+		done = 1;
+	}
+	return done;
+}
+
+/** @brief  Counts what went wrong in the level that just ended. The first level
+ * 			with a problem ends the levels of this number of axes.
+ *
+ *  @param (none)
+ *  @return (none)
+ */
+static void ben_evaluateLevel (void)
+{
+	T_BEN_RESULT *result = &ben.result[ben.mode][ben.axes - 1];
+	uint32_t misses = 0, underruns = 0, errors = 0;
+	uint32_t steps = 0, calls = 0;
+	uint64_t level_cycles = (uint64_t) (HAL_GetTick() - ben.start) * (SystemCoreClock / 1000);
+	uint32_t step_cycles = debug_load.cycles[DEBUG_LOAD_STEP] - ben.step_cycles;
+	int32_t i;
+	uint32_t lock;
+
+	for (i = 0; i < ben.axes; i++)
+	{
+		misses += ben_axis[i]->tim_overruns - ben.overruns[i];
+		underruns += ben_axis[i]->q_underruns - ben.underruns[i];
+		steps += abs(ben_axis[i]->motor.pos - ben.start_pos[i]);
+		calls += ben_axis[i]->isr_calls - ben.isr_calls[i];
+		if (ben_axis[i]->status == STG_ERROR || ben_axis[i]->motor.pos != ben.start_pos[i] + ben.steps)
+		{
+			errors++;
+			lock = SCH_lockPlanner();
+			STG_flushQueue(ben_axis[i]);
+			ben_axis[i]->status = STG_IDLE;
+			ben_axis[i]->motor.scheduled_pos = ben_axis[i]->motor.pos;
+			SCH_unlockPlanner(lock);
+		}
+	}
+
+	dbgprintf("Step rate benchmark: %s, %d axis at %d steps/s: %d misses, %d underruns, %d errors, %d interrupts for %d steps",
+			ben.mode == STG_STEP_PULSE ? "pulse" : "toggle", ben.axes, ben.rate, misses, underruns, errors, calls, steps);
+
+	if (misses == 0 && underruns == 0 && errors == 0)
+	{
+		result->safe_rate = ben.rate;
+		result->isr_per_step = steps > 0 ? (uint16_t) ((uint64_t) calls * 100 / steps) : 0;
+		result->step_load = level_cycles > 0 ? (uint16_t) ((uint64_t) step_cycles * 1000 / level_cycles) : 0;
+	}
+	else
+	{
+		result->fail_rate = ben.rate;
+		result->misses = misses > 0xFFFF ? 0xFFFF : misses;
+		result->underruns = underruns > 0xFFFF ? 0xFFFF : underruns;
+		result->errors = errors;
+	}
+}
+
+/** @brief  Puts the axes back as they were before the benchmark and reports the result
+ *
+ *  @param (none)
+ *  @return (none)
+ */
+static void ben_finish (void)
+{
+	int32_t i;
+	uint32_t lock;
+
+	lock = SCH_lockPlanner();
+	for (i = 0; i < BEN_AXES; i++)
+	{
+		ben_axis[i]->motor.pos = ben.saved_pos[i];
+		ben_axis[i]->motor.scheduled_pos = ben.saved_pos[i];
+		STG_setStepMode(ben_axis[i], ben.saved_mode[i]);
+		ben_enableOutput(ben_axis[i], 1);
+	}
+	SCH_unlockPlanner(lock);
+
+	for (i = 0; i < BEN_AXES; i++)
+	{
+		dbgprintf("Step rate benchmark: %d axis safe up to %d / %d steps/s with pulse / toggle (failed at %d / %d, planner limit %d)",
+				i + 1, ben.result[STG_STEP_PULSE][i].safe_rate, ben.result[STG_STEP_TOGGLE][i].safe_rate,
+				ben.result[STG_STEP_PULSE][i].fail_rate, ben.result[STG_STEP_TOGGLE][i].fail_rate, ben.result[STG_STEP_PULSE][i].cap_rate);
+		dbgprintf("                      interrupts per step %d.%02d / %d.%02d, step ISR load %d / %d permille",
+				ben.result[STG_STEP_PULSE][i].isr_per_step / 100, ben.result[STG_STEP_PULSE][i].isr_per_step % 100,
+				ben.result[STG_STEP_TOGGLE][i].isr_per_step / 100, ben.result[STG_STEP_TOGGLE][i].isr_per_step % 100,
+				ben.result[STG_STEP_PULSE][i].step_load, ben.result[STG_STEP_TOGGLE][i].step_load);
+	}
+	ben.state = BEN_DONE;
+}
+
+/** @brief  Switches the step output of a motor on or off. Off, the timer channel
+ * 			keeps running with its interrupts, but the pin is not driven.
+ *
+ *  @param *ctl - motor
+ *  @param enable - 1 on, 0 off
+ *  @return (none)
+ */
+static void ben_enableOutput (T_MOTOR_CONTROL *ctl, int32_t enable)
+{
+	// TIM_CHANNEL_1..4 are 0, 4, 8, 12, just like the positions of CC1E..CC4E
+	if (enable)
+		ctl->motor.hw.timer->Instance->CCER |= TIM_CCER_CC1E << ctl->motor.hw.channel;
+	else
+		ctl->motor.hw.timer->Instance->CCER &= ~(TIM_CCER_CC1E << ctl->motor.hw.channel);
+}
@@ -0,0 +1,84 @@
+/** @file step_bench.h
+ *  @brief Step rate benchmark: how fast the axes can step together before the step ISR
+ *  		falls behind
+ *
+ *  The step ISR is driven directly: every level queues one synthetic cycle of constant
+ *  step interval per axis and starts the axes together, first x alone, then x and y, then
+ *  all three. Neither the channels nor the planner are involved, so the rates go on beyond
+ *  what the planner can give an axis (w_max, W_ERR) up to what the timer output allows.
+ *  The step outputs are disabled meanwhile, so the motors do not move, and the positions
+ *  are restored at the end. A level fails if a compare value was in the past already
+ *  (tim_overruns), the cycle queue ran empty (q_underruns) or an axis did not end up where
+ *  it should. For every number of axes the highest rate that passed is kept.
+ *
+ *  All of that is done once with the pulses and once with the toggling step output
+ *  (E_STG_STEP_MODE), so the two can be compared: besides the rates, the interrupts per
+ *  step and the CPU share of the step ISR of the last level that passed are kept.
+ *
+ *  While the benchmark runs, the commands that move the axes, change their parameters or
+ *  erase flash are refused (see communication.c).
+ *
+ *  @author Josef Heel
+	@date October 18th, 2026
+ */
+
+#ifndef STEP_BENCH_H_
+#define STEP_BENCH_H_
+
+#include "main.h"
+#include "step_generation.h"
+
+#define BEN_AXES			3			// x, y, z of the DAE apparatus, in the order they are added
+#define BEN_RATE_START		1000		// [steps/s] first level
+#define BEN_RATE_GROWTH		1.5			// rate of the next level, relative to the last one
+#define BEN_RATE_MAX		200000		// [steps/s] last level with the toggling output. With pulses the pulse may take half the period at most.
+#define BEN_HOLD_MS			200			// [ms] duration of every level
+#define BEN_TIMEOUT_MS		2000		// [ms] a level that is not done this long after its end failed
+
+typedef enum
+{
+	BEN_NOT_RUN = 0,
+	BEN_RUNNING,
+	BEN_DONE
+}E_BEN_STATE;
+
+// Result for one number of axes, all little endian
+typedef struct __attribute__((__packed__))
+{
+	uint32_t safe_rate;		// highest rate per axis that passed [steps/s], 0 if none did
+	uint32_t fail_rate;		// rate of the level that failed [steps/s], 0 if everything passed up to the last level
+	uint32_t cap_rate;		// highest rate the planner can give these axes [steps/s], for comparison, the levels go beyond it
+	uint16_t misses;		// compare values in the past in the failed level
+	uint16_t underruns;		// cycle queue underruns in the failed level
+	uint8_t  errors;		// axes that ended in error or off their target in the failed level
+	uint16_t isr_per_step;	// step ISR executions per step in the last level that passed [1/100]
+	uint16_t step_load;		// CPU share of the step ISR in the last level that passed [1/1000], 0 without DBG_CPU_LOAD
+}T_BEN_RESULT;
+
+typedef struct
+{
+	E_BEN_STATE state;
+	E_STG_STEP_MODE mode;			// step mode of the current level
+	int32_t  axes;					// number of axes running in the current level
+	int32_t  rate;					// [steps/s] of the current level
+	int32_t  cap;					// [steps/s] last level of the step mode
+	int32_t  steps;					// steps of every axis in the current level
+	int32_t  levels;				// levels run so far
+	uint32_t start;					// HAL tick at the start of the level
+	int32_t  start_pos[BEN_AXES];	// position at the start of the level
+	uint32_t overruns[BEN_AXES];	// tim_overruns at the start of the level
+	uint32_t underruns[BEN_AXES];	// q_underruns at the start of the level
+	uint32_t isr_calls[BEN_AXES];	// isr_calls at the start of the level
+	uint32_t step_cycles;			// CPU cycles of the step ISR at the start of the level (debug_load)
+	int32_t  saved_pos[BEN_AXES];	// restored at the end
+	E_STG_STEP_MODE saved_mode[BEN_AXES];
+	T_BEN_RESULT result[STG_STEP_MODES][BEN_AXES];	// result[mode][n-1] is for n axes
+}T_BEN_STATE;
+
+extern T_BEN_STATE ben;
+
+// PROTOTYPES
+ErrorStatus BEN_start (void);
+void BEN_update (void);
+
+#endif /* STEP_BENCH_H_ */
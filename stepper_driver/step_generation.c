@@ -17,12 +17,24 @@
 #include "stm32f7xx_it.h"
 #include "debug_tools.h"
 #include "step_generation.h"
+#include "motor_control.h"
 #include "motor_parameters.h"
+#include "scheduler.h"
+#include "counters.h"
 #include <math.h>
 #include <string.h>
+#include <stdlib.h>
 
-int32_t 	c_table_xy[C_TABLE_SIZE]; 		// contains timer preload values for each acceleration index n for all x and y axis
-int32_t 	c_table_z[C_TABLE_SIZE]; 		// Contains timer preload values for each acceleration index n for both z-axis
+// Everything the step ISR touches lives in DTCM, so it is never delayed by cache misses or bus contention.
+int32_t 	c_table_xy[C_TABLE_SIZE] DTCM_BSS; 		// contains timer preload values for each acceleration index n for all x and y axis
+int32_t 	c_table_z[C_TABLE_SIZE] DTCM_BSS; 		// Contains timer preload values for each acceleration index n for both z-axis
+
+// Global stepper state variables
+T_ISR_CONTROL stepper_shutoff DTCM_BSS;
+T_MOTOR_CONTROL x_dae_motor DTCM_BSS;
+T_MOTOR_CONTROL y_dae_motor DTCM_BSS;
+T_MOTOR_CONTROL z_dae_motor DTCM_BSS;
+T_STG_GROUP_STAT stg_group;
 
 // Human-readable names for motors to have a string in the motor handle for printf.
 char *x_dae_name = "X_DAE_MOTOR";
@@ -32,17 +44,20 @@ char *x_gda_name = "X_GDA_MOTOR";
 char *y_gda_name = "Y_GDA_MOTOR";
 char *z_gda_name = "Z_GDA_MOTOR";
 
-// Width of step pulse. Has basically no effect on CPU load, but should not be too short
-// in order for the ISR to finish before the next interrupt comes. currently set to 40us.
-#define STEP_PULSE_WIDTH 	F_TIMER/25000
+// Least time between reading the counter and the compare match the ISR sets up. Covers the write of the
+// compare register, a match closer than that could be missed and come only after a full timer revolution.
+#define STG_OVERRUN_MARGIN	(F_TIMER/2000000)
 
 // PROTOTYPES
-uint16_t step_calculations(T_ISR_CONTROL *isr);
 void xy_type_init(T_MOTOR_CONTROL *ctl);
 void z_type_init(T_MOTOR_CONTROL *ctl);
-void check_cycle_status(T_MOTOR_CONTROL *ctl);
-void accel_table_init(int32_t *array, uint32_t length, double acceleration, double alpha);
-static int32_t absolute(int32_t arg);
+void check_cycle_status(T_MOTOR_CONTROL *ctl) ITCM_TEXT;
+static int32_t absolute(int32_t arg) ITCM_TEXT;
+static void prepare_start(T_MOTOR_CONTROL *ctl);
+static void isr_update_toggle (T_MOTOR_CONTROL *ctl, uint16_t tim_cnt) ITCM_TEXT;
+static void isr_set_compare (T_MOTOR_CONTROL *ctl, uint16_t tim_cnt, int32_t wait) ITCM_TEXT;
+static void set_idle_output (T_MOTOR_CONTROL *ctl) ITCM_TEXT;
+static void isr_measure_stop (T_MOTOR_CONTROL *ctl) ITCM_TEXT;
 
 // FUNCTIONS
 
@@ -73,6 +88,8 @@ void STG_Init (void)
 	x_dae_motor.motor.hw.oc_active_mask = X_DAE_HW_OC_ACTIVE_MASK;
 	x_dae_motor.motor.hw.oc_inactive_mask = X_DAE_HW_OC_INACTIVE_MASK;
 	x_dae_motor.motor.hw.oc_forced_inactive_mask = X_DAE_HW_OC_FORCED_INACTIVE_MASK;
+	x_dae_motor.motor.hw.oc_toggle_mask = X_DAE_HW_OC_TOGGLE_MASK;
+	x_dae_motor.motor.hw.step_mode = X_DAE_HW_STEP_MODE;
 	xy_type_init(&x_dae_motor);
 	HAL_TIM_OC_Start_IT(X_DAE_HW_TIMER, X_DAE_HW_CHANNEL); // Start timer channel for this motor
 
@@ -91,6 +108,8 @@ void STG_Init (void)
 	y_dae_motor.motor.hw.oc_active_mask = Y_DAE_HW_OC_ACTIVE_MASK;
 	y_dae_motor.motor.hw.oc_inactive_mask = Y_DAE_HW_OC_INACTIVE_MASK;
 	y_dae_motor.motor.hw.oc_forced_inactive_mask = Y_DAE_HW_OC_FORCED_INACTIVE_MASK;
+	y_dae_motor.motor.hw.oc_toggle_mask = Y_DAE_HW_OC_TOGGLE_MASK;
+	y_dae_motor.motor.hw.step_mode = Y_DAE_HW_STEP_MODE;
 	xy_type_init(&y_dae_motor);
 	HAL_TIM_OC_Start_IT(Y_DAE_HW_TIMER, Y_DAE_HW_CHANNEL); // Start timer channel for this motor
 
@@ -109,6 +128,8 @@ void STG_Init (void)
 	z_dae_motor.motor.hw.oc_active_mask = Z_DAE_HW_OC_ACTIVE_MASK;
 	z_dae_motor.motor.hw.oc_inactive_mask = Z_DAE_HW_OC_INACTIVE_MASK;
 	z_dae_motor.motor.hw.oc_forced_inactive_mask = Z_DAE_HW_OC_FORCED_INACTIVE_MASK;
+	z_dae_motor.motor.hw.oc_toggle_mask = Z_DAE_HW_OC_TOGGLE_MASK;
+	z_dae_motor.motor.hw.step_mode = Z_DAE_HW_STEP_MODE;
 	z_type_init(&z_dae_motor);
 
 
@@ -146,6 +167,77 @@ void accel_table_init(int32_t *array, uint32_t length, real acceleration, real a
 	}*/
 }
 
+/** @brief 	Changes the acceleration of a motor and recalculates its acceleration table.
+ * 			All motors of the same type share the table (x and y use c_table_xy), so
+ * 			the acceleration changes for all of them. They all have to stand still.
+ *
+ *  @param  *ctl - motor control structure
+ *  @param  acc - new acceleration [rad/sec^2]
+ *  @return SUCCESS, ERROR if the value is out of range or a motor is moving
+ */
+ErrorStatus STG_setAcceleration(T_MOTOR_CONTROL *ctl, real acc)
+{
+	T_MOTOR_CONTROL *motors[] = {&x_dae_motor, &y_dae_motor, &z_dae_motor};
+	int32_t *table = ctl->ctl_queue[0].c_table;
+	uint32_t i;
+
+	if (acc <= 0)
+		return ERROR;
+	for (i = 0; i < sizeof(motors) / sizeof(motors[0]); i++)
+	{
+		// A lower acceleration makes the table reach a lower speed, the w_max of the motors has to stay within
+		if (motors[i]->ctl_queue[0].c_table == table
+				&& (motors[i]->status != STG_IDLE || motors[i]->motor.w_max > STG_maxSpeed(&motors[i]->motor, acc)))
+			return ERROR;
+	}
+
+	accel_table_init(table, C_TABLE_SIZE, acc, ctl->motor.alpha);
+	for (i = 0; i < sizeof(motors) / sizeof(motors[0]); i++)
+	{
+		if (motors[i]->ctl_queue[0].c_table == table)
+		{
+			motors[i]->motor.acc = acc;
+			STG_refreshStopCycle(motors[i]);
+		}
+	}
+	return SUCCESS;
+}
+
+/** @brief 	Highest w_max a motor can have with an acceleration: the acceleration table
+ * 			has to reach it and the planner has to stay clear of W_ERR.
+ *
+ *  @param  *motor - motor parameters (alpha)
+ *  @param  acc - acceleration [rad/sec^2]
+ *  @return [rad/s]
+ */
+real STG_maxSpeed (const T_STEPPER_STATE *motor, real acc)
+{
+	real w_table = sqrt(2 * motor->alpha * acc * (C_TABLE_SIZE - 2));
+	return fmin(w_table, STG_W_MARGIN * W_ERR);
+}
+
+/** @brief 	Switches a motor between the two ways to generate the step output (see E_STG_STEP_MODE).
+ * 			The motor has to stand still.
+ *
+ *  @param  *ctl - motor control structure
+ *  @param  mode - new step mode
+ *  @return SUCCESS, ERROR if the mode is unknown or the motor is moving
+ */
+ErrorStatus STG_setStepMode (T_MOTOR_CONTROL *ctl, E_STG_STEP_MODE mode)
+{
+	uint32_t primask = __get_PRIMASK();
+
+	if (mode >= STG_STEP_MODES || ctl->status != STG_IDLE)
+		return ERROR;
+
+	// The other channel in the same CCMR could be running
+	__disable_irq();
+	ctl->motor.hw.step_mode = mode;
+	set_idle_output(ctl);
+	__set_PRIMASK(primask);
+	return SUCCESS;
+}
+
 /** @brief 	Initialisation function that is used for the x/y-axis.
  *
  * 			We need different functions for the z and the x/y axis
@@ -156,8 +248,11 @@ void accel_table_init(int32_t *array, uint32_t length, real acceleration, real a
  */
 void xy_type_init(T_MOTOR_CONTROL *ctl)
 {
+	int32_t i;
+
 	ctl->motor.pos = 0;
 	ctl->motor.scheduled_pos = 0;
+	ctl->motor.w_scheduled = 0;
 	ctl->motor.acc = XY_ACCEL_MAX;
 	ctl->motor.w_max = XY_SPEED_MAX;
 	ctl->motor.alpha = XY_ALPHA;
@@ -166,12 +261,21 @@ void xy_type_init(T_MOTOR_CONTROL *ctl)
 	ctl->motor.overshoot_off = 0;
 
 	// Put pointers for c_table in place
-	ctl->ctl_swap[0].c_table = c_table_xy;
-	ctl->ctl_swap[1].c_table = c_table_xy;
+	for (i = 0; i < STG_QUEUE_LENGTH; i++)
+	{
+		ctl->ctl_queue[i].c_table = c_table_xy;
+	}
+	STG_refreshStopCycle(ctl);
 
-	// Initialize ISR control swap stuff
+	// Initialize ISR control queue stuff
 	ctl->active = &stepper_shutoff; // Motor is stopped at the beginning
-	ctl->waiting = &(ctl->ctl_swap[0]); // swap[0] is waiting to be filled.
+	ctl->q_head = 0;
+	ctl->q_tail = 0;
+	ctl->q_underruns = 0;
+	ctl->tim_overruns = 0;
+	ctl->tim_late_max = 0;
+	ctl->isr_calls = 0;
+	STG_flushQueue(ctl); // also puts waiting on the first slot
 	ctl->status = STG_IDLE;
 }
 
@@ -187,8 +291,11 @@ void xy_type_init(T_MOTOR_CONTROL *ctl)
  */
 void z_type_init(T_MOTOR_CONTROL *ctl)
 {
+	int32_t i;
+
 	ctl->motor.pos = 0;
 	ctl->motor.scheduled_pos = 0;
+	ctl->motor.w_scheduled = 0;
 	ctl->motor.acc = Z_ACCEL_MAX;
 	ctl->motor.w_max = Z_SPEED_MAX;
 	ctl->motor.alpha = Z_ALPHA;
@@ -197,34 +304,38 @@ void z_type_init(T_MOTOR_CONTROL *ctl)
 	ctl->motor.overshoot_off = 0;
 
 	// Put pointers for c_table in place
-	ctl->ctl_swap[0].c_table = c_table_z;
-	ctl->ctl_swap[1].c_table = c_table_z;
+	for (i = 0; i < STG_QUEUE_LENGTH; i++)
+	{
+		ctl->ctl_queue[i].c_table = c_table_z;
+	}
+	STG_refreshStopCycle(ctl);
 
-	// Initialize ISR control swap stuff
+	// Initialize ISR control queue stuff
 	ctl->active = &stepper_shutoff; // Motor is stopped at the beginning
-	ctl->waiting = &(ctl->ctl_swap[0]); // swap[0] is waiting to be filled.
+	ctl->q_head = 0;
+	ctl->q_tail = 0;
+	ctl->q_underruns = 0;
+	ctl->tim_overruns = 0;
+	ctl->tim_late_max = 0;
+	ctl->isr_calls = 0;
+	STG_flushQueue(ctl); // also puts waiting on the first slot
 	ctl->status = STG_IDLE;
 }
 
-/** @brief 	Usually, the timer swaps its control struct by itself. But if it is the first command or
- * 			a stop cycle was executed, it has to be started again precisely. Therefore it is necessary
- * 			to generate a timer interrupt without (!) generating an output pulse. This is done by this function.
- * 			This function can also be called when a cycle is already in progress and should be restarted for some
- * 			reason. But be careful, it may perform an instant change in speed and therefore loose steps!
+/** @brief 	Makes the first queued cycle active and sets the output up so that the first
+ * 			ISR after the start only calculates the first step and does not generate a pulse.
+ * 			The compare register is not touched here.
  *
  *  @param  *ctl - motor control structure for which the cycle should be started
  *  @return (none)
  */
-void STG_StartCycle(T_MOTOR_CONTROL *ctl)
+static void prepare_start(T_MOTOR_CONTROL *ctl)
 {
-	uint16_t tim_preload;
-
-	// The prepared struct is always in "waiting". We therefore swap it to "active" first and then kick off the timer.
+	// The prepared struct is the first one in the queue. We therefore swap it to "active" first and then kick off the timer.
 	STG_swapISRcontrol(ctl);
 
 	// First mute the output (The ISR activates it again by itself immediately)
-	*(ctl->motor.hw.CCMR) &= ctl->motor.hw.oc_mask;
-	*(ctl->motor.hw.CCMR) |= ctl->motor.hw.oc_forced_inactive_mask;
+	set_idle_output(ctl);
 
 	// Initialize out_state so that it first waits the calculated time and does not generate an interrupt after pulsewidth
 	ctl->active->out_state = 0;
@@ -236,12 +347,144 @@ void STG_StartCycle(T_MOTOR_CONTROL *ctl)
 	ctl->motor.overshoot_on = 0;
 	ctl->motor.overshoot_off = 0;
 
+	ctl->start_pending = 0;
+	ctl->start_armed = 1;
+}
+
+/** @brief 	Usually, the timer swaps its control struct by itself. But if it is the first command or
+ * 			a stop cycle was executed, it has to be started again precisely. Therefore it is necessary
+ * 			to generate a timer interrupt without (!) generating an output pulse. This is done by this function.
+ * 			This function can also be called when a cycle is already in progress and should be restarted for some
+ * 			reason. But be careful, it may perform an instant change in speed and therefore loose steps!
+ *
+ *  @param  *ctl - motor control structure for which the cycle should be started
+ *  @return (none)
+ */
+void STG_StartCycle(T_MOTOR_CONTROL *ctl)
+{
+	uint16_t tim_preload;
+
+	prepare_start(ctl);
+
 	// And finally offset the timer by 1, so that it starts at the next tick (which is statistically 0.5 intervals away).
 	tim_preload = __HAL_TIM_GET_COUNTER(ctl->motor.hw.timer) + 1;
 	__HAL_TIM_SetCompare(ctl->motor.hw.timer, ctl->motor.hw.channel, tim_preload);
 
 }
 
+/** @brief 	Starts the first queued cycle of several motors at exactly the same timer tick.
+ * 			All motors get the same absolute compare value, STG_GROUP_START_LEAD ahead of
+ * 			the counter, so their first ISRs (and with them the timing of all following
+ * 			steps) have the same reference. The motors have to use the same timer.
+ *
+ * 			Motors that were stopped in the meantime (status is not STG_READY anymore) are left out.
+ *
+ *  @param  **ctl - array of motor control structures to start
+ *  @param  count - number of motors in the array (max. STG_GROUP_MAX)
+ *  @return (none)
+ */
+void STG_StartCycleGroup(T_MOTOR_CONTROL **ctl, int32_t count)
+{
+	int32_t i;
+	int32_t members = 0;
+	uint16_t tim_preload;
+	uint32_t primask = __get_PRIMASK();
+
+	// Nothing may come in between, otherwise the shared compare value could be in the past already
+	__disable_irq();
+
+	for (i = 0; i < count && i < STG_GROUP_MAX; i++)
+	{
+		if (ctl[i]->status != STG_READY)
+		{
+			ctl[i]->start_pending = 0;
+			continue;
+		}
+
+		prepare_start(ctl[i]);
+		if (ctl[i]->active != &stepper_shutoff)
+			stg_group.member[members++] = ctl[i];
+	}
+
+	tim_preload = __HAL_TIM_GET_COUNTER(ctl[0]->motor.hw.timer) + STG_GROUP_START_LEAD;
+	for (i = 0; i < members; i++)
+	{
+		__HAL_TIM_SetCompare(stg_group.member[i]->motor.hw.timer, stg_group.member[i]->motor.hw.channel, tim_preload);
+		// An old match must not trigger the ISR early. (TIM_CHANNEL_x is 0, 4, 8 ... and the CCxIF flags are bit 1, 2, 3 ...)
+		__HAL_TIM_CLEAR_FLAG(stg_group.member[i]->motor.hw.timer, TIM_FLAG_CC1 << (stg_group.member[i]->motor.hw.channel >> 2));
+	}
+	stg_group.compare = tim_preload;
+	stg_group.members = members;
+
+	__set_PRIMASK(primask);
+}
+
+/** @brief 	Calculates the skew of the last group start as soon as the first ISR of every
+ * 			motor in the group was executed. Should be called periodically (planner).
+ *
+ *  @param (none)
+ *  @return (none)
+ */
+void STG_evaluateGroupStart(void)
+{
+	int32_t i;
+	int32_t diff, diff_min, diff_max;
+
+	if (stg_group.members == 0)
+		return;
+
+	for (i = 0; i < stg_group.members; i++)
+	{
+		if (stg_group.member[i]->start_armed)
+			return; // not all of them started yet
+	}
+
+	// All differences are relative to the shared compare value (16 bit timer, so it is done in int16)
+	diff_min = INT32_MAX;
+	diff_max = INT32_MIN;
+	for (i = 0; i < stg_group.members; i++)
+	{
+		diff = (int16_t) (stg_group.member[i]->start_tick - stg_group.compare);
+		if (diff < diff_min)
+			diff_min = diff;
+		if (diff > diff_max)
+			diff_max = diff;
+	}
+
+	if (diff_max > stg_group.entry_max)
+		stg_group.entry_max = diff_max;
+
+	if (stg_group.members > 1)
+	{
+		stg_group.skew_last = diff_max - diff_min;
+		if (stg_group.skew_last > stg_group.skew_max)
+			stg_group.skew_max = stg_group.skew_last;
+		stg_group.groups++;
+	}
+	stg_group.members = 0;
+}
+
+/** @brief 	Position the step output of a motor is at right now. The step pulse is put
+ * 			out by the timer at the compare match, but only counted in motor.pos by the
+ * 			ISR that follows. If that ISR is still pending, the step is counted here.
+ *
+ * 			Only to be called at the priority of the step ISR (limit switch EXTI),
+ * 			so the ISR cannot count the step in between.
+ *
+ *  @param *ctl - Motor control struct to operate on.
+ *  @return position [steps]
+ */
+int32_t STG_getOutputPosition (T_MOTOR_CONTROL *ctl)
+{
+	int32_t pos = ctl->motor.pos;
+
+	// TIM_CHANNEL_1..4 are 0, 4, 8, 12, their compare flags CC1IF..CC4IF are bits 1..4
+	if (ctl->active->running == 1 && ctl->active->shutoff == 0 && ctl->active->out_state == 1
+			&& (ctl->motor.hw.timer->Instance->SR & (TIM_SR_CC1IF << (ctl->motor.hw.channel >> 2))))
+		pos += ctl->active->dir_abs;
+	return pos;
+}
+
 /** @brief 	Perfrom an immediate hard stop.
  * 			Be careful! This function will, depending on the
  * 			momentary speed of the motor, loose steps.
@@ -251,127 +494,285 @@ void STG_StartCycle(T_MOTOR_CONTROL *ctl)
  */
 void STG_hardstop (T_MOTOR_CONTROL *ctl)
 {
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+
+	// Throw away everything that is queued. q_final keeps the planner from committing a cycle it is just calculating.
 	ctl->active = &stepper_shutoff;
+	ctl->q_tail = ctl->q_head;
+	ctl->q_time = 0;
+	ctl->q_final = 1;
 	ctl->status = STG_IDLE;
+
+	__set_PRIMASK(primask);
 }
 
-/** @brief 	Perfrom an immediate soft stop. This function will
- * 			overwrite the settings in the currently active isr swap
- * 			to decelerate the motor as fast as possible.
+/** @brief 	Perfrom an immediate soft stop: the stop cycle the planner keeps ready
+ * 			(see STG_refreshStopCycle) takes over from the active cycle and
+ * 			decelerates the motor as fast as possible. Everything queued is dropped.
+ *
+ * 			Called from the limit switch EXTI, so there is no floating point in here.
+ * 			The ramp index of the current speed is known already: it is the index
+ * 			the ISR is at while ramping, or neq_stop of the planner at target speed.
  *
  *  @param *ctl - Motor control struct to operate on.
+ *  @param request - DWT->CYCCNT at the entry of the EXTI or the stop command, the latency is measured from there
  *  @return (none)
  */
-void STG_softstop (T_MOTOR_CONTROL *ctl)
+void STG_softstop (T_MOTOR_CONTROL *ctl, uint32_t request)
 {
-	real w_begin;
+	T_ISR_CONTROL *isr;
+	T_ISR_CONTROL *stop = &(ctl->stop_cycle);
 	int32_t neq_begin;
+	int32_t pending;
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
 
-	// First determine current motor speed
-	w_begin = ctl->motor.alpha * F_TIMER / (ctl->active->c_hw);
-
-	// Then calculate the equivalent deceleration index (number of steps necessary to reach a stop)
-	neq_begin = - w_begin * w_begin / (2 * ctl->motor.alpha * ctl->motor.acc);
+	isr = ctl->active;
+	if (isr == stop)
+	{
+		// Stopping as fast as it can already
+		__set_PRIMASK(primask);
+		return;
+	}
 
-	dbgprintf("Decel: neq begin: %d", neq_begin);
+	// Equivalent deceleration index (number of steps necessary to reach a stop, negative)
+	if (isr->s == 0 && isr->out_state == 0 && isr->c_hwr == 0)
+		neq_begin = isr->no_accel ? isr->neq_stop : -absolute(isr->neq_on); // first step not calculated yet, still at start speed
+	else if (isr->no_accel == 1 || isr->c == isr->c_t)
+		neq_begin = isr->neq_stop;
+	else
+		neq_begin = -absolute(isr->n);
 
 	// The motor is currently moving at significant speed -> decel ramp needed
-	if (absolute(neq_begin) > 0)
-	{
-		ctl->active->s = 0;
-		ctl->active->s_total = absolute(neq_begin);
-		ctl->active->s_on = 0;
-		ctl->active->s_off = 0; // looks a bit scary putting s_on and s_off both at 0 (what is it gonna do, on or off?), but works if you look at the execution exactly
-		ctl->active->neq_on = 0; // never used
-		ctl->active->neq_off = neq_begin;
-		ctl->active->shutoff = 0; // Not shutoff yet
-		ctl->active->no_accel = 0; // Not the case here, we are moving relatively fast still
-		ctl->active->d_off = -1; // Thats important: We want to decelerate at the end.
-		ctl->active->w_finish = 0; // when we are finished, the motor stands still (not sure if anyone uses this variable, though)
-
-		// If this decel cycle is done, it will swap once again. It is important that shutoff is now in it so that it does not randomly tick along.
-		ctl->waiting->shutoff = 1;
-		ctl->status = STG_PREPARED; // meaning that we prepared shutoff in the waiting struct.
+	if (isr->running == 1 && isr->shutoff == 0 && neq_begin < 0)
+	{
+		// A step that is calculated already (waiting for its edge) is put out and counted by the stop cycle
+		pending = (isr->out_state == 1 || isr->c_hwr > 0);
+
+		stop->c = isr->c;
+		stop->c_hw = isr->c_hw;
+		stop->c_hwi = isr->c_hwi;
+		stop->c_hwr = isr->c_hwr;
+		stop->c_real = 0;
+		stop->s = 0;
+		stop->s_total = pending - neq_begin;
+		stop->n = neq_begin;
+		stop->neq_off = neq_begin;
+		stop->out_state = isr->out_state;
+		stop->dir_abs = isr->dir_abs;
+		stop->overshoot_off = 0;
+
+		// Drop the whole queue including the active cycle. When the stop cycle is done, the queue is
+		// empty and q_final is set, so the ISR stops the motor instead of reporting an underrun.
+		ctl->active = stop;
+		ctl->q_tail = ctl->q_head;
+		ctl->q_time = 0;
+		ctl->q_final = 1;
+		ctl->status = STG_PREPARED; // meaning that nothing needs to be prepared anymore
+
+		// The ISR measures the rest (see isr_measure_stop and check_cycle_status)
+		ctl->stop.request = request;
+		ctl->stop.latency_open = 1;
+		ctl->stop.pos_start = ctl->motor.pos;
+		ctl->stop.cycles_last = DWT->CYCCNT - request;
+		if (ctl->stop.cycles_last > ctl->stop.cycles_max)
+			ctl->stop.cycles_max = ctl->stop.cycles_last;
+		__set_PRIMASK(primask);
 	}
 	// The motor is currently moving very slow or not at all -> just put in stop swap.
 	else
 	{
-		ctl->active = &stepper_shutoff;
+		__set_PRIMASK(primask);
 		// This is important so it does not start when the next datapoint comes
-		ctl->status = STG_IDLE;
+		STG_hardstop(ctl);
+	}
+}
+
+/** @brief 	Sets up the stop cycle of a motor. Only the part that depends on the speed
+ * 			at the moment of the stop is left to STG_softstop. Has to be called again
+ * 			when the acceleration or the maximum speed of the motor changes.
+ * 			The motor must not be stopping at the moment.
+ *
+ *  @param *ctl - Motor control struct to operate on.
+ *  @return (none)
+ */
+void STG_refreshStopCycle (T_MOTOR_CONTROL *ctl)
+{
+	T_ISR_CONTROL *stop = &(ctl->stop_cycle);
+	real w_max = ctl->motor.w_max;
+
+	stop->c_t = 0; // never reached, so the ramp always follows the table
+	stop->c_ideal = 0;
+	stop->t_ideal = 0;
+	stop->s_on = 0;
+	stop->s_off = 0; // looks a bit scary putting s_on and s_off both at 0 (what is it gonna do, on or off?), but works if you look at the execution exactly
+	stop->neq_on = 0; // never used
+	stop->neq_stop = 0;
+	stop->shutoff = 0;
+	stop->running = 1;
+	stop->no_accel = 0;
+	stop->d_on = -1;
+	stop->d_off = -1; // Thats important: We want to decelerate at the end.
+	stop->c_table = ctl->ctl_queue[0].c_table;
+	stop->overshoot_on = 0;
+	stop->w_finish = 0;
+
+	// A stop from w_max, plus a step that is on its way already and one for the rounding of the ramp index
+	ctl->stop.bound = (int32_t) (w_max * w_max / (2 * ctl->motor.alpha * ctl->motor.acc)) + 2;
+}
+
+/** @brief 	Empties the cycle queue of a motor that is not running, so the
+ * 			planner can start to fill in a new trajectory. Also resets the
+ * 			queue statistics of the last trajectory.
+ *
+ *  @param *ctl - Motor control struct to operate on.
+ *  @return (none)
+ */
+void STG_flushQueue (T_MOTOR_CONTROL *ctl)
+{
+	ctl->q_tail = ctl->q_head;
+	ctl->waiting = &(ctl->ctl_queue[ctl->q_head % STG_QUEUE_LENGTH]);
+	ctl->q_time = 0;
+	ctl->q_final = 0;
+	ctl->q_min_fill = STG_QUEUE_LENGTH;
+	ctl->q_min_slack = INT32_MAX;
+}
+
+/** @brief 	Hands the cycle prepared in "waiting" over to the ISR and moves
+ * 			"waiting" to the next free slot. A stop cycle (shutoff = 1) marks
+ * 			the end of the trajectory, nothing is accepted after it until the
+ * 			queue is flushed again. The same is true after a hard- or softstop,
+ * 			so a cycle that was being calculated while the stop happened is dropped.
+ *
+ * 			Must only be called when STG_getQueueFree() is greater than 0.
+ *
+ *  @param *ctl - Motor control struct to operate on.
+ *  @return SUCCESS if the cycle was queued, ERROR if it was dropped.
+ */
+uint8_t STG_commitCycle (T_MOTOR_CONTROL *ctl)
+{
+	uint8_t ret = SUCCESS;
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+
+	if (ctl->q_final == 1)
+	{
+		ret = ERROR;
 	}
+	else
+	{
+		if (ctl->waiting->shutoff == 1)
+			ctl->q_final = 1;
+		else
+			ctl->q_time += ctl->waiting->t_ideal;
+
+		ctl->q_head++;
+
+		// Nothing more to do for the planner if the queue is full or the stop is in it.
+		if (ctl->status == STG_NOT_PREPARED && (ctl->q_final == 1 || ctl->q_head - ctl->q_tail >= STG_QUEUE_LENGTH))
+			ctl->status = STG_PREPARED;
+	}
+	ctl->waiting = &(ctl->ctl_queue[ctl->q_head % STG_QUEUE_LENGTH]);
+
+	__set_PRIMASK(primask);
+	return ret;
 }
 
+/** @brief 	Number of free queue slots, i.e. how many cycles the planner can prepare right now.
+ *
+ *  @param *ctl - Motor control struct to operate on.
+ *  @return number of free slots
+ */
+uint32_t STG_getQueueFree (T_MOTOR_CONTROL *ctl)
+{
+	return STG_QUEUE_LENGTH - (ctl->q_head - ctl->q_tail);
+}
+
+/** @brief 	Number of occupied queue slots, including the cycle that is executed at the moment.
+ *
+ *  @param *ctl - Motor control struct to operate on.
+ *  @return number of queued cycles
+ */
+uint32_t STG_getQueueFill (T_MOTOR_CONTROL *ctl)
+{
+	return ctl->q_head - ctl->q_tail;
+}
 
-/** @brief 	Makes the waiting ISR control struct active and puts the other of the two
- * 			control structs in waiting. Whatever was in "active" before is thrown away.
- * 			(if e.g. stepper_shutoff was put here). It also sets shutoff to 0, which
- * 			is always set to 1 in a fresh cycle
+/** @brief 	Releases the finished active cycle and makes the next one of the queue active.
+ * 			Whatever was in "active" before is thrown away (if e.g. stepper_shutoff was put here).
+ * 			If the next cycle is a stop cycle, the motor goes idle. If the queue is empty although
+ * 			the trajectory is not finished, the planner was too late (underrun) and the motor is stopped.
  *
  *  @param *ctl - Motor control struct to operate on.
  *  @return (none)
  */
 void STG_swapISRcontrol (T_MOTOR_CONTROL *ctl)
 {
-	if (ctl->status == STG_PREPARED)
+	uint32_t fill;
+
+	// The finished cycle gives its slot back to the planner (stepper_shutoff and the stop cycle are not part of the queue)
+	if (ctl->active != &stepper_shutoff && ctl->active != &(ctl->stop_cycle))
 	{
+		ctl->q_time -= ctl->active->t_ideal;
+		ctl->q_tail++;
+	}
 
-		ctl->active = ctl->waiting;
-		if (ctl->active == &(ctl->ctl_swap[0]))
-		{
-			ctl->waiting = &(ctl->ctl_swap[1]);
-		}
-		else
-		{
-			// Also if active is shutoff, the zero is waiting.
-			ctl->waiting = &(ctl->ctl_swap[0]);
-		}
+	if (ctl->q_head != ctl->q_tail)
+	{
+		ctl->active = &(ctl->ctl_queue[ctl->q_tail % STG_QUEUE_LENGTH]);
 
 		if (ctl->active->shutoff == 1)
 		{
-			// The motor calculator decied that this active cycle is a stop cycle.
+			// The motor calculator decied that this is a stop cycle.
 			// So the trajectory is completed and we are just waiting to be started again
-			// Maybe this would be a good point to do some statisctics with c_err and so on.
-			ctl->status = STG_IDLE;
+			ctl->q_tail++;
+			ctl->active = &stepper_shutoff;
+			if (ctl->status != STG_ERROR)
+				ctl->status = STG_IDLE;
 		}
 		else
 		{
+			// Keep track of how far the planner is ahead of the execution (in cycles and in time)
+			fill = ctl->q_head - ctl->q_tail - 1;
+			if (ctl->q_final == 0)
+			{
+				if (fill < ctl->q_min_fill)
+					ctl->q_min_fill = fill;
+				if (ctl->q_time < ctl->q_min_slack)
+					ctl->q_min_slack = ctl->q_time;
+				CNT_HIST(CNT_HIST_REFILL_SLACK, ctl->q_time);
+			}
+
 			ctl->active->running = 1;
 			debug_indicate_cycle_start(ctl->active->s_total, ctl->active->c_ideal/(F_TIMER/1000));
-			ctl->status = STG_NOT_PREPARED;	// Mark that the now waiting one does not contain valid information.
+			if (ctl->status == STG_READY || ctl->status == STG_PREPARED || ctl->status == STG_NOT_PREPARED)
+			{
+				ctl->status = ctl->q_final ? STG_PREPARED : STG_NOT_PREPARED; // There is a free slot now (unless the end is queued already)
+				if (ctl->status == STG_NOT_PREPARED)
+					SCH_requestRefill(ctl);
+			}
 			toggle_debug_led();
 		}
 	}
-	else if (ctl->status == STG_NOT_PREPARED)
+	else if (ctl->q_final == 1)
 	{
-		// for some reason the waiting control sturct has not been updated. As we cannot do anything
-		// sensible now, we stop the motor immediately (for now).
+		// Queue ran empty after a softstop. That is the regular end.
 		ctl->active = &stepper_shutoff;
-		ctl->status = STG_IDLE;
-		dbgprintf("Swap ISR control: No waiting structure was found. Stopping.");
+		if (ctl->status != STG_ERROR)
+			ctl->status = STG_IDLE;
 	}
-	else if (ctl->status == STG_MANUAL)
+	else
 	{
-		// The manual move has just been started. Our prepared struct is in waiting.
-		ctl->active = ctl->waiting;
-		if (ctl->active == &(ctl->ctl_swap[0]))
-		{
-			ctl->waiting = &(ctl->ctl_swap[1]);
-		}
-		else
-		{
-			ctl->waiting = &(ctl->ctl_swap[0]);
-		}
-
-		if (ctl->active->shutoff == 1)
-		{ // This is a weired case that should not occur. If we do a manual move, it should not just stop
+		// The planner did not prepare a following cycle in time. As we cannot do anything
+		// sensible now, we stop the motor immediately (for now).
+		ctl->q_underruns++;
+		CNT_INC(CNT_STG_QUEUE_UNDERRUNS);
+		ctl->active = &stepper_shutoff;
+		ctl->q_final = 1;
+		if (ctl->status != STG_ERROR)
 			ctl->status = STG_IDLE;
-		}
-		else
-		{
-			ctl->waiting->shutoff = 1; // Prepare the next struct, which in this case does nothing but stop the motor.
-			ctl->status = STG_PREPARED;
-		}
+		dbgprintf("Swap ISR control: Cycle queue underrun. Stopping.");
 	}
 }
 
@@ -477,12 +878,29 @@ uint16_t step_calculations(T_ISR_CONTROL *isr)
 void check_cycle_status(T_MOTOR_CONTROL *ctl)
 {
 	// Did we finish this cycle?
-	if (ctl->active->s == ctl->active->s_total)
+	if (ctl->active == &(ctl->stop_cycle) && ctl->active->s == ctl->active->s_total)
+	{
+		// A stop has no timing to keep, only its length is of interest. The steps put out are
+		// counted, the motor goes idle with this swap.
+		ctl->stop.count++;
+		ctl->stop.distance_last = abs(ctl->motor.pos - ctl->stop.pos_start);
+		if (ctl->stop.distance_last > ctl->stop.distance_max)
+			ctl->stop.distance_max = ctl->stop.distance_last;
+		if (ctl->stop.distance_last > ctl->stop.bound)
+		{
+			ctl->stop.overruns++;
+			CNT_INC(CNT_STG_STOP_OVERRUNS);
+		}
+		STG_swapISRcontrol(ctl);
+	}
+	else if (ctl->active->s == ctl->active->s_total)
 	{
 		// Save the difference in timer ticks this cycle produced for information and possibly correction at some point.
 		ctl->motor.c_err += ctl->active->c_real - ctl->active->c_ideal;
 		ctl->motor.overshoot_on = ctl->active->overshoot_on;
 		ctl->motor.overshoot_off = ctl->active->overshoot_off;
+		CNT_HIST(CNT_HIST_C_ERR, abs(ctl->active->c_real - ctl->active->c_ideal));
+		CNT_HIST(CNT_HIST_OVERSHOOT, ctl->active->overshoot_on + ctl->active->overshoot_off);
 
 		// Swap the buffers and start a new cycle
 		STG_swapISRcontrol(ctl);
@@ -500,9 +918,24 @@ void check_cycle_status(T_MOTOR_CONTROL *ctl)
  */
 void isr_update_stg (T_MOTOR_CONTROL *ctl, uint16_t tim_cnt)
 {
-	uint16_t 	preload = tim_cnt+1;
+	int32_t 	wait = 1;		// timer ticks from tim_cnt to the next compare match
 	uint16_t	c_hw;
 
+	ctl->isr_calls++;
+
+	// First ISR after a start: remember when it came for the skew measurement of group starts
+	if (ctl->start_armed)
+	{
+		ctl->start_tick = tim_cnt;
+		ctl->start_armed = 0;
+	}
+
+	if (ctl->motor.hw.step_mode == STG_STEP_TOGGLE)
+	{
+		isr_update_toggle(ctl, tim_cnt);
+		return;
+	}
+
 	// First check if the cycle is finished already. This is done only on the falling edge of the step pulse (save interrupt time)
 	if (ctl->active->out_state == 0 && ctl->active->c_hwr == 0  && ctl->active->running == 1
 			&& ctl->active->shutoff == 0)
@@ -522,7 +955,7 @@ void isr_update_stg (T_MOTOR_CONTROL *ctl, uint16_t tim_cnt)
 			*(ctl->motor.hw.CCMR) &= ~(ctl->motor.hw.oc_mask);
 			*(ctl->motor.hw.CCMR) |= ctl->motor.hw.oc_inactive_mask;
 			// Intermediate step to generate small pulse
-			preload = tim_cnt + STEP_PULSE_WIDTH;
+			wait = STEP_PULSE_WIDTH;
 			// now a step has been done
 			ctl->motor.pos += ctl->active->dir_abs;
 			// relative step counter is always positive
@@ -537,8 +970,10 @@ void isr_update_stg (T_MOTOR_CONTROL *ctl, uint16_t tim_cnt)
 				// Recalculate timer preload out of old or new control struct
 				c_hw = step_calculations(ctl->active);
 				debug_push_preload(c_hw); // we need to push the full preload, not every individual round.
+				if (ctl->active == &(ctl->stop_cycle))
+					isr_measure_stop(ctl);
 
-				preload = tim_cnt + ctl->active->c_hwi; // the PULSE_WIDTH is included in the step calculation already.
+				wait = ctl->active->c_hwi; // the PULSE_WIDTH is included in the step calculation already.
 
 				// generate an edge at the next match if no rounds left
 				if (ctl->active->c_hwr == 0)
@@ -551,7 +986,7 @@ void isr_update_stg (T_MOTOR_CONTROL *ctl, uint16_t tim_cnt)
 			else if (ctl->active->c_hwr > 0)
 			{
 				// We've already waited the fraction of a round, but need to wait more full rounds.
-				preload = tim_cnt + C_MAX;
+				wait = C_MAX;
 				ctl->active->c_hwr--;
 
 				// generate a tick at the next match if no rounds left
@@ -568,27 +1003,162 @@ void isr_update_stg (T_MOTOR_CONTROL *ctl, uint16_t tim_cnt)
 				ctl->active->c_hwr = 0;
 			}
 
-			// Take care of direction pin.
+			// Take care of direction pin. Written directly to BSRR, so the ISR does not have to call into flash.
 			switch(ctl->active->dir_abs * ctl->motor.hw.flip_dir)
 			{
-			case  1: HAL_GPIO_WritePin(ctl->motor.hw.dir_port, ctl->motor.hw.dir_pin, GPIO_PIN_SET); break;
-			case -1: HAL_GPIO_WritePin(ctl->motor.hw.dir_port, ctl->motor.hw.dir_pin, GPIO_PIN_RESET); break;
+			case  1: ctl->motor.hw.dir_port->BSRR = ctl->motor.hw.dir_pin; break;
+			case -1: ctl->motor.hw.dir_port->BSRR = (uint32_t)ctl->motor.hw.dir_pin << 16; break;
 			}
 		}
 
-		// Only preset compare reg if neccesary
-		__HAL_TIM_SetCompare(ctl->motor.hw.timer, ctl->motor.hw.channel, preload);
-
+		isr_set_compare(ctl, tim_cnt, wait);
 	}
 	else
 	{
 		// Force off output, so that it does not randomly tick along
-		*(ctl->motor.hw.CCMR) &= ~(ctl->motor.hw.oc_mask);
-		*(ctl->motor.hw.CCMR) |= ctl->motor.hw.oc_forced_inactive_mask;
+		set_idle_output(ctl);
 	}
 
 }
 
+/** @brief 	isr_update_stg for STG_STEP_TOGGLE. The timer toggles the pin at the match all by
+ * 			itself, so the match is the step and there is no second interrupt to end a pulse.
+ * 			The compare mode is only changed for the full rounds of the timer before slow steps,
+ * 			which must not toggle. out_state has the same meaning as for the pulses: 1 if the
+ * 			next match puts out a step.
+ *
+ *  @param *ctl - motor
+ *  @param tim_cnt - timer counter at the entry of the ISR
+ *  @return (none)
+ */
+static void isr_update_toggle (T_MOTOR_CONTROL *ctl, uint16_t tim_cnt)
+{
+	int32_t		wait;
+	uint32_t	mode;
+
+	if (ctl->active->out_state == 1 && ctl->active->running == 1 && ctl->active->shutoff == 0)
+	{
+		// The match that brought us here was a step
+		ctl->active->out_state = 0;
+		ctl->motor.pos += ctl->active->dir_abs;
+		ctl->active->s++;
+	}
+
+	// Same as for the pulses: only after a step (or the start), not during the full rounds
+	if (ctl->active->out_state == 0 && ctl->active->c_hwr == 0  && ctl->active->running == 1
+			&& ctl->active->shutoff == 0)
+	{
+		check_cycle_status(ctl);
+	}
+
+	if (ctl->active->running == 1 && ctl->active->shutoff == 0)
+	{
+		if (ctl->active->c_hwr == 0)
+		{
+			debug_push_preload(step_calculations(ctl->active));
+			if (ctl->active == &(ctl->stop_cycle))
+				isr_measure_stop(ctl);
+
+			// step_calculations takes off STEP_PULSE_WIDTH for the pulse, there is none here.
+			// If that does not fit into the compare register, the rest is dropped and not counted in c_real.
+			wait = ctl->active->c_hwi + STEP_PULSE_WIDTH;
+			if (wait > C_MAX)
+			{
+				ctl->active->c_real -= wait - C_MAX;
+				wait = C_MAX;
+			}
+
+			switch(ctl->active->dir_abs * ctl->motor.hw.flip_dir)
+			{
+			case  1: ctl->motor.hw.dir_port->BSRR = ctl->motor.hw.dir_pin; break;
+			case -1: ctl->motor.hw.dir_port->BSRR = (uint32_t)ctl->motor.hw.dir_pin << 16; break;
+			}
+		}
+		else
+		{
+			wait = C_MAX;
+			ctl->active->c_hwr--;
+		}
+
+		// Frozen for the full rounds, toggle for the match that is the step
+		mode = 0;
+		if (ctl->active->c_hwr == 0)
+		{
+			ctl->active->out_state = 1;
+			mode = ctl->motor.hw.oc_toggle_mask;
+		}
+		if ((*(ctl->motor.hw.CCMR) & ctl->motor.hw.oc_mask) != mode)
+			*(ctl->motor.hw.CCMR) = (*(ctl->motor.hw.CCMR) & ~(ctl->motor.hw.oc_mask)) | mode;
+
+		isr_set_compare(ctl, tim_cnt, wait);
+	}
+	else
+	{
+		set_idle_output(ctl);
+	}
+}
+
+/** @brief 	Takes the latency of a stop when the ISR has set up the first decelerating step
+ * 			of the stop cycle. A step that was in flight at the stop is put out before.
+ *
+ *  @param *ctl - motor, its stop cycle is active
+ *  @return (none)
+ */
+static void isr_measure_stop (T_MOTOR_CONTROL *ctl)
+{
+	if (!ctl->stop.latency_open)
+		return;
+	ctl->stop.latency_open = 0;
+	ctl->stop.latency_last = DWT->CYCCNT - ctl->stop.request;
+	if (ctl->stop.latency_last > ctl->stop.latency_max)
+		ctl->stop.latency_max = ctl->stop.latency_last;
+}
+
+/** @brief 	Sets up the next compare match of a motor.
+ *
+ * 			tim_cnt was read at the entry of the ISR, the other channels may have taken their time since.
+ * 			A compare value that has passed already would only match after a full revolution of the timer,
+ * 			so the edge is put out right away instead and the cycle carries the delay as timing error.
+ *
+ *  @param *ctl - motor
+ *  @param tim_cnt - timer counter at the entry of the ISR
+ *  @param wait - timer ticks from tim_cnt to the match, 1 .. C_MAX
+ *  @return (none)
+ */
+static void isr_set_compare (T_MOTOR_CONTROL *ctl, uint16_t tim_cnt, int32_t wait)
+{
+	int32_t		elapsed, late;
+
+	elapsed = (uint16_t) (__HAL_TIM_GET_COUNTER(ctl->motor.hw.timer) - tim_cnt);
+	if (elapsed + STG_OVERRUN_MARGIN > wait)
+	{
+		late = elapsed + STG_OVERRUN_MARGIN - wait;
+		wait += late;
+		ctl->active->c_real += late;
+		ctl->tim_overruns++;
+		if (late > ctl->tim_late_max)
+			ctl->tim_late_max = late;
+		CNT_INC(CNT_STG_TIMER_OVERRUNS);
+	}
+
+	__HAL_TIM_SetCompare(ctl->motor.hw.timer, ctl->motor.hw.channel, (uint16_t) (tim_cnt + wait));
+}
+
+/** @brief 	Compare mode of a motor that does not step: the pulses are forced low,
+ * 			a toggling output is frozen where it is (forcing it low could be a step).
+ * 			Only the mode bits of this channel may be changed, the other channel in
+ * 			the same CCMR could be running.
+ *
+ *  @param *ctl - motor
+ *  @return (none)
+ */
+static void set_idle_output (T_MOTOR_CONTROL *ctl)
+{
+	*(ctl->motor.hw.CCMR) &= ~(ctl->motor.hw.oc_mask);
+	if (ctl->motor.hw.step_mode == STG_STEP_PULSE)
+		*(ctl->motor.hw.CCMR) |= ctl->motor.hw.oc_forced_inactive_mask;
+}
+
 /** @brief 	Fills in a deceleration swap that allows to slow down the motor to
  * 			a stop from whichever speed it is currently moving.
  *
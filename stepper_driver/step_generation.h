@@ -13,18 +13,30 @@
 #define FACTOR			1000
 #define PI				(3.141592654F)
 #define C_TABLE_SIZE	1200				// Size of acceleration table. That is the maximum number of accelerating steps starting at zero speed.
+#define STG_W_MARGIN	0.95F				// w_max stays this fraction of W_ERR below it (see STG_maxSpeed)
 
 // Timer setup
 #define F_TIMER			8000000				// Motor timer frequency. currently 1MHz.
 #define C_MAX			65536				// 16 bit timer -> one revolution is 2^16 = 65536 ticks.
 
+// Width of step pulse. Has basically no effect on CPU load, but should not be too short
+// in order for the ISR to finish before the next interrupt comes. currently set to 40us.
+#define STEP_PULSE_WIDTH 	(F_TIMER/25000)
+
+// Cycle queue
+#define STG_QUEUE_LENGTH	8				// Number of ISR control structs per motor. One is executed, the others can be prepared ahead by the planner.
+
+// Synchronised start of several motors
+#define STG_GROUP_MAX			3				// Maximum number of motors that can be started together (all motors on TIM1)
+#define STG_GROUP_START_LEAD	(F_TIMER/10000)	// The shared start compare is set this far ahead of the counter (100us), so it cannot be missed while arming.
+
 typedef enum
 {
 	STG_IDLE, 		// Meaning the axis is resting because it previously encountered a zero-cycle or has not been started yet
 	STG_READY,		// Meaning the axis can start executing a new cycle because the timekeeper decided it needs to start now
-	STG_PREPARED,	// It has an active cycle running and the next one already prepared
-	STG_NOT_PREPARED,// It has an active cycle running, but the next one still needs to be calculated
-	STG_MANUAL,		// Motor is in manual moving mode. This means after each move, it goes to stop automatically
+	STG_PREPARED,	// It has an active cycle running and the queue is full or already ends with the stop of the trajectory
+	STG_NOT_PREPARED,// It has an active cycle running and there is space in the queue to prepare further cycles
+	STG_MANUAL,		// Motor is in manual moving mode. The whole move including its stop is queued, it goes to stop automatically
 	STG_ERROR,		// When a calculation error has been made, this motor stops.
 }E_STG_EXECUTION_STATUS;
 
@@ -38,6 +50,14 @@ typedef enum
 	STG_WAITING_SECOND_CONTACT  // Currently moving towards the second contact with the limit switch
 }E_STG_HOME_STATUS;
 
+// How the step output of a motor is generated (see isr_update_stg)
+typedef enum
+{
+	STG_STEP_PULSE = 0,			// A pulse of STEP_PULSE_WIDTH per step: the compare mode is switched to active and back to inactive, two interrupts per step
+	STG_STEP_TOGGLE,			// The compare toggles the pin, every edge is a step: one interrupt per step. Only for drivers that step on both edges!
+	STG_STEP_MODES
+}E_STG_STEP_MODE;
+
 typedef struct
 {
 	int32_t			flip_dir;		// A final switch to reverse motor direction
@@ -50,6 +70,8 @@ typedef struct
 	uint32_t		oc_active_mask; // The three masks needed to set the compare mode of the step pin.
 	uint32_t		oc_inactive_mask;
 	uint32_t 		oc_forced_inactive_mask;
+	uint32_t		oc_toggle_mask;	// Compare mode of the step pin for STG_STEP_TOGGLE
+	E_STG_STEP_MODE	step_mode;		// Set with STG_setStepMode
 }T_MOTOR_HW;
 
 // Contains motor parameters which are not dependent on the current cycle
@@ -57,7 +79,8 @@ typedef struct
 {
 	// General motor data
 	int32_t 		pos; 			// Absolute motor position, relative to end stop [in steps]
-	int32_t			scheduled_pos;	// Next scheduled position. After completion of the ongoing cycle, the motor will be there. scheduled_pos is identical to pos if the motor stands still
+	int32_t			scheduled_pos;	// Next scheduled position. After completion of all queued cycles, the motor will be there. scheduled_pos is identical to pos if the motor stands still
+	float			w_scheduled;	// Speed at the end of the last queued cycle. Start speed for the next cycle to be prepared [rad/sec]
 	float			acc; 			// Maximum allowed acceleration/deceleration [rad^2/sec]
 	float 			w_max; 			// maximal allowed motor speed [rad/sec]
 	float 			alpha; 			// Rotor angle per step [rad]
@@ -67,10 +90,14 @@ typedef struct
 	int32_t 		max_travel; 	// Holds the number of steps of the whole range the motor is able to cover. Used for homing the axis
 	T_MOTOR_HW		hw;				// contains the mapping of this motor to the hardware (pins, timer registers ...)
 	E_STG_HOME_STATUS home_status;	// Holds the information whether this motor has found its home position or not, or if homing is ongoing.
+	int32_t			home_overrun;	// Steps the first approach may run past the limit switch while it decelerates. 0 if it stops hard at the switch.
+	uint32_t		home_start;		// HAL tick when the referencing was started
+	uint32_t		home_time;		// Duration of the last successful referencing [ms]
+	int32_t			home_confirm;	// 1 if the position was restored from the parameter store. Referencing then only confirms it with the second contact.
 } T_STEPPER_STATE;
 
 // Contains information for ISR Setup of one cycle
-// Each motor has two of those, one is actively executed in the ISR, while the other one is being prepared
+// Each motor has a queue of those, one is actively executed in the ISR, while the following ones are being prepared
 typedef struct
 {	int32_t		c;				// ISR Timer preload (contains FACTOR!) [in timer ticks * FACTOR]
 	int32_t 	c_t; 			// Target speed preload value [in timer ticks * FACTOR]
@@ -78,6 +105,7 @@ typedef struct
 	int32_t		c_hwi; 			// timer preload increment. c_hw = c_hwr * 65536 + c_hwi. Both together allow for about 4s between steps with 1MHz and FACTOR is 1000
 	int32_t 	c_hwr;			// timer preload rounds. If c_hw cannot be obtained by one full timer revolution, this is the round counter
 	int32_t		c_ideal; 		// Theoretical number of timer ticks in this cycle
+	int32_t		t_ideal;		// Theoretical duration of this cycle [ms]
 	int32_t		c_real; 		// Actual number of timer ticks this cycle took. Used to keep track of timing error accumulation.
 	int32_t		s; 				// Current relative step position in this cycle
 	int32_t 	s_total; 		// Relative amount of steps to do in this cycle
@@ -86,6 +114,7 @@ typedef struct
 	int32_t		n; 				// acceleration index (corresponds to the number of steps needed to get to this speed from 0)
 	int32_t		neq_on; 		// acceleration index preload at the start of cycle
 	int32_t 	neq_off; 		// acceleration index preload at the end of cycle
+	int32_t		neq_stop;		// acceleration index preload to stop from target speed c_t. Set by the planner for STG_softstop.
 	int32_t		shutoff; 		// When set to 1, the motor does not move at all and it does not automatically start the next cycle
 	int32_t		running; 		// Timer only executes this control struct, when running is 1. Otherwise it does nothing.
 	int32_t		no_accel;		// When set to 1, the motor does not accelerate at all and just moves at target speed
@@ -99,31 +128,91 @@ typedef struct
 	float		w_finish;		// finishing speed, when this cycle is done. Not used for calculations, but to correctly update the motor status after cycle execution.
 } T_ISR_CONTROL;
 
+// Emergency stops of one motor (see STG_softstop)
+typedef struct
+{
+	int32_t		bound;			// Most steps a stop can take, i.e. a stop from w_max [steps]. Set by STG_refreshStopCycle.
+	uint32_t	count;			// Stops that were executed with the stop cycle
+	uint32_t	request;		// DWT cycle counter at the entry of the EXTI or the stop command of the running stop
+	int32_t		latency_open;	// 1 until the first decelerating step of the running stop is measured
+	int32_t		pos_start;		// Motor position when the stop cycle was swapped in [steps]
+	int32_t		distance_last;	// Steps the motor made from the stop request to standstill (last stop)
+	int32_t		distance_max;	// Maximum of distance_last
+	uint32_t	overruns;		// Stops that took more than bound steps
+	uint32_t	cycles_last;	// CPU cycles from the stop request until the stop cycle was swapped in
+	uint32_t	cycles_max;		// Maximum of cycles_last
+	uint32_t	latency_last;	// CPU cycles from the stop request until the ISR set up the first decelerating step
+	uint32_t	latency_max;	// Maximum of latency_last
+}T_STG_STOP_STAT;
+
 // One of these for every motor. Contains all the information for this particular motor
 typedef struct
 {
 	char* 			name; 			// Pointer to string where name of motor is stored. Used to print out which motor it was in routines where only the handle is given.
 	T_STEPPER_STATE	motor;
-	T_ISR_CONTROL 	ctl_swap[2]; 	// This is the memory allocation for active and waiting structs. In active and waiting, there are the pointers of those two
-	T_ISR_CONTROL* 	active;
-	T_ISR_CONTROL* 	waiting;
-	E_STG_EXECUTION_STATUS	status; // State machine status. Running, Idle, prepared, error... see definition
+	T_ISR_CONTROL 	ctl_queue[STG_QUEUE_LENGTH]; // Ring buffer of cycles. Filled by the planner (SM_updateMotor), emptied by the ISR (STG_swapISRcontrol)
+	volatile uint32_t q_head;		// Number of cycles committed to the queue so far. Only advanced by the planner (STG_commitCycle).
+	volatile uint32_t q_tail;		// Number of cycles released by the ISR so far. The active cycle (if not stepper_shutoff) is the one at q_tail.
+	int32_t			q_final;		// Set when the trajectory end is queued (or a stop was requested). Nothing is committed anymore until the queue is flushed.
+	uint32_t		q_min_fill;		// Lowest number of cycles that were prepared ahead when a new cycle started (scheduling slack of the planner)
+	uint32_t		q_underruns;	// Number of times a cycle ended without a successor being prepared. Leads to an immediate stop.
+	uint32_t		tim_overruns;	// Number of compare values that had passed already when the ISR set them up (see isr_update_stg)
+	int32_t			tim_late_max;	// Most timer ticks an edge came late because of an overrun
+	uint32_t		isr_calls;		// Executions of isr_update_stg, to compare the step modes (see step_bench.h)
+	volatile int32_t q_time;		// Sum of t_ideal of all queued cycles including the active one [ms]
+	int32_t			q_min_slack;	// Lowest q_time when a new cycle started, i.e. worst case time the planner had left for a refill [ms]
+	T_ISR_CONTROL* 	active;			// Cycle currently executed by the ISR (a queue slot or stepper_shutoff)
+	T_ISR_CONTROL* 	waiting;		// Next free queue slot the planner fills in (always ctl_queue[q_head % STG_QUEUE_LENGTH])
+	T_ISR_CONTROL	stop_cycle;		// Deceleration to standstill, kept ready by STG_refreshStopCycle. STG_softstop swaps it in as active.
+	T_STG_STOP_STAT	stop;			// Statistics of the stops
+	volatile E_STG_EXECUTION_STATUS	status; // State machine status. Running, Idle, prepared, error... see definition
+	int32_t			start_pending;	// Set by the planner when the first cycle of a trajectory is queued. The motor is then started together with all others due at the same time.
+	volatile int32_t start_armed;	// Set when the motor was started, cleared by the first ISR afterwards
+	volatile uint16_t start_tick;	// Timer counter at the first ISR after the start (for skew measurement)
 	int32_t slow_decel_at_limit; 	// Should usually be set to 0. If set to non-zero, the motor makes a soft stop when running in the limit. This is used for referencing as it is assumed that at a hardstop, it looses steps.
 }T_MOTOR_CONTROL;
 
-// Global stepper state variables
-T_ISR_CONTROL stepper_shutoff; // to map into other motor control structs to turn it off.
-T_MOTOR_CONTROL x_dae_motor;
-T_MOTOR_CONTROL y_dae_motor;
-T_MOTOR_CONTROL z_dae_motor;
+// Statistics of the synchronised start (see STG_StartCycleGroup)
+typedef struct
+{
+	T_MOTOR_CONTROL *member[STG_GROUP_MAX]; // Motors of the last group start
+	int32_t		members;		// Number of motors in the last group start. Set to 0 when its skew was evaluated.
+	uint16_t	compare;		// Shared compare value the last group was started on
+	uint32_t	groups;			// Number of evaluated group starts with more than one motor
+	int32_t		skew_last;		// Timer ticks between the first ISRs of the first and the last motor of the last group
+	int32_t		skew_max;		// Maximum of skew_last
+	int32_t		entry_max;		// Maximum timer ticks from the shared compare match to the first ISR of a motor
+}T_STG_GROUP_STAT;
+
+// Global stepper state variables (allocated in DTCM, see step_generation.c)
+extern T_ISR_CONTROL stepper_shutoff; // to map into other motor control structs to turn it off.
+extern T_MOTOR_CONTROL x_dae_motor;
+extern T_MOTOR_CONTROL y_dae_motor;
+extern T_MOTOR_CONTROL z_dae_motor;
+extern T_STG_GROUP_STAT stg_group;
+extern int32_t c_table_xy[C_TABLE_SIZE];
+extern int32_t c_table_z[C_TABLE_SIZE];
 
 // PROTOTYPES
-void isr_update_stg (T_MOTOR_CONTROL *ctl, uint16_t tim_cnt);
+void isr_update_stg (T_MOTOR_CONTROL *ctl, uint16_t tim_cnt) ITCM_TEXT;
 void STG_Init (void);
-void STG_swapISRcontrol (T_MOTOR_CONTROL *ctl);
+void STG_swapISRcontrol (T_MOTOR_CONTROL *ctl) ITCM_TEXT;
 void STG_StartCycle(T_MOTOR_CONTROL *ctl);
+void STG_StartCycleGroup(T_MOTOR_CONTROL **ctl, int32_t count);
+void STG_evaluateGroupStart(void);
 void STG_hardstop (T_MOTOR_CONTROL *ctl);
-void STG_softstop (T_MOTOR_CONTROL *ctl);
+void STG_softstop (T_MOTOR_CONTROL *ctl, uint32_t request) ITCM_TEXT;
+void STG_refreshStopCycle (T_MOTOR_CONTROL *ctl);
+ErrorStatus STG_setAcceleration(T_MOTOR_CONTROL *ctl, real acc);
+real STG_maxSpeed (const T_STEPPER_STATE *motor, real acc);
+ErrorStatus STG_setStepMode (T_MOTOR_CONTROL *ctl, E_STG_STEP_MODE mode);
+int32_t STG_getOutputPosition (T_MOTOR_CONTROL *ctl);
+void STG_flushQueue (T_MOTOR_CONTROL *ctl);
+uint8_t STG_commitCycle (T_MOTOR_CONTROL *ctl);
+uint32_t STG_getQueueFree (T_MOTOR_CONTROL *ctl);
+uint32_t STG_getQueueFill (T_MOTOR_CONTROL *ctl);
+uint16_t step_calculations(T_ISR_CONTROL *isr) ITCM_TEXT;
+void accel_table_init(int32_t *array, uint32_t length, real acceleration, real alpha);
 
 #endif // STEP_GENERATION_H_
 
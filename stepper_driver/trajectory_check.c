@@ -0,0 +1,241 @@
+/** @file trajectory_check.c
+ *  @brief On-device check of the motion stack against golden trajectories
+ *
+ *  A few known passages are run through calculate_motor_control() and the step
+ *  calculation of the ISR on a scratch motor, without touching the real axes or
+ *  timers. What comes out (timing of the arrivals, highest speed and acceleration,
+ *  overshoot corrections, calculation errors) is compared to a baseline recorded
+ *  with a known good version. A change in the planner or the acceleration tables
+ *  that alters the motion shows up as a failed passage before it is heard on the
+ *  instrument.
+ *
+ *  The passages are chained exactly like prepare_next_cycle() does it: the
+ *  passover speed of one cycle is the start speed of the next one, a zero-cycle
+ *  stops the axis and the next cycle starts from standstill again.
+ *
+ *  @author Josef Heel
+	@date October 18th, 2026
+ */
+
+#include "main.h"
+#include "debug_tools.h"
+#include "motor_control.h"
+#include "motor_parameters.h"
+#include "trajectory_check.h"
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Synthetic passages, shaped like bowing: short detache strokes on a xy axis
+// and long legato bows with a change of direction on a z axis
+static const int32_t trc_detache_steps[] = 	{0, 	300, 	0, 		300, 	0, 		300, 	0, 		300, 	0, 		0};
+static const int32_t trc_detache_times[] = 	{0, 	200, 	200, 	200, 	200, 	180, 	180, 	180, 	180, 	100};
+static const int32_t trc_legato_steps[] = 	{0, 	2000, 	4500, 	6000, 	4000, 	1500, 	0, 		0};
+static const int32_t trc_legato_times[] = 	{0, 	400, 	500, 	400, 	400, 	500, 	400, 	100};
+
+// The baseline is what the motion stack does today, not an ideal. The acceleration stays
+// within a few percent of the limit (what is left is the timer resolution at high speed),
+// the arrivals are off by the rounding of the step intervals over a cycle.
+static const T_TRC_PASSAGE trc_passages[TRC_PASSAGES] = {
+	// name				axis			count	steps					timediff			baseline (arrival, speed, acc, overshoot, w_err, cycles)
+	{"test cycle xy",	TRC_AXIS_XY,	TEST_POINTS, test_positions_xy,	test_times_xy,		{155, 781, 1006, 17, 0, 7, 0}},
+	{"test cycle z",	TRC_AXIS_Z,		TEST_POINTS, test_positions_z,	test_times_z,		{642, 929, 1065, 17, 0, 8, 0}},
+	{"detache xy",		TRC_AXIS_XY,	10,		trc_detache_steps,		trc_detache_times,	{18, 344, 1000, 16, 0, 8, 0}},
+	{"legato z",		TRC_AXIS_Z,		8,		trc_legato_steps,		trc_legato_times,	{452, 431, 1005, 14, 0, 6, 0}},
+};
+
+// Scratch motor the passages are calculated on. Never started.
+static T_MOTOR_CONTROL trc_motor;
+static int32_t trc_table[C_TABLE_SIZE];
+
+// Step rates of the last steps, the acceleration is taken over TRC_ACC_WINDOW steps
+typedef struct
+{
+	real w[TRC_ACC_WINDOW];			// step rate over the period of the step [rad/s]
+	uint32_t t[TRC_ACC_WINDOW];		// middle of the step period [timer ticks]
+	uint32_t now;					// time stepped since the start of the passage [timer ticks]
+	int32_t count;					// steps recorded since the axis left standstill
+}T_TRC_RATES;
+
+// PROTOTYPES
+static void trc_runPassage (const T_TRC_PASSAGE *passage, T_TRC_RESULT *result);
+static void trc_stepCycle (const T_ISR_CONTROL *cycle, T_TRC_RESULT *result, T_TRC_RATES *rates);
+static uint8_t trc_compare (const T_TRC_RESULT *result, const T_TRC_RESULT *baseline);
+
+/** @brief 	Runs all passages and compares them to their baseline.
+ * 			Takes some ms of calculation, so it is not done while the music time runs.
+ *
+ *  @param 	*results - array of TRC_PASSAGES results, filled in
+ *  @return number of failed passages, -1 if the check was not run
+ */
+int32_t TRC_runCheck (T_TRC_RESULT *results)
+{
+	int32_t i;
+	int32_t failed = 0;
+
+	if (CHA_getIfTimeActive())
+	{
+		dbgprintf("Trajectory check not possible while playing");
+		return -1;
+	}
+
+	for (i = 0; i < TRC_PASSAGES; i++)
+	{
+		trc_runPassage(&trc_passages[i], &results[i]);
+		results[i].pass = trc_compare(&results[i], &trc_passages[i].baseline);
+		if (!results[i].pass)
+			failed++;
+
+		dbgprintf("TRC %-14s %s: arrival %u us, speed %u, acc %u (1/1000), overshoot %u, errors %u, cycles %u",
+				trc_passages[i].name, results[i].pass ? "ok  " : "FAIL",
+				results[i].arrival, results[i].speed, results[i].acc,
+				results[i].overshoot, results[i].w_err, results[i].cycles);
+	}
+	return failed;
+}
+
+/** @brief 	Calculates and steps through one passage on the scratch motor
+ *
+ *  @param 	*passage - datapoints and axis type
+ *  @param 	*result - filled in
+ *  @return (none)
+ */
+static void trc_runPassage (const T_TRC_PASSAGE *passage, T_TRC_RESULT *result)
+{
+	T_SPT_CYCLESPEC setup;
+	int32_t i, next;
+	real w_ret;
+	T_TRC_RATES rates;
+
+	memset(result, 0, sizeof(T_TRC_RESULT));
+	memset(&rates, 0, sizeof(rates));
+	memset(&trc_motor, 0, sizeof(trc_motor));
+	trc_motor.name = "trc";
+	trc_motor.waiting = &trc_motor.ctl_queue[0];
+	// The compiled-in limits, the baseline was recorded with them. Tuned values (parameter store)
+	// would change the result, so the passages run on a table of their own.
+	if (passage->axis == TRC_AXIS_XY)
+	{
+		trc_motor.motor.acc = XY_ACCEL_MAX;
+		trc_motor.motor.w_max = XY_SPEED_MAX;
+		trc_motor.motor.alpha = XY_ALPHA;
+	}
+	else
+	{
+		trc_motor.motor.acc = Z_ACCEL_MAX;
+		trc_motor.motor.w_max = Z_SPEED_MAX;
+		trc_motor.motor.alpha = Z_ALPHA;
+	}
+	accel_table_init(trc_table, C_TABLE_SIZE, trc_motor.motor.acc, trc_motor.motor.alpha);
+	trc_motor.waiting->c_table = trc_table;
+
+	for (i = 0; i < passage->count; i++)
+	{
+		// Same as prepare_next_cycle(): the last point is followed by a zero-cycle
+		next = i + 1 < passage->count ? i + 1 : i;
+		setup.delta_s0 = passage->steps[i] - trc_motor.motor.scheduled_pos;
+		setup.delta_t0 = passage->timediff[i];
+		setup.delta_s1 = passage->steps[next] - passage->steps[i];
+		setup.delta_t1 = next != i ? passage->timediff[next] : 100;
+		setup.w_s = trc_motor.motor.w_scheduled;
+		trc_motor.motor.scheduled_pos = passage->steps[i];
+
+		w_ret = calculate_motor_control(&setup, &trc_motor);
+		if (w_ret == W_ERR || trc_motor.waiting->shutoff)
+		{
+			// The axis stops here and starts again on time with the next datapoint
+			if (w_ret == W_ERR)
+				result->w_err++;
+			trc_motor.motor.w_scheduled = 0;
+			rates.count = 0;
+			continue;
+		}
+
+		trc_stepCycle(trc_motor.waiting, result, &rates);
+		trc_motor.motor.w_scheduled = w_ret;
+		result->cycles++;
+	}
+}
+
+/** @brief 	Steps through one calculated cycle like the ISR does and updates the maxima
+ *
+ *  @param 	*cycle - calculated cycle, not modified
+ *  @param 	*result - maxima are updated
+ *  @param 	*rates - step rates of the last steps before the cycle, updated
+ *  @return (none)
+ */
+static void trc_stepCycle (const T_ISR_CONTROL *cycle, T_TRC_RESULT *result, T_TRC_RATES *rates)
+{
+	T_ISR_CONTROL isr = *cycle;
+	T_STEPPER_STATE *motor = &trc_motor.motor;
+	real w, speed, acc;
+	uint32_t mid;
+	int32_t arrival, i;
+	uint8_t ramp;
+
+	while (isr.s < isr.s_total)
+	{
+		ramp = isr.no_accel == 0 && (isr.s < isr.s_on || isr.s >= isr.s_off);
+		step_calculations(&isr);
+		isr.s++;
+		if (isr.c_hw <= 0)
+			continue;
+
+		// The step rate over the period of this step
+		w = motor->alpha * F_TIMER / isr.c_hw;
+		speed = w * 1000 / motor->w_max;
+		if (speed > result->speed)
+			result->speed = speed < UINT16_MAX ? speed : UINT16_MAX;
+		mid = rates->now + isr.c_hw / 2;
+		rates->now += isr.c_hw;
+
+		// The first entries of the acceleration table are far from a constant acceleration
+		// (c0 is only an approximation), so the steps next to standstill are not counted.
+		// step_calculations() has moved on to the next table entry already.
+		if (ramp && abs(isr.n - 1) < TRC_RAMP_STEPS)
+		{
+			rates->count = 0;
+			continue;
+		}
+
+		// Change of the step rate over the window. A single step is no measure: at high
+		// speed the interval changes by one timer tick, which alone is more than acc.
+		i = rates->count % TRC_ACC_WINDOW;
+		if (rates->count >= TRC_ACC_WINDOW)
+		{
+			acc = fabs(w - rates->w[i]) * F_TIMER / (mid - rates->t[i]) * 1000 / motor->acc;
+			if (acc > result->acc)
+				result->acc = acc < UINT16_MAX ? acc : UINT16_MAX;
+		}
+		rates->w[i] = w;
+		rates->t[i] = mid;
+		rates->count++;
+	}
+
+	// Arrival of the datapoint against its time, like CNT_HIST_C_ERR in the ISR
+	arrival = abs(isr.c_real - isr.c_ideal) / (F_TIMER / 1000000);
+	if (arrival > result->arrival)
+		result->arrival = arrival < UINT16_MAX ? arrival : UINT16_MAX;
+	result->overshoot += isr.overshoot_on + isr.overshoot_off;
+}
+
+/** @brief 	Compares a result to the baseline within the tolerances
+ *
+ *  @param 	*result - result of the passage
+ *  @param 	*baseline - recorded result of the passage
+ *  @return 1 if it matches, 0 otherwise
+ */
+static uint8_t trc_compare (const T_TRC_RESULT *result, const T_TRC_RESULT *baseline)
+{
+	if (abs(result->arrival - baseline->arrival) > TRC_TOL_ARRIVAL)
+		return 0;
+	if (abs(result->speed - baseline->speed) > TRC_TOL_SPEED)
+		return 0;
+	if (abs(result->acc - baseline->acc) > TRC_TOL_ACC)
+		return 0;
+	if (abs(result->overshoot - baseline->overshoot) > TRC_TOL_OVERSHOOT)
+		return 0;
+	if (result->w_err != baseline->w_err || result->cycles != baseline->cycles)
+		return 0;
+	return 1;
+}
@@ -0,0 +1,57 @@
+/** @file trajectory_check.h
+ *  @brief On-device check of the motion stack against golden trajectories
+ *
+ *  @author Josef Heel
+	@date October 18th, 2026
+ */
+
+#ifndef TRAJECTORY_CHECK_H_
+#define TRAJECTORY_CHECK_H_
+
+#include "main.h"
+
+#define TRC_PASSAGES			4
+
+// Allowed deviation from the baseline before a passage fails
+#define TRC_TOL_ARRIVAL			200		// [us]
+#define TRC_TOL_SPEED			20		// [1/1000 of w_max]
+#define TRC_TOL_ACC				50		// [1/1000 of acc]
+#define TRC_TOL_OVERSHOOT		5		// [steps]
+
+// Measurement of the acceleration
+#define TRC_RAMP_STEPS			3		// steps at the start of the acceleration table (next to standstill) that are not counted
+#define TRC_ACC_WINDOW			32		// [steps] the change of the step rate is taken over that many steps
+
+typedef enum
+{
+	TRC_AXIS_XY = 0,
+	TRC_AXIS_Z
+}E_TRC_AXIS;
+
+// What the step engine made of a passage
+typedef struct __attribute__((__packed__))
+{
+	uint16_t arrival;		// largest deviation of a datapoint arrival from its time [us]
+	uint16_t speed;			// highest step rate [1/1000 of w_max]
+	uint16_t acc;			// highest change of step rate [1/1000 of acc]
+	uint16_t overshoot;		// steps the overshoot protection had to correct
+	uint16_t w_err;			// cycles the motor control could not fit
+	uint16_t cycles;		// number of cycles that were stepped
+	uint8_t  pass;			// 1 if within the tolerances of the baseline
+}T_TRC_RESULT;
+
+// A passage of motor datapoints (as they come out of a channel) for one axis type
+typedef struct
+{
+	const char *name;
+	E_TRC_AXIS axis;
+	int32_t count;
+	const int32_t *steps;		// absolute position of each datapoint [steps]
+	const int32_t *timediff;	// time from the previous datapoint [ms]
+	T_TRC_RESULT baseline;		// recorded with the known good motion stack, pass is not used
+}T_TRC_PASSAGE;
+
+// PROTOTYPES
+int32_t TRC_runCheck (T_TRC_RESULT *results);
+
+#endif /* TRAJECTORY_CHECK_H_ */
@@ -0,0 +1,249 @@
+/*
+ * parameters.c
+ *
+ *  Created on: Oct 18, 2026
+ *      Author: josef
+ *
+ *	Parameter store (see parameters.h for the layout of the sector).
+ *	Like the piece store, flash is only written while nothing is played.
+ */
+
+#include "main.h"
+#include "debug_tools.h"
+#include "channels.h"
+#include "motor_control.h"
+#include "communication.h"
+#include "store.h"
+#include "parameters.h"
+#include <string.h>
+
+T_PAR_STATE par;
+
+// Axes in the order of T_PAR_RECORD.axis
+static T_MOTOR_CONTROL * const par_axis[PAR_AXIS] = {&x_dae_motor, &y_dae_motor, &z_dae_motor};
+
+// PROTOTYPES
+static ErrorStatus par_readRecord (int32_t slot, T_PAR_RECORD *record);
+static void par_apply (const T_PAR_RECORD *record);
+static ErrorStatus par_eraseFlash (void);
+
+/** @brief  Looks for the current record in the parameter store and applies it.
+ * 			Has to be called after CHA_Init() and SM_Init(), which set up
+ * 			the defaults. Without a valid record the defaults stay.
+ *
+ *  @param (none)
+ *  @return (none)
+ */
+void PAR_Init (void)
+{
+	T_PAR_RECORD record;
+	int32_t slot;
+
+	memset(&par, 0, sizeof(par));
+	par.slot = -1;
+	par.next = PAR_SLOTS;
+
+	for (slot = 0; slot < PAR_SLOTS; slot++)
+	{
+		if (*(uint32_t*) (PAR_FLASH_BASE + slot * PAR_SLOT_SIZE) == 0xFFFFFFFF)
+		{
+			par.next = slot;
+			break;
+		}
+		if (par_readRecord(slot, &record) == SUCCESS && (par.slot < 0 || record.sequence > par.sequence))
+		{
+			par.slot = slot;
+			par.sequence = record.sequence;
+		}
+	}
+
+	if (par.slot < 0)
+	{
+		dbgprintf("No parameters stored, using the defaults.");
+		return;
+	}
+	par_readRecord(par.slot, &record);
+	par_apply(&record);
+	dbgprintf("Parameters restored from slot %d (record %u)", par.slot, par.sequence);
+}
+
+/** @brief  Writes the current parameters and positions as a new record.
+ * 			Erases the sector first if it is full, which takes a second or two.
+ *
+ *  @param (none)
+ *  @return SUCCESS, ERROR if playing, an axis is moving or the flash could not be written
+ */
+ErrorStatus PAR_save (void)
+{
+	T_PAR_RECORD record;
+	T_MOTOR_CONTROL *ctl;
+	int32_t i;
+
+	// The positions are only worth keeping with all axes at rest, and erasing stalls the CPU
+	if (CHA_getIfTimeActive() || sm_homing.active)
+		return ERROR;
+	for (i = 0; i < PAR_AXIS; i++)
+	{
+		if (par_axis[i]->status != STG_IDLE)
+			return ERROR;
+	}
+
+	memset(&record, 0, sizeof(record));
+	record.magic = PAR_MAGIC;
+	record.version = PAR_VERSION;
+	record.length = sizeof(T_PAR_RECORD);
+	record.sequence = par.sequence + 1;
+	for (i = 0; i < PAR_AXIS; i++)
+	{
+		ctl = par_axis[i];
+		record.axis[i].acc = ctl->motor.acc;
+		record.axis[i].w_max = ctl->motor.w_max;
+		record.axis[i].max_travel = ctl->motor.max_travel;
+		record.axis[i].flip_dir = ctl->motor.hw.flip_dir;
+		record.axis[i].step_mode = ctl->motor.hw.step_mode;
+		record.axis[i].home_pos = ctl->motor.pos;
+		if (ctl->motor.home_status == STG_HOME)
+			record.axis[i].home_token = PAR_HOME_TOKEN;
+	}
+	for (i = 0; i < CHA_NUMBER_CHANNELS_TOTAL; i++)
+		record.lead_time[i] = cha_list[i]->lead_time;
+	record.crc = crc16((const unsigned char*) &record, sizeof(T_PAR_RECORD) - sizeof(uint16_t));
+
+	if (par.next >= PAR_SLOTS)
+	{
+		if (par_eraseFlash() != SUCCESS)
+			return ERROR;
+		par.next = 0;
+		par.erases++;
+	}
+
+	if (STO_programFlash(PAR_FLASH_BASE + par.next * PAR_SLOT_SIZE, (const uint8_t*) &record, sizeof(record)) != SUCCESS)
+	{
+		// The slot is used up anyway, the next save takes the one after it
+		par.next++;
+		return ERROR;
+	}
+	SCB_InvalidateDCache_by_Addr((uint32_t*) (PAR_FLASH_BASE + par.next * PAR_SLOT_SIZE), PAR_SLOT_SIZE);
+
+	par.slot = par.next++;
+	par.sequence = record.sequence;
+	par.saves++;
+	dbgprintf("Parameters saved in slot %d (record %u)", par.slot, par.sequence);
+	return SUCCESS;
+}
+
+/** @brief  Changes the tuning of an axis. Takes effect right away, it is only
+ * 			kept over a power cycle after PAR_save(). Only while the axis stands still.
+ *
+ *  @param *ctl - axis
+ *  @param acc - [rad/s^2], shared by all axis of the same type (see STG_setAcceleration)
+ *  @param w_max - [rad/s]
+ *  @param max_travel - [steps]
+ *  @param flip_dir - 1 or -1
+ *  @param step_mode - how the step output is generated (see E_STG_STEP_MODE)
+ *  @return SUCCESS or ERROR if a value is out of range or the axis is busy
+ */
+ErrorStatus PAR_setAxis (T_MOTOR_CONTROL *ctl, real acc, real w_max, int32_t max_travel, int32_t flip_dir, E_STG_STEP_MODE step_mode)
+{
+	real w_old = ctl->motor.w_max;
+
+	// w_max has to be within reach of the acceleration table (see STG_maxSpeed)
+	if (ctl->status != STG_IDLE || acc <= 0 || w_max <= 0 || w_max > STG_maxSpeed(&ctl->motor, acc)
+			|| max_travel <= 0 || (flip_dir != 1 && flip_dir != -1) || step_mode >= STG_STEP_MODES)
+		return ERROR;
+
+	// The new w_max first, STG_setAcceleration checks it against the new table
+	ctl->motor.w_max = w_max;
+	if (acc != ctl->motor.acc && STG_setAcceleration(ctl, acc) != SUCCESS)
+	{
+		ctl->motor.w_max = w_old;
+		return ERROR;
+	}
+	if (step_mode != ctl->motor.hw.step_mode && STG_setStepMode(ctl, step_mode) != SUCCESS)
+		return ERROR;
+
+	ctl->motor.max_travel = max_travel;
+	ctl->motor.hw.flip_dir = flip_dir;
+	STG_refreshStopCycle(ctl);
+	return SUCCESS;
+}
+
+/** @brief  Reads a record out of its slot and checks it
+ *
+ *  @param slot - slot number
+ *  @param *record - destination
+ *  @return SUCCESS if it is a complete record of this version
+ */
+static ErrorStatus par_readRecord (int32_t slot, T_PAR_RECORD *record)
+{
+	memcpy(record, (const void*) (PAR_FLASH_BASE + slot * PAR_SLOT_SIZE), sizeof(T_PAR_RECORD));
+
+	if (record->magic != PAR_MAGIC || record->version != PAR_VERSION || record->length != sizeof(T_PAR_RECORD))
+		return ERROR;
+	if (crc16((const unsigned char*) record, sizeof(T_PAR_RECORD) - sizeof(uint16_t)) != record->crc)
+		return ERROR;
+	return SUCCESS;
+}
+
+/** @brief  Applies a record to the axis and channels. A valid home position
+ * 			becomes the position of the axis and lets the next SM_referenceAll()
+ * 			confirm it with a short approach.
+ *
+ *  @param *record - checked record
+ *  @return (none)
+ */
+static void par_apply (const T_PAR_RECORD *record)
+{
+	const T_PAR_AXIS *axis;
+	T_MOTOR_CONTROL *ctl;
+	int32_t i;
+
+	for (i = 0; i < PAR_AXIS; i++)
+	{
+		ctl = par_axis[i];
+		axis = &record->axis[i];
+		if (PAR_setAxis(ctl, axis->acc, axis->w_max, axis->max_travel, axis->flip_dir, axis->step_mode) != SUCCESS)
+			dbgprintf("%s: stored parameters not usable, defaults kept", ctl->name);
+
+		// An axis parked at the switch may stand a few steps behind it (negative position)
+		if (axis->home_token == PAR_HOME_TOKEN && axis->home_pos <= ctl->motor.max_travel)
+		{
+			ctl->motor.pos = axis->home_pos;
+			ctl->motor.scheduled_pos = axis->home_pos;
+			ctl->motor.home_confirm = 1;
+		}
+	}
+
+	// Channels without a buffer refuse a lead time, they have none anyway
+	for (i = 0; i < CHA_NUMBER_CHANNELS_TOTAL; i++)
+		CHA_setLeadTime(cha_list[i], record->lead_time[i]);
+}
+
+/** @brief  Erases the parameter sector
+ *
+ *  @param (none)
+ *  @return SUCCESS or ERROR
+ */
+static ErrorStatus par_eraseFlash (void)
+{
+	FLASH_EraseInitTypeDef erase;
+	uint32_t sector_error = 0;
+	HAL_StatusTypeDef status;
+
+	erase.TypeErase = FLASH_TYPEERASE_SECTORS;
+	erase.Sector = PAR_FLASH_SECTOR;
+	erase.NbSectors = 1;
+	erase.VoltageRange = FLASH_VOLTAGE_RANGE_3;
+
+	HAL_FLASH_Unlock();
+	status = HAL_FLASHEx_Erase(&erase, &sector_error);
+	HAL_FLASH_Lock();
+	SCB_InvalidateDCache_by_Addr((uint32_t*) PAR_FLASH_BASE, PAR_FLASH_SIZE);
+
+	if (status != HAL_OK)
+	{
+		dbgprintf("Erasing the parameter store failed");
+		return ERROR;
+	}
+	return SUCCESS;
+}
@@ -0,0 +1,80 @@
+/*
+ * parameters.h
+ *
+ *  Created on: Oct 18, 2026
+ *      Author: josef
+ *
+ *	Parameter store: tuning of the axes, lead times of the channels and the
+ *	last known position of the axes survive a power cycle in flash sector 11.
+ *
+ *	The sector is written as a log of fixed size records. Every save goes into
+ *	the next empty slot with a higher sequence number, the sector is only erased
+ *	when it is full (PAR_SLOTS saves per erase). At boot the last record with a
+ *	correct crc is applied, a record torn by a reset while it was written is skipped.
+ *
+ *	The position of an axis is only kept as home position (with PAR_HOME_TOKEN)
+ *	if the axis was referenced and stood still when the record was written. At
+ *	boot it is no proof of the position (the axis could have been moved by hand),
+ *	it only allows SM_referenceAll() to confirm the home with the second contact
+ *	alone instead of a sweep over the whole travel.
+ */
+
+#ifndef PARAMETERS_H_
+#define PARAMETERS_H_
+
+#include "main.h"
+#include "channels.h"
+#include "step_generation.h"
+
+#define PAR_MAGIC				0x43565053	// "SPVC"
+#define PAR_VERSION				1
+
+#define PAR_FLASH_BASE			0x081C0000	// Sector 11. Has to match PARAM_STORE in the linker script.
+#define PAR_FLASH_SIZE			(256*1024)
+#define PAR_FLASH_SECTOR		FLASH_SECTOR_11
+#define PAR_SLOT_SIZE			128			// [bytes] one record, padded. Has to hold a T_PAR_RECORD.
+#define PAR_SLOTS				(PAR_FLASH_SIZE / PAR_SLOT_SIZE)
+
+#define PAR_AXIS				3			// x, y, z of the DAE apparatus
+#define PAR_HOME_TOKEN			0xA5		// home_pos is the position of a referenced axis at rest
+
+typedef struct __attribute__((__packed__))
+{
+	float    acc;			// [rad/s^2]
+	float    w_max;			// [rad/s]
+	int32_t  max_travel;	// [steps]
+	int8_t   flip_dir;		// 1 or -1
+	uint8_t  home_token;	// PAR_HOME_TOKEN if home_pos is valid
+	uint8_t  step_mode;		// E_STG_STEP_MODE, 0 (pulses) in records of older firmware
+	uint8_t  reserved;
+	int32_t  home_pos;		// position of the axis when the record was written [steps]
+}T_PAR_AXIS;
+
+typedef struct __attribute__((__packed__))
+{
+	uint32_t magic;			// PAR_MAGIC
+	uint16_t version;		// PAR_VERSION
+	uint16_t length;		// sizeof(T_PAR_RECORD)
+	uint32_t sequence;		// counts up with every record, the highest valid one is current
+	T_PAR_AXIS axis[PAR_AXIS];
+	uint16_t lead_time[CHA_NUMBER_CHANNELS_TOTAL];	// [ms]
+	uint16_t crc;			// crc16 over everything before it
+}T_PAR_RECORD;
+
+typedef struct
+{
+	int32_t  slot;			// slot of the current record, -1 if there is none
+	int32_t  next;			// next empty slot, PAR_SLOTS if the sector is full
+	uint32_t sequence;		// of the current record
+	uint32_t saves;			// records written since the start
+	uint32_t erases;		// sector erases since the start
+}T_PAR_STATE;
+
+extern T_PAR_STATE par;
+
+// PROTOTYPES
+void PAR_Init (void);
+ErrorStatus PAR_save (void);
+ErrorStatus PAR_setAxis (T_MOTOR_CONTROL *ctl, real acc, real w_max, int32_t max_travel, int32_t flip_dir, E_STG_STEP_MODE step_mode);
+
+#endif /* PARAMETERS_H_ */
@@ -0,0 +1,642 @@
+/*
+ * store.c
+ *
+ *  Created on: Oct 18, 2026
+ *      Author: josef
+ *
+ *	Store-and-play (see store.h for the format).
+ *
+ *	Upload: STO_beginUpload clears the RAM arena or marks the flash sectors for
+ *	erasing, STO_update (main loop) erases them one by one after the command is
+ *	acknowledged. STO_writeData writes the chunks in order once the erase is done,
+ *	STO_endUpload checks header and crc.
+ *	Flash is only written while nothing is played: while a flash sector is erased
+ *	or programmed, every read from flash (code, vector table) stalls.
+ *
+ *	Playback: when the store is selected, CHA_startPlaying() calls STO_startStream().
+ *	From then on, STO_update() (main loop) keeps the channel buffers topped up
+ *	from the store, just like the host does when streaming.
+ *
+ *	Seek: STO_seek stops the music and the axes, sets up the channels at the
+ *	keyframe and moves the axes to the keyframe pose. When they are there,
+ *	STO_update starts the music time again. The A/B loop uses the same seek.
+ */
+
+#include "main.h"
+#include "debug_tools.h"
+#include "channels.h"
+#include "motor_control.h"
+#include "scheduler.h"
+#include "communication.h"
+#include "store.h"
+#include <string.h>
+
+T_STO_STATE sto;
+T_STO_STREAM sto_stream[CHA_NUMBER_CHANNELS_TOTAL];
+uint8_t sto_ram[STO_RAM_SIZE] __attribute__((aligned(4))); // RAM arena for short pieces
+
+// Axes in the order of T_STO_KEYFRAME.position
+static T_MOTOR_CONTROL * const sto_axis[STO_KEYFRAME_AXES] = {&x_dae_motor, &y_dae_motor, &z_dae_motor};
+static T_CHANNEL * const sto_axis_channel[STO_KEYFRAME_AXES] = {&cha_posx_dae, &cha_posy_dae, &cha_str_dae};
+static const real sto_axis_speed[STO_KEYFRAME_AXES] = {XY_NOMSPEED, XY_NOMSPEED, Z_NOMSPEED};
+
+// PROTOTYPES
+static ErrorStatus sto_checkPiece (const uint8_t *base, uint32_t size);
+static void sto_setupChannels (int32_t keyframe);
+static void sto_fillChannels (void);
+static const T_STO_KEYFRAME* sto_getKeyframe (int32_t keyframe);
+static ErrorStatus sto_getStartPosition (int32_t axis, int32_t *position);
+static int32_t sto_axesIdle (void);
+static void sto_eraseNextSector (void);
+
+/** @brief  Looks for a valid piece in the flash store. A piece in the RAM arena
+ * 			does not survive a reset.
+ *
+ *  @param (none)
+ *  @return (none)
+ */
+void STO_Init (void)
+{
+	memset(&sto, 0, sizeof(sto));
+	memset(sto_stream, 0, sizeof(sto_stream));
+	sto.target = STO_FLASH;
+	sto.base = (uint8_t*) STO_FLASH_BASE;
+
+	if (sto_checkPiece(sto.base, STO_FLASH_SIZE) == SUCCESS)
+	{
+		sto.valid = 1;
+		dbgprintf("Stored piece found in flash: %d bytes, %d ms",
+				((T_STO_HEADER*) sto.base)->length, ((T_STO_HEADER*) sto.base)->duration);
+	}
+}
+
+/** @brief  Starts the upload of a piece. The old piece is deleted: for flash,
+ * 			the sectors needed are erased by STO_update afterwards, which takes
+ * 			a few seconds. The data is only accepted when STO_isErasing() is 0.
+ * 			Not possible while playing.
+ *
+ *  @param target - STO_FLASH or STO_RAM
+ *  @param length - total length of the piece [bytes]
+ *  @return SUCCESS, or ERROR if playing or too long
+ */
+ErrorStatus STO_beginUpload (E_STO_TARGET target, uint32_t length)
+{
+	uint32_t size = (target == STO_FLASH) ? STO_FLASH_SIZE : STO_RAM_SIZE;
+
+	if (CHA_getIfTimeActive() || length < sizeof(T_STO_HEADER) || length > size)
+		return ERROR;
+
+	sto.valid = 0;
+	sto.selected = 0;
+	sto.streaming = 0;
+	sto.target = target;
+	sto.length = length;
+	sto.received = 0;
+	sto.program_cycles = 0;
+	sto.upload_start = HAL_GetTick();
+	sto.erase_time = 0;
+	sto.erase_left = 0;
+
+	if (target == STO_FLASH)
+	{
+		// Erasing stalls every read from flash, so not before the command is acknowledged
+		sto.base = (uint8_t*) STO_FLASH_BASE;
+		sto.erase_sector = STO_FLASH_FIRST_SECTOR;
+		sto.erase_left = (length + STO_FLASH_SECTOR_SIZE - 1) / STO_FLASH_SECTOR_SIZE;
+	}
+	else
+	{
+		sto.base = sto_ram;
+		memset(sto_ram, 0xFF, length);
+	}
+
+	sto.uploading = 1;
+	return SUCCESS;
+}
+
+/** @brief  Returns if the flash for an upload is still being erased
+ *
+ *  @param (none)
+ *  @return 1 while erasing
+ */
+int32_t STO_isErasing (void)
+{
+	return sto.erase_left > 0;
+}
+
+/** @brief  Writes the next chunk of the piece. Chunks have to come in order.
+ * 			A chunk that was written already (host repeated it) is accepted
+ * 			without writing it again.
+ *
+ *  @param offset - position of the chunk in the piece [bytes]. Multiple of 4.
+ *  @param *data - chunk
+ *  @param len - length of the chunk [bytes]. Multiple of 4 except for the last chunk.
+ *  @return SUCCESS, or ERROR if out of order, too long or programming failed
+ */
+ErrorStatus STO_writeData (uint32_t offset, const uint8_t *data, uint32_t len)
+{
+	uint32_t start;
+	ErrorStatus ret = SUCCESS;
+
+	if (!sto.uploading || STO_isErasing())
+		return ERROR;
+	if (offset + len <= sto.received)
+		return SUCCESS; // repeated chunk
+	if (offset != sto.received || offset + len > sto.length || (offset & 0x3) != 0)
+		return ERROR;
+
+	start = DWT->CYCCNT;
+	if (sto.target == STO_FLASH)
+		ret = STO_programFlash(STO_FLASH_BASE + offset, data, len);
+	else
+		memcpy(&sto_ram[offset], data, len);
+	sto.program_cycles += DWT->CYCCNT - start;
+
+	if (ret == SUCCESS)
+		sto.received += len;
+	return ret;
+}
+
+/** @brief  Finishes the upload. The piece can be played if all bytes came in
+ * 			and the crc matches. Reports the upload throughput.
+ *
+ *  @param (none)
+ *  @return SUCCESS if the piece is valid
+ */
+ErrorStatus STO_endUpload (void)
+{
+	uint32_t bytes_per_s;
+
+	if (!sto.uploading)
+		return ERROR;
+	sto.uploading = 0;
+	sto.upload_time = HAL_GetTick() - sto.upload_start;
+
+	if (sto.target == STO_FLASH)
+		SCB_InvalidateDCache_by_Addr((uint32_t*) STO_FLASH_BASE, STO_FLASH_SIZE);
+
+	if (sto.received != sto.length || sto_checkPiece(sto.base, sto.length) == ERROR)
+	{
+		dbgprintf("Stored piece invalid (%d of %d bytes)", sto.received, sto.length);
+		return ERROR;
+	}
+	sto.valid = 1;
+
+	bytes_per_s = sto.upload_time > 0 ? (uint32_t) ((uint64_t) sto.received * 1000 / sto.upload_time) : 0;
+	dbgprintf("Piece stored in %s: %d bytes in %d ms (%d bytes/s), erase %d ms, write %d us",
+			sto.target == STO_FLASH ? "flash" : "RAM", sto.received, sto.upload_time, bytes_per_s,
+			sto.erase_time, sto.program_cycles / (SystemCoreClock / 1000000));
+	return SUCCESS;
+}
+
+/** @brief  Selects where CHA_startPlaying() takes the datapoints from.
+ *
+ *  @param selected - 1: from the stored piece, 0: streamed by the host
+ *  @return SUCCESS, or ERROR if there is no valid piece to select
+ */
+ErrorStatus STO_select (int32_t selected)
+{
+	if (selected && !sto.valid)
+		return ERROR;
+	sto.selected = selected ? 1 : 0;
+	if (!sto.selected)
+		sto.streaming = 0;
+	return SUCCESS;
+}
+
+/** @brief  Returns if the stored piece is played
+ *
+ *  @param (none)
+ *  @return 1 if selected
+ */
+int32_t STO_isSelected (void)
+{
+	return sto.selected;
+}
+
+/** @brief  Rewinds the stored piece and fills all channels from the start.
+ * 			The channels are cleared before. Called by CHA_startPlaying().
+ *
+ *  @param (none)
+ *  @return (none)
+ */
+void STO_startStream (void)
+{
+	if (!sto.valid)
+		return;
+
+	sto.seek = STO_SEEK_NONE;
+	sto.underruns = 0;
+	sto.min_fill = INT32_MAX;
+	sto_setupChannels(-1);
+}
+
+/** @brief  Jumps to a time in the stored piece. Playing continues at the last
+ * 			keyframe before that time, after the axes moved to its pose.
+ * 			Before the first keyframe, it is the start of the piece, where the
+ * 			pose is the first datapoint of each axis.
+ * 			Without keyframes, only the start of the piece can be reached.
+ * 			Also starts playing if the piece was stopped.
+ * 			Has to be called with the planner locked.
+ *
+ *  @param time - music time to continue at [ms]
+ *  @return SUCCESS, or ERROR if the stored piece is not played
+ */
+ErrorStatus STO_seek (uint32_t time)
+{
+	uint32_t request = DWT->CYCCNT;
+	const T_STO_HEADER *header = (const T_STO_HEADER*) sto.base;
+	int32_t lo, hi, mid;
+
+	if (!sto.valid || !sto.selected)
+		return ERROR;
+
+	// Last keyframe at or before time (binary search, keyframes are sorted)
+	lo = 0;
+	hi = header->keyframes - 1;
+	sto.seek_keyframe = -1;
+	while (lo <= hi)
+	{
+		mid = (lo + hi) / 2;
+		if (sto_getKeyframe(mid)->time <= time)
+		{
+			sto.seek_keyframe = mid;
+			lo = mid + 1;
+		}
+		else
+			hi = mid - 1;
+	}
+
+	CHA_stopTime();
+	SM_softstop(request);
+	sto.seek = STO_SEEK_STOPPING;
+	sto.streaming = 1;
+	dbgprintf("Seek to t=%d: keyframe %d at t=%d", time, sto.seek_keyframe,
+			sto.seek_keyframe >= 0 ? sto_getKeyframe(sto.seek_keyframe)->time : 0);
+	return SUCCESS;
+}
+
+/** @brief  Sets the A/B loop: when the music time reaches b, it seeks back to a.
+ *
+ *  @param a - loop start [ms]
+ *  @param b - loop end [ms]. 0 switches the loop off.
+ *  @return SUCCESS, or ERROR if b is not after a
+ */
+ErrorStatus STO_setLoop (uint32_t a, uint32_t b)
+{
+	if (b == 0)
+	{
+		sto.loop = 0;
+		return SUCCESS;
+	}
+	if (b <= a)
+		return ERROR;
+
+	sto.loop_a = a;
+	sto.loop_b = b;
+	sto.loop = 1;
+	return SUCCESS;
+}
+
+/** @brief  Tops up all channel buffers from the stored piece and runs seeks
+ * 			and the A/B loop. Called from the main loop.
+ *
+ *  @param (none)
+ *  @return (none)
+ */
+void STO_update (void)
+{
+	uint32_t lock;
+	int32_t i, position;
+
+	if (STO_isErasing())
+	{
+		sto_eraseNextSector();
+		return;
+	}
+
+	if (!sto.streaming)
+		return;
+
+	if (sto.seek != STO_SEEK_NONE || (sto.loop && CHA_getIfTimeActive() && CHA_getChannelTime() >= sto.loop_b))
+	{
+		lock = SCH_lockPlanner();
+		if (sto.seek == STO_SEEK_NONE)
+		{
+			STO_seek(sto.loop_a);
+		}
+		else if (sto.seek == STO_SEEK_STOPPING && sto_axesIdle())
+		{
+			// Channels continue at the keyframe, the axes go to its pose
+			sto_setupChannels(sto.seek_keyframe);
+			for (i = 0; i < STO_KEYFRAME_AXES; i++)
+			{
+				if (sto.seek_keyframe >= 0)
+					SM_moveMotorToLocation(sto_axis[i], sto_getKeyframe(sto.seek_keyframe)->position[i], sto_axis_speed[i]);
+				else if (sto_getStartPosition(i, &position) == SUCCESS)
+					SM_moveMotorToLocation(sto_axis[i], position, sto_axis_speed[i]);
+			}
+			sto.seek = STO_SEEK_MOVING;
+		}
+		else if (sto.seek == STO_SEEK_MOVING && sto_axesIdle())
+		{
+			sto.seek = STO_SEEK_NONE;
+			CHA_startTime();
+		}
+		SCH_unlockPlanner(lock);
+	}
+
+	sto_fillChannels();
+}
+
+/** @brief  Stops feeding the channels and a running seek. Called by CHA_stopPlaying().
+ *
+ *  @param (none)
+ *  @return (none)
+ */
+void STO_stopStream (void)
+{
+	sto.seek = STO_SEEK_NONE;
+	sto.streaming = 0;
+}
+
+/** @brief  Prints the playback statistics of the store over the debug uart
+ *
+ *  @param (none)
+ *  @return (none)
+ */
+void STO_reportStatistics (void)
+{
+	if (!sto.streaming)
+		return;
+	dbgprintf("Store: %d underruns, min channel fill %d", sto.underruns,
+			sto.min_fill == INT32_MAX ? -1 : sto.min_fill);
+}
+
+/** @brief  Clears the channels and sets them up to continue at a keyframe:
+ * 			read positions in the store, time of the last executed datapoint
+ * 			and start point of motor segments. Sets the channel time to the keyframe.
+ *
+ *  @param keyframe - keyframe number, -1 for the start of the piece
+ *  @return (none)
+ */
+static void sto_setupChannels (int32_t keyframe)
+{
+	const T_STO_HEADER *header = (const T_STO_HEADER*) sto.base;
+	const T_STO_INDEX *index = (const T_STO_INDEX*) (sto.base + sizeof(T_STO_HEADER));
+	const T_STO_KEYFRAME *kf = NULL;
+	const T_STO_KEYPOINT *kp = NULL;
+	T_STO_STREAM *str;
+	T_CHANNEL *cha;
+	int32_t i;
+
+	if (keyframe >= 0)
+	{
+		kf = sto_getKeyframe(keyframe);
+		kp = (const T_STO_KEYPOINT*) (kf + 1);
+	}
+
+	CHA_Init();
+	memset(sto_stream, 0, sizeof(sto_stream));
+	for (i = 0; i < header->channels; i++)
+	{
+		// Checked by sto_checkPiece
+		str = &sto_stream[index[i].channel_nr];
+		cha = cha_list[index[i].channel_nr];
+		str->next = sto.base + index[i].offset;
+		str->left = index[i].count;
+		if (kp != NULL)
+		{
+			str->next += kp[i].point * index[i].ellen;
+			str->left -= kp[i].point;
+			cha->last_point_time = kp[i].last_time;
+		}
+	}
+
+	// Hermite segments continue from the keyframe pose
+	for (i = 0; kf != NULL && i < STO_KEYFRAME_AXES; i++)
+	{
+		if (sto_axis_channel[i]->segment != NULL)
+		{
+			sto_axis_channel[i]->segment->last_steps = kf->position[i];
+			sto_axis_channel[i]->segment->last_velocity = 0;
+			sto_axis_channel[i]->segment->last_valid = 1;
+		}
+	}
+
+	CHA_setChannelTime(kf != NULL ? kf->time : 0);
+	sto.streaming = 1;
+	sto_fillChannels();
+}
+
+/** @brief  Returns a keyframe of the stored piece
+ *
+ *  @param keyframe - number of the keyframe, has to exist
+ *  @return pointer to the keyframe, followed by its keypoints
+ */
+static const T_STO_KEYFRAME* sto_getKeyframe (int32_t keyframe)
+{
+	const T_STO_HEADER *header = (const T_STO_HEADER*) sto.base;
+	uint32_t size = sizeof(T_STO_KEYFRAME) + header->channels * sizeof(T_STO_KEYPOINT);
+
+	return (const T_STO_KEYFRAME*) (sto.base + sizeof(T_STO_HEADER) + header->channels * sizeof(T_STO_INDEX)
+			+ keyframe * size);
+}
+
+/** @brief  Start pose of an axis for a seek to the start of the piece: the first
+ * 			datapoint of its channel. The axis waits there until that point is due.
+ *
+ *  @param axis - number of the axis, as in T_STO_KEYFRAME.position
+ *  @param *position - [steps], written on success
+ *  @return SUCCESS, or ERROR if the piece has no datapoints for the axis
+ */
+static ErrorStatus sto_getStartPosition (int32_t axis, int32_t *position)
+{
+	const T_STO_HEADER *header = (const T_STO_HEADER*) sto.base;
+	const T_STO_INDEX *index = (const T_STO_INDEX*) (sto.base + sizeof(T_STO_HEADER));
+	int32_t i;
+
+	for (i = 0; i < header->channels; i++)
+	{
+		if (index[i].channel_nr == sto_axis_channel[axis]->channel_number && index[i].count > 0)
+		{
+			*position = ((const T_DTP_MOTOR*) (sto.base + index[i].offset))->steps;
+			return SUCCESS;
+		}
+	}
+	return ERROR;
+}
+
+/** @brief  Checks if all axes stand still
+ *
+ *  @param (none)
+ *  @return 1 if all axes of the keyframes are idle
+ */
+static int32_t sto_axesIdle (void)
+{
+	int32_t i;
+	for (i = 0; i < STO_KEYFRAME_AXES; i++)
+	{
+		if (sto_axis[i]->status != STG_IDLE && sto_axis[i]->status != STG_ERROR)
+			return 0;
+	}
+	return 1;
+}
+
+/** @brief  Pushes datapoints from the store on all channels that have space.
+ * 			The channels are single producer / single consumer ring buffers,
+ * 			so no lock is needed (same as for the host stream).
+ *
+ *  @param (none)
+ *  @return (none)
+ */
+static void sto_fillChannels (void)
+{
+	T_STO_STREAM *str;
+	T_CHANNEL *cha;
+	int32_t i, fill, free;
+
+	for (i = 0; i < CHA_NUMBER_CHANNELS_TOTAL; i++)
+	{
+		str = &sto_stream[i];
+		if (str->left == 0)
+			continue;
+		cha = cha_list[i];
+
+		fill = CHA_getNumberDatapoint(cha);
+		if (CHA_getIfTimeActive())
+		{
+			if (fill < sto.min_fill)
+				sto.min_fill = fill;
+			if (fill == 0 && !str->dry)
+				sto.underruns++;
+			str->dry = (fill == 0);
+		}
+
+		free = CHA_getFreeDatapoints(cha);
+		while (free > 0 && str->left > 0)
+		{
+			CHA_pushDatapoints(cha, (void*) str->next, 1);
+			str->next += cha->ellen;
+			str->left--;
+			free--;
+		}
+	}
+}
+
+
+/** @brief  Checks header, index and crc of a piece
+ *
+ *  @param *base - start of the piece
+ *  @param size - maximum size of the piece [bytes]
+ *  @return SUCCESS if the piece can be played
+ */
+static ErrorStatus sto_checkPiece (const uint8_t *base, uint32_t size)
+{
+	const T_STO_HEADER *header = (const T_STO_HEADER*) base;
+	const T_STO_INDEX *index = (const T_STO_INDEX*) (base + sizeof(T_STO_HEADER));
+	const T_STO_KEYPOINT *kp;
+	T_CHANNEL *cha;
+	uint32_t kf_size, kf_start;
+	int32_t i, k;
+
+	if (header->magic != STO_MAGIC || header->version != STO_VERSION)
+		return ERROR;
+	if (header->length > size || header->length < sizeof(T_STO_HEADER) + header->channels * sizeof(T_STO_INDEX))
+		return ERROR;
+
+	for (i = 0; i < header->channels; i++)
+	{
+		if (index[i].channel_nr >= CHA_NUMBER_CHANNELS_TOTAL)
+			return ERROR;
+		cha = cha_list[index[i].channel_nr];
+		if (cha->buffer_length == 0 || index[i].ellen != cha->ellen
+				|| index[i].offset + (uint64_t) index[i].count * index[i].ellen > header->length)
+			return ERROR;
+	}
+
+	// Keyframe table has to fit and point into the channels
+	kf_size = sizeof(T_STO_KEYFRAME) + header->channels * sizeof(T_STO_KEYPOINT);
+	kf_start = sizeof(T_STO_HEADER) + header->channels * sizeof(T_STO_INDEX);
+	if (kf_start + (uint64_t) header->keyframes * kf_size > header->length)
+		return ERROR;
+	for (k = 0; k < header->keyframes; k++)
+	{
+		kp = (const T_STO_KEYPOINT*) (base + kf_start + k * kf_size + sizeof(T_STO_KEYFRAME));
+		for (i = 0; i < header->channels; i++)
+		{
+			if (kp[i].point > index[i].count)
+				return ERROR;
+		}
+	}
+
+	if (crc16(base + sizeof(T_STO_HEADER), header->length - sizeof(T_STO_HEADER)) != header->crc)
+		return ERROR;
+
+	return SUCCESS;
+}
+
+/** @brief  Erases the next flash sector of an upload. One sector blocks for
+ * 			about a second, so STO_update does one per call.
+ *
+ *  @param (none)
+ *  @return (none)
+ */
+static void sto_eraseNextSector (void)
+{
+	FLASH_EraseInitTypeDef erase;
+	uint32_t sector_error = 0;
+	uint32_t start = HAL_GetTick();
+	HAL_StatusTypeDef status;
+
+	erase.TypeErase = FLASH_TYPEERASE_SECTORS;
+	erase.Sector = sto.erase_sector;
+	erase.NbSectors = 1;
+	erase.VoltageRange = FLASH_VOLTAGE_RANGE_3;
+
+	HAL_FLASH_Unlock();
+	status = HAL_FLASHEx_Erase(&erase, &sector_error);
+	HAL_FLASH_Lock();
+	sto.erase_time += HAL_GetTick() - start;
+
+	if (status != HAL_OK)
+	{
+		// The upload is dead, the data gets a NACK from now on
+		dbgprintf("Erasing the piece store failed at sector %d", sector_error);
+		sto.erase_left = 0;
+		sto.uploading = 0;
+		return;
+	}
+	sto.erase_sector++;
+	sto.erase_left--;
+}
+
+/** @brief  Programs data into erased flash, one word at a time. Used for the
+ * 			pieces and for the parameter store (parameters.c).
+ * 			A last incomplete word is padded with 0xFF.
+ *
+ *  @param address - flash address, word aligned
+ *  @param *data - data to write
+ *  @param len - [bytes]
+ *  @return SUCCESS or ERROR
+ */
+ErrorStatus STO_programFlash (uint32_t address, const uint8_t *data, uint32_t len)
+{
+	uint32_t word;
+	uint32_t i;
+	ErrorStatus ret = SUCCESS;
+
+	HAL_FLASH_Unlock();
+	for (i = 0; i < len; i += 4)
+	{
+		word = 0xFFFFFFFF;
+		memcpy(&word, &data[i], (len - i) < 4 ? (len - i) : 4);
+		if (HAL_FLASH_Program(FLASH_TYPEPROGRAM_WORD, address + i, word) != HAL_OK)
+		{
+			ret = ERROR;
+			break;
+		}
+	}
+	HAL_FLASH_Lock();
+	return ret;
+}
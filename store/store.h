@@ -0,0 +1,140 @@
+/*
+ * store.h
+ *
+ *  Created on: Oct 18, 2026
+ *      Author: josef
+ *
+ *	Store-and-play: a complete piece is uploaded by the host into a dedicated
+ *	flash region (sectors 9 and 10) or into a RAM arena and then played from
+ *	there without any help of the host.
+ *
+ *	Format of a stored piece (all little endian, packed):
+ *		T_STO_HEADER
+ *		T_STO_INDEX[header.channels]
+ *		header.keyframes times:
+ *			T_STO_KEYFRAME
+ *			T_STO_KEYPOINT[header.channels] (same order as the index)
+ *		datapoints of each channel, in the format of the channel (T_DTP_...),
+ *		at the offset given in the index
+ *
+ *	Keyframes are snapshots every few bars (sorted by time): where the axes are and
+ *	where each channel continues. Seeking jumps to the last keyframe before the
+ *	requested time, so it takes as long as the keyframe spacing, not the piece.
+ *	Keyframe times should be on motor datapoints, so the axes start on time.
+ */
+
+#ifndef STORE_H_
+#define STORE_H_
+
+#include "main.h"
+
+#define STO_MAGIC				0x50565053	// "SPVP"
+#define STO_VERSION				1
+
+#define STO_FLASH_BASE			0x08140000	// Sector 9. Has to match PIECE_STORE in the linker script.
+#define STO_FLASH_SIZE			(512*1024)	// Sectors 9 and 10
+#define STO_FLASH_SECTOR_SIZE	(256*1024)
+#define STO_FLASH_FIRST_SECTOR	FLASH_SECTOR_9
+#define STO_RAM_SIZE			(128*1024)	// RAM arena for short pieces
+
+typedef enum
+{
+	STO_FLASH = 0,
+	STO_RAM
+}E_STO_TARGET;
+
+typedef struct __attribute__((__packed__))
+{
+	uint32_t magic;		// STO_MAGIC
+	uint16_t version;	// STO_VERSION
+	uint16_t channels;	// number of index entries following the header
+	uint32_t length;	// total length of the piece including this header [bytes]
+	uint32_t duration;	// [ms], only for information
+	uint16_t crc;		// crc16 over everything after the header
+	uint16_t keyframes;	// number of keyframes following the index
+}T_STO_HEADER;
+
+typedef struct __attribute__((__packed__))
+{
+	uint8_t  channel_nr;	// channel number according to spec
+	uint8_t  ellen;			// length of one datapoint, has to match the channel
+	uint16_t reserved;
+	uint32_t offset;		// of the first datapoint, from the start of the piece [bytes]
+	uint32_t count;			// number of datapoints
+}T_STO_INDEX;
+
+#define STO_KEYFRAME_AXES		3	// x, y, z of the DAE apparatus
+
+typedef struct __attribute__((__packed__))
+{
+	uint32_t time;							// music time of the keyframe [ms]
+	int32_t  position[STO_KEYFRAME_AXES];	// pose of the axes at that time [steps]
+}T_STO_KEYFRAME;
+
+typedef struct __attribute__((__packed__))
+{
+	uint32_t point;		// first datapoint of the channel not executed at the keyframe time
+	uint32_t last_time;	// music time of the datapoint before it [ms]
+}T_STO_KEYPOINT;
+
+typedef enum
+{
+	STO_SEEK_NONE = 0,
+	STO_SEEK_STOPPING,	// waiting for the axes to stop
+	STO_SEEK_MOVING		// axes move to the pose of the keyframe
+}E_STO_SEEK;
+
+// Read position of one channel in the stored piece
+typedef struct
+{
+	const uint8_t *next;	// next datapoint to be pushed on the channel
+	uint32_t left;			// datapoints not pushed yet
+	int32_t  dry;			// 1 while the channel is empty although the store has points for it
+}T_STO_STREAM;
+
+typedef struct
+{
+	E_STO_TARGET target;	// where the piece is (being) stored
+	uint8_t  *base;			// start of the piece
+	uint32_t length;		// announced length of the upload [bytes]
+	uint32_t received;		// bytes written so far
+	int32_t  uploading;		// 1 between STO_beginUpload and STO_endUpload
+	uint32_t erase_sector;	// next flash sector STO_update erases for the upload
+	uint32_t erase_left;	// flash sectors still to be erased before the data is accepted
+	int32_t  valid;			// 1 if a complete piece with correct crc is stored
+	int32_t  selected;		// 1: CHA_startPlaying() plays from the store instead of the host stream
+	int32_t  streaming;		// 1 while the store feeds the channels
+	E_STO_SEEK seek;		// state of a running seek
+	int32_t  seek_keyframe;	// keyframe the seek goes to, -1 for the start of the piece
+	int32_t  loop;			// 1 if A/B loop is on
+	uint32_t loop_a;		// [ms] loop start
+	uint32_t loop_b;		// [ms] loop end, jumps back to loop_a when reached
+	// Upload benchmark
+	uint32_t upload_start;	// HAL tick of STO_beginUpload
+	uint32_t upload_time;	// [ms] from begin to end of the last upload (erase included)
+	uint32_t erase_time;	// [ms]
+	uint32_t program_cycles;// DWT cycles spent writing the data
+	// Playback benchmark
+	uint32_t underruns;		// channel ran empty while the store still had points for it
+	int32_t  min_fill;		// lowest channel fill seen while the store still had points for the channel
+}T_STO_STATE;
+
+extern T_STO_STATE sto;
+
+// PROTOTYPES
+void STO_Init (void);
+ErrorStatus STO_beginUpload (E_STO_TARGET target, uint32_t length);
+int32_t STO_isErasing (void);
+ErrorStatus STO_writeData (uint32_t offset, const uint8_t *data, uint32_t len);
+ErrorStatus STO_endUpload (void);
+ErrorStatus STO_select (int32_t selected);
+int32_t STO_isSelected (void);
+void STO_startStream (void);
+void STO_update (void);
+void STO_stopStream (void);
+ErrorStatus STO_seek (uint32_t time);
+ErrorStatus STO_setLoop (uint32_t a, uint32_t b);
+ErrorStatus STO_programFlash (uint32_t address, const uint8_t *data, uint32_t len);
+void STO_reportStatistics (void);
+
+#endif /* STORE_H_ */
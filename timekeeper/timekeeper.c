@@ -12,6 +12,9 @@
 #include "channels.h"
 #include <string.h>
 #include "communication.h"
+#include "scheduler.h"
+#include "notes.h"
+#include "vibrato.h"
 
 
 /** @brief  Starts the main system timer. Timeouts and other things will
@@ -51,14 +54,30 @@ void isr_tk_millisecond (void)
 	// Check if time advanced to match a datapoint.
 	if (CHA_getIfTimeActive())
 	{
+		// Trills and tremolos that are running. Before the channels, so new notes override them.
+		notes_update();
+
 		// Check if any of the channels has a datapoint that needs to be executed now
 		CHA_updateChannels();
 
+		// Vibrato motion of all strings for this ms
+		VIB_update();
+
 		// And increment the channel time.
 		CHA_incrementChannelTime();
 	}
 
+	// All note changes of this ms are sent to the magnets in one DMA transfer
+	notes_flush();
+
 	COM_updateTimeout();
+
+#if (DBG_CPU_LOAD)
+	debug_load_tick();
+#endif
+
+	// Let the planner look for new datapoints and homing progress at least once per ms
+	SCH_requestPlanning();
 }
 
 
@@ -15,6 +15,7 @@
 #include "usbd_cdc_if.h"
 #include "debug_tools.h"
 #include "communication.h"
+#include "counters.h"
 
 
 /** @brief When using USB CDC stuff, call this fx first
@@ -25,24 +26,85 @@
 int USB_CDC_Init(void)
 {
 	USB_CDC_clearRxBuffer();
+	memset(&usb_cdc_tx_buffer, 0, sizeof(usb_cdc_tx_buffer));
 	return SUCCESS;
 }
 
 
-/** @brief Transmits bytes out of a buffer to the PC via
- * 			USB CDC device.
+/** @brief Queues bytes for transmission to the PC via
+ * 			USB CDC device. The bytes are copied, so the buffer
+ * 			can be reused right after the call. Either the whole
+ * 			buffer is queued or nothing.
  *
  *  @param buffer - byte array containing bytes to transmit
  *  @param length - number of bytes to transmit out of buffer
- *  @return 0 if success, 1 otherwise
+ *  @return SUCCESS, or ERROR if the queue is full
  */
 int USB_CDC_TransmitBuffer(uint8_t* buffer, uint32_t length)
 {
+	uint32_t pos, chunk;
 
-	if (CDC_Transmit_FS(buffer, length))
-		return SUCCESS;
-	else
+	if (length > USB_CDC_getTxFree())
+	{
+		usb_cdc_tx_buffer.dropped++;
+		CNT_INC(CNT_COM_TX_DROPPED);
 		return ERROR;
+	}
+
+	// Copy in up to two pieces, the queue might wrap around
+	pos = usb_cdc_tx_buffer.in % USB_CDC_TX_BUFFER_SIZE;
+	chunk = USB_CDC_TX_BUFFER_SIZE - pos;
+	if (chunk > length)
+		chunk = length;
+	memcpy(&usb_cdc_tx_buffer.data[pos], buffer, chunk);
+	memcpy(&usb_cdc_tx_buffer.data[0], &buffer[chunk], length - chunk);
+	usb_cdc_tx_buffer.in += length;
+
+	// Send it right away if the driver is free
+	USB_CDC_updateTx();
+	return SUCCESS;
+}
+
+/** @brief Hands the next part of the transmit queue to the driver
+ * 			as soon as the last transfer is done. Called from the main loop.
+ *
+ *  @param (none)
+ *  @return (none)
+ */
+void USB_CDC_updateTx(void)
+{
+	uint32_t pos, length;
+
+	if (CDC_IsTxBusy_FS())
+		return;
+
+	// The last transfer is done, its space is free again
+	usb_cdc_tx_buffer.out += usb_cdc_tx_buffer.sending;
+	usb_cdc_tx_buffer.sending = 0;
+
+	length = usb_cdc_tx_buffer.in - usb_cdc_tx_buffer.out;
+	if (length == 0)
+		return;
+
+	// One transfer only goes up to the end of the ring
+	pos = usb_cdc_tx_buffer.out % USB_CDC_TX_BUFFER_SIZE;
+	if (length > USB_CDC_TX_BUFFER_SIZE - pos)
+		length = USB_CDC_TX_BUFFER_SIZE - pos;
+	if (length > USB_CDC_TX_MAX_TRANSFER)
+		length = USB_CDC_TX_MAX_TRANSFER;
+
+	if (CDC_Transmit_FS(&usb_cdc_tx_buffer.data[pos], length) == USBD_OK)
+		usb_cdc_tx_buffer.sending = length;
+}
+
+/** @brief Returns the free space in the transmit queue
+ *
+ *  @param (none)
+ *  @return number of bytes that can be queued
+ */
+uint32_t USB_CDC_getTxFree(void)
+{
+	return USB_CDC_TX_BUFFER_SIZE - (usb_cdc_tx_buffer.in - usb_cdc_tx_buffer.out);
 }
 
 /** @brief This function is called by the CDC driver!
@@ -7,6 +7,8 @@
 
 
 #define 	USB_CDC_RX_BUFFER_SIZE		1024		// Receive buffer (Data from PC is put here)
+#define 	USB_CDC_TX_BUFFER_SIZE		4096		// Transmit queue (Data to PC waits here until the driver is free)
+#define 	USB_CDC_TX_MAX_TRANSFER		1023		// Longest transfer handed to the driver at once. Not a multiple of 64, so no zero length packet is needed at its end.
 
 // Struct for accessing the usb rx-buffer
 typedef struct
@@ -17,13 +19,28 @@ typedef struct
 
 }T_USB_CDC_RX_BUFFER;
 
+// Ring buffer for transmitting. Written and sent only from the main loop, the USB
+// interrupt just finishes the transfers, so no locking is needed.
+typedef struct
+{
+	uint8_t data[USB_CDC_TX_BUFFER_SIZE];		// bytes waiting for transmission
+	uint32_t in;								// total number of bytes queued so far
+	uint32_t out;								// total number of bytes completely transmitted so far
+	uint32_t sending;							// bytes of the transfer the driver currently works on (starting at out)
+	uint32_t dropped;							// number of buffers that did not fit in the queue
+
+}T_USB_CDC_TX_BUFFER;
+
 // GLOBAL VARIABLES
 T_USB_CDC_RX_BUFFER usb_cdc_rx_buffer; 			// Global data structure for keeping received data
+T_USB_CDC_TX_BUFFER usb_cdc_tx_buffer; 			// Global data structure for data to be transmitted
 
 
 // PROTOTYPES
 int USB_CDC_Init(void);
 int USB_CDC_TransmitBuffer(uint8_t* buffer, uint32_t length);
+void USB_CDC_updateTx(void);
+uint32_t USB_CDC_getTxFree(void);
 void USB_CDC_addDataToRxBuffer(uint8_t* buffer, uint32_t length); // Called by driver! Do not call yourself!
 void USB_CDC_clearRxBuffer(void);
 